@@ -26,51 +26,425 @@
  *********************************************************************/
 
 #include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h> // for CHAR_MAX
+#include <getopt.h>
+
+#include <algorithm>
+#include <fstream>
 #include <iostream>
+#include <string>
+#include <vector>
 
 #include "cli.hpp"
 #include "os_string.hpp"
-#include "os_process.hpp"
-#include "cli_resources.hpp"
+#include "os_thread.hpp"
+#include "image.hpp"
 
 static const char *synopsis = "Identify differences between two image dumps.";
 
-static os::String
-find_command(void)
+static void
+usage(void)
+{
+    std::cout
+        << "usage: apitrace diff-images [OPTIONS] REF_PREFIX SRC_PREFIX\n"
+        << synopsis << "\n"
+        << "\n"
+        << "Compares the PNG images found under both prefixes, writing an HTML\n"
+        << "summary and, for mismatching images, a .diff.png highlighting the\n"
+        << "differences.  Exits with 1 if any image mismatches.\n"
+        << "\n"
+        << "    -h, --help           Show this help message and exit\n"
+        << "    -v, --verbose        Verbose output\n"
+        << "    -o, --output=FILE    Output filename [default: index.html]\n"
+        << "    -f, --fuzz=RATIO     Fuzz ratio [default: 0.05]\n"
+        << "    -j, --jobs=N         Number of images to compare in parallel\n"
+        << "                         [default: number of CPUs]\n"
+        << "        --overwrite      Overwrite existing difference images\n"
+        << "        --show-all       Show all images, including similar ones\n"
+        << "\n";
+}
+
+enum {
+    OVERWRITE_OPT = CHAR_MAX + 1,
+    SHOW_ALL_OPT,
+};
+
+const static char *
+shortOptions = "hvo:f:aj:";
+
+const static struct option
+longOptions[] = {
+    {"help", no_argument, 0, 'h'},
+    {"verbose", no_argument, 0, 'v'},
+    {"output", required_argument, 0, 'o'},
+    {"fuzz", required_argument, 0, 'f'},
+    {"alpha", no_argument, 0, 'a'},
+    {"jobs", required_argument, 0, 'j'},
+    {"overwrite", no_argument, 0, OVERWRITE_OPT},
+    {"show-all", no_argument, 0, SHOW_ALL_OPT},
+    {0, 0, 0, 0}
+};
+
+
+static const unsigned thumbSize = 320;
+
+static bool verbose = false;
+static double fuzz = 0.05;
+static bool overwrite = false;
+static bool showAll = false;
+
+
+static bool
+endsWith(const std::string &s, const char *suffix)
+{
+    size_t length = strlen(suffix);
+    return s.length() >= length &&
+           s.compare(s.length() - length, length, suffix) == 0;
+}
+
+
+static bool
+isImage(const std::string &name)
 {
-    return findScript("snapdiff.py");
+    return endsWith(name, ".png") &&
+           !endsWith(name, ".diff.png") &&
+           !endsWith(name, ".thumb.png");
 }
 
+
 static void
-usage(void)
+findImages(const std::string &prefix, const std::string &dir, std::vector<std::string> &images)
+{
+    std::vector<os::String> names;
+    if (!os::listDirectory(dir.empty() ? "." : dir.c_str(), names)) {
+        return;
+    }
+
+    for (unsigned i = 0; i < names.size(); ++i) {
+        std::string path = dir;
+        if (!path.empty() && path[path.length() - 1] != OS_DIR_SEP) {
+            path += OS_DIR_SEP;
+        }
+        path += names[i].str();
+
+        if (os::isDirectory(path.c_str())) {
+            findImages(prefix, path, images);
+        } else if (path.compare(0, prefix.length(), prefix) == 0 &&
+                   isImage(path)) {
+            images.push_back(path.substr(prefix.length()));
+        }
+    }
+}
+
+
+/**
+ * Find the images whose path starts with the prefix, returning the remainder
+ * of their paths.
+ */
+static void
+findImages(const std::string &prefix, std::vector<std::string> &images)
+{
+    std::string dir;
+    if (os::isDirectory(prefix.c_str())) {
+        dir = prefix;
+    } else {
+        size_t sep = prefix.rfind(OS_DIR_SEP);
+        if (sep != std::string::npos) {
+            dir = prefix.substr(0, sep);
+        }
+    }
+
+    findImages(prefix, dir, images);
+
+    std::sort(images.begin(), images.end());
+}
+
+
+struct Comparison
+{
+    std::string name;
+    std::string refImage;
+    std::string srcImage;
+    std::string deltaImage;
+
+    unsigned refWidth, refHeight;
+    unsigned srcWidth, srcHeight;
+
+    image::Difference difference;
+    bool compared;
+    bool match;
+
+    bool done;
+};
+
+
+static bool
+isOlder(const std::string &path, const std::string &other)
+{
+    return os::getModificationTime(path.c_str()) < os::getModificationTime(other.c_str());
+}
+
+
+static void
+compareImages(Comparison &comparison)
 {
-    os::String command = find_command();
+    image::Image *ref = image::readPNG(comparison.refImage.c_str());
+    image::Image *src = image::readPNG(comparison.srcImage.c_str());
+
+    if (ref) {
+        comparison.refWidth = ref->width;
+        comparison.refHeight = ref->height;
+    }
+    if (src) {
+        comparison.srcWidth = src->width;
+        comparison.srcHeight = src->height;
+    }
+
+    if (ref && src) {
+        comparison.compared = image::compare(*ref, *src, comparison.difference, fuzz);
+        comparison.match = comparison.compared &&
+                           comparison.difference.absoluteError == 0;
 
-    char *args[4];
-    args[0] = (char *) APITRACE_PYTHON_EXECUTABLE;
-    args[1] = (char *) command.str();
-    args[2] = (char *) "--help";
-    args[3] = NULL;
+        if (comparison.compared &&
+            (!comparison.match || showAll) &&
+            (overwrite ||
+             !os::String(comparison.deltaImage.c_str()).exists() ||
+             (isOlder(comparison.deltaImage, comparison.refImage) &&
+              isOlder(comparison.deltaImage, comparison.srcImage)))) {
+            image::Image *delta = image::createDiffImage(*ref, *src, fuzz);
+            if (delta) {
+                delta->writePNG(comparison.deltaImage.c_str());
+                delete delta;
+            }
+        }
+    }
 
-    os::execute(args);
+    delete ref;
+    delete src;
 }
 
+
+/**
+ * Compares images on a pool of threads, while the results are consumed in
+ * order.
+ */
+class ComparisonPool
+{
+    std::vector<Comparison> &comparisons;
+    size_t next;
+
+    os::mutex mutex;
+    os::condition_variable done_cond;
+    std::vector<os::thread> workers;
+
+public:
+    ComparisonPool(std::vector<Comparison> &comparisons_, unsigned numWorkers) :
+        comparisons(comparisons_),
+        next(0)
+    {
+        for (unsigned i = 0; i < numWorkers; ++i) {
+            workers.push_back(os::thread(workerThread, this));
+        }
+    }
+
+    ~ComparisonPool() {
+        for (unsigned i = 0; i < workers.size(); ++i) {
+            workers[i].join();
+        }
+    }
+
+    Comparison &
+    wait(size_t i) {
+        os::unique_lock<os::mutex> lock(mutex);
+        while (!comparisons[i].done) {
+            done_cond.wait(lock);
+        }
+        return comparisons[i];
+    }
+
+private:
+    static void *
+    workerThread(ComparisonPool *_this) {
+        _this->work();
+        return 0;
+    }
+
+    void
+    work(void) {
+        os::unique_lock<os::mutex> lock(mutex);
+        while (next < comparisons.size()) {
+            Comparison &comparison = comparisons[next++];
+            lock.unlock();
+
+            compareImages(comparison);
+
+            lock.lock();
+            comparison.done = true;
+            done_cond.signal();
+        }
+    }
+};
+
+
+static void
+surface(std::ostream &html, const std::string &image, unsigned width, unsigned height)
+{
+    html << "        <td><a href=\"" << image << "\"><img src=\"" << image << "\"";
+    if (width && height) {
+        if (width >= height) {
+            height = height * thumbSize / width;
+            width = thumbSize;
+        } else {
+            width = width * thumbSize / height;
+            height = thumbSize;
+        }
+        html << " width=\"" << width << "\" height=\"" << height << "\"";
+    }
+    html << "/></a></td>\n";
+}
+
+
 static int
 command(int argc, char *argv[])
 {
-    int i;
+    const char *output = "index.html";
+    unsigned numWorkers = os::thread::hardware_concurrency();
 
-    os::String command = find_command();
+    int opt;
+    while ((opt = getopt_long(argc, argv, shortOptions, longOptions, NULL)) != -1) {
+        switch (opt) {
+        case 'h':
+            usage();
+            return 0;
+        case 'v':
+            verbose = true;
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'f':
+            fuzz = atof(optarg);
+            break;
+        case 'a':
+            // Accepted for compatibility; alpha never affected the comparison
+            break;
+        case 'j':
+            numWorkers = atoi(optarg);
+            break;
+        case OVERWRITE_OPT:
+            overwrite = true;
+            break;
+        case SHOW_ALL_OPT:
+            showAll = true;
+            break;
+        default:
+            std::cerr << "error: unexpected option `" << (char)opt << "`\n";
+            usage();
+            return 1;
+        }
+    }
 
-    std::vector<const char *> args;
-    args.push_back(APITRACE_PYTHON_EXECUTABLE);
-    args.push_back(command.str());
-    for (i = 1; i < argc; i++) {
-        args.push_back(argv[i]);
+    if (argc != optind + 2) {
+        std::cerr << "error: incorrect number of arguments\n";
+        usage();
+        return 1;
     }
-    args.push_back(NULL);
 
-    return os::execute((char * const *)&args[0]);
+    std::string refPrefix = argv[optind];
+    std::string srcPrefix = argv[optind + 1];
+
+    std::vector<std::string> refImages;
+    std::vector<std::string> srcImages;
+    findImages(refPrefix, refImages);
+    findImages(srcPrefix, srcImages);
+
+    std::vector<std::string> images;
+    std::set_intersection(refImages.begin(), refImages.end(),
+                          srcImages.begin(), srcImages.end(),
+                          std::back_inserter(images));
+
+    std::vector<Comparison> comparisons(images.size());
+    for (unsigned i = 0; i < images.size(); ++i) {
+        Comparison &comparison = comparisons[i];
+        comparison.name = images[i];
+        comparison.refImage = refPrefix + images[i];
+        comparison.srcImage = srcPrefix + images[i];
+        os::String root(comparison.srcImage.c_str());
+        root.trimExtension();
+        comparison.deltaImage = std::string(root.str()) + ".diff.png";
+        comparison.refWidth = comparison.refHeight = 0;
+        comparison.srcWidth = comparison.srcHeight = 0;
+        comparison.compared = false;
+        comparison.match = false;
+        comparison.done = false;
+    }
+
+    std::ofstream file;
+    if (output[0]) {
+        file.open(output);
+        if (!file) {
+            std::cerr << "error: failed to create " << output << "\n";
+            return 1;
+        }
+    }
+    std::ostream &html = output[0] ? file : std::cout;
+
+    html << "<html>\n";
+    html << "  <body>\n";
+    html << "    <table border=\"1\">\n";
+    html << "      <tr><th>File</th><th>" << refPrefix << "</th><th>" << srcPrefix << "</th><th>&Delta;</th></tr>\n";
+
+    unsigned failures = 0;
+    {
+        numWorkers = std::max(std::min<unsigned>(numWorkers, comparisons.size()), 1U);
+        ComparisonPool pool(comparisons, numWorkers);
+
+        for (unsigned i = 0; i < comparisons.size(); ++i) {
+            Comparison &comparison = pool.wait(i);
+
+            const char *result;
+            const char *bgcolor;
+            if (comparison.match) {
+                result = "MATCH";
+                bgcolor = "#20ff20";
+            } else {
+                result = "MISMATCH";
+                bgcolor = "#ff2020";
+                ++failures;
+            }
+
+            if (verbose) {
+                std::cout << "Comparing " << comparison.refImage
+                          << " and " << comparison.srcImage << " ... " << result;
+                if (comparison.compared) {
+                    char details[64];
+                    snprintf(details, sizeof details, " (%.1f bits, %llu pixels differ)",
+                             comparison.difference.precision(),
+                             comparison.difference.absoluteError);
+                    std::cout << details;
+                }
+                std::cout << "\n";
+            }
+
+            html << "      <tr>\n";
+            html << "        <td bgcolor=\"" << bgcolor << "\"><a href=\"" << comparison.refImage << "\">" << comparison.name << "</a></td>\n";
+            if (!comparison.match || showAll) {
+                surface(html, comparison.refImage, comparison.refWidth, comparison.refHeight);
+                surface(html, comparison.srcImage, comparison.srcWidth, comparison.srcHeight);
+                surface(html, comparison.deltaImage, comparison.srcWidth, comparison.srcHeight);
+            }
+            html << "      </tr>\n";
+            html.flush();
+        }
+    }
+
+    html << "    </table>\n";
+    html << "  </body>\n";
+    html << "</html>\n";
+
+    return failures ? 1 : 0;
 }
 
 const Command diff_images_command = {
@@ -25,6 +25,7 @@
  **************************************************************************/
 
 
+#include <stdlib.h>
 #include <string.h>
 #include <limits.h> // for CHAR_MAX
 #include <getopt.h>
@@ -32,13 +33,18 @@
 #include <unistd.h> // for isatty()
 #endif
 
+#include <sstream>
+
 #include "cli.hpp"
 #include "cli_pager.hpp"
 
+#include "os_thread.hpp"
 #include "trace_parser.hpp"
 #include "trace_dump.hpp"
 #include "trace_callset.hpp"
+#include "trace_index.hpp"
 #include "trace_option.hpp"
+#include "trace_scanner.hpp"
 
 
 enum ColorOption {
@@ -53,6 +59,8 @@ static bool verbose = false;
 
 static trace::CallSet calls(trace::FREQUENCY_ALL);
 
+static unsigned numThreads = os::thread::hardware_concurrency();
+
 static const char *synopsis = "Dump given trace(s) to standard output.";
 
 static void
@@ -69,8 +77,10 @@ usage(void)
         "    --colour[=WHEN]      colored syntax highlighting\n"
         "                         WHEN is 'auto', 'always', or 'never'\n"
         "    --thread-ids=[=BOOL] dump thread ids [default: no]\n"
+        "    --call-times[=BOOL]  dump how long calls took while tracing [default: no]\n"
         "    --call-nos[=BOOL]    dump call numbers[default: yes]\n"
         "    --arg-names[=BOOL]   dump argument names [default: yes]\n"
+        "    --threads=N          threads to dump indexed traces with [default: number of CPUs]\n"
         "\n"
     ;
 }
@@ -79,8 +89,10 @@ enum {
     CALLS_OPT = CHAR_MAX + 1,
     COLOR_OPT,
     THREAD_IDS_OPT,
+    CALL_TIMES_OPT,
     CALL_NOS_OPT,
     ARG_NAMES_OPT,
+    THREADS_OPT,
 };
 
 const static char *
@@ -94,11 +106,64 @@ longOptions[] = {
     {"colour", optional_argument, 0, COLOR_OPT},
     {"color", optional_argument, 0, COLOR_OPT},
     {"thread-ids", optional_argument, 0, THREAD_IDS_OPT},
+    {"call-times", optional_argument, 0, CALL_TIMES_OPT},
     {"call-nos", optional_argument, 0, CALL_NOS_OPT},
     {"arg-names", optional_argument, 0, ARG_NAMES_OPT},
+    {"threads", required_argument, 0, THREADS_OPT},
     {0, 0, 0, 0}
 };
 
+static void
+dumpCall(trace::Call &call, std::ostream &os, trace::DumpFlags dumpFlags)
+{
+    if (calls.contains(call)) {
+        if (verbose ||
+            !(call.flags & trace::CALL_FLAG_VERBOSE)) {
+            trace::dump(call, os, dumpFlags);
+        }
+    }
+}
+
+/**
+ * Dumps a range of calls into memory, to be output in order.
+ */
+class DumpVisitor : public trace::RangeVisitor
+{
+public:
+    std::ostringstream os;
+    trace::DumpFlags dumpFlags;
+
+    DumpVisitor(trace::DumpFlags _dumpFlags) :
+        dumpFlags(_dumpFlags)
+    {}
+
+    void visitCall(trace::Call *call) {
+        dumpCall(*call, os, dumpFlags);
+    }
+};
+
+class DumpScanner : public trace::ParallelScanner
+{
+protected:
+    trace::DumpFlags dumpFlags;
+
+public:
+    DumpScanner(trace::DumpFlags _dumpFlags) :
+        dumpFlags(_dumpFlags)
+    {}
+
+protected:
+    trace::RangeVisitor *createVisitor(void) {
+        return new DumpVisitor(dumpFlags);
+    }
+
+    void finishVisitor(trace::RangeVisitor *visitor) {
+        std::string str = static_cast<DumpVisitor *>(visitor)->os.str();
+        std::cout.write(str.data(), str.size());
+        delete visitor;
+    }
+};
+
 static int
 command(int argc, char *argv[])
 {
@@ -136,6 +201,13 @@ command(int argc, char *argv[])
                 dumpFlags &= ~trace::DUMP_FLAG_THREAD_IDS;
             }
             break;
+        case CALL_TIMES_OPT:
+            if (trace::boolOption(optarg)) {
+                dumpFlags |= trace::DUMP_FLAG_CALL_TIMES;
+            } else {
+                dumpFlags &= ~trace::DUMP_FLAG_CALL_TIMES;
+            }
+            break;
         case CALL_NOS_OPT:
             if (trace::boolOption(optarg)) {
                 dumpFlags &= ~trace::DUMP_FLAG_NO_CALL_NO;
@@ -150,6 +222,9 @@ command(int argc, char *argv[])
                 dumpFlags |= trace::DUMP_FLAG_NO_ARG_NAMES;
             }
             break;
+        case THREADS_OPT:
+            numThreads = atoi(optarg);
+            break;
         default:
             std::cerr << "error: unexpected option `" << (char)opt << "`\n";
             usage();
@@ -170,21 +245,46 @@ command(int argc, char *argv[])
         dumpFlags |= trace::DUMP_FLAG_NO_COLOR;
     }
 
+#ifdef _WIN32
+    // Console colors can't be buffered
+    if (color == COLOR_OPTION_ALWAYS) {
+        numThreads = 1;
+    }
+#endif
+
     for (int i = optind; i < argc; ++i) {
+        trace::Index index;
+        bool indexed = index.load(argv[i]);
+
+        // Indexed traces can be dumped in parallel
+        if (indexed && numThreads > 1) {
+            DumpScanner scanner(dumpFlags);
+            if (!scanner.scan(argv[i], index, numThreads, true,
+                              calls.getFirst(), calls.getLast())) {
+                return 1;
+            }
+            continue;
+        }
+
         trace::Parser p;
 
         if (!p.open(argv[i])) {
             return 1;
         }
 
+        // Skip straight to the first call when the trace is indexed
+        if (indexed &&
+            calls.getFirst() > 0 &&
+            p.importSignatures(index.signatures)) {
+            const trace::ParseBookmark *bookmark = index.findCall(calls.getFirst());
+            if (bookmark) {
+                p.setBookmark(*bookmark);
+            }
+        }
+
         trace::Call *call;
         while ((call = p.parse_call())) {
-            if (calls.contains(*call)) {
-                if (verbose ||
-                    !(call->flags & trace::CALL_FLAG_VERBOSE)) {
-                    trace::dump(*call, std::cout, dumpFlags);
-                }
-            }
+            dumpCall(*call, std::cout, dumpFlags);
             delete call;
         }
     }
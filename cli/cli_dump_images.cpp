@@ -54,12 +54,15 @@ usage(void)
         "                           otherwise use sequental numbers (default=yes)\n"
         "    -o, --output=PREFIX    prefix to use in naming output files\n"
         "                           (default is trace filename without extension)\n"
+        "        --compression=LEVEL  PNG compression: 0-9, `store`, `rle`,\n"
+        "                           `fast` (default), `default`, or `best`\n"
         "\n";
 }
 
 enum {
     CALLS_OPT = CHAR_MAX + 1,
     CALL_NOS_OPT,
+    COMPRESSION_OPT,
 };
 
 const static char *
@@ -70,6 +73,7 @@ longOptions[] = {
     {"help", no_argument, 0, 'h'},
     {"calls", required_argument, 0, CALLS_OPT},
     {"call-nos", optional_argument, 0, CALL_NOS_OPT},
+    {"compression", required_argument, 0, COMPRESSION_OPT},
     {"output", required_argument, 0, 'o'},
     {0, 0, 0, 0}
 };
@@ -82,6 +86,7 @@ command(int argc, char *argv[])
     const char *traceName = NULL;
     const char *output = NULL;
     std::string call_nos;
+    std::string compression;
 
     int opt;
     while ((opt = getopt_long(argc, argv, shortOptions, longOptions, NULL)) != -1) {
@@ -96,6 +101,10 @@ command(int argc, char *argv[])
             call_nos = "--call-nos=";
             call_nos.append(optarg);
             break;
+        case COMPRESSION_OPT:
+            compression = "--snapshot-compression=";
+            compression.append(optarg);
+            break;
         case 'o':
             output = optarg;
             break;
@@ -140,6 +149,9 @@ command(int argc, char *argv[])
     if (!call_nos.empty()) {
         opts.push_back(call_nos.c_str());
     }
+    if (!compression.empty()) {
+        opts.push_back(compression.c_str());
+    }
 
     return executeRetrace(opts, traceName);
 }
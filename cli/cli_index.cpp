@@ -0,0 +1,115 @@
+/**************************************************************************
+ *
+ * Copyright 2015 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+
+#include <string.h>
+#include <getopt.h>
+
+#include <iostream>
+
+#include "cli.hpp"
+
+#include "trace_index.hpp"
+
+
+static const char *synopsis = "Create an index for faster random access to a trace.";
+
+static void
+usage(void)
+{
+    std::cout
+        << "usage: apitrace index <trace-file>...\n"
+        << synopsis << "\n"
+        << "\n"
+        << "The index is written alongside the trace, with an additional .idx\n"
+        << "extension, and lets the loader, the GUI and `apitrace dump` seek to\n"
+        << "any frame or call without scanning the whole trace first, as well as\n"
+        << "parse different parts of the trace on different threads.\n"
+        << "Indices are ignored once the trace they were created for changes.\n"
+        << "\n"
+        << "Only Snappy compressed traces can be indexed.\n"
+        << "\n";
+}
+
+const static char *
+shortOptions = "h";
+
+const static struct option
+longOptions[] = {
+    {"help", no_argument, 0, 'h'},
+    {0, 0, 0, 0}
+};
+
+static int
+indexTrace(const char *traceFileName)
+{
+    trace::Index index;
+
+    if (!index.build(traceFileName) ||
+        !index.save(traceFileName)) {
+        return 1;
+    }
+
+    return 0;
+}
+
+static int
+command(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt_long(argc, argv, shortOptions, longOptions, NULL)) != -1) {
+        switch (opt) {
+        case 'h':
+            usage();
+            return 0;
+        default:
+            std::cerr << "error: unexpected option `" << (char)opt << "`\n";
+            usage();
+            return 1;
+        }
+    }
+
+    if (argc <= optind) {
+        std::cerr << "error: insufficient number of arguments\n";
+        usage();
+        return 1;
+    }
+
+    for (int i = optind; i < argc; ++i) {
+        int ret = indexTrace(argv[i]);
+        if (ret) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+const Command index_command = {
+    "index",
+    synopsis,
+    usage,
+    command
+};
@@ -71,7 +71,9 @@ static const Command * commands[] = {
     &diff_images_command,
     &dump_command,
     &dump_images_command,
+    &index_command,
     &pickle_command,
+    &profile_command,
     &sed_command,
     &repack_command,
     &retrace_command,
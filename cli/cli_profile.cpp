@@ -0,0 +1,213 @@
+/**************************************************************************
+ *
+ * Copyright 2015 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+
+#include <string.h>
+#include <stdio.h>
+#include <getopt.h>
+
+#include <fstream>
+#include <iostream>
+
+#include "cli.hpp"
+
+#include "os_binary.hpp"
+#include "trace_parser.hpp"
+#include "trace_profiler.hpp"
+
+
+static const char *synopsis = "Convert a replay profile to text.";
+
+static void
+usage(void)
+{
+    std::cout
+        << "usage: apitrace profile [OPTIONS] [PROFILE]\n"
+        << synopsis << "\n"
+        << "\n"
+        << "Reads a profile written by `apitrace replay --profile-format=binary`\n"
+        << "(or a text one) from PROFILE or the standard input, and writes it in\n"
+        << "the text format read by scripts/profileshader.py.\n"
+        << "\n"
+        << "With --trace, the CPU times of the calls recorded while tracing with\n"
+        << "APITRACE_CALL_TIMES=1 are written instead.\n"
+        << "\n"
+        << "    -h, --help           Show this help message and exit\n"
+        << "    -o, --output=FILE    Write to FILE instead of the standard output\n"
+        << "    -t, --trace=TRACE    Convert the call times recorded in TRACE\n"
+        << "\n";
+}
+
+const static char *
+shortOptions = "ho:t:";
+
+const static struct option
+longOptions[] = {
+    {"help", no_argument, 0, 'h'},
+    {"output", required_argument, 0, 'o'},
+    {"trace", required_argument, 0, 't'},
+    {0, 0, 0, 0}
+};
+
+
+class TextProfileWriter : public trace::ProfileParser
+{
+    std::ostream &os;
+
+public:
+    TextProfileWriter(std::ostream &os_) :
+        os(os_)
+    {
+        trace::Profiler::writeHeader(os);
+    }
+
+protected:
+    void handleCall(const trace::Profile::Call &call) {
+        trace::Profiler::writeCall(os, call);
+    }
+
+    void handleFrameEnd(void) {
+        trace::Profiler::writeFrameEnd(os);
+    }
+};
+
+
+static bool
+writeCallTimes(const char *filename, std::ostream &os)
+{
+    trace::Parser p;
+    if (!p.open(filename)) {
+        std::cerr << "error: failed to open " << filename << "\n";
+        return false;
+    }
+
+    trace::Profiler::writeHeader(os);
+
+    bool found = false;
+    trace::Call *call;
+    while ((call = p.scan_call())) {
+        if (call->cpuDuration >= 0) {
+            trace::Profile::Call profileCall;
+            profileCall.no = call->no;
+            profileCall.cpuStart = call->cpuStart;
+            profileCall.cpuDuration = call->cpuDuration;
+            profileCall.name = call->name();
+            trace::Profiler::writeCall(os, profileCall);
+            found = true;
+        }
+        if (call->flags & trace::CALL_FLAG_END_FRAME) {
+            trace::Profiler::writeFrameEnd(os);
+        }
+        delete call;
+    }
+
+    if (!found) {
+        std::cerr << "warning: no call times recorded in " << filename << "\n";
+    }
+
+    return true;
+}
+
+static int
+command(int argc, char *argv[])
+{
+    const char *output = NULL;
+    const char *trace = NULL;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, shortOptions, longOptions, NULL)) != -1) {
+        switch (opt) {
+        case 'h':
+            usage();
+            return 0;
+        case 'o':
+            output = optarg;
+            break;
+        case 't':
+            trace = optarg;
+            break;
+        default:
+            std::cerr << "error: unexpected option `" << (char)opt << "`\n";
+            usage();
+            return 1;
+        }
+    }
+
+    if (argc > optind + (trace ? 0 : 1)) {
+        std::cerr << "error: too many arguments\n";
+        usage();
+        return 1;
+    }
+
+    std::ofstream file;
+    if (output) {
+        file.open(output);
+        if (!file) {
+            std::cerr << "error: failed to create " << output << "\n";
+            return 1;
+        }
+    }
+
+    if (trace) {
+        return writeCallTimes(trace, output ? file : std::cout) ? 0 : 1;
+    }
+
+    FILE *in = stdin;
+    if (argc > optind) {
+        in = fopen(argv[optind], "rb");
+        if (!in) {
+            std::cerr << "error: failed to open " << argv[optind] << "\n";
+            return 1;
+        }
+    } else {
+        os::setBinaryMode(stdin);
+    }
+
+    TextProfileWriter writer(output ? file : std::cout);
+
+    char buffer[64*1024];
+    size_t length;
+    while ((length = fread(buffer, 1, sizeof buffer, in)) != 0) {
+        writer.parse(buffer, length);
+    }
+
+    if (in != stdin) {
+        fclose(in);
+    }
+
+    if (!writer.finish()) {
+        std::cerr << "error: truncated or invalid profile\n";
+        return 1;
+    }
+
+    return 0;
+}
+
+const Command profile_command = {
+    "profile",
+    synopsis,
+    usage,
+    command
+};
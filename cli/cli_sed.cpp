@@ -67,9 +67,57 @@ using namespace trace;
 
 
 /**
- * A visitor that replaces symbol constants.
+ * Read a signed integer encoded at the given offset, returning its size.
  */
-class Replacer : public Visitor
+static signed long long
+readSInt(const std::string &data, size_t offset, size_t &size)
+{
+    size_t pos = offset;
+    int type = (unsigned char)data[pos++];
+    unsigned long long value = 0;
+    unsigned shift = 0;
+    unsigned char c;
+    do {
+        c = data[pos++];
+        value |= (unsigned long long)(c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    size = pos - offset;
+    return type == trace::TYPE_SINT ? -(signed long long)value : value;
+}
+
+
+/**
+ * Encode a signed integer like Writer::writeSInt.
+ */
+static std::string
+encodeSInt(signed long long value)
+{
+    std::string bytes;
+    unsigned long long uvalue;
+    if (value < 0) {
+        bytes += (char)trace::TYPE_SINT;
+        uvalue = -value;
+    } else {
+        bytes += (char)trace::TYPE_UINT;
+        uvalue = value;
+    }
+    do {
+        char c = uvalue & 0x7f;
+        uvalue >>= 7;
+        if (uvalue) {
+            c |= 0x80;
+        }
+        bytes += c;
+    } while (uvalue);
+    return bytes;
+}
+
+
+/**
+ * Replaces symbol constants in the encoded details of a call.
+ */
+class Replacer
 {
 protected:
     std::string searchName;
@@ -85,80 +133,35 @@ public:
     ~Replacer() {
     }
 
-    void visit(Null *) {
-    }
-
-    void visit(Bool *node) {
-    }
-
-    void visit(SInt *node) {
-    }
-
-    void visit(UInt *node) {
-    }
-
-    void visit(Float *node) {
-    }
-
-    void visit(Double *node) {
-    }
-
-    void visit(String *node) {
-    }
+    void replace(RawCall *raw) {
+        for (size_t i = 0; i < raw->sigs.size(); ++i) {
+            const RawCall::SigRef &ref = raw->sigs[i];
+            if (ref.kind != RawCall::SIG_ENUM) {
+                continue;
+            }
 
-    void visit(WString *node) {
-    }
+            /* The enum value follows its signature. */
+            const EnumSig *sig = ref.enumSig;
+            size_t size;
+            signed long long value = readSInt(raw->data, ref.offset, size);
 
-    void visit(Enum *node) {
-        const EnumValue *it = node->lookup();
-        if (it) {
-            if (searchName.compare(it->name) == 0) {
-                const EnumSig *sig = node->sig;
-                for (unsigned i = 0; i < sig->num_values; ++i) {
-                    if (replaceName.compare(sig->values[i].name) == 0) {
-                        node->value = sig->values[i].value;
-                        break;
-                    }
+            const EnumValue *it;
+            for (it = sig->values; it != sig->values + sig->num_values; ++it) {
+                if (it->value == value) {
+                    break;
                 }
             }
-        }
-    }
-
-    void visit(Bitmask *bitmask) {
-    }
-
-    void visit(Struct *s) {
-        for (unsigned i = 0; i < s->members.size(); ++i) {
-            Value *memberValue = s->members[i];
-            _visit(memberValue);
-        }
-    }
-
-    void visit(Array *array) {
-        for (std::vector<Value *>::iterator it = array->values.begin(); it != array->values.end(); ++it) {
-            _visit(*it);
-        }
-    }
-
-    void visit(Blob *blob) {
-    }
-
-    void visit(Pointer *p) {
-    }
-
-    void visit(Repr *r) {
-        _visit(r->humanValue);
-    }
-
-    void visit(Call *call) {
-        for (unsigned i = 0; i < call->args.size(); ++i) {
-            if (call->args[i].value) {
-                _visit(call->args[i].value);
+            if (it == sig->values + sig->num_values ||
+                searchName.compare(it->name) != 0) {
+                continue;
             }
-        }
 
-        if (call->ret) {
-            _visit(call->ret);
+            for (unsigned j = 0; j < sig->num_values; ++j) {
+                if (replaceName.compare(sig->values[j].name) == 0) {
+                    raw->replace(ref.offset, size, encodeSInt(sig->values[j].value));
+                    break;
+                }
+            }
         }
     }
 };
@@ -192,10 +195,10 @@ sed_trace(Replacements &replacements, const char *inFileName, std::string &outFi
     }
 
     trace::Call *call;
-    while ((call = p.parse_call())) {
+    while ((call = p.parse_raw_call())) {
 
         for (Replacements::iterator it = replacements.begin(); it != replacements.end(); ++it) {
-            it->visit(call);
+            it->replace(call->raw);
         }
 
         writer.writeCall(call);
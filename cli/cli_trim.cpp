@@ -29,7 +29,9 @@
 #include <limits.h> // for CHAR_MAX
 #include <getopt.h>
 
+#include <algorithm>
 #include <set>
+#include <vector>
 
 #include "cli.hpp"
 
@@ -199,13 +201,28 @@ struct trim_options {
     TrimFlags trim_flags;
 };
 
+/* A point in the trace with no pending calls, recorded in pass 1 so
+ * that pass 2 can skip over stretches of calls that are not
+ * required. */
+struct trim_bookmark {
+    trace::ParseBookmark bookmark;
+    unsigned frame;
+};
+
+static bool
+compare_bookmark(trace::CallNo call_no, const trim_bookmark &bookmark)
+{
+    return call_no < bookmark.bookmark.next_call_no;
+}
+
 static int
 trim_trace(const char *filename, struct trim_options *options)
 {
     trace::ParseBookmark beginning;
     trace::Parser p;
     TraceAnalyzer analyzer(options->trim_flags);
-    trace::FastCallSet *required;
+    const CallBitset *required;
+    std::vector<trim_bookmark> bookmarks;
     unsigned frame;
     int call_range_first, call_range_last;
 
@@ -217,10 +234,11 @@ trim_trace(const char *filename, struct trim_options *options)
     /* Mark the beginning so we can return here for pass 2. */
     p.getBookmark(beginning);
 
-    /* In pass 1, analyze which calls are needed. */
+    /* In pass 1, analyze which calls are needed.  The values of the calls
+     * are only looked at by the dependency analysis. */
     frame = 0;
     trace::Call *call;
-    while ((call = p.parse_call())) {
+    while ((call = options->dependency_analysis ? p.parse_call() : p.scan_call())) {
 
         /* There's no use doing any work past the last call and frame
          * requested by the user. */
@@ -263,6 +281,17 @@ trim_trace(const char *filename, struct trim_options *options)
             frame++;
 
         delete call;
+
+        /* Remember at most one bookmark per chunk. */
+        if (!p.hasPendingCalls()) {
+            trim_bookmark bookmark;
+            p.getBookmark(bookmark.bookmark);
+            if (bookmarks.empty() ||
+                bookmarks.back().bookmark.offset.chunk != bookmark.bookmark.offset.chunk) {
+                bookmark.frame = frame;
+                bookmarks.push_back(bookmark);
+            }
+        }
     }
 
     /* Prepare output file and writer for output. */
@@ -282,13 +311,14 @@ trim_trace(const char *filename, struct trim_options *options)
     /* Reset bookmark for pass 2. */
     p.setBookmark(beginning);
 
-    /* In pass 2, emit the calls that are required. */
+    /* In pass 2, emit the calls that are required, copying them as they
+     * were encoded. */
     required = analyzer.get_required();
 
     frame = 0;
     call_range_first = -1;
     call_range_last = -1;
-    while ((call = p.parse_call())) {
+    while ((call = p.parse_raw_call())) {
 
         /* There's no use doing any work past the last call and frame
          * requested by the user. */
@@ -321,6 +351,29 @@ trim_trace(const char *filename, struct trim_options *options)
         }
 
         delete call;
+
+        /* Skip ahead to the last bookmark before the next required
+         * call, if there is one. */
+        if (!p.hasPendingCalls()) {
+            trace::ParseBookmark current;
+            p.getBookmark(current);
+
+            trace::CallNo next_required = current.next_call_no;
+            if (!required->next(next_required)) {
+                break;
+            }
+
+            std::vector<trim_bookmark>::const_iterator it =
+                std::upper_bound(bookmarks.begin(), bookmarks.end(),
+                                 next_required, compare_bookmark);
+            if (it != bookmarks.begin()) {
+                --it;
+                if (it->bookmark.next_call_no > current.next_call_no) {
+                    p.setBookmark(it->bookmark);
+                    frame = it->frame;
+                }
+            }
+        }
     }
 
     if (options->print_callset) {
@@ -23,7 +23,9 @@
  *
  **************************************************************************/
 
-#include <sstream>
+#include <algorithm>
+
+#include <assert.h>
 
 #include "trace_analyzer.hpp"
 
@@ -39,24 +41,194 @@ TraceAnalyzer::renderingHasSideEffect(void)
     return transformFeedbackActive || framebufferObjectActive;
 }
 
+void
+CallBitset::insert(trace::CallNo call_no)
+{
+    trace::CallNo index = call_no / 64;
+    unsigned long long bit = 1ULL << (call_no % 64);
+
+    /* Calls are mostly inserted in increasing order. */
+    if (words.empty() || words.back().index < index) {
+        Word word;
+        word.index = index;
+        word.bits = bit;
+        words.push_back(word);
+        return;
+    }
+
+    std::vector<Word>::iterator it =
+        std::lower_bound(words.begin(), words.end(), index, compareIndex);
+    if (it->index == index) {
+        it->bits |= bit;
+    } else {
+        Word word;
+        word.index = index;
+        word.bits = bit;
+        words.insert(it, word);
+    }
+}
+
+void
+CallBitset::insert(const CallBitset &other)
+{
+    if (other.words.empty()) {
+        return;
+    }
+    if (words.empty()) {
+        words = other.words;
+        return;
+    }
+
+    /* Most of the other calls usually fall in words already present,
+     * so update those in place, and count the ones missing. */
+    size_t old_size = words.size();
+    size_t missing = 0;
+    std::vector<Word>::iterator it = words.begin();
+    for (size_t i = 0; i < other.words.size(); ++i) {
+        const Word &word = other.words[i];
+        it = std::lower_bound(it, words.end(), word.index, compareIndex);
+        if (it != words.end() && it->index == word.index) {
+            it->bits |= word.bits;
+        } else {
+            ++missing;
+        }
+    }
+    if (!missing) {
+        return;
+    }
+
+    /* Then merge the missing words from the back. */
+    words.resize(old_size + missing);
+    size_t i = old_size;
+    size_t j = other.words.size();
+    size_t k = words.size();
+    while (j > 0 && k > i) {
+        const Word &word = other.words[j - 1];
+        if (i > 0 && words[i - 1].index >= word.index) {
+            if (words[i - 1].index == word.index) {
+                --j;
+            }
+            words[--k] = words[--i];
+        } else {
+            words[--k] = word;
+            --j;
+        }
+    }
+}
+
+bool
+CallBitset::contains(trace::CallNo call_no) const
+{
+    trace::CallNo index = call_no / 64;
+    std::vector<Word>::const_iterator it =
+        std::lower_bound(words.begin(), words.end(), index, compareIndex);
+    return it != words.end() &&
+           it->index == index &&
+           (it->bits >> (call_no % 64)) & 1;
+}
+
+bool
+CallBitset::next(trace::CallNo &call_no) const
+{
+    trace::CallNo index = call_no / 64;
+    std::vector<Word>::const_iterator it =
+        std::lower_bound(words.begin(), words.end(), index, compareIndex);
+    if (it == words.end()) {
+        return false;
+    }
+
+    unsigned bit = 0;
+    unsigned long long bits = it->bits;
+    if (it->index == index) {
+        bit = call_no % 64;
+        bits >>= bit;
+        if (!bits) {
+            if (++it == words.end()) {
+                return false;
+            }
+            bit = 0;
+            bits = it->bits;
+        }
+    }
+
+    assert(bits);
+    while (!(bits & 1)) {
+        bits >>= 1;
+        ++bit;
+    }
+
+    call_no = it->index * 64 + bit;
+    return true;
+}
+
+static inline size_t
+hashResource(unsigned kind, unsigned first, unsigned second)
+{
+    size_t hash = ((kind * 0x9E3779B1U) ^ first) * 0x85EBCA6BU ^ second;
+    return hash ^ (hash >> 16);
+}
+
+/* Return the ID of the given resource, assigning a new one when
+ * seen for the first time. */
+TraceAnalyzer::ResourceId
+TraceAnalyzer::resource(ResourceKind kind, unsigned first, unsigned second)
+{
+    size_t mask = resourceTable.size() - 1;
+    size_t slot = hashResource(kind, first, second) & mask;
+    while (resourceTable[slot]) {
+        ResourceId id = resourceTable[slot] - 1;
+        const ResourceKey &key = resourceKeys[id];
+        if (key.kind == kind &&
+            key.first == first &&
+            key.second == second) {
+            return id;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    ResourceId id = resourceKeys.size();
+    ResourceKey key;
+    key.kind = kind;
+    key.first = first;
+    key.second = second;
+    resourceKeys.push_back(key);
+    resources.resize(id + 1);
+    dependencies.resize(id + 1);
+    resourceTable[slot] = id + 1;
+
+    /* Keep the table at most half full. */
+    if (resourceKeys.size() * 2 > resourceTable.size()) {
+        std::vector<ResourceId> table(resourceTable.size() * 2);
+        mask = table.size() - 1;
+        for (size_t i = 0; i < resourceTable.size(); ++i) {
+            if (resourceTable[i]) {
+                const ResourceKey &k = resourceKeys[resourceTable[i] - 1];
+                size_t s = hashResource(k.kind, k.first, k.second) & mask;
+                while (table[s]) {
+                    s = (s + 1) & mask;
+                }
+                table[s] = resourceTable[i];
+            }
+        }
+        resourceTable.swap(table);
+    }
+
+    return id;
+}
+
 /* Provide: Record that the given call affects the given resource
  * as a side effect. */
 void
-TraceAnalyzer::provide(std::string resource, trace::CallNo call_no)
+TraceAnalyzer::provide(ResourceId resource, trace::CallNo call_no)
 {
     resources[resource].insert(call_no);
 }
 
-/* Like provide, but with a simply-formatted string, (appending an
- * integer to the given string). */
+/* Like provide, but for all the given calls. */
 void
-TraceAnalyzer::providef(std::string resource,
-                        int resource_no,
-                        trace::CallNo call_no)
+TraceAnalyzer::provide(ResourceId resource, const CallBitset &calls)
 {
-    std::stringstream ss;
-    ss << resource << resource_no;
-    provide(ss.str(), call_no);
+    resources[resource].insert(calls);
 }
 
 /* Link: Establish a dependency between resource 'resource' and
@@ -65,105 +237,64 @@ TraceAnalyzer::providef(std::string resource,
  * before 'resource' is consumed, those calls will still be
  * captured. */
 void
-TraceAnalyzer::link(std::string resource, std::string dependency)
-{
-    dependencies[resource].insert(dependency);
-}
-
-/* Like link, but with a simply-formatted string, (appending an
- * integer to the given string). */
-void
-TraceAnalyzer::linkf(std::string resource, std::string dependency, int dep_no)
+TraceAnalyzer::link(ResourceId resource, ResourceId dependency)
 {
-
-    std::stringstream ss;
-    ss << dependency << dep_no;
-    link(resource, ss.str());
+    std::vector<ResourceId> &deps = dependencies[resource];
+    if (std::find(deps.begin(), deps.end(), dependency) == deps.end()) {
+        deps.push_back(dependency);
+    }
 }
 
 /* Unlink: Remove dependency from 'resource' on 'dependency'. */
 void
-TraceAnalyzer::unlink(std::string resource, std::string dependency)
+TraceAnalyzer::unlink(ResourceId resource, ResourceId dependency)
 {
-    dependencies[resource].erase(dependency);
-    if (dependencies[resource].size() == 0) {
-        dependencies.erase(resource);
+    std::vector<ResourceId> &deps = dependencies[resource];
+    std::vector<ResourceId>::iterator it =
+        std::find(deps.begin(), deps.end(), dependency);
+    if (it != deps.end()) {
+        deps.erase(it);
     }
 }
 
-/* Like unlink, but with a simply-formated string, (appending an
- * integer to the given string). */
-void
-TraceAnalyzer::unlinkf(std::string resource, std::string dependency, int dep_no)
-{
-
-    std::stringstream ss;
-    ss << dependency << dep_no;
-    unlink(resource, ss.str());
-}
-
 /* Unlink all: Remove dependencies from 'resource' to all other
  * resources. */
 void
-TraceAnalyzer::unlinkAll(std::string resource)
+TraceAnalyzer::unlinkAll(ResourceId resource)
 {
-    dependencies.erase(resource);
+    dependencies[resource].clear();
 }
 
 /* Resolve: Recursively compute all calls providing 'resource',
  * (including linked dependencies of 'resource' on other
- * resources). */
-std::set<unsigned>
-TraceAnalyzer::resolve(std::string resource)
+ * resources), adding them to 'calls'. */
+void
+TraceAnalyzer::resolve(ResourceId resource, CallBitset &calls)
 {
-    std::set<std::string> *deps;
-    std::set<std::string>::iterator dep;
-
-    std::set<unsigned> *calls;
-    std::set<unsigned>::iterator call;
-
-    std::set<unsigned> result, deps_set;
-
     /* Recursively chase dependencies. */
-    if (dependencies.count(resource)) {
-        deps = &dependencies[resource];
-        for (dep = deps->begin(); dep != deps->end(); dep++) {
-            deps_set = resolve(*dep);
-            for (call = deps_set.begin(); call != deps_set.end(); call++) {
-                result.insert(*call);
-            }
-        }
+    const std::vector<ResourceId> &deps = dependencies[resource];
+    for (size_t i = 0; i < deps.size(); ++i) {
+        resolve(deps[i], calls);
     }
 
     /* Also look for calls that directly provide 'resource' */
-    if (resources.count(resource)) {
-        calls = &resources[resource];
-        for (call = calls->begin(); call != calls->end(); call++) {
-            result.insert(*call);
-        }
-    }
-
-    return result;
+    calls.insert(resources[resource]);
 }
 
 /* Consume: Resolve all calls that provide the given resource, and
  * add them to the required list. Then clear the call list for
  * 'resource' along with any dependencies. */
 void
-TraceAnalyzer::consume(std::string resource)
+TraceAnalyzer::consume(ResourceId resource)
 {
+    CallBitset calls;
 
-    std::set<unsigned> calls;
-    std::set<unsigned>::iterator call;
-
-    calls = resolve(resource);
+    resolve(resource, calls);
 
-    dependencies.erase(resource);
-    resources.erase(resource);
+    dependencies[resource].clear();
+    resources[resource].clear();
 
-    for (call = calls.begin(); call != calls.end(); call++) {
-        required.add(*call);
-    }
+    required.insert(calls);
 }
 
 void
@@ -253,8 +384,9 @@ TraceAnalyzer::stateTrackPostCall(trace::Call *call)
      * next frame. */
     if (call->flags & trace::CALL_FLAG_SWAP_RENDERTARGET &&
         call->flags & trace::CALL_FLAG_END_FRAME) {
-        dependencies.erase("framebuffer");
-        resources.erase("framebuffer");
+        ResourceId framebuffer = resource(RESOURCE_FRAMEBUFFER);
+        dependencies[framebuffer].clear();
+        resources[framebuffer].clear();
         return;
     }
 
@@ -286,7 +418,7 @@ TraceAnalyzer::recordTextureSideEffects(trace::Call *call, const char *name)
         if (textures) {
             for (i = 0; i < textures->size(); i++) {
                 texture = textures->values[i]->toUInt();
-                providef("texture-", texture, call->no);
+                provide(resource(RESOURCE_TEXTURE, texture), call->no);
             }
         }
         return true;
@@ -301,28 +433,27 @@ TraceAnalyzer::recordTextureSideEffects(trace::Call *call, const char *name)
 
         texture = call->arg(3).toUInt();
 
-        linkf("render-state", "texture-", texture);
+        link(resource(RESOURCE_RENDER_STATE),
+             resource(RESOURCE_TEXTURE, texture));
 
-        provide("state", call->no);
+        provide(resource(RESOURCE_STATE), call->no);
     }
 
     if (strcmp(name, "glBindTexture") == 0) {
         GLenum target;
         GLuint texture;
 
-        std::stringstream ss_target, ss_texture;
-
         target = static_cast<GLenum>(call->arg(0).toSInt());
         texture = call->arg(1).toUInt();
 
-        ss_target << "texture-unit-" << activeTextureUnit << "-target-" << target;
-        ss_texture << "texture-" << texture;
+        ResourceId unit_target = resource(RESOURCE_TEXTURE_UNIT_TARGET,
+                                          activeTextureUnit, target);
 
-        resources.erase(ss_target.str());
-        provide(ss_target.str(), call->no);
+        resources[unit_target].clear();
+        provide(unit_target, call->no);
 
-        unlinkAll(ss_target.str());
-        link(ss_target.str(), ss_texture.str());
+        unlinkAll(unit_target);
+        link(unit_target, resource(RESOURCE_TEXTURE, texture));
 
         /* FIXME: This really shouldn't be necessary. The effect
          * this provide() has is that all glBindTexture calls will
@@ -336,7 +467,7 @@ TraceAnalyzer::recordTextureSideEffects(trace::Call *call, const char *name)
          *
          * More investigation is necessary, but for now, be
          * conservative and don't trim. */
-        provide("state", call->no);
+        provide(resource(RESOURCE_STATE), call->no);
 
         return true;
     }
@@ -351,25 +482,16 @@ TraceAnalyzer::recordTextureSideEffects(trace::Call *call, const char *name)
         strcmp(name, "glInvalidateTexImage") == 0 ||
         strcmp(name, "glInvalidateTexSubImage") == 0) {
 
-        std::set<unsigned> *calls;
-        std::set<unsigned>::iterator c;
-        std::stringstream ss_target, ss_texture;
-
         GLenum target = static_cast<GLenum>(call->arg(0).toSInt());
 
-        ss_target << "texture-unit-" << activeTextureUnit << "-target-" << target;
-        ss_texture << "texture-" << texture_map[target];
+        ResourceId unit_target = resource(RESOURCE_TEXTURE_UNIT_TARGET,
+                                          activeTextureUnit, target);
+        ResourceId texture = resource(RESOURCE_TEXTURE, texture_map[target]);
 
         /* The texture resource depends on this call and any calls
          * providing the given texture target. */
-        provide(ss_texture.str(), call->no);
-
-        if (resources.count(ss_target.str())) {
-            calls = &resources[ss_target.str()];
-            for (c = calls->begin(); c != calls->end(); c++) {
-                provide(ss_texture.str(), *c);
-            }
-        }
+        provide(texture, call->no);
+        provide(texture, resources[unit_target]);
 
         return true;
     }
@@ -384,14 +506,11 @@ TraceAnalyzer::recordTextureSideEffects(trace::Call *call, const char *name)
             cap == GL_TEXTURE_3D ||
             cap == GL_TEXTURE_CUBE_MAP)
         {
-            std::stringstream ss;
-
-            ss << "texture-unit-" << activeTextureUnit << "-target-" << cap;
-
-            link("render-state", ss.str());
+            link(resource(RESOURCE_RENDER_STATE),
+                 resource(RESOURCE_TEXTURE_UNIT_TARGET, activeTextureUnit, cap));
         }
 
-        provide("state", call->no);
+        provide(resource(RESOURCE_STATE), call->no);
         return true;
     }
 
@@ -405,14 +524,11 @@ TraceAnalyzer::recordTextureSideEffects(trace::Call *call, const char *name)
             cap == GL_TEXTURE_3D ||
             cap == GL_TEXTURE_CUBE_MAP)
         {
-            std::stringstream ss;
-
-            ss << "texture-unit-" << activeTextureUnit << "-target-" << cap;
-
-            unlink("render-state", ss.str());
+            unlink(resource(RESOURCE_RENDER_STATE),
+                   resource(RESOURCE_TEXTURE_UNIT_TARGET, activeTextureUnit, cap));
         }
 
-        provide("state", call->no);
+        provide(resource(RESOURCE_STATE), call->no);
         return true;
     }
 
@@ -427,7 +543,7 @@ TraceAnalyzer::recordShaderSideEffects(trace::Call *call, const char *name)
         strcmp(name, "glCreateShaderObjectARB") == 0) {
 
         GLuint shader = call->ret->toUInt();
-        providef("shader-", shader, call->no);
+        provide(resource(RESOURCE_SHADER, shader), call->no);
         return true;
     }
 
@@ -439,7 +555,7 @@ TraceAnalyzer::recordShaderSideEffects(trace::Call *call, const char *name)
         strcmp(name, "glGetShaderInfoLog") == 0) {
 
         GLuint shader = call->arg(0).toUInt();
-        providef("shader-", shader, call->no);
+        provide(resource(RESOURCE_SHADER, shader), call->no);
         return true;
     }
 
@@ -447,7 +563,7 @@ TraceAnalyzer::recordShaderSideEffects(trace::Call *call, const char *name)
         strcmp(name, "glCreateProgramObjectARB") == 0) {
 
         GLuint program = call->ret->toUInt();
-        providef("program-", program, call->no);
+        provide(resource(RESOURCE_PROGRAM, program), call->no);
         return true;
     }
 
@@ -455,16 +571,14 @@ TraceAnalyzer::recordShaderSideEffects(trace::Call *call, const char *name)
         strcmp(name, "glAttachObjectARB") == 0) {
 
         GLuint program, shader;
-        std::stringstream ss_program, ss_shader;
 
         program = call->arg(0).toUInt();
         shader = call->arg(1).toUInt();
 
-        ss_program << "program-" << program;
-        ss_shader << "shader-" << shader;
+        ResourceId program_id = resource(RESOURCE_PROGRAM, program);
 
-        link(ss_program.str(), ss_shader.str());
-        provide(ss_program.str(), call->no);
+        link(program_id, resource(RESOURCE_SHADER, shader));
+        provide(program_id, call->no);
 
         return true;
     }
@@ -473,15 +587,12 @@ TraceAnalyzer::recordShaderSideEffects(trace::Call *call, const char *name)
         strcmp(name, "glDetachObjectARB") == 0) {
 
         GLuint program, shader;
-        std::stringstream ss_program, ss_shader;
 
         program = call->arg(0).toUInt();
         shader = call->arg(1).toUInt();
 
-        ss_program << "program-" << program;
-        ss_shader << "shader-" << shader;
-
-        unlink(ss_program.str(), ss_shader.str());
+        unlink(resource(RESOURCE_PROGRAM, program),
+               resource(RESOURCE_SHADER, shader));
 
         return true;
     }
@@ -493,20 +604,21 @@ TraceAnalyzer::recordShaderSideEffects(trace::Call *call, const char *name)
 
         program = call->arg(0).toUInt();
 
-        unlinkAll("render-program-state");
+        ResourceId render_state = resource(RESOURCE_RENDER_STATE);
+        ResourceId render_program_state = resource(RESOURCE_RENDER_PROGRAM_STATE);
+
+        unlinkAll(render_program_state);
 
         if (program == 0) {
-            unlink("render-state", "render-program-state");
-            provide("state", call->no);
+            unlink(render_state, render_program_state);
+            provide(resource(RESOURCE_STATE), call->no);
         } else {
-            std::stringstream ss;
+            ResourceId program_id = resource(RESOURCE_PROGRAM, program);
 
-            ss << "program-" << program;
+            link(render_state, render_program_state);
+            link(render_program_state, program_id);
 
-            link("render-state", "render-program-state");
-            link("render-program-state", ss.str());
-
-            provide(ss.str(), call->no);
+            provide(program_id, call->no);
         }
 
         return true;
@@ -523,7 +635,7 @@ TraceAnalyzer::recordShaderSideEffects(trace::Call *call, const char *name)
 
         GLuint program = call->arg(0).toUInt();
 
-        providef("program-", program, call->no);
+        provide(resource(RESOURCE_PROGRAM, program), call->no);
 
         return true;
     }
@@ -534,7 +646,7 @@ TraceAnalyzer::recordShaderSideEffects(trace::Call *call, const char *name)
     if (call->sig->num_args > 0 &&
         strcmp(call->sig->arg_names[0], "location") == 0) {
 
-        providef("program-", activeProgram, call->no);
+        provide(resource(RESOURCE_PROGRAM, activeProgram), call->no);
 
         /* We can't easily tell if this uniform is being used to
          * associate a sampler in the shader with a texture
@@ -550,23 +662,21 @@ TraceAnalyzer::recordShaderSideEffects(trace::Call *call, const char *name)
             GLint max_unit = MAX(GL_MAX_TEXTURE_COORDS, GL_MAX_COMBINED_TEXTURE_IMAGE_UNITS);
 
             GLint unit = call->arg(1).toSInt();
-            std::stringstream ss_program;
-            std::stringstream ss_texture;
 
             if (unit < max_unit) {
 
-                ss_program << "program-" << activeProgram;
+                ResourceId program_id = resource(RESOURCE_PROGRAM, activeProgram);
 
-                ss_texture << "texture-unit-" << GL_TEXTURE0 + unit << "-target-";
+                unsigned texture_unit = GL_TEXTURE0 + unit;
 
                 /* We don't know what target(s) might get bound to
                  * this texture unit, so conservatively link to
                  * all. Only bound textures will actually get inserted
                  * into the output call stream. */
-                linkf(ss_program.str(), ss_texture.str(), GL_TEXTURE_1D);
-                linkf(ss_program.str(), ss_texture.str(), GL_TEXTURE_2D);
-                linkf(ss_program.str(), ss_texture.str(), GL_TEXTURE_3D);
-                linkf(ss_program.str(), ss_texture.str(), GL_TEXTURE_CUBE_MAP);
+                link(program_id, resource(RESOURCE_TEXTURE_UNIT_TARGET, texture_unit, GL_TEXTURE_1D));
+                link(program_id, resource(RESOURCE_TEXTURE_UNIT_TARGET, texture_unit, GL_TEXTURE_2D));
+                link(program_id, resource(RESOURCE_TEXTURE_UNIT_TARGET, texture_unit, GL_TEXTURE_3D));
+                link(program_id, resource(RESOURCE_TEXTURE_UNIT_TARGET, texture_unit, GL_TEXTURE_CUBE_MAP));
             }
         }
 
@@ -589,7 +699,7 @@ TraceAnalyzer::recordShaderSideEffects(trace::Call *call, const char *name)
           strcmp(call->sig->arg_names[0], "programObj") == 0))) {
 
         GLuint program = call->arg(0).toUInt();
-        providef("program-", program, call->no);
+        provide(resource(RESOURCE_PROGRAM, program), call->no);
         return true;
     }
 
@@ -606,24 +716,22 @@ TraceAnalyzer::recordDrawingSideEffects(trace::Call *call, const char *name)
     if (call->flags & trace::CALL_FLAG_RENDER ||
         insideBeginEnd) {
 
-        std::set<unsigned> calls;
-        std::set<unsigned>::iterator c;
+        CallBitset calls;
 
-        provide("framebuffer", call->no);
+        ResourceId framebuffer = resource(RESOURCE_FRAMEBUFFER);
 
-        calls = resolve("render-state");
+        provide(framebuffer, call->no);
 
-        for (c = calls.begin(); c != calls.end(); c++) {
-            provide("framebuffer", *c);
-        }
+        resolve(resource(RESOURCE_RENDER_STATE), calls);
+
+        provide(framebuffer, calls);
 
         /* In some cases, rendering has side effects beyond the
          * framebuffer update. */
         if (renderingHasSideEffect()) {
-            provide("state", call->no);
-            for (c = calls.begin(); c != calls.end(); c++) {
-                provide("state", *c);
-            }
+            ResourceId state = resource(RESOURCE_STATE);
+            provide(state, call->no);
+            provide(state, calls);
         }
 
         return true;
@@ -656,14 +764,15 @@ TraceAnalyzer::recordSideEffects(trace::Call *call)
      * lists will work, but does not trim out unused display
      * lists. */
     if (insideNewEndList != 0) {
-        provide("state", call->no);
+        provide(resource(RESOURCE_STATE), call->no);
 
         /* Also, any texture bound inside a display list is
          * conservatively considered required. */
         if (strcmp(name, "glBindTexture") == 0) {
             GLuint texture = call->arg(1).toUInt();
 
-            linkf("state", "texture-", texture);
+            link(resource(RESOURCE_STATE),
+                 resource(RESOURCE_TEXTURE, texture));
         }
 
         return;
@@ -698,7 +807,7 @@ TraceAnalyzer::recordSideEffects(trace::Call *call)
     }
 
     /* By default, assume this call affects the state somehow. */
-    resources["state"].insert(call->no);
+    provide(resource(RESOURCE_STATE), call->no);
 }
 
 void
@@ -708,11 +817,11 @@ TraceAnalyzer::requireDependencies(trace::Call *call)
     /* Swap-buffers calls depend on framebuffer state. */
     if (call->flags & trace::CALL_FLAG_SWAP_RENDERTARGET &&
         call->flags & trace::CALL_FLAG_END_FRAME) {
-        consume("framebuffer");
+        consume(resource(RESOURCE_FRAMEBUFFER));
     }
 
     /* By default, just assume this call depends on generic state. */
-    consume("state");
+    consume(resource(RESOURCE_STATE));
 }
 
 TraceAnalyzer::TraceAnalyzer(TrimFlags trimFlagsOpt):
@@ -723,7 +832,7 @@ TraceAnalyzer::TraceAnalyzer(TrimFlags trimFlagsOpt):
     activeTextureUnit(GL_TEXTURE0),
     trimFlags(trimFlagsOpt)
 {
-    /* Nothing needed. */
+    resourceTable.resize(64);
 }
 
 TraceAnalyzer::~TraceAnalyzer()
@@ -754,13 +863,13 @@ TraceAnalyzer::require(trace::Call *call)
     requireDependencies(call);
 
     /* Then insert this call itself. */
-    required.add(call->no);
+    required.insert(call->no);
 }
 
 /* Return a set of all the required calls, (both those calls added
  * explicitly with require() and those implicitly depended
  * upon. */
-trace::FastCallSet *
+const CallBitset *
 TraceAnalyzer::get_required(void)
 {
     return &required;
@@ -23,13 +23,13 @@
  *
  **************************************************************************/
 
-#include <set>
+#include <map>
+#include <vector>
 
 #include <GL/gl.h>
 #include <GL/glext.h>
 
 #include "trace_callset.hpp"
-#include "trace_fast_callset.hpp"
 #include "trace_parser.hpp"
 
 typedef unsigned TrimFlags;
@@ -52,14 +52,91 @@ enum {
     TRIM_FLAG_DRAWING			= (1 << 3),
 };
 
+/**
+ * Compact set of call numbers.
+ *
+ * Call numbers are kept as a sorted sequence of 64-bit words, each covering
+ * 64 consecutive call numbers, which is both small and fast to merge for the
+ * runs of nearby calls that resources are typically provided by.
+ */
+class CallBitset {
+private:
+    struct Word {
+        trace::CallNo index;
+        unsigned long long bits;
+    };
+
+    std::vector<Word> words;
+
+    static bool
+    compareIndex(const Word &word, trace::CallNo index) {
+        return word.index < index;
+    }
+
+public:
+    bool
+    empty(void) const {
+        return words.empty();
+    }
+
+    void
+    clear(void) {
+        words.clear();
+    }
+
+    void
+    insert(trace::CallNo call_no);
+
+    /* Insert all calls in the given set. */
+    void
+    insert(const CallBitset &other);
+
+    bool
+    contains(trace::CallNo call_no) const;
+
+    /* Find the first call in the set not less than call_no, returning
+     * false if there is none. */
+    bool
+    next(trace::CallNo &call_no) const;
+};
+
 class TraceAnalyzer {
 private:
-    std::map<std::string, std::set<unsigned> > resources;
-    std::map<std::string, std::set<std::string> > dependencies;
+    /* Resources are referred by small integer IDs, interned from
+     * their kind and up to two numbers (e.g., the texture name). */
+    typedef unsigned ResourceId;
+
+    enum ResourceKind {
+        RESOURCE_STATE,
+        RESOURCE_FRAMEBUFFER,
+        RESOURCE_RENDER_STATE,
+        RESOURCE_RENDER_PROGRAM_STATE,
+        RESOURCE_TEXTURE,
+        RESOURCE_TEXTURE_UNIT_TARGET,
+        RESOURCE_SHADER,
+        RESOURCE_PROGRAM,
+    };
+
+    struct ResourceKey {
+        ResourceKind kind;
+        unsigned first;
+        unsigned second;
+    };
+
+    /* Open addressing hash table of resource IDs plus one, (zero
+     * marking empty slots), with a power of two size. */
+    std::vector<ResourceId> resourceTable;
+    std::vector<ResourceKey> resourceKeys;
+
+    /* Calls providing each resource. */
+    std::vector<CallBitset> resources;
+
+    /* Resources each resource is linked to. */
+    std::vector<std::vector<ResourceId> > dependencies;
 
     std::map<GLenum, unsigned> texture_map;
 
-    trace::FastCallSet required;
+    CallBitset required;
 
     bool transformFeedbackActive;
     bool framebufferObjectActive;
@@ -69,15 +146,14 @@ private:
     GLuint activeProgram;
     unsigned int trimFlags;
 
-    void provide(std::string resource, trace::CallNo call_no);
-    void providef(std::string resource, int resource_no, trace::CallNo call_no);
+    ResourceId resource(ResourceKind kind, unsigned first = 0, unsigned second = 0);
 
-    void link(std::string resource, std::string dependency);
-    void linkf(std::string resource, std::string dependency, int dep_no);
+    void provide(ResourceId resource, trace::CallNo call_no);
+    void provide(ResourceId resource, const CallBitset &calls);
 
-    void unlink(std::string resource, std::string dependency);
-    void unlinkf(std::string resource, std::string dependency, int dep_no);
-    void unlinkAll(std::string resource);
+    void link(ResourceId resource, ResourceId dependency);
+    void unlink(ResourceId resource, ResourceId dependency);
+    void unlinkAll(ResourceId resource);
 
     void stateTrackPreCall(trace::Call *call);
 
@@ -90,9 +166,9 @@ private:
     void stateTrackPostCall(trace::Call *call);
 
     bool renderingHasSideEffect(void);
-    std::set<unsigned> resolve(std::string resource);
+    void resolve(ResourceId resource, CallBitset &calls);
 
-    void consume(std::string resource);
+    void consume(ResourceId resource);
     void requireDependencies(trace::Call *call);
 
 public:
@@ -110,5 +186,5 @@ public:
     /* Return a set of all the required calls, (both those calls added
      * explicitly with require() and those implicitly depended
      * upon. */
-    trace::FastCallSet *get_required(void);
+    const CallBitset *get_required(void);
 };
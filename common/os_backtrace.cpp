@@ -35,6 +35,7 @@
 #include <set>
 #include <vector>
 #include "os.hpp"
+#include "os_thread.hpp"
 
 #if defined(ANDROID)
 #  include <dlfcn.h>
@@ -53,6 +54,12 @@ using trace::Id;
 
 namespace os {
 
+/*
+ * The trace writer unwinds without holding its own mutex, so the providers'
+ * caches are guarded by this one.
+ */
+static os::mutex backtraceMutex;
+
 /*
  * Pascal string (with zero terminator optionally omitted)
  * This is a helper class for storing a set of exact strings or prefixes
@@ -269,10 +276,15 @@ public:
 };
 
 std::vector<RawStackFrame> get_backtrace() {
+    os::unique_lock<os::mutex> lock(backtraceMutex);
     static DalvikBacktraceProvider backtraceProvider;
     return backtraceProvider.parseBacktrace(backtraceProvider.getBacktrace());
 }
 
+const RawStack *get_stack() {
+    return NULL;
+}
+
 void dump_backtrace() {
     /* TODO */
 }
@@ -336,10 +348,31 @@ class libbacktraceProvider {
     int skipFrames;
     Id nextFrameId;
     std::map<uintptr_t, std::vector<RawStackFrame> > cache;
-    std::vector<RawStackFrame> *current, *current_frames;
+    std::vector<RawStackFrame> *current_frames;
     RawStackFrame *current_frame;
     bool missingDwarf;
 
+    /*
+     * Stacks seen so far, keyed by a hash of their return addresses, with
+     * colliding ones chained.
+     */
+    struct StackEntry {
+        RawStack stack;
+        unsigned num_pcs;
+        uintptr_t pcs[BT_DEPTH];
+        StackEntry *next;
+    };
+    std::map<unsigned long long, StackEntry *> stacks;
+    Id nextStackId;
+
+    /*
+     * Return addresses of one call site, unwound without the mutex held.
+     */
+    struct Unwinding {
+        unsigned num_pcs;
+        uintptr_t pcs[BT_DEPTH];
+    };
+
     static void bt_err_callback(void *vdata, const char *msg, int errnum)
     {
         libbacktraceProvider *this_ = (libbacktraceProvider*)vdata;
@@ -394,23 +427,36 @@ class libbacktraceProvider {
                                        : pc - (uintptr_t)info.dli_fbase;
     }
 
-    static int bt_callback(void *vdata, uintptr_t pc)
+    const std::vector<RawStackFrame> &getFrames(uintptr_t pc)
     {
-        libbacktraceProvider *this_ = (libbacktraceProvider*)vdata;
-        std::vector<RawStackFrame> &frames = this_->cache[pc];
+        std::vector<RawStackFrame> &frames = cache[pc];
         if (!frames.size()) {
             RawStackFrame frame;
             dl_fill(&frame, pc);
-            this_->current_frame = &frame;
-            this_->current_frames = &frames;
-            backtrace_pcinfo(this_->state, pc, bt_full_callback, bt_err_callback, vdata);
+            current_frame = &frame;
+            current_frames = &frames;
+            backtrace_pcinfo(state, pc, bt_full_callback, bt_err_callback, this);
             if (!frames.size()) {
-                frame.id = this_->nextFrameId++;
+                frame.id = nextFrameId++;
                 frames.push_back(frame);
             }
         }
-        this_->current->insert(this_->current->end(), frames.begin(), frames.end());
-        return this_->current->size() >= BT_DEPTH;
+        return frames;
+    }
+
+    static void bt_unwind_err_callback(void *vdata, const char *msg, int errnum)
+    {
+        if (errnum > 0)
+            os::log("libbacktrace: %s: %s\n", msg, strerror(errnum));
+        else
+            os::log("libbacktrace: %s\n", msg);
+    }
+
+    static int bt_callback(void *vdata, uintptr_t pc)
+    {
+        Unwinding *unwinding = (Unwinding*)vdata;
+        unwinding->pcs[unwinding->num_pcs++] = pc;
+        return unwinding->num_pcs >= BT_DEPTH;
     }
 
     static int bt_full_dump_callback(void *vdata, uintptr_t pc,
@@ -439,18 +485,81 @@ class libbacktraceProvider {
         return 0;
     }
 
+    /*
+     * Must be called with backtraceMutex held.
+     */
+    const RawStack *lookupStack(const Unwinding &unwinding)
+    {
+        unsigned num_pcs = unwinding.num_pcs;
+        const uintptr_t *pcs = unwinding.pcs;
+
+        // FNV-1a
+        unsigned long long hash = 14695981039346656037ULL;
+        for (unsigned i = 0; i < num_pcs; ++i) {
+            hash = (hash ^ pcs[i]) * 1099511628211ULL;
+        }
+
+        StackEntry *&head = stacks[hash];
+        for (StackEntry *entry = head; entry; entry = entry->next) {
+            if (entry->num_pcs == num_pcs &&
+                memcmp(entry->pcs, pcs, num_pcs * sizeof pcs[0]) == 0) {
+                return &entry->stack;
+            }
+        }
+
+        StackEntry *entry = new StackEntry;
+        entry->stack.id = nextStackId++;
+        entry->num_pcs = num_pcs;
+        memcpy(entry->pcs, pcs, num_pcs * sizeof pcs[0]);
+        entry->next = head;
+        head = entry;
+
+        std::vector<const RawStackFrame *> &frames = entry->stack.frames;
+        for (unsigned i = 0; i < num_pcs && frames.size() < BT_DEPTH; ++i) {
+            const std::vector<RawStackFrame> &pcFrames = getFrames(pcs[i]);
+            for (unsigned j = 0; j < pcFrames.size(); ++j) {
+                frames.push_back(&pcFrames[j]);
+            }
+        }
+
+        return &entry->stack;
+    }
+
 public:
     libbacktraceProvider():
-        state(backtrace_create_state(NULL, 0, bt_err_callback, NULL))
+        state(backtrace_create_state(NULL, 0, bt_err_callback, NULL)),
+        skipFrames(0),
+        nextFrameId(0),
+        nextStackId(0)
     {
         backtrace_simple(state, 0, bt_countskip, bt_err_callback, this);
     }
 
+    /*
+     * These must unwind from the same depth as the constructor, for
+     * skipFrames to apply.
+     */
+
+    const RawStack *getStack()
+    {
+        Unwinding unwinding;
+        unwinding.num_pcs = 0;
+        backtrace_simple(state, skipFrames, bt_callback, bt_unwind_err_callback, &unwinding);
+        os::unique_lock<os::mutex> lock(backtraceMutex);
+        return lookupStack(unwinding);
+    }
+
     std::vector<RawStackFrame> getParsedBacktrace()
     {
-        std::vector<RawStackFrame> parsedBacktrace;
-        current = &parsedBacktrace;
-        backtrace_simple(state, skipFrames, bt_callback, bt_err_callback, this);
+        Unwinding unwinding;
+        unwinding.num_pcs = 0;
+        backtrace_simple(state, skipFrames, bt_callback, bt_unwind_err_callback, &unwinding);
+        os::unique_lock<os::mutex> lock(backtraceMutex);
+        const RawStack *stack = lookupStack(unwinding);
+        std::vector<RawStackFrame> parsedBacktrace(stack->frames.size());
+        for (unsigned i = 0; i < stack->frames.size(); ++i) {
+            parsedBacktrace[i] = *stack->frames[i];
+        }
         return parsedBacktrace;
     }
 
@@ -460,9 +569,30 @@ public:
     }
 };
 
+/*
+ * Shared so that frame IDs are unique, and created by the functions using it,
+ * from the same depth they unwind from.
+ */
+static libbacktraceProvider *backtraceProvider = NULL;
+
 std::vector<RawStackFrame> get_backtrace() {
-    static libbacktraceProvider backtraceProvider;
-    return backtraceProvider.getParsedBacktrace();
+    {
+        os::unique_lock<os::mutex> lock(backtraceMutex);
+        if (!backtraceProvider) {
+            backtraceProvider = new libbacktraceProvider;
+        }
+    }
+    return backtraceProvider->getParsedBacktrace();
+}
+
+const RawStack *get_stack() {
+    {
+        os::unique_lock<os::mutex> lock(backtraceMutex);
+        if (!backtraceProvider) {
+            backtraceProvider = new libbacktraceProvider;
+        }
+    }
+    return backtraceProvider->getStack();
 }
 
 void dump_backtrace() {
@@ -477,6 +607,10 @@ std::vector<RawStackFrame> get_backtrace() {
     return std::vector<RawStackFrame>();
 }
 
+const RawStack *get_stack() {
+    return NULL;
+}
+
 void dump_backtrace() {
 }
 
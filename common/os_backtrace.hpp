@@ -36,7 +36,23 @@ namespace os {
 using trace::RawStackFrame;
 
 
+/**
+ * A backtrace shared by all calls made from the same place.
+ */
+struct RawStack {
+    trace::Id id;
+    std::vector<const RawStackFrame *> frames;
+};
+
 std::vector<RawStackFrame> get_backtrace();
+
+/**
+ * Get the backtrace of the current call site, looked up by its return
+ * addresses, so that it's only symbolized the first time.  Returns NULL
+ * where return addresses aren't available.
+ */
+const RawStack *get_stack();
+
 bool backtrace_is_needed(const char* fname);
 
 void dump_backtrace();
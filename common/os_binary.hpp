@@ -44,7 +44,8 @@
 namespace os {
 
 
-void setBinaryMode(FILE *fp) {
+inline void
+setBinaryMode(FILE *fp) {
 #ifdef _WIN32
     fflush(fp);
     int mode = _setmode(_fileno(fp), _O_BINARY);
@@ -33,6 +33,7 @@
 #include <unistd.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <dirent.h>
 #include <fcntl.h>
 #include <signal.h>
 
@@ -150,6 +151,43 @@ String::exists(void) const
     return true;
 }
 
+bool
+isDirectory(const String &path)
+{
+    struct stat st;
+    return stat(path.str(), &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+bool
+listDirectory(const String &path, std::vector<String> &names)
+{
+    DIR *dir = opendir(path.str());
+    if (!dir) {
+        return false;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") != 0 &&
+            strcmp(entry->d_name, "..") != 0) {
+            names.push_back(entry->d_name);
+        }
+    }
+
+    closedir(dir);
+    return true;
+}
+
+long long
+getModificationTime(const String &path)
+{
+    struct stat st;
+    if (stat(path.str(), &st) != 0) {
+        return -1;
+    }
+    return st.st_mtime;
+}
+
 int execute(char * const * args)
 {
     pid_t pid = fork();
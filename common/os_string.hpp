@@ -430,6 +430,19 @@ bool copyFile(const String &srcFileName, const String &dstFileName, bool overrid
 
 bool removeFile(const String &fileName);
 
+bool isDirectory(const String &path);
+
+/**
+ * List the names of the entries of a directory, except "." and "..".
+ */
+bool listDirectory(const String &path, std::vector<String> &names);
+
+/**
+ * Last modification time of a file, in seconds since the epoch, or -1 if the
+ * file doesn't exist.
+ */
+long long getModificationTime(const String &path);
+
 } /* namespace os */
 
 #endif /* _OS_STRING_HPP_ */
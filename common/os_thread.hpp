@@ -37,6 +37,7 @@
 #include <windows.h>
 #else
 #include <pthread.h>
+#include <unistd.h>
 #endif
 
 
@@ -415,6 +416,18 @@ namespace os {
 #endif
         }
 
+        static inline unsigned
+        hardware_concurrency(void) {
+#ifdef _WIN32
+            SYSTEM_INFO info;
+            GetSystemInfo(&info);
+            return info.dwNumberOfProcessors;
+#else
+            long count = sysconf(_SC_NPROCESSORS_ONLN);
+            return count > 0 ? unsigned(count) : 0;
+#endif
+        }
+
     private:
         native_handle_type _native_handle;
 
@@ -96,6 +96,52 @@ removeFile(const String &srcFilename)
     return DeleteFileA(srcFilename);
 }
 
+bool
+isDirectory(const String &path)
+{
+    DWORD attrs = GetFileAttributesA(path.str());
+    return attrs != INVALID_FILE_ATTRIBUTES &&
+           (attrs & FILE_ATTRIBUTE_DIRECTORY);
+}
+
+bool
+listDirectory(const String &path, std::vector<String> &names)
+{
+    String pattern(path);
+    pattern.join("*");
+
+    WIN32_FIND_DATAA data;
+    HANDLE hFind = FindFirstFileA(pattern.str(), &data);
+    if (hFind == INVALID_HANDLE_VALUE) {
+        return GetLastError() == ERROR_FILE_NOT_FOUND;
+    }
+
+    do {
+        if (strcmp(data.cFileName, ".") != 0 &&
+            strcmp(data.cFileName, "..") != 0) {
+            names.push_back(data.cFileName);
+        }
+    } while (FindNextFileA(hFind, &data));
+
+    FindClose(hFind);
+    return true;
+}
+
+long long
+getModificationTime(const String &path)
+{
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!GetFileAttributesExA(path.str(), GetFileExInfoStandard, &data)) {
+        return -1;
+    }
+
+    // FILETIME counts 100ns intervals since 1601-01-01
+    ULARGE_INTEGER time;
+    time.LowPart = data.ftLastWriteTime.dwLowDateTime;
+    time.HighPart = data.ftLastWriteTime.dwHighDateTime;
+    return (long long)(time.QuadPart / 10000000ULL) - 11644473600LL;
+}
+
 /**
  * Determine whether an argument should be quoted.
  */
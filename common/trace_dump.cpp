@@ -284,6 +284,10 @@ public:
         if (callFlags & CALL_FLAG_INCOMPLETE) {
             os << " // " << red << "incomplete" << normal;
         }
+
+        if ((dumpFlags & DUMP_FLAG_CALL_TIMES) && call->cpuDuration >= 0) {
+            os << " // " << italic << call->cpuDuration / 1000.0 << " us" << normal;
+        }
         
         os << "\n";
 
@@ -46,6 +46,7 @@ enum {
     DUMP_FLAG_NO_ARG_NAMES             = (1 << 1),
     DUMP_FLAG_NO_CALL_NO               = (1 << 2),
     DUMP_FLAG_THREAD_IDS               = (1 << 3),
+    DUMP_FLAG_CALL_TIMES               = (1 << 4),
 };
 
 
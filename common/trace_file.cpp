@@ -28,6 +28,8 @@
 
 #include <assert.h>
 
+#include "os_thread.hpp"
+
 
 using namespace trace;
 
@@ -54,3 +56,52 @@ void File::setCurrentOffset(const File::Offset &offset)
     assert(0);
 }
 
+const char *File::rawReadInPlace(size_t length, Chunk * &chunk)
+{
+    return NULL;
+}
+
+
+/*
+ * Chunks are referenced from the parsing thread and released from whichever
+ * thread consumes the calls, but rarely enough that a single lock suffices.
+ */
+static os::mutex chunkMutex;
+
+File::Chunk::Chunk(size_t _size)
+    : data(new char[_size]),
+      size(_size),
+      refCount(1)
+{
+}
+
+File::Chunk::~Chunk()
+{
+    delete [] data;
+}
+
+void File::Chunk::ref(void)
+{
+    os::unique_lock<os::mutex> lock(chunkMutex);
+    ++refCount;
+}
+
+void File::Chunk::unref(void)
+{
+    unsigned newRefCount;
+    {
+        os::unique_lock<os::mutex> lock(chunkMutex);
+        assert(refCount > 0);
+        newRefCount = --refCount;
+    }
+    if (newRefCount == 0) {
+        delete this;
+    }
+}
+
+bool File::Chunk::isShared(void) const
+{
+    os::unique_lock<os::mutex> lock(chunkMutex);
+    return refCount > 1;
+}
+
@@ -53,6 +53,37 @@ public:
         uint32_t offsetInChunk;
     };
 
+    /**
+     * Reference counted buffer of decompressed data.
+     *
+     * It allows parsed values to refer to the data in place, even after the
+     * file moved on to the next chunk or was closed.
+     */
+    class Chunk {
+    public:
+        Chunk(size_t _size);
+
+        void ref(void);
+        void unref(void);
+
+        /**
+         * Whether anybody other than the creator holds a reference.
+         */
+        bool isShared(void) const;
+
+        char * const data;
+        const size_t size;
+
+    private:
+        unsigned refCount;
+
+        ~Chunk();
+
+        // Disallow copying
+        Chunk(const Chunk &);
+        Chunk & operator = (const Chunk &);
+    };
+
 public:
     static File *createZLib(void);
     static File *createSnappy(void);
@@ -75,6 +106,15 @@ public:
     bool skip(size_t length);
     int percentRead();
 
+    /**
+     * Return a pointer to the next length bytes and advance past them,
+     * without copying, adding a reference to the chunk holding them.
+     *
+     * Returns NULL and advances nothing if the bytes can't be referred in
+     * place (e.g., they straddle chunks), in which case read() must be used.
+     */
+    const char *readInPlace(size_t length, Chunk * &chunk);
+
     virtual bool supportsOffsets() const = 0;
     virtual File::Offset currentOffset() = 0;
     virtual void setCurrentOffset(const File::Offset &offset);
@@ -87,6 +127,7 @@ protected:
     virtual void rawFlush() = 0;
     virtual bool rawSkip(size_t length) = 0;
     virtual int rawPercentRead() = 0;
+    virtual const char *rawReadInPlace(size_t length, Chunk * &chunk);
 
 protected:
     File::Mode m_mode;
@@ -130,6 +171,14 @@ inline size_t File::read(void *buffer, size_t length)
     return rawRead(buffer, length);
 }
 
+inline const char *File::readInPlace(size_t length, Chunk * &chunk)
+{
+    if (!m_isOpened || m_mode != File::Read) {
+        return NULL;
+    }
+    return rawReadInPlace(length, chunk);
+}
+
 inline int File::percentRead()
 {
     if (!m_isOpened || m_mode != File::Read) {
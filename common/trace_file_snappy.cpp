@@ -48,6 +48,10 @@
  * to offer a pretty good compression/disk io speed ratio
  * but that might change.
  *
+ * When writing, filled chunks are compressed by a small pool of background
+ * threads, so that the thread producing the data doesn't stall on it.  The
+ * compressed chunks are still written in order, by the producing thread.
+ *
  */
 
 
@@ -57,18 +61,38 @@
 #include <algorithm>
 
 #include <assert.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include <vector>
+
+#include "os.hpp"
+#include "os_thread.hpp"
 #include "trace_file.hpp"
 
 
 #define SNAPPY_CHUNK_SIZE (1 * 1024 * 1024)
 
+/*
+ * Default number of compression threads, which can be overriden with the
+ * APITRACE_COMPRESS_THREADS environment variable.  Zero means compressing on
+ * the writing thread.
+ */
+#define SNAPPY_COMPRESS_THREADS 2
+
 
 
 using namespace trace;
 
 
+class SnappyFile;
+
+/*
+ * The file whose job ring the calling thread is in the middle of, if any.
+ */
+static OS_THREAD_SPECIFIC_PTR(SnappyFile) jobSectionFile;
+
+
 class SnappyFile : public File {
 public:
     SnappyFile(const std::string &filename = std::string(),
@@ -87,6 +111,7 @@ protected:
     virtual void rawFlush();
     virtual bool rawSkip(size_t length);
     virtual int rawPercentRead();
+    virtual const char *rawReadInPlace(size_t length, Chunk * &chunk);
 
 private:
     inline size_t usedCacheSize() const
@@ -112,10 +137,64 @@ private:
     void createCache(size_t size);
     void writeCompressedLength(size_t length);
     size_t readCompressedLength();
+
+    enum JobState {
+        JOB_FREE,
+        JOB_PENDING,
+        JOB_COMPRESSING,
+        JOB_DONE
+    };
+
+    struct Job {
+        JobState state;
+        char *input;
+        size_t inputLength;
+        char *output;
+        size_t outputLength;
+    };
+
+    typedef os::unique_lock<os::mutex> Lock;
+
+    /*
+     * Marks the calling thread as being inside the job ring, either touching
+     * it under m_jobMutex or as one of the compression threads.  A flush from
+     * a crash handler that interrupted such a thread must not wait on the
+     * ring, as it may never make progress again.
+     */
+    class JobSection {
+    public:
+        JobSection(SnappyFile *file) {
+            assert(!jobSectionFile);
+            jobSectionFile = file;
+        }
+        ~JobSection() {
+            jobSectionFile = NULL;
+        }
+    };
+
+    inline bool interruptedInJobs() const
+    {
+        return jobSectionFile == this;
+    }
+
+    void startThreads(unsigned numThreads);
+    void stopThreads(void);
+    void submitJob(size_t inputLength);
+    Job *findPendingJob(void);
+    void compressJob(Lock &lock, Job &job);
+    void retireJobs(Lock &lock, size_t maxJobs);
+    void compressThread(void);
+
+    static void *
+    compressThreadFunc(void *arg) {
+        static_cast<SnappyFile *>(arg)->compressThread();
+        return 0;
+    }
 private:
     std::fstream m_stream;
     size_t m_cacheMaxSize;
     size_t m_cacheSize;
+    Chunk *m_chunk;
     char *m_cache;
     char *m_cachePtr;
 
@@ -123,6 +202,19 @@ private:
 
     File::Offset m_currentOffset;
     std::streampos m_endPos;
+
+    /*
+     * Ring of chunks being compressed and written.  The m_jobCount jobs from
+     * m_jobHead are in flight, and the one after them is being filled.
+     */
+    os::mutex m_jobMutex;
+    os::condition_variable m_jobPending;
+    os::condition_variable m_jobDone;
+    std::vector<Job> m_jobs;
+    size_t m_jobHead;
+    size_t m_jobCount;
+    std::vector<os::thread> m_threads;
+    bool m_stopThreads;
 };
 
 SnappyFile::SnappyFile(const std::string &filename,
@@ -130,8 +222,12 @@ SnappyFile::SnappyFile(const std::string &filename,
     : File(),
       m_cacheMaxSize(SNAPPY_CHUNK_SIZE),
       m_cacheSize(m_cacheMaxSize),
-      m_cache(new char [m_cacheMaxSize]),
-      m_cachePtr(m_cache)
+      m_chunk(new Chunk(m_cacheMaxSize)),
+      m_cache(m_chunk->data),
+      m_cachePtr(m_cache),
+      m_jobHead(0),
+      m_jobCount(0),
+      m_stopThreads(false)
 {
     size_t maxCompressedLength =
         snappy::MaxCompressedLength(SNAPPY_CHUNK_SIZE);
@@ -142,7 +238,9 @@ SnappyFile::~SnappyFile()
 {
     close();
     delete [] m_compressedCache;
-    delete [] m_cache;
+    if (m_chunk) {
+        m_chunk->unref();
+    }
 }
 
 bool SnappyFile::rawOpen(const std::string &filename, File::Mode mode)
@@ -151,6 +249,15 @@ bool SnappyFile::rawOpen(const std::string &filename, File::Mode mode)
     if (mode == File::Write) {
         fmode |= (std::fstream::out | std::fstream::trunc);
         createCache(SNAPPY_CHUNK_SIZE);
+
+        unsigned numThreads = SNAPPY_COMPRESS_THREADS;
+        const char *threads = getenv("APITRACE_COMPRESS_THREADS");
+        if (threads) {
+            numThreads = atoi(threads);
+        }
+        if (numThreads > 0) {
+            startThreads(numThreads);
+        }
     } else if (mode == File::Read) {
         fmode |= std::fstream::in;
     }
@@ -249,10 +356,19 @@ int SnappyFile::rawGetc()
 void SnappyFile::rawClose()
 {
     if (m_mode == File::Write) {
-        flushWriteCache();
+        if (interruptedInJobs()) {
+            // Joining the threads could mean waiting on this one
+            os::log("apitrace: not flushing trace as compression was interrupted\n");
+        } else {
+            flushWriteCache();
+            stopThreads();
+        }
     }
     m_stream.close();
-    delete [] m_cache;
+    if (m_chunk) {
+        m_chunk->unref();
+    }
+    m_chunk = NULL;
     m_cache = NULL;
     m_cachePtr = NULL;
 }
@@ -260,7 +376,16 @@ void SnappyFile::rawClose()
 void SnappyFile::rawFlush()
 {
     assert(m_mode == File::Write);
+    if (interruptedInJobs()) {
+        os::log("apitrace: not flushing trace as compression was interrupted\n");
+        return;
+    }
     flushWriteCache();
+    if (!m_threads.empty()) {
+        JobSection section(this);
+        Lock lock(m_jobMutex);
+        retireJobs(lock, 0);
+    }
     m_stream.flush();
 }
 
@@ -268,7 +393,14 @@ void SnappyFile::flushWriteCache()
 {
     size_t inputLength = usedCacheSize();
 
-    if (inputLength) {
+    if (inputLength && !m_threads.empty()) {
+        if (interruptedInJobs()) {
+            // Drop what the crash handler writes rather than deadlock
+            m_cachePtr = m_cache;
+            return;
+        }
+        submitJob(inputLength);
+    } else if (inputLength) {
         size_t compressedLength;
 
         ::snappy::RawCompress(m_cache, inputLength,
@@ -281,6 +413,180 @@ void SnappyFile::flushWriteCache()
     assert(m_cachePtr == m_cache);
 }
 
+void SnappyFile::startThreads(unsigned numThreads)
+{
+    assert(m_threads.empty());
+
+    size_t maxCompressedLength =
+        snappy::MaxCompressedLength(SNAPPY_CHUNK_SIZE);
+
+    // Bound the memory in flight to two chunks per thread, plus the one
+    // being filled
+    m_jobs.resize(2*numThreads + 1);
+    for (size_t i = 0; i < m_jobs.size(); ++i) {
+        Job &job = m_jobs[i];
+        job.state = JOB_FREE;
+        job.input = new char[SNAPPY_CHUNK_SIZE];
+        job.inputLength = 0;
+        job.output = new char[maxCompressedLength];
+        job.outputLength = 0;
+    }
+    m_jobHead = 0;
+    m_jobCount = 0;
+
+    // Fill the jobs' input directly
+    if (m_chunk) {
+        m_chunk->unref();
+        m_chunk = NULL;
+    }
+    m_cache = m_jobs[0].input;
+    m_cachePtr = m_cache;
+    m_cacheSize = SNAPPY_CHUNK_SIZE;
+
+    m_stopThreads = false;
+    m_threads.resize(numThreads);
+    for (unsigned i = 0; i < numThreads; ++i) {
+        m_threads[i] = os::thread(compressThreadFunc, this);
+    }
+}
+
+void SnappyFile::stopThreads(void)
+{
+    if (m_threads.empty()) {
+        return;
+    }
+
+    JobSection section(this);
+
+    {
+        Lock lock(m_jobMutex);
+        m_stopThreads = true;
+        m_jobPending.signal();
+    }
+
+    for (unsigned i = 0; i < m_threads.size(); ++i) {
+        m_threads[i].join();
+    }
+    m_threads.clear();
+
+    Lock lock(m_jobMutex);
+
+    // The threads may have been terminated abruptly (e.g., when the process
+    // is exiting on Windows), so redo any job they left unfinished.
+    for (size_t i = 0; i < m_jobs.size(); ++i) {
+        if (m_jobs[i].state == JOB_COMPRESSING) {
+            m_jobs[i].state = JOB_PENDING;
+        }
+    }
+
+    retireJobs(lock, 0);
+
+    for (size_t i = 0; i < m_jobs.size(); ++i) {
+        delete [] m_jobs[i].input;
+        delete [] m_jobs[i].output;
+    }
+    m_jobs.clear();
+
+    m_cache = NULL;
+    m_cachePtr = NULL;
+}
+
+void SnappyFile::submitJob(size_t inputLength)
+{
+    JobSection section(this);
+    Lock lock(m_jobMutex);
+
+    Job &job = m_jobs[(m_jobHead + m_jobCount) % m_jobs.size()];
+    assert(job.input == m_cache);
+    assert(job.state == JOB_FREE);
+    job.inputLength = inputLength;
+    job.state = JOB_PENDING;
+    ++m_jobCount;
+    m_jobPending.signal();
+
+    // Write whatever is finished, ensuring the next job is free
+    retireJobs(lock, m_jobs.size() - 1);
+
+    Job &nextJob = m_jobs[(m_jobHead + m_jobCount) % m_jobs.size()];
+    assert(nextJob.state == JOB_FREE);
+    m_cache = nextJob.input;
+    m_cachePtr = m_cache;
+}
+
+SnappyFile::Job *SnappyFile::findPendingJob(void)
+{
+    for (size_t i = 0; i < m_jobCount; ++i) {
+        Job &job = m_jobs[(m_jobHead + i) % m_jobs.size()];
+        if (job.state == JOB_PENDING) {
+            return &job;
+        }
+    }
+    return NULL;
+}
+
+void SnappyFile::compressJob(Lock &lock, Job &job)
+{
+    assert(job.state == JOB_PENDING);
+    job.state = JOB_COMPRESSING;
+    lock.unlock();
+
+    ::snappy::RawCompress(job.input, job.inputLength,
+                          job.output, &job.outputLength);
+
+    lock.lock();
+    job.state = JOB_DONE;
+}
+
+/*
+ * Write the finished jobs in order, until no more than maxJobs are in
+ * flight.
+ */
+void SnappyFile::retireJobs(Lock &lock, size_t maxJobs)
+{
+    while (m_jobCount) {
+        Job &job = m_jobs[m_jobHead];
+        if (job.state == JOB_DONE) {
+            // Only this thread touches finished jobs
+            lock.unlock();
+            writeCompressedLength(job.outputLength);
+            m_stream.write(job.output, job.outputLength);
+            lock.lock();
+
+            job.state = JOB_FREE;
+            m_jobHead = (m_jobHead + 1) % m_jobs.size();
+            --m_jobCount;
+        } else if (m_jobCount <= maxJobs) {
+            break;
+        } else {
+            // Rather than idly waiting for the threads, lend them a hand
+            Job *pendingJob = findPendingJob();
+            if (pendingJob) {
+                compressJob(lock, *pendingJob);
+            } else {
+                m_jobDone.wait(lock);
+            }
+        }
+    }
+}
+
+void SnappyFile::compressThread(void)
+{
+    JobSection section(this);
+    Lock lock(m_jobMutex);
+    while (!m_stopThreads) {
+        Job *job = findPendingJob();
+        if (job) {
+            compressJob(lock, *job);
+            m_jobDone.signal();
+        } else {
+            m_jobPending.wait(lock);
+        }
+    }
+
+    // Wake up the next thread so that it stops too
+    m_jobPending.signal();
+}
+
 void SnappyFile::flushReadCache(size_t skipLength)
 {
     //assert(m_cachePtr == m_cache + m_cacheSize);
@@ -312,14 +618,17 @@ void SnappyFile::flushReadCache(size_t skipLength)
 
 void SnappyFile::createCache(size_t size)
 {
-    if (size > m_cacheMaxSize) {
-        do {
-            m_cacheMaxSize <<= 1;
-        } while (size > m_cacheMaxSize);
+    // Don't overwrite the chunk while values still refer to it
+    if (!m_chunk || size > m_cacheMaxSize || m_chunk->isShared()) {
+        if (size > m_cacheMaxSize) {
+            m_cacheMaxSize = size;
+        }
 
-        delete [] m_cache;
-        m_cache = new char[size];
-        m_cacheMaxSize = size;
+        if (m_chunk) {
+            m_chunk->unref();
+        }
+        m_chunk = new Chunk(m_cacheMaxSize);
+        m_cache = m_chunk->data;
     }
 
     m_cachePtr = m_cache;
@@ -378,6 +687,20 @@ void SnappyFile::setCurrentOffset(const File::Offset &offset)
 
 }
 
+const char *SnappyFile::rawReadInPlace(size_t length, Chunk * &chunk)
+{
+    if (freeCacheSize() < length) {
+        return NULL;
+    }
+
+    const char *data = m_cachePtr;
+    m_cachePtr += length;
+
+    m_chunk->ref();
+    chunk = m_chunk;
+    return data;
+}
+
 bool SnappyFile::rawSkip(size_t length)
 {
     if (endOfData()) {
@@ -35,7 +35,14 @@
 namespace trace {
 
 
-#define TRACE_VERSION 5
+#define TRACE_VERSION 10
+
+
+/*
+ * Number of entries in each thread's table of recent blob digests, which
+ * writers and readers keep alike.  Must be a power of two.
+ */
+#define BLOB_DIGEST_TABLE_SIZE (16*1024)
 
 
 enum Event {
@@ -49,6 +56,8 @@ enum CallDetail {
     CALL_RET,
     CALL_THREAD,
     CALL_BACKTRACE,
+    CALL_STACK,
+    CALL_TIME,
 };
 
 enum Type {
@@ -68,6 +77,9 @@ enum Type {
     TYPE_OPAQUE,
     TYPE_REPR,
     TYPE_WSTRING,
+    TYPE_HASHED_BLOB,
+    TYPE_BLOB_REF,
+    TYPE_PACKED_ARRAY,
 };
 
 enum BacktraceDetail {
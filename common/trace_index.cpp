@@ -0,0 +1,442 @@
+/**************************************************************************
+ *
+ * Copyright 2015 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+
+#include <assert.h>
+#include <string.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+
+#include "trace_index.hpp"
+
+
+#define INDEX_MAGIC "apitrace-index"
+#define INDEX_VERSION 4
+
+/*
+ * Amount of data at each end of the trace that is hashed to tell whether an
+ * index is stale.
+ */
+#define INDEX_HASH_SIZE (64*1024)
+
+
+namespace trace {
+
+
+void
+IndexWriter::writeUInt(unsigned long long value) {
+    do {
+        unsigned char c = value & 0x7f;
+        value >>= 7;
+        if (value) {
+            c |= 0x80;
+        }
+        data.push_back(c);
+    } while (value);
+}
+
+
+void
+IndexWriter::writeSInt(signed long long value) {
+    // zig-zag encoding
+    writeUInt(((unsigned long long)value << 1) ^ (unsigned long long)(value >> 63));
+}
+
+
+void
+IndexWriter::writeString(const char *str) {
+    if (!str) {
+        writeUInt(0);
+        return;
+    }
+    size_t len = strlen(str);
+    writeUInt(len + 1);
+    data.append(str, len);
+}
+
+
+void
+IndexWriter::writeBookmark(const ParseBookmark &bookmark) {
+    writeUInt(bookmark.offset.chunk);
+    writeUInt(bookmark.offset.offsetInChunk);
+    writeUInt(bookmark.next_call_no);
+}
+
+
+IndexReader::IndexReader(const char *data, size_t size) :
+    ptr((const unsigned char *)data),
+    end((const unsigned char *)data + size),
+    error(false)
+{
+}
+
+
+unsigned long long
+IndexReader::readUInt(void) {
+    unsigned long long value = 0;
+    unsigned shift = 0;
+    unsigned char c;
+    do {
+        if (ptr >= end || shift >= 64) {
+            error = true;
+            return 0;
+        }
+        c = *ptr++;
+        value |= (unsigned long long)(c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    return value;
+}
+
+
+signed long long
+IndexReader::readSInt(void) {
+    unsigned long long value = readUInt();
+    return (signed long long)(value >> 1) ^ -(signed long long)(value & 1);
+}
+
+
+size_t
+IndexReader::readCount(void) {
+    unsigned long long count = readUInt();
+    if (count > (unsigned long long)(end - ptr)) {
+        error = true;
+        return 0;
+    }
+    return count;
+}
+
+
+const char *
+IndexReader::readBytes(size_t size) {
+    if (size > size_t(end - ptr)) {
+        error = true;
+        return NULL;
+    }
+    const char *bytes = (const char *)ptr;
+    ptr += size;
+    return bytes;
+}
+
+
+char *
+IndexReader::readString(void) {
+    size_t len = readCount();
+    if (!len) {
+        return NULL;
+    }
+    --len;
+    const char *bytes = readBytes(len);
+    if (!bytes) {
+        return NULL;
+    }
+    char *str = new char[len + 1];
+    memcpy(str, bytes, len);
+    str[len] = 0;
+    return str;
+}
+
+
+void
+IndexReader::readBookmark(ParseBookmark &bookmark) {
+    bookmark.offset.chunk = readUInt();
+    bookmark.offset.offsetInChunk = readUInt();
+    bookmark.next_call_no = readUInt();
+}
+
+
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+
+
+static inline unsigned long long
+fnv1a(unsigned long long hash, const char *data, size_t size)
+{
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+
+/**
+ * Identify the trace contents by its size and a FNV-1a hash of its head and
+ * tail, which is cheap and good enough to catch traces that were overwritten.
+ */
+static bool
+fingerprint(const char *traceFilename,
+            unsigned long long &size,
+            unsigned long long &hash)
+{
+    std::ifstream stream(traceFilename, std::ios::in | std::ios::binary);
+    if (!stream.is_open()) {
+        return false;
+    }
+
+    stream.seekg(0, std::ios::end);
+    size = stream.tellg();
+
+    std::vector<char> buf(INDEX_HASH_SIZE);
+    hash = FNV_OFFSET_BASIS;
+
+    for (unsigned i = 0; i < 2; ++i) {
+        unsigned long long start = 0;
+        size_t length = INDEX_HASH_SIZE;
+        if (size < length) {
+            length = size;
+        }
+        if (i) {
+            start = size - length;
+        }
+        stream.seekg(start, std::ios::beg);
+        stream.read(&buf[0], length);
+        if (stream.fail()) {
+            return false;
+        }
+        hash = fnv1a(hash, &buf[0], length);
+    }
+
+    return true;
+}
+
+
+Index::Index() :
+    lastFrameComplete(true)
+{
+}
+
+
+std::string
+Index::getFilename(const char *traceFilename) {
+    return std::string(traceFilename) + ".idx";
+}
+
+
+bool
+Index::build(const char *traceFilename) {
+    Parser parser;
+    if (!parser.open(traceFilename)) {
+        return false;
+    }
+    if (!parser.supportsOffsets()) {
+        std::cerr << "error: " << traceFilename << " doesn't support seeking\n";
+        return false;
+    }
+
+    frames.clear();
+    callBookmarks.clear();
+    lastFrameComplete = true;
+
+    Frame frame;
+    parser.getBookmark(frame.start);
+    frame.numberOfCalls = 0;
+    frame.lastCallNo = 0;
+
+    callBookmarks.push_back(frame.start);
+
+    Call *call;
+    while ((call = parser.scan_call())) {
+        ++frame.numberOfCalls;
+        frame.lastCallNo = call->no;
+        bool endFrame = call->flags & CALL_FLAG_END_FRAME;
+        delete call;
+
+        ParseBookmark bookmark;
+        parser.getBookmark(bookmark);
+
+        if (bookmark.offset.chunk != callBookmarks.back().offset.chunk &&
+            !parser.hasPendingCalls()) {
+            callBookmarks.push_back(bookmark);
+        }
+
+        if (endFrame) {
+            frames.push_back(frame);
+            frame.start = bookmark;
+            frame.numberOfCalls = 0;
+        }
+    }
+
+    if (frame.numberOfCalls) {
+        frames.push_back(frame);
+        lastFrameComplete = false;
+    }
+
+    IndexWriter writer;
+    parser.exportSignatures(writer);
+    signatures.swap(writer.data);
+
+    return true;
+}
+
+
+bool
+Index::save(const char *traceFilename) const {
+    unsigned long long size;
+    unsigned long long hash;
+    if (!fingerprint(traceFilename, size, hash)) {
+        std::cerr << "error: failed to read " << traceFilename << "\n";
+        return false;
+    }
+
+    IndexWriter writer;
+    writer.writeString(INDEX_MAGIC);
+    writer.writeUInt(INDEX_VERSION);
+    writer.writeUInt(size);
+    writer.writeUInt(hash);
+
+    writer.writeUInt(frames.size());
+    for (std::vector<Frame>::const_iterator it = frames.begin(); it != frames.end(); ++it) {
+        writer.writeBookmark(it->start);
+        writer.writeUInt(it->numberOfCalls);
+        writer.writeUInt(it->lastCallNo);
+    }
+    writer.writeUInt(lastFrameComplete);
+
+    writer.writeUInt(callBookmarks.size());
+    for (std::vector<ParseBookmark>::const_iterator it = callBookmarks.begin(); it != callBookmarks.end(); ++it) {
+        writer.writeBookmark(*it);
+    }
+
+    writer.writeUInt(signatures.size());
+    writer.data.append(signatures);
+
+    // Trailing checksum of everything above
+    unsigned long long checksum = fnv1a(FNV_OFFSET_BASIS, writer.data.data(), writer.data.size());
+    for (unsigned i = 0; i < 8; ++i) {
+        writer.data.push_back((char)(checksum >> (8*i)));
+    }
+
+    std::string filename = getFilename(traceFilename);
+    std::ofstream stream(filename.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+    if (stream.is_open()) {
+        stream.write(writer.data.data(), writer.data.size());
+        stream.close();
+    }
+    if (stream.fail()) {
+        std::cerr << "error: failed to write " << filename << "\n";
+        return false;
+    }
+
+    return true;
+}
+
+
+bool
+Index::load(const char *traceFilename) {
+    std::string filename = getFilename(traceFilename);
+    std::ifstream stream(filename.c_str(), std::ios::in | std::ios::binary);
+    if (!stream.is_open()) {
+        return false;
+    }
+    std::string data((std::istreambuf_iterator<char>(stream)),
+                     std::istreambuf_iterator<char>());
+    stream.close();
+
+    unsigned long long checksum = 0;
+    if (data.size() >= 8) {
+        for (unsigned i = 0; i < 8; ++i) {
+            checksum |= (unsigned long long)(unsigned char)data[data.size() - 8 + i] << (8*i);
+        }
+        data.resize(data.size() - 8);
+    }
+    if (checksum != fnv1a(FNV_OFFSET_BASIS, data.data(), data.size())) {
+        std::cerr << "warning: ignoring corrupt index " << filename << "\n";
+        return false;
+    }
+
+    IndexReader reader(data.data(), data.size());
+
+    char *magic = reader.readString();
+    bool validMagic = magic && strcmp(magic, INDEX_MAGIC) == 0;
+    delete [] magic;
+    if (!validMagic ||
+        reader.readUInt() != INDEX_VERSION) {
+        std::cerr << "warning: ignoring unsupported index " << filename << "\n";
+        return false;
+    }
+
+    unsigned long long size;
+    unsigned long long hash;
+    if (!fingerprint(traceFilename, size, hash) ||
+        reader.readUInt() != size ||
+        reader.readUInt() != hash) {
+        std::cerr << "warning: ignoring stale index " << filename << "\n";
+        return false;
+    }
+
+    frames.resize(reader.readCount());
+    for (std::vector<Frame>::iterator it = frames.begin(); it != frames.end(); ++it) {
+        reader.readBookmark(it->start);
+        it->numberOfCalls = reader.readUInt();
+        it->lastCallNo = reader.readUInt();
+    }
+    lastFrameComplete = reader.readUInt() != 0;
+
+    callBookmarks.resize(reader.readCount());
+    for (std::vector<ParseBookmark>::iterator it = callBookmarks.begin(); it != callBookmarks.end(); ++it) {
+        reader.readBookmark(*it);
+    }
+
+    size_t signaturesSize = reader.readCount();
+    const char *signaturesData = reader.readBytes(signaturesSize);
+    if (signaturesData) {
+        signatures.assign(signaturesData, signaturesSize);
+    }
+
+    if (reader.error ||
+        callBookmarks.empty() ||
+        (!lastFrameComplete && frames.empty())) {
+        std::cerr << "warning: ignoring corrupt index " << filename << "\n";
+        frames.clear();
+        callBookmarks.clear();
+        signatures.clear();
+        return false;
+    }
+
+    return true;
+}
+
+
+static bool
+compareNextCallNo(unsigned callNo, const ParseBookmark &bookmark) {
+    return callNo < bookmark.next_call_no;
+}
+
+
+const ParseBookmark *
+Index::findCall(unsigned callNo) const {
+    std::vector<ParseBookmark>::const_iterator it =
+        std::upper_bound(callBookmarks.begin(), callBookmarks.end(), callNo, compareNextCallNo);
+    if (it == callBookmarks.begin()) {
+        return NULL;
+    }
+    --it;
+    return &*it;
+}
+
+
+} /* namespace trace */
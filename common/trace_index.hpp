@@ -0,0 +1,171 @@
+/**************************************************************************
+ *
+ * Copyright 2015 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+/*
+ * Trace index sidecar.
+ *
+ * Scanning a whole trace to find where each frame starts is slow for large
+ * traces, so `apitrace index` saves the bookmarks, together with all
+ * signature definitions and where referred blobs lie, to a file alongside
+ * the trace.  A parser primed with those signatures can then be set to any of
+ * the bookmarks straight away.
+ */
+
+#ifndef _TRACE_INDEX_HPP_
+#define _TRACE_INDEX_HPP_
+
+
+#include <string>
+#include <vector>
+
+#include "trace_parser.hpp"
+
+
+namespace trace {
+
+
+/**
+ * Helper to serialize index data.
+ */
+class IndexWriter
+{
+public:
+    std::string data;
+
+    void writeUInt(unsigned long long value);
+    void writeSInt(signed long long value);
+    void writeString(const char *str);
+    void writeBookmark(const ParseBookmark &bookmark);
+};
+
+
+/**
+ * Helper to deserialize index data.
+ *
+ * Reading past the end or malformed data sets the error flag instead of
+ * failing, so callers only need to check it once at the end.
+ */
+class IndexReader
+{
+protected:
+    const unsigned char *ptr;
+    const unsigned char *end;
+
+public:
+    bool error;
+
+    IndexReader(const char *data, size_t size);
+
+    unsigned long long readUInt(void);
+    signed long long readSInt(void);
+
+    /**
+     * Read a number of elements, each taking at least one byte.
+     */
+    size_t readCount(void);
+
+    /**
+     * Returns a pointer to the next size bytes, or NULL.
+     */
+    const char *readBytes(size_t size);
+
+    /**
+     * Returns a new[] allocated string, or NULL.
+     */
+    char *readString(void);
+
+    void readBookmark(ParseBookmark &bookmark);
+};
+
+
+class Index
+{
+public:
+    struct Frame {
+        ParseBookmark start;
+        unsigned numberOfCalls;
+        unsigned lastCallNo;
+    };
+
+    /**
+     * Frames delimited by calls flagged with CALL_FLAG_END_FRAME.  Any calls
+     * after the last frame marker are gathered in an incomplete frame.
+     */
+    std::vector<Frame> frames;
+    bool lastFrameComplete;
+
+    /**
+     * At most one bookmark per file chunk, at the first call boundary within
+     * it where no call is pending.  The calls between two consecutive
+     * bookmarks can therefore be parsed independently of the rest.
+     */
+    std::vector<ParseBookmark> callBookmarks;
+
+    /**
+     * All signature definitions and referred blobs, as serialized by
+     * Parser::exportSignatures.
+     */
+    std::string signatures;
+
+    Index();
+
+    static std::string
+    getFilename(const char *traceFilename);
+
+    /**
+     * Scan the whole trace.
+     */
+    bool
+    build(const char *traceFilename);
+
+    bool
+    save(const char *traceFilename) const;
+
+    /**
+     * Load the index of the given trace, failing if it is missing or was
+     * created for a different trace.
+     */
+    bool
+    load(const char *traceFilename);
+
+    /**
+     * Number of frames ending with a frame marker.
+     */
+    unsigned
+    numberOfCompleteFrames(void) const {
+        return unsigned(frames.size()) - (lastFrameComplete ? 0 : 1);
+    }
+
+    /**
+     * Bookmark from where parsing will reach the given call soonest.
+     */
+    const ParseBookmark *
+    findCall(unsigned callNo) const;
+};
+
+
+} /* namespace trace */
+
+#endif /* _TRACE_INDEX_HPP_ */
@@ -1,4 +1,5 @@
 #include "trace_loader.hpp"
+#include "trace_index.hpp"
 
 
 using namespace trace;
@@ -50,6 +51,11 @@ bool Loader::open(const char *filename)
         return false;
     }
 
+    if (m_frameMarker == FrameMarker_SwapBuffers &&
+        loadIndex(filename)) {
+        return true;
+    }
+
     trace::Call *call;
     ParseBookmark startBookmark;
     unsigned numOfFrames = 0;
@@ -84,6 +90,25 @@ bool Loader::open(const char *filename)
     return true;
 }
 
+bool Loader::loadIndex(const char *filename)
+{
+    Index index;
+    if (!index.load(filename) ||
+        !m_parser.importSignatures(index.signatures)) {
+        return false;
+    }
+
+    // Loader ignores calls after the last frame marker
+    unsigned numOfFrames = index.numberOfCompleteFrames();
+    for (unsigned i = 0; i < numOfFrames; ++i) {
+        FrameBookmark frameBookmark(index.frames[i].start);
+        frameBookmark.numberOfCalls = index.frames[i].numberOfCalls;
+        m_frameBookmarks[i] = frameBookmark;
+    }
+
+    return true;
+}
+
 void Loader::close()
 {
     m_parser.close();
@@ -51,6 +51,7 @@ private:
         unsigned numberOfCalls;
     };
     bool isCallAFrameMarker(const trace::Call *call) const;
+    bool loadIndex(const char *filename);
 
 private:
     trace::Parser m_parser;
@@ -36,6 +36,99 @@ namespace trace {
 static Null null;
 
 
+Arena::~Arena() {
+    while (blocks) {
+        Block *next = blocks->next;
+        delete [] reinterpret_cast<char *>(blocks);
+        blocks = next;
+    }
+}
+
+
+void *
+Arena::allocBlock(size_t size) {
+    // Blocks are laid out as a header followed by the allocations.
+    size_t headerSize = (sizeof(Block) + ALIGNMENT - 1) & ~size_t(ALIGNMENT - 1);
+
+    if (size > BLOCK_SIZE/4) {
+        // Give large allocations a block of their own, so that the remainder
+        // of the current block isn't wasted.
+        Block *block = reinterpret_cast<Block *>(new char[headerSize + size]);
+        block->next = blocks;
+        blocks = block;
+        return reinterpret_cast<char *>(block) + headerSize;
+    }
+
+    Block *block = reinterpret_cast<Block *>(new char[headerSize + BLOCK_SIZE]);
+    block->next = blocks;
+    blocks = block;
+    ptr = reinterpret_cast<char *>(block) + headerSize;
+    end = ptr + BLOCK_SIZE;
+
+    void *p = ptr;
+    ptr += size;
+    return p;
+}
+
+
+/*
+ * Every value is preceded by a header recording where it was allocated from.
+ */
+union ValueHeader {
+    Arena *arena;
+    long long alignment;
+};
+
+
+void *
+Value::operator new(size_t size) {
+    ValueHeader *header = static_cast<ValueHeader *>(::operator new(sizeof(ValueHeader) + size));
+    header->arena = NULL;
+    return header + 1;
+}
+
+
+void *
+Value::operator new(size_t size, Arena &arena) {
+    ValueHeader *header = static_cast<ValueHeader *>(arena.alloc(sizeof(ValueHeader) + size));
+    header->arena = &arena;
+    return header + 1;
+}
+
+
+void
+Value::operator delete(void *ptr) {
+    if (ptr) {
+        ValueHeader *header = static_cast<ValueHeader *>(ptr) - 1;
+        if (!header->arena) {
+            ::operator delete(header);
+        }
+    }
+}
+
+
+void
+Value::operator delete(void *ptr, Arena &arena) {
+    // Only called if a constructor throws -- nothing to do.
+}
+
+
+void
+RawCall::replace(size_t offset, size_t size, const std::string &bytes) {
+    data.replace(offset, size, bytes);
+
+    size_t delta = bytes.size() - size;
+    for (std::vector<SigRef>::iterator it = sigs.begin(); it != sigs.end(); ++it) {
+        if (it->offset > offset) {
+            it->offset += delta;
+        }
+    }
+    if (leaveOffset > offset) {
+        leaveOffset += delta;
+    }
+}
+
+
 Call::~Call() {
     for (unsigned i = 0; i < args.size(); ++i) {
         delete args[i].value;
@@ -44,6 +137,9 @@ Call::~Call() {
     if (ret) {
         delete ret;
     }
+
+    delete backtrace;
+    delete raw;
 }
 
 Value &
@@ -81,6 +177,120 @@ Array::~Array() {
 }
 
 
+PackedArray::~PackedArray() {
+    delete array;
+}
+
+
+signed long long
+PackedArray::getSInt(size_t index) const {
+    assert(index < count);
+    const char *p = static_cast<const char *>(data) + index * elementSize;
+    if (kind == KIND_FLOAT) {
+        return static_cast<signed long long>(getDouble(index));
+    }
+    if (kind == KIND_UINT) {
+        return static_cast<signed long long>(getUInt(index));
+    }
+    switch (elementSize) {
+    case 1: { signed char v; memcpy(&v, p, sizeof v); return v; }
+    case 2: { short v; memcpy(&v, p, sizeof v); return v; }
+    case 4: { int v; memcpy(&v, p, sizeof v); return v; }
+    default: { long long v; memcpy(&v, p, sizeof v); return v; }
+    }
+}
+
+
+unsigned long long
+PackedArray::getUInt(size_t index) const {
+    assert(index < count);
+    const char *p = static_cast<const char *>(data) + index * elementSize;
+    if (kind == KIND_FLOAT) {
+        return static_cast<unsigned long long>(getDouble(index));
+    }
+    if (kind == KIND_SINT) {
+        return static_cast<unsigned long long>(getSInt(index));
+    }
+    switch (elementSize) {
+    case 1: { unsigned char v; memcpy(&v, p, sizeof v); return v; }
+    case 2: { unsigned short v; memcpy(&v, p, sizeof v); return v; }
+    case 4: { unsigned v; memcpy(&v, p, sizeof v); return v; }
+    default: { unsigned long long v; memcpy(&v, p, sizeof v); return v; }
+    }
+}
+
+
+double
+PackedArray::getDouble(size_t index) const {
+    assert(index < count);
+    const char *p = static_cast<const char *>(data) + index * elementSize;
+    switch (kind) {
+    case KIND_SINT:
+        return static_cast<double>(getSInt(index));
+    case KIND_UINT:
+        return static_cast<double>(getUInt(index));
+    default:
+        if (elementSize == sizeof(float)) {
+            float v;
+            memcpy(&v, p, sizeof v);
+            return v;
+        } else {
+            double v;
+            memcpy(&v, p, sizeof v);
+            return v;
+        }
+    }
+}
+
+
+const Array *
+PackedArray::toArray(void) const {
+    if (!array) {
+        // Same values as parsed from an array written element by element
+        array = new Array(count);
+        for (size_t i = 0; i < count; ++i) {
+            Value *value;
+            switch (kind) {
+            case KIND_SINT:
+                {
+                    signed long long v = getSInt(i);
+                    if (v < 0) {
+                        value = new SInt(v);
+                    } else {
+                        value = new UInt(v);
+                    }
+                }
+                break;
+            case KIND_UINT:
+                value = new UInt(getUInt(i));
+                break;
+            default:
+                if (elementSize == sizeof(float)) {
+                    value = new Float(getDouble(i));
+                } else {
+                    value = new Double(getDouble(i));
+                }
+                break;
+            }
+            array->values[i] = value;
+        }
+    }
+    return array;
+}
+
+
+Array *
+PackedArray::toArray(void) {
+    return const_cast<Array *>(static_cast<const PackedArray *>(this)->toArray());
+}
+
+
+Repr::~Repr() {
+    delete humanValue;
+    delete machineValue;
+}
+
+
 #define BLOB_MAX_BOUND_SIZE (1*1024*1024*1024)
 
 class BoundBlob {
@@ -175,6 +385,7 @@ bool String ::toBool(void) const { return true; }
 bool WString::toBool(void) const { return true; }
 bool Struct ::toBool(void) const { return true; }
 bool Array  ::toBool(void) const { return true; }
+bool PackedArray::toBool(void) const { return true; }
 bool Blob   ::toBool(void) const { return true; }
 bool Pointer::toBool(void) const { return value != 0; }
 bool Repr   ::toBool(void) const { return static_cast<bool>(machineValue); }
@@ -265,6 +476,7 @@ void Enum   ::visit(Visitor &visitor) { visitor.visit(this); }
 void Bitmask::visit(Visitor &visitor) { visitor.visit(this); }
 void Struct ::visit(Visitor &visitor) { visitor.visit(this); }
 void Array  ::visit(Visitor &visitor) { visitor.visit(this); }
+void PackedArray::visit(Visitor &visitor) { visitor.visit(this); }
 void Blob   ::visit(Visitor &visitor) { visitor.visit(this); }
 void Pointer::visit(Visitor &visitor) { visitor.visit(this); }
 void Repr   ::visit(Visitor &visitor) { visitor.visit(this); }
@@ -282,6 +494,7 @@ void Visitor::visit(Enum *node) { assert(0); }
 void Visitor::visit(Bitmask *node) { visit(static_cast<UInt *>(node)); }
 void Visitor::visit(Struct *) { assert(0); }
 void Visitor::visit(Array *) { assert(0); }
+void Visitor::visit(PackedArray *node) { visit(node->toArray()); }
 void Visitor::visit(Blob *) { assert(0); }
 void Visitor::visit(Pointer *) { assert(0); }
 void Visitor::visit(Repr *node) { node->machineValue->visit(*this); }
@@ -34,7 +34,9 @@
 #include <assert.h>
 #include <stdlib.h>
 
+#include <limits>
 #include <map>
+#include <string>
 #include <vector>
 #include <ostream>
 
@@ -91,10 +93,71 @@ struct BitmaskSig {
 };
 
 
+/**
+ * Simple bump allocator.
+ *
+ * Allocations can't be freed individually -- all memory is released at once
+ * when the arena is destroyed.
+ */
+class Arena
+{
+public:
+    Arena() :
+        ptr(NULL),
+        end(NULL),
+        blocks(NULL)
+    {}
+
+    /**
+     * Use the given buffer before resorting to the heap.
+     */
+    Arena(void *buf, size_t size) :
+        ptr(static_cast<char *>(buf)),
+        end(static_cast<char *>(buf) + size),
+        blocks(NULL)
+    {}
+
+    ~Arena();
+
+    inline void *
+    alloc(size_t size) {
+        size = (size + ALIGNMENT - 1) & ~size_t(ALIGNMENT - 1);
+        if (size > size_t(end - ptr)) {
+            return allocBlock(size);
+        }
+        void *p = ptr;
+        ptr += size;
+        return p;
+    }
+
+private:
+    enum {
+        ALIGNMENT = 8,
+        BLOCK_SIZE = 4096
+    };
+
+    struct Block {
+        Block *next;
+    };
+
+    char *ptr;
+    char *end;
+    Block *blocks;
+
+    void *
+    allocBlock(size_t size);
+
+    // Disallow copying
+    Arena(const Arena &);
+    Arena & operator = (const Arena &);
+};
+
+
 class Visitor;
 class Null;
 class Struct;
 class Array;
+class PackedArray;
 
 
 class Value
@@ -103,6 +166,16 @@ public:
     virtual ~Value() {}
     virtual void visit(Visitor &visitor) = 0;
 
+    /*
+     * Values are either allocated from the heap, or from the arena of the
+     * call they belong to.  Deleting the latter merely destroys them, as
+     * their memory is released together with the arena.
+     */
+    static void *operator new(size_t size);
+    static void *operator new(size_t size, Arena &arena);
+    static void operator delete(void *ptr);
+    static void operator delete(void *ptr, Arena &arena);
+
     virtual bool toBool(void) const = 0;
     virtual signed long long toSInt(void) const;
     virtual unsigned long long toUInt(void) const;
@@ -123,6 +196,8 @@ public:
     virtual const Struct *toStruct(void) const { return NULL; }
     virtual Struct *toStruct(void) { return NULL; }
 
+    virtual const PackedArray *toPackedArray(void) const { return NULL; }
+
     Value & operator[](size_t index) const;
 };
 
@@ -324,6 +399,93 @@ public:
 };
 
 
+/**
+ * Array of integer or floating point numbers, kept as the raw bytes they were
+ * written with, rather than as a value per element.
+ *
+ * toArray() converts it into an ordinary array on demand, so that it can be
+ * handled as any other array, at the cost of that conversion.
+ */
+class PackedArray : public Value
+{
+public:
+    enum Kind {
+        KIND_SINT,
+        KIND_UINT,
+        KIND_FLOAT
+    };
+
+    PackedArray(Kind _kind, unsigned _elementSize, size_t _count, const void *_data) :
+        kind(_kind),
+        elementSize(_elementSize),
+        count(_count),
+        data(_data),
+        array(NULL)
+    {}
+
+    ~PackedArray();
+
+    bool toBool(void) const;
+    void visit(Visitor &visitor);
+
+    const Array *toArray(void) const;
+    Array *toArray(void);
+
+    const PackedArray *toPackedArray(void) const { return this; }
+
+    signed long long getSInt(size_t index) const;
+    unsigned long long getUInt(size_t index) const;
+    double getDouble(size_t index) const;
+
+    /**
+     * Whether the elements are laid out as an array of T.
+     */
+    template< class T >
+    inline bool
+    isArrayOf(void) const {
+        if (elementSize != sizeof(T)) {
+            return false;
+        }
+        if (!std::numeric_limits<T>::is_integer) {
+            return kind == KIND_FLOAT;
+        }
+        return kind == (std::numeric_limits<T>::is_signed ? KIND_SINT : KIND_UINT);
+    }
+
+    inline size_t
+    size(void) const {
+        return count;
+    }
+
+    Kind kind;
+    unsigned elementSize;
+    size_t count;
+    const void *data;
+
+private:
+    mutable Array *array;
+};
+
+
+/**
+ * 128 bits hash of a blob's contents.
+ */
+struct BlobDigest {
+    unsigned long long low;
+    unsigned long long high;
+};
+
+inline bool
+operator == (const BlobDigest &a, const BlobDigest &b) {
+    return a.low == b.low && a.high == b.high;
+}
+
+inline bool
+operator < (const BlobDigest &a, const BlobDigest &b) {
+    return a.high < b.high || (a.high == b.high && a.low < b.low);
+}
+
+
 class Blob : public Value
 {
 public:
@@ -343,6 +505,16 @@ public:
     size_t size;
     char *buf;
     bool bound;
+
+protected:
+    /**
+     * For subclasses whose bytes are not allocated with new [].
+     */
+    Blob(size_t _size, char *_buf) :
+        size(_size),
+        buf(_buf),
+        bound(false)
+    {}
 };
 
 
@@ -366,6 +538,7 @@ public:
         humanValue(human),
         machineValue(machine)
     {}
+    ~Repr();
 
     /** Human-readible value */
     Value *humanValue;
@@ -427,6 +600,14 @@ public:
 
 typedef std::vector<StackFrame *> Backtrace;
 
+/**
+ * A backtrace shared by all calls made from the same place.
+ */
+struct Stack {
+    Id id;
+    Backtrace frames;
+};
+
 class Visitor
 {
 public:
@@ -442,6 +623,7 @@ public:
     virtual void visit(Bitmask *);
     virtual void visit(Struct *);
     virtual void visit(Array *);
+    virtual void visit(PackedArray *);
     virtual void visit(Blob *);
     virtual void visit(Pointer *);
     virtual void visit(Repr *);
@@ -543,8 +725,77 @@ struct Arg
 };
 
 
+/**
+ * Encoded details of a call, as read from a trace, so that it can be copied
+ * to another trace without parsing its values.
+ *
+ * Signature IDs are left out of the encoded data and kept aside instead, as
+ * the signature definitions must be written wherever they are first used in
+ * the new trace.
+ */
+class RawCall
+{
+public:
+    enum SigKind {
+        SIG_STRUCT,
+        SIG_ENUM,
+        SIG_BITMASK,
+        SIG_FRAME,
+        SIG_STACK,
+        SIG_BLOB,
+    };
+
+    /* Parts which the writer encodes itself, as they depend on what it wrote
+     * before. */
+    struct SigRef {
+        /* Offset in data where the signature ID belongs, or where the blob
+         * contents lie. */
+        size_t offset;
+        SigKind kind;
+        union {
+            const StructSig *structSig;
+            const EnumSig *enumSig;
+            const BitmaskSig *bitmaskSig;
+            const RawStackFrame *frame;
+            const Stack *stack;
+            size_t blobSize;
+        };
+    };
+
+    /* Details of the enter event followed by those of the leave event, each
+     * without the terminating CALL_END. */
+    std::string data;
+    std::vector<SigRef> sigs;
+
+    /* Where the leave event details start, in data and sigs. */
+    size_t leaveOffset;
+    size_t leaveSig;
+
+    RawCall() :
+        leaveOffset(0),
+        leaveSig(0)
+    {}
+
+    /**
+     * Replace size bytes at the given offset, updating the offsets after.
+     */
+    void
+    replace(size_t offset, size_t size, const std::string &bytes);
+};
+
+
 class Call
 {
+private:
+    /**
+     * Inline storage for the arena, large enough for the values of most
+     * calls.
+     */
+    union {
+        long long alignment;
+        char buf[256];
+    } storage;
+
 public:
     unsigned thread_id;
     unsigned no;
@@ -555,13 +806,36 @@ public:
     CallFlags flags;
     Backtrace* backtrace;
 
+    /**
+     * When the call started, in nanoseconds since tracing did, and how long
+     * it took, as recorded by the tracer, or -1.
+     */
+    long long cpuStart;
+    long long cpuDuration;
+
+    /**
+     * Encoded details, when parsed for copying only, in which case args and
+     * ret are not set.
+     */
+    RawCall *raw;
+
+    /**
+     * Arena from which the parser allocates this call's values, so that
+     * they can all be released in one go.
+     */
+    Arena arena;
+
     Call(const FunctionSig *_sig, const CallFlags &_flags, unsigned _thread_id) :
         thread_id(_thread_id), 
         sig(_sig), 
         args(_sig->num_args), 
         ret(0),
         flags(_flags),
-        backtrace(0) {
+        backtrace(0),
+        cpuStart(-1),
+        cpuDuration(-1),
+        raw(0),
+        arena(storage.buf, sizeof storage.buf) {
     }
 
     ~Call();
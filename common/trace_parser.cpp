@@ -29,8 +29,11 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <new>
+
 #include "trace_file.hpp"
 #include "trace_dump.hpp"
+#include "trace_index.hpp"
 #include "trace_parser.hpp"
 
 
@@ -40,13 +43,132 @@
 namespace trace {
 
 
+/*
+ * Blobs up to this size have their contents allocated from the call arena,
+ * while larger ones refer to the decompressed file data in place when possible.
+ */
+#define ARENA_BLOB_MAX_SIZE (16*1024)
+
+
+/*
+ * Total size of the referred blob contents kept in memory.  Beyond it they
+ * are read again from the file.
+ */
+#define BLOB_CACHE_MAX_SIZE (64*1024*1024)
+
+
+/*
+ * Thread of leave events whose call is unknown, e.g., after seeking.
+ */
+#define UNKNOWN_THREAD (~0U)
+
+
+/*
+ * Values whose contents are allocated from the call arena, and therefore must
+ * not be freed by their destructors.
+ */
+
+class ArenaString : public String
+{
+public:
+    ArenaString(const char * _value) : String(_value) {}
+    ~ArenaString() { value = NULL; }
+};
+
+
+class ArenaWString : public WString
+{
+public:
+    ArenaWString(const wchar_t * _value) : WString(_value) {}
+    ~ArenaWString() { value = NULL; }
+};
+
+
+class ArenaBlob : public Blob
+{
+public:
+    ArenaBlob(size_t _size, char *_buf) : Blob(_size, _buf) {}
+
+    ~ArenaBlob() {
+        if (!bound) {
+            buf = NULL;
+        }
+    }
+
+    void *toPointer(void) const {
+        return buf;
+    }
+
+    void *toPointer(bool bind) {
+        if (bind && !bound) {
+            // Bound blobs outlive the call, so move the contents to the heap.
+            char *heapBuf = new char[size];
+            memcpy(heapBuf, buf, size);
+            buf = heapBuf;
+            bound = true;
+        }
+        return buf;
+    }
+};
+
+
+/*
+ * Blob referring in place to the decompressed file data.
+ */
+class ChunkBlob : public Blob
+{
+protected:
+    File::Chunk *chunk;
+
+public:
+    ChunkBlob(size_t _size, const char *_buf, File::Chunk *_chunk) :
+        Blob(_size, const_cast<char *>(_buf)),
+        chunk(_chunk)
+    {}
+
+    ~ChunkBlob() {
+        if (!bound) {
+            buf = NULL;
+        }
+        if (chunk) {
+            chunk->unref();
+        }
+    }
+
+    void *toPointer(void) const {
+        return buf;
+    }
+
+    void *toPointer(bool bind) {
+        if (bind && !bound) {
+            // Bound blobs are referred by later calls, so copy the contents
+            // instead of pinning the chunk indefinitely.
+            char *heapBuf = new char[size];
+            memcpy(heapBuf, buf, size);
+            buf = heapBuf;
+            bound = true;
+            chunk->unref();
+            chunk = NULL;
+        }
+        return buf;
+    }
+};
+
+
 Parser::Parser() {
     file = NULL;
+    arena = NULL;
+    rawCall = NULL;
+    blobCacheSize = 0;
+    blobThread = 0;
     next_call_no = 0;
     version = 0;
     api = API_UNKNOWN;
 
     glGetErrorSig = NULL;
+
+    functionSigHook = NULL;
+    functionSigHookParam = NULL;
 }
 
 
@@ -101,6 +223,14 @@ void Parser::close(void) {
 
     deleteAll(calls);
 
+    clear_signatures();
+    clear_blobs();
+
+    next_call_no = 0;
+}
+
+
+void Parser::clear_signatures(void) {
     // Delete all signature data.  Signatures are mere structures which don't
     // own their own memory, so we need to destroy all data we created here.
 
@@ -154,7 +284,304 @@ void Parser::close(void) {
     }
     bitmasks.clear();
 
-    next_call_no = 0;
+    deleteAll(frames);
+    deleteAll(stacks);
+
+    glGetErrorSig = NULL;
+}
+
+
+void Parser::clear_blobs(void) {
+    clear_blob_cache();
+    blobTables.clear();
+    referredBlobs.clear();
+}
+
+
+void Parser::clear_blob_cache(void) {
+    for (unsigned i = 0; i < blobTables.size(); ++i) {
+        BlobTable &table = blobTables[i];
+        for (BlobTable::iterator it = table.begin(); it != table.end(); ++it) {
+            if (it->second.contents) {
+                it->second.contents->unref();
+                it->second.contents = NULL;
+            }
+        }
+    }
+    blobCacheSize = 0;
+}
+
+
+static void
+writeOffset(IndexWriter &writer, const File::Offset &offset) {
+    writer.writeUInt(offset.chunk);
+    writer.writeUInt(offset.offsetInChunk);
+}
+
+
+static void
+readOffset(IndexReader &reader, File::Offset &offset) {
+    offset.chunk = reader.readUInt();
+    offset.offsetInChunk = reader.readUInt();
+}
+
+
+template<class T>
+static size_t
+countSigs(const std::vector<T *> &map) {
+    size_t count = 0;
+    for (typename std::vector<T *>::const_iterator it = map.begin(); it != map.end(); ++it) {
+        if (*it) {
+            ++count;
+        }
+    }
+    return count;
+}
+
+
+/**
+ * Helper function to create a new signature while importing, failing on
+ * duplicate or implausible IDs.
+ */
+template<class T>
+static T *
+importSig(IndexReader &reader, std::vector<T *> &map, size_t maxId) {
+    size_t id = reader.readUInt();
+    if (reader.error ||
+        id > maxId ||
+        (id < map.size() && map[id])) {
+        reader.error = true;
+        return NULL;
+    }
+    if (id >= map.size()) {
+        map.resize(id + 1);
+    }
+    T *sig = new T;
+    sig->id = id;
+    map[id] = sig;
+    return sig;
+}
+
+
+void Parser::exportSignatures(IndexWriter &writer) const {
+    writer.writeUInt(countSigs(functions));
+    for (FunctionMap::const_iterator it = functions.begin(); it != functions.end(); ++it) {
+        const FunctionSigState *sig = *it;
+        if (sig) {
+            writer.writeUInt(sig->id);
+            writer.writeString(sig->name);
+            writer.writeUInt(sig->num_args);
+            for (unsigned arg = 0; arg < sig->num_args; ++arg) {
+                writer.writeString(sig->arg_names[arg]);
+            }
+            writeOffset(writer, sig->fileOffset);
+        }
+    }
+
+    writer.writeUInt(countSigs(structs));
+    for (StructMap::const_iterator it = structs.begin(); it != structs.end(); ++it) {
+        const StructSigState *sig = *it;
+        if (sig) {
+            writer.writeUInt(sig->id);
+            writer.writeString(sig->name);
+            writer.writeUInt(sig->num_members);
+            for (unsigned member = 0; member < sig->num_members; ++member) {
+                writer.writeString(sig->member_names[member]);
+            }
+            writeOffset(writer, sig->fileOffset);
+        }
+    }
+
+    writer.writeUInt(countSigs(enums));
+    for (EnumMap::const_iterator it = enums.begin(); it != enums.end(); ++it) {
+        const EnumSigState *sig = *it;
+        if (sig) {
+            writer.writeUInt(sig->id);
+            writer.writeUInt(sig->num_values);
+            for (unsigned value = 0; value < sig->num_values; ++value) {
+                writer.writeString(sig->values[value].name);
+                writer.writeSInt(sig->values[value].value);
+            }
+            writeOffset(writer, sig->fileOffset);
+        }
+    }
+
+    writer.writeUInt(countSigs(bitmasks));
+    for (BitmaskMap::const_iterator it = bitmasks.begin(); it != bitmasks.end(); ++it) {
+        const BitmaskSigState *sig = *it;
+        if (sig) {
+            writer.writeUInt(sig->id);
+            writer.writeUInt(sig->num_flags);
+            for (unsigned flag = 0; flag < sig->num_flags; ++flag) {
+                writer.writeString(sig->flags[flag].name);
+                writer.writeUInt(sig->flags[flag].value);
+            }
+            writeOffset(writer, sig->fileOffset);
+        }
+    }
+
+    writer.writeUInt(countSigs(frames));
+    for (StackFrameMap::const_iterator it = frames.begin(); it != frames.end(); ++it) {
+        const StackFrameState *frame = *it;
+        if (frame) {
+            writer.writeUInt(it - frames.begin());
+            writer.writeString(frame->module);
+            writer.writeString(frame->function);
+            writer.writeString(frame->filename);
+            writer.writeSInt(frame->linenumber);
+            writer.writeSInt(frame->offset);
+            writeOffset(writer, frame->fileOffset);
+        }
+    }
+
+    writer.writeUInt(countSigs(stacks));
+    for (StackMap::const_iterator it = stacks.begin(); it != stacks.end(); ++it) {
+        const StackState *stack = *it;
+        if (stack) {
+            writer.writeUInt(stack->id);
+            writer.writeUInt(stack->frames.size());
+            for (unsigned i = 0; i < stack->frames.size(); ++i) {
+                writer.writeUInt(stack->frames[i]->id);
+            }
+            writeOffset(writer, stack->fileOffset);
+        }
+    }
+
+    writer.writeUInt(referredBlobs.size());
+    for (BlobMap::const_iterator it = referredBlobs.begin(); it != referredBlobs.end(); ++it) {
+        writer.writeUInt(it->first.low);
+        writer.writeUInt(it->first.high);
+        writer.writeUInt(it->second.size);
+        writeOffset(writer, it->second.offset);
+    }
+}
+
+
+bool Parser::importSignatures(const std::string &data) {
+    assert(functions.empty());
+
+    IndexReader reader(data.data(), data.size());
+
+    size_t count = reader.readCount();
+    for (size_t i = 0; i < count && !reader.error; ++i) {
+        FunctionSigState *sig = importSig(reader, functions, data.size());
+        if (!sig) {
+            break;
+        }
+        sig->name = reader.readString();
+        sig->num_args = reader.readCount();
+        const char **arg_names = new const char *[sig->num_args];
+        for (unsigned arg = 0; arg < sig->num_args; ++arg) {
+            arg_names[arg] = reader.readString();
+        }
+        sig->arg_names = arg_names;
+        readOffset(reader, sig->fileOffset);
+        if (!sig->name) {
+            reader.error = true;
+            break;
+        }
+        sig->flags = lookupCallFlags(sig->name);
+        setup_function_sig(sig);
+    }
+
+    count = reader.readCount();
+    for (size_t i = 0; i < count && !reader.error; ++i) {
+        StructSigState *sig = importSig(reader, structs, data.size());
+        if (!sig) {
+            break;
+        }
+        sig->name = reader.readString();
+        sig->num_members = reader.readCount();
+        const char **member_names = new const char *[sig->num_members];
+        for (unsigned member = 0; member < sig->num_members; ++member) {
+            member_names[member] = reader.readString();
+        }
+        sig->member_names = member_names;
+        readOffset(reader, sig->fileOffset);
+    }
+
+    count = reader.readCount();
+    for (size_t i = 0; i < count && !reader.error; ++i) {
+        EnumSigState *sig = importSig(reader, enums, data.size());
+        if (!sig) {
+            break;
+        }
+        sig->num_values = reader.readCount();
+        EnumValue *values = new EnumValue[sig->num_values];
+        for (EnumValue *it = values; it != values + sig->num_values; ++it) {
+            it->name = reader.readString();
+            it->value = reader.readSInt();
+        }
+        sig->values = values;
+        readOffset(reader, sig->fileOffset);
+    }
+
+    count = reader.readCount();
+    for (size_t i = 0; i < count && !reader.error; ++i) {
+        BitmaskSigState *sig = importSig(reader, bitmasks, data.size());
+        if (!sig) {
+            break;
+        }
+        sig->num_flags = reader.readCount();
+        BitmaskFlag *flags = new BitmaskFlag[sig->num_flags];
+        for (BitmaskFlag *it = flags; it != flags + sig->num_flags; ++it) {
+            it->name = reader.readString();
+            it->value = reader.readUInt();
+        }
+        sig->flags = flags;
+        readOffset(reader, sig->fileOffset);
+    }
+
+    count = reader.readCount();
+    for (size_t i = 0; i < count && !reader.error; ++i) {
+        StackFrameState *frame = importSig(reader, frames, data.size());
+        if (!frame) {
+            break;
+        }
+        frame->module = reader.readString();
+        frame->function = reader.readString();
+        frame->filename = reader.readString();
+        frame->linenumber = reader.readSInt();
+        frame->offset = reader.readSInt();
+        readOffset(reader, frame->fileOffset);
+    }
+
+    count = reader.readCount();
+    for (size_t i = 0; i < count && !reader.error; ++i) {
+        StackState *stack = importSig(reader, stacks, data.size());
+        if (!stack) {
+            break;
+        }
+        stack->frames.resize(reader.readCount());
+        for (unsigned j = 0; j < stack->frames.size(); ++j) {
+            size_t id = reader.readUInt();
+            if (id >= frames.size() || !frames[id]) {
+                reader.error = true;
+                break;
+            }
+            stack->frames[j] = frames[id];
+        }
+        readOffset(reader, stack->fileOffset);
+    }
+
+    count = reader.readCount();
+    for (size_t i = 0; i < count && !reader.error; ++i) {
+        BlobDigest digest;
+        digest.low = reader.readUInt();
+        digest.high = reader.readUInt();
+        BlobLocation &location = referredBlobs[digest];
+        location.size = reader.readUInt();
+        readOffset(reader, location.offset);
+    }
+
+    if (reader.error) {
+        clear_signatures();
+        clear_blobs();
+        api = API_UNKNOWN;
+        return false;
+    }
+
+    return true;
 }
 
 
@@ -246,41 +673,7 @@ Parser::parse_function_sig(void) {
         sig->fileOffset = file->currentOffset();
         functions[id] = sig;
 
-        /**
-         * Try to autodetect the API.
-         *
-         * XXX: Ideally we would allow to mix multiple APIs in a single trace,
-         * but as it stands today, retrace is done separately for each API.
-         */
-        if (api == API_UNKNOWN) {
-            const char *n = sig->name;
-            if ((n[0] == 'g' && n[1] == 'l' && n[2] == 'X') || // glX*
-                (n[0] == 'w' && n[1] == 'g' && n[2] == 'l' && n[3] >= 'A' && n[3] <= 'Z') || // wgl[A-Z]*
-                (n[0] == 'C' && n[1] == 'G' && n[2] == 'L')) { // CGL*
-                api = trace::API_GL;
-            } else if (n[0] == 'e' && n[1] == 'g' && n[2] == 'l' && n[3] >= 'A' && n[3] <= 'Z') { // egl[A-Z]*
-                api = trace::API_EGL;
-            } else if ((n[0] == 'D' &&
-                        ((n[1] == 'i' && n[2] == 'r' && n[3] == 'e' && n[4] == 'c' && n[5] == 't') || // Direct*
-                         (n[1] == '3' && n[2] == 'D'))) || // D3D*
-                       (n[0] == 'C' && n[1] == 'r' && n[2] == 'e' && n[3] == 'a' && n[4] == 't' && n[5] == 'e')) { // Create*
-                api = trace::API_DX;
-            } else {
-                /* TODO */
-            }
-        }
-
-        /**
-         * Note down the signature of special functions for future reference.
-         *
-         * NOTE: If the number of comparisons increases we should move this to a
-         * separate function and use bisection.
-         */
-        if (sig->num_args == 0 &&
-            strcmp(sig->name, "glGetError") == 0) {
-            glGetErrorSig = sig;
-        }
-
+        setup_function_sig(sig);
     } else if (file->currentOffset() < sig->fileOffset) {
         /* skip over the signature */
         skip_string(); /* name */
@@ -295,6 +688,59 @@ Parser::parse_function_sig(void) {
 }
 
 
+void Parser::setup_function_sig(FunctionSigState *sig) {
+    /**
+     * Try to autodetect the API.
+     *
+     * XXX: Ideally we would allow to mix multiple APIs in a single trace,
+     * but as it stands today, retrace is done separately for each API.
+     */
+    if (api == API_UNKNOWN) {
+        const char *n = sig->name;
+        if ((n[0] == 'g' && n[1] == 'l' && n[2] == 'X') || // glX*
+            (n[0] == 'w' && n[1] == 'g' && n[2] == 'l' && n[3] >= 'A' && n[3] <= 'Z') || // wgl[A-Z]*
+            (n[0] == 'C' && n[1] == 'G' && n[2] == 'L')) { // CGL*
+            api = trace::API_GL;
+        } else if (n[0] == 'e' && n[1] == 'g' && n[2] == 'l' && n[3] >= 'A' && n[3] <= 'Z') { // egl[A-Z]*
+            api = trace::API_EGL;
+        } else if ((n[0] == 'D' &&
+                    ((n[1] == 'i' && n[2] == 'r' && n[3] == 'e' && n[4] == 'c' && n[5] == 't') || // Direct*
+                     (n[1] == '3' && n[2] == 'D'))) || // D3D*
+                   (n[0] == 'C' && n[1] == 'r' && n[2] == 'e' && n[3] == 'a' && n[4] == 't' && n[5] == 'e')) { // Create*
+            api = trace::API_DX;
+        } else {
+            /* TODO */
+        }
+    }
+
+    /**
+     * Note down the signature of special functions for future reference.
+     *
+     * NOTE: If the number of comparisons increases we should move this to a
+     * separate function and use bisection.
+     */
+    if (sig->num_args == 0 &&
+        strcmp(sig->name, "glGetError") == 0) {
+        glGetErrorSig = sig;
+    }
+
+    sig->hookData = functionSigHook ? functionSigHook(sig, functionSigHookParam) : NULL;
+}
+
+
+void Parser::setFunctionSigHook(FunctionSigHook hook, void *param) {
+    functionSigHook = hook;
+    functionSigHookParam = param;
+
+    for (FunctionMap::iterator it = functions.begin(); it != functions.end(); ++it) {
+        FunctionSigState *sig = *it;
+        if (sig) {
+            sig->hookData = hook ? hook(sig, param) : NULL;
+        }
+    }
+}
+
+
 StructSig *Parser::parse_struct_sig() {
     size_t id = read_uint();
 
@@ -439,10 +885,19 @@ void Parser::parse_enter(Mode mode) {
     FunctionSigFlags *sig = parse_function_sig();
 
     Call *call = new Call(sig, sig->flags, thread_id);
+    blobThread = thread_id;
 
     call->no = next_call_no++;
 
+    if (mode == RAW) {
+        call->raw = new RawCall;
+    }
+
     if (parse_call_details(call, mode)) {
+        if (call->raw) {
+            call->raw->leaveOffset = call->raw->data.size();
+            call->raw->leaveSig = call->raw->sigs.size();
+        }
         calls.push_back(call);
     } else {
         delete call;
@@ -467,11 +922,13 @@ Call *Parser::parse_leave(Mode mode) {
          */
         const FunctionSig sig = {0, NULL, 0, NULL};
         call = new Call(&sig, 0, 0);
+        blobThread = UNKNOWN_THREAD;
         parse_call_details(call, SCAN);
         delete call;
         return NULL;
     }
 
+    blobThread = call->thread_id;
     if (parse_call_details(call, mode)) {
         return call;
     } else {
@@ -482,6 +939,11 @@ Call *Parser::parse_leave(Mode mode) {
 
 
 bool Parser::parse_call_details(Call *call, Mode mode) {
+    if (mode == RAW) {
+        return copy_call_details(call);
+    }
+
+    arena = &call->arena;
     do {
         int c = read_byte();
         switch (c) {
@@ -508,6 +970,71 @@ bool Parser::parse_call_details(Call *call, Mode mode) {
 #endif
             parse_call_backtrace(call, mode);
             break;
+        case trace::CALL_STACK:
+#if TRACE_VERBOSE
+            std::cerr << "\tCALL_STACK\n";
+#endif
+            call->backtrace = new Backtrace(parse_stack(mode)->frames);
+            break;
+        case trace::CALL_TIME:
+#if TRACE_VERBOSE
+            std::cerr << "\tCALL_TIME\n";
+#endif
+            call->cpuStart = read_uint();
+            call->cpuDuration = read_uint();
+            break;
+        default:
+            std::cerr << "error: ("<<call->name()<< ") unknown call detail "
+                      << c << "\n";
+            exit(1);
+        case -1:
+            return false;
+        }
+    } while(true);
+}
+
+/**
+ * Copy the call details to the call's RawCall, re-encoding them as the
+ * Writer would, (e.g., for traces of older versions), but with signature IDs
+ * and definitions left out.
+ */
+bool Parser::copy_call_details(Call *call) {
+    rawCall = call->raw;
+    assert(rawCall);
+    do {
+        int c = read_byte();
+        switch (c) {
+        case trace::CALL_END:
+            return true;
+        case trace::CALL_ARG:
+            copy_byte(c);
+            copy_uint(read_uint());
+            copy_value();
+            break;
+        case trace::CALL_RET:
+            copy_byte(c);
+            copy_value();
+            break;
+        case trace::CALL_BACKTRACE:
+            {
+                unsigned num_frames = read_uint();
+                if (num_frames) {
+                    copy_byte(c);
+                    copy_uint(num_frames);
+                }
+                for (unsigned i = 0; i < num_frames; ++i) {
+                    copy_sig(RawCall::SIG_FRAME).frame = parse_backtrace_frame(RAW);
+                }
+            }
+            break;
+        case trace::CALL_STACK:
+            copy_sig(RawCall::SIG_STACK).stack = parse_stack(RAW);
+            break;
+        case trace::CALL_TIME:
+            copy_byte(c);
+            copy_uint(read_uint());
+            copy_uint(read_uint());
+            break;
         default:
             std::cerr << "error: ("<<call->name()<< ") unknown call detail "
                       << c << "\n";
@@ -535,6 +1062,7 @@ StackFrame * Parser::parse_backtrace_frame(Mode mode) {
 
     if (!frame) {
         frame = new StackFrameState;
+        frame->id = id;
         int c = read_byte();
         while (c != trace::BACKTRACE_END &&
                c != -1) {
@@ -596,6 +1124,31 @@ StackFrame * Parser::parse_backtrace_frame(Mode mode) {
     return frame;
 }
 
+Stack * Parser::parse_stack(Mode mode) {
+    size_t id = read_uint();
+
+    StackState *stack = lookup(stacks, id);
+
+    if (!stack) {
+        stack = new StackState;
+        stack->id = id;
+        unsigned num_frames = read_uint();
+        stack->frames.resize(num_frames);
+        for (unsigned i = 0; i < num_frames; ++i) {
+            stack->frames[i] = parse_backtrace_frame(mode);
+        }
+        stack->fileOffset = file->currentOffset();
+        stacks[id] = stack;
+    } else if (file->currentOffset() < stack->fileOffset) {
+        unsigned num_frames = read_uint();
+        for (unsigned i = 0; i < num_frames; ++i) {
+            parse_backtrace_frame(mode);
+        }
+    }
+
+    return stack;
+}
+
 /**
  * Make adjustments to this particular call flags.
  *
@@ -618,6 +1171,8 @@ void Parser::parse_arg(Call *call, Mode mode) {
         if (index >= call->args.size()) {
             call->args.resize(index + 1);
         }
+        /* Arguments may be written both on enter and leave. */
+        delete call->args[index].value;
         call->args[index].value = value;
     }
 }
@@ -629,13 +1184,13 @@ Value *Parser::parse_value(void) {
     c = read_byte();
     switch (c) {
     case trace::TYPE_NULL:
-        value = new Null;
+        value = new (*arena) Null;
         break;
     case trace::TYPE_FALSE:
-        value = new Bool(false);
+        value = new (*arena) Bool(false);
         break;
     case trace::TYPE_TRUE:
-        value = new Bool(true);
+        value = new (*arena) Bool(true);
         break;
     case trace::TYPE_SINT:
         value = parse_sint();
@@ -661,11 +1216,16 @@ Value *Parser::parse_value(void) {
     case trace::TYPE_ARRAY:
         value = parse_array();
         break;
+    case trace::TYPE_PACKED_ARRAY:
+        value = parse_packed_array();
+        break;
     case trace::TYPE_STRUCT:
         value = parse_struct();
         break;
     case trace::TYPE_BLOB:
-        value = parse_blob();
+    case trace::TYPE_HASHED_BLOB:
+    case trace::TYPE_BLOB_REF:
+        value = parse_blob(c);
         break;
     case trace::TYPE_OPAQUE:
         value = parse_opaque();
@@ -725,11 +1285,16 @@ void Parser::scan_value(void) {
     case trace::TYPE_ARRAY:
         scan_array();
         break;
+    case trace::TYPE_PACKED_ARRAY:
+        scan_packed_array();
+        break;
     case trace::TYPE_STRUCT:
         scan_struct();
         break;
     case trace::TYPE_BLOB:
-        scan_blob();
+    case trace::TYPE_HASHED_BLOB:
+    case trace::TYPE_BLOB_REF:
+        scan_blob(c);
         break;
     case trace::TYPE_OPAQUE:
         scan_opaque();
@@ -750,7 +1315,7 @@ void Parser::scan_value(void) {
 
 
 Value *Parser::parse_sint() {
-    return new SInt(-(signed long long)read_uint());
+    return new (*arena) SInt(-(signed long long)read_uint());
 }
 
 
@@ -760,7 +1325,7 @@ void Parser::scan_sint() {
 
 
 Value *Parser::parse_uint() {
-    return new UInt(read_uint());
+    return new (*arena) UInt(read_uint());
 }
 
 
@@ -772,7 +1337,7 @@ void Parser::scan_uint() {
 Value *Parser::parse_float() {
     float value;
     file->read(&value, sizeof value);
-    return new Float(value);
+    return new (*arena) Float(value);
 }
 
 
@@ -784,7 +1349,7 @@ void Parser::scan_float() {
 Value *Parser::parse_double() {
     double value;
     file->read(&value, sizeof value);
-    return new Double(value);
+    return new (*arena) Double(value);
 }
 
 
@@ -794,7 +1359,16 @@ void Parser::scan_double() {
 
 
 Value *Parser::parse_string() {
-    return new String(read_string());
+    size_t len = read_uint();
+    char * value = static_cast<char *>(arena->alloc(len + 1));
+    if (len) {
+        file->read(value, len);
+    }
+    value[len] = 0;
+#if TRACE_VERBOSE
+    std::cerr << "\tSTRING \"" << value << "\"\n";
+#endif
+    return new (*arena) ArenaString(value);
 }
 
 
@@ -814,7 +1388,7 @@ Value *Parser::parse_enum() {
         assert(sig->num_values == 1);
         value = sig->values->value;
     }
-    return new Enum(sig, value);
+    return new (*arena) Enum(sig, value);
 }
 
 
@@ -833,7 +1407,7 @@ Value *Parser::parse_bitmask() {
 
     unsigned long long value = read_uint();
 
-    return new Bitmask(sig, value);
+    return new (*arena) Bitmask(sig, value);
 }
 
 
@@ -845,7 +1419,7 @@ void Parser::scan_bitmask() {
 
 Value *Parser::parse_array(void) {
     size_t len = read_uint();
-    Array *array = new Array(len);
+    Array *array = new (*arena) Array(len);
     for (size_t i = 0; i < len; ++i) {
         array->values[i] = parse_value();
     }
@@ -861,9 +1435,99 @@ void Parser::scan_array(void) {
 }
 
 
-Value *Parser::parse_blob(void) {
+/**
+ * Read the element type of a packed array, and its size in bytes.
+ */
+PackedArray::Kind Parser::read_packed_array_type(size_t &elementSize) {
+    int c = read_byte();
+    elementSize = read_uint();
+    PackedArray::Kind kind;
+    bool valid;
+    switch (c) {
+    case trace::TYPE_SINT:
+    case trace::TYPE_UINT:
+        kind = c == trace::TYPE_SINT ? PackedArray::KIND_SINT : PackedArray::KIND_UINT;
+        valid = elementSize == 1 || elementSize == 2 || elementSize == 4 || elementSize == 8;
+        break;
+    case trace::TYPE_FLOAT:
+        kind = PackedArray::KIND_FLOAT;
+        valid = elementSize == sizeof(float);
+        break;
+    case trace::TYPE_DOUBLE:
+        kind = PackedArray::KIND_FLOAT;
+        valid = elementSize == sizeof(double);
+        break;
+    default:
+        kind = PackedArray::KIND_UINT;
+        valid = false;
+        break;
+    }
+    if (!valid) {
+        std::cerr << "error: unsupported packed array of type " << c << " and size " << elementSize << "\n";
+        exit(1);
+    }
+    return kind;
+}
+
+
+Value *Parser::parse_packed_array(void) {
+    size_t elementSize;
+    PackedArray::Kind kind = read_packed_array_type(elementSize);
+    size_t count = read_uint();
+    size_t size = count * elementSize;
+    void *data = arena->alloc(size);
+    if (size) {
+        file->read(data, size);
+    }
+    return new (*arena) PackedArray(kind, elementSize, count, data);
+}
+
+
+void Parser::scan_packed_array(void) {
+    size_t elementSize;
+    read_packed_array_type(elementSize);
+    size_t count = read_uint();
+    if (count) {
+        file->skip(count * elementSize);
+    }
+}
+
+
+Value *Parser::parse_blob(int type) {
     size_t size = read_uint();
-    Blob *blob = new Blob(size);
+    if (type != trace::TYPE_BLOB) {
+        BlobDigest digest = read_digest();
+        if (type == trace::TYPE_BLOB_REF) {
+            File::Chunk *contents = lookup_blob(digest, size);
+            if (!contents) {
+                Blob *blob = new (*arena) Blob(size);
+                memset(blob->buf, 0, size);
+                return blob;
+            }
+            if (size <= ARENA_BLOB_MAX_SIZE) {
+                char *buf = static_cast<char *>(arena->alloc(size));
+                memcpy(buf, contents->data, size);
+                contents->unref();
+                return new (*arena) ArenaBlob(size, buf);
+            }
+            return new (*arena) ChunkBlob(size, contents->data, contents);
+        }
+        add_blob(digest, size);
+    }
+
+    Blob *blob;
+    if (size <= ARENA_BLOB_MAX_SIZE) {
+        char *buf = static_cast<char *>(arena->alloc(size));
+        blob = new (*arena) ArenaBlob(size, buf);
+    } else {
+        File::Chunk *chunk = NULL;
+        const char *buf = file->readInPlace(size, chunk);
+        if (buf) {
+            return new (*arena) ChunkBlob(size, buf, chunk);
+        }
+        // Straddles chunks, or the file doesn't support it
+        blob = new (*arena) Blob(size);
+    }
     if (size) {
         file->read(blob->buf, size);
     }
@@ -871,17 +1535,174 @@ Value *Parser::parse_blob(void) {
 }
 
 
-void Parser::scan_blob(void) {
+void Parser::scan_blob(int type) {
     size_t size = read_uint();
+    if (type != trace::TYPE_BLOB) {
+        BlobDigest digest = read_digest();
+        if (type == trace::TYPE_BLOB_REF) {
+            // Still note that it was referred to
+            refer_blob(digest, size);
+            return;
+        }
+        add_blob(digest, size);
+    }
     if (size) {
         file->skip(size);
     }
 }
 
 
+BlobDigest Parser::read_digest(void) {
+    BlobDigest digest = {0, 0};
+    file->read(&digest.low, sizeof digest.low);
+    if (version >= 10) {
+        file->read(&digest.high, sizeof digest.high);
+    }
+    return digest;
+}
+
+
+/**
+ * Slot of the current thread's table where a blob with the given digest goes.
+ */
+Parser::BlobSlot *Parser::get_blob_slot(const BlobDigest &digest) {
+    if (blobThread == UNKNOWN_THREAD) {
+        return NULL;
+    }
+    if (blobThread >= blobTables.size()) {
+        blobTables.resize(blobThread + 1);
+    }
+    BlobTable &table = blobTables[blobThread];
+    unsigned index = digest.low & (BLOB_DIGEST_TABLE_SIZE - 1);
+    BlobTable::iterator it = table.lower_bound(index);
+    if (it == table.end() || it->first != index) {
+        BlobSlot empty;
+        empty.digest.low = 0;
+        empty.digest.high = 0;
+        empty.location.size = 0;
+        empty.contents = NULL;
+        empty.referred = false;
+        it = table.insert(it, std::make_pair(index, empty));
+    }
+    return &it->second;
+}
+
+
+/**
+ * Remember where the contents of a blob that may be referred to start,
+ * which must be next in the file.
+ */
+void Parser::add_blob(const BlobDigest &digest, size_t size) {
+    BlobLocation location;
+    location.size = size;
+    if (file->supportsOffsets()) {
+        location.offset = file->currentOffset();
+    }
+
+    if (version < 10) {
+        // Digests were narrower, and not all writers kept a table per
+        // thread, so remember every blob as before.
+        referredBlobs[digest] = location;
+    }
+
+    BlobSlot *slot = get_blob_slot(digest);
+    if (!slot) {
+        return;
+    }
+    if (slot->digest == digest && slot->location.size == size) {
+        // Written anew by the flight recorder, with the same contents
+        return;
+    }
+    if (slot->contents) {
+        blobCacheSize -= slot->location.size;
+        slot->contents->unref();
+        slot->contents = NULL;
+    }
+    slot->digest = digest;
+    slot->location = location;
+    slot->referred = false;
+}
+
+
+/**
+ * Find the blob referred to by digest in the current thread's table, noting
+ * it was referred to.
+ */
+Parser::BlobSlot *Parser::refer_blob(const BlobDigest &digest, size_t size) {
+    BlobSlot *slot = get_blob_slot(digest);
+    if (!slot) {
+        return NULL;
+    }
+
+    if (slot->digest == digest && slot->location.size == size) {
+        if (!slot->referred) {
+            referredBlobs[digest] = slot->location;
+            slot->referred = true;
+        }
+        return slot;
+    }
+
+    BlobMap::const_iterator it = referredBlobs.find(digest);
+    if (it == referredBlobs.end() || it->second.size != size) {
+        std::cerr << "error: reference to unknown blob\n";
+        return NULL;
+    }
+
+    // The writer had it in this slot, so put it back
+    if (slot->contents) {
+        blobCacheSize -= slot->location.size;
+        slot->contents->unref();
+        slot->contents = NULL;
+    }
+    slot->digest = digest;
+    slot->location = it->second;
+    slot->referred = true;
+    return slot;
+}
+
+
+/**
+ * Get the contents of a blob referred to by digest, reading them again from
+ * the file if they are not in memory.  The returned chunk must be unref'ed.
+ */
+File::Chunk *Parser::lookup_blob(const BlobDigest &digest, size_t size) {
+    BlobSlot *slot = refer_blob(digest, size);
+    if (!slot) {
+        return NULL;
+    }
+
+    if (!slot->contents) {
+        if (!file->supportsOffsets()) {
+            std::cerr << "error: can't read referred blob, as the trace doesn't support seeking\n";
+            return NULL;
+        }
+
+        File::Chunk *contents = new File::Chunk(size);
+        File::Offset current = file->currentOffset();
+        file->setCurrentOffset(slot->location.offset);
+        size_t read = size ? file->read(contents->data, size) : 0;
+        file->setCurrentOffset(current);
+        if (read != size) {
+            std::cerr << "error: failed to read referred blob\n";
+            contents->unref();
+            return NULL;
+        }
+
+        if (blobCacheSize + size > BLOB_CACHE_MAX_SIZE) {
+            clear_blob_cache();
+        }
+        slot->contents = contents;
+        blobCacheSize += size;
+    }
+
+    slot->contents->ref();
+    return slot->contents;
+}
+
+
 Value *Parser::parse_struct() {
     StructSig *sig = parse_struct_sig();
-    Struct *value = new Struct(sig);
+    Struct *value = new (*arena) Struct(sig);
 
     for (size_t i = 0; i < sig->num_members; ++i) {
         value->members[i] = parse_value();
@@ -902,7 +1723,7 @@ void Parser::scan_struct() {
 Value *Parser::parse_opaque() {
     unsigned long long addr;
     addr = read_uint();
-    return new Pointer(addr);
+    return new (*arena) Pointer(addr);
 }
 
 
@@ -914,7 +1735,7 @@ void Parser::scan_opaque() {
 Value *Parser::parse_repr() {
     Value *humanValue = parse_value();
     Value *machineValue = parse_value();
-    return new Repr(humanValue, machineValue);
+    return new (*arena) Repr(humanValue, machineValue);
 }
 
 
@@ -926,7 +1747,7 @@ void Parser::scan_repr() {
 
 Value *Parser::parse_wstring() {
     size_t len = read_uint();
-    wchar_t * value = new wchar_t[len + 1];
+    wchar_t * value = static_cast<wchar_t *>(arena->alloc((len + 1) * sizeof(wchar_t)));
     for (size_t i = 0; i < len; ++i) {
         value[i] = read_uint();
     }
@@ -934,7 +1755,7 @@ Value *Parser::parse_wstring() {
 #if TRACE_VERBOSE
     std::cerr << "\tWSTRING \"" << value << "\"\n";
 #endif
-    return new WString(value);
+    return new (*arena) ArenaWString(value);
 }
 
 
@@ -946,6 +1767,189 @@ void Parser::scan_wstring() {
 }
 
 
+void Parser::copy_value(void) {
+    int c = read_byte();
+    switch (c) {
+    case trace::TYPE_NULL:
+    case trace::TYPE_FALSE:
+    case trace::TYPE_TRUE:
+        copy_byte(c);
+        break;
+    case trace::TYPE_SINT:
+        copy_sint(-(signed long long)read_uint());
+        break;
+    case trace::TYPE_UINT:
+    case trace::TYPE_OPAQUE:
+        copy_byte(c);
+        copy_uint(read_uint());
+        break;
+    case trace::TYPE_FLOAT:
+        copy_byte(c);
+        copy_bytes(sizeof(float));
+        break;
+    case trace::TYPE_DOUBLE:
+        copy_byte(c);
+        copy_bytes(sizeof(double));
+        break;
+    case trace::TYPE_STRING:
+        {
+            size_t len = read_uint();
+            copy_byte(c);
+            copy_uint(len);
+            copy_bytes(len);
+        }
+        break;
+    case trace::TYPE_BLOB:
+    case trace::TYPE_HASHED_BLOB:
+    case trace::TYPE_BLOB_REF:
+        {
+            /* Blobs are written anew, so that the writer decides which to
+             * refer to -- see Writer::writeBlob. */
+            size_t size = read_uint();
+            BlobDigest digest = {0, 0};
+            if (c != trace::TYPE_BLOB) {
+                digest = read_digest();
+            }
+            copy_sig(RawCall::SIG_BLOB).blobSize = size;
+            if (c == trace::TYPE_BLOB_REF) {
+                File::Chunk *contents = lookup_blob(digest, size);
+                if (contents) {
+                    rawCall->data.append(contents->data, size);
+                    contents->unref();
+                } else {
+                    rawCall->data.append(size, '\0');
+                }
+            } else {
+                if (c == trace::TYPE_HASHED_BLOB) {
+                    add_blob(digest, size);
+                }
+                size_t offset = rawCall->data.size();
+                copy_bytes(size);
+                rawCall->data.resize(offset + size);
+            }
+        }
+        break;
+    case trace::TYPE_ENUM:
+        copy_byte(c);
+        if (version >= 3) {
+            copy_sig(RawCall::SIG_ENUM).enumSig = parse_enum_sig();
+            copy_sint(read_sint());
+        } else {
+            EnumSig *sig = parse_old_enum_sig();
+            copy_sig(RawCall::SIG_ENUM).enumSig = sig;
+            copy_sint(sig->values->value);
+        }
+        break;
+    case trace::TYPE_BITMASK:
+        copy_byte(c);
+        copy_sig(RawCall::SIG_BITMASK).bitmaskSig = parse_bitmask_sig();
+        copy_uint(read_uint());
+        break;
+    case trace::TYPE_ARRAY:
+        {
+            size_t len = read_uint();
+            copy_byte(c);
+            copy_uint(len);
+            for (size_t i = 0; i < len; ++i) {
+                copy_value();
+            }
+        }
+        break;
+    case trace::TYPE_PACKED_ARRAY:
+        {
+            copy_byte(c);
+            copy_byte(read_byte());
+            size_t elementSize = read_uint();
+            size_t count = read_uint();
+            copy_uint(elementSize);
+            copy_uint(count);
+            copy_bytes(count * elementSize);
+        }
+        break;
+    case trace::TYPE_STRUCT:
+        {
+            copy_byte(c);
+            StructSig *sig = parse_struct_sig();
+            copy_sig(RawCall::SIG_STRUCT).structSig = sig;
+            for (size_t i = 0; i < sig->num_members; ++i) {
+                copy_value();
+            }
+        }
+        break;
+    case trace::TYPE_REPR:
+        copy_byte(c);
+        copy_value();
+        copy_value();
+        break;
+    case trace::TYPE_WSTRING:
+        {
+            /* Wide strings are written as ASCII -- see Writer::writeWString. */
+            size_t len = read_uint();
+            copy_byte(trace::TYPE_STRING);
+            copy_uint(len);
+            for (size_t i = 0; i < len; ++i) {
+                wchar_t wc = read_uint();
+                copy_byte(wc >= 0 && wc < 0x80 ? (char)wc : '?');
+            }
+        }
+        break;
+    default:
+        std::cerr << "error: unknown type " << c << "\n";
+        exit(1);
+    case -1:
+        break;
+    }
+}
+
+
+inline void Parser::copy_byte(int c) {
+    rawCall->data += (char)c;
+}
+
+
+void Parser::copy_uint(unsigned long long value) {
+    do {
+        char c = value & 0x7f;
+        value >>= 7;
+        if (value) {
+            c |= 0x80;
+        }
+        rawCall->data += c;
+    } while (value);
+}
+
+
+void Parser::copy_sint(signed long long value) {
+    if (value < 0) {
+        copy_byte(trace::TYPE_SINT);
+        copy_uint(-value);
+    } else {
+        copy_byte(trace::TYPE_UINT);
+        copy_uint(value);
+    }
+}
+
+
+void Parser::copy_bytes(size_t length) {
+    std::string &data = rawCall->data;
+    size_t offset = data.size();
+    data.resize(offset + length);
+    if (length) {
+        size_t read = file->read(&data[offset], length);
+        data.resize(offset + read);
+    }
+}
+
+
+RawCall::SigRef &Parser::copy_sig(RawCall::SigKind kind) {
+    RawCall::SigRef ref;
+    ref.offset = rawCall->data.size();
+    ref.kind = kind;
+    rawCall->sigs.push_back(ref);
+    return rawCall->sigs.back();
+}
+
+
 const char * Parser::read_string(void) {
     size_t len = read_uint();
     char * value = new char[len + 1];
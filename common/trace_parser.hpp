@@ -29,6 +29,8 @@
 
 #include <iostream>
 #include <list>
+#include <map>
+#include <string>
 
 #include "trace_file.hpp"
 #include "trace_format.hpp"
@@ -39,6 +41,9 @@
 namespace trace {
 
 
+class IndexWriter;
+
+
 struct ParseBookmark
 {
     File::Offset offset;
@@ -48,13 +53,22 @@ struct ParseBookmark
 
 class Parser
 {
+public:
+    /**
+     * Hook invoked as each function signature is defined, so that parser
+     * users can resolve whatever they need about it once, rather than on
+     * every call.  The returned pointer is attached to the signature.
+     */
+    typedef void *(*FunctionSigHook)(const FunctionSig *sig, void *param);
+
 protected:
     File *file;
 
     enum Mode {
         FULL = 0,
         SCAN,
-        SKIP
+        SKIP,
+        RAW
     };
 
     typedef std::list<Call *> CallList;
@@ -62,6 +76,7 @@ protected:
 
     struct FunctionSigFlags : public FunctionSig {
         CallFlags flags;
+        void *hookData;
     };
 
     // Helper template that extends a base signature structure, with additional
@@ -79,23 +94,77 @@ protected:
     typedef SigState<EnumSig> EnumSigState;
     typedef SigState<BitmaskSig> BitmaskSigState;
     typedef SigState<StackFrame> StackFrameState;
+    typedef SigState<Stack> StackState;
 
     typedef std::vector<FunctionSigState *> FunctionMap;
     typedef std::vector<StructSigState *> StructMap;
     typedef std::vector<EnumSigState *> EnumMap;
     typedef std::vector<BitmaskSigState *> BitmaskMap;
     typedef std::vector<StackFrameState *> StackFrameMap;
+    typedef std::vector<StackState *> StackMap;
 
     FunctionMap functions;
     StructMap structs;
     EnumMap enums;
     BitmaskMap bitmasks;
     StackFrameMap frames;
+    StackMap stacks;
 
     FunctionSig *glGetErrorSig;
 
+    FunctionSigHook functionSigHook;
+    void *functionSigHookParam;
+
+    /**
+     * Where the contents of a blob that may be referred to lie.
+     */
+    struct BlobLocation {
+        size_t size;
+        File::Offset offset;
+    };
+
+    /**
+     * The blobs each thread may refer to, in the same direct mapped tables
+     * the writer keeps -- see Writer::BlobDigests -- so that those it can no
+     * longer refer to are forgotten.  Only the slots written are stored, as
+     * traces may have many threads.  The contents of recently referred
+     * blobs are kept in memory.
+     */
+    struct BlobSlot {
+        BlobDigest digest;
+        BlobLocation location;
+        File::Chunk *contents;
+        bool referred;
+    };
+    typedef std::map<unsigned, BlobSlot> BlobTable;
+    std::vector<BlobTable> blobTables;
+    size_t blobCacheSize;
+
+    /**
+     * Thread of the event being parsed, whose table blobs go in.
+     */
+    unsigned blobThread;
+
+    /**
+     * Blobs referred to at least once, by digest.  After seeking back, or
+     * once primed from the trace index, references to blobs the tables
+     * don't hold any more are resolved from here.
+     */
+    typedef std::map<BlobDigest, BlobLocation> BlobMap;
+    BlobMap referredBlobs;
+
     unsigned next_call_no;
 
+    /**
+     * Arena of the call being parsed, from which its values are allocated.
+     */
+    Arena *arena;
+
+    /**
+     * Encoded details of the call being parsed, in RAW mode.
+     */
+    RawCall *rawCall;
+
 public:
     unsigned long long version;
     API api;
@@ -130,17 +199,68 @@ public:
         return parse_call(SCAN);
     }
 
+    /**
+     * Parse a call keeping its details encoded, for copying them to another
+     * trace with Writer::writeCall.  Only the call number, thread, signature
+     * and flags are available.
+     */
+    Call *parse_raw_call() {
+        return parse_call(RAW);
+    }
+
+    /**
+     * Set the hook for the function signatures defined from now on, and run
+     * it over those defined so far.
+     */
+    void setFunctionSigHook(FunctionSigHook hook, void *param);
+
+    /**
+     * Data attached by the hook to the signature of a call returned by a
+     * parser.
+     */
+    static inline void *
+    getFunctionSigData(const FunctionSig *sig) {
+        return static_cast<const FunctionSigFlags *>(sig)->hookData;
+    }
+
+    /**
+     * Whether any call was entered but not left yet.
+     */
+    bool hasPendingCalls() const {
+        return !calls.empty();
+    }
+
+    /**
+     * Serialize all signatures and referred blobs parsed so far, for the
+     * trace index.
+     */
+    void exportSignatures(IndexWriter &writer) const;
+
+    /**
+     * Prime a freshly opened parser with the signatures saved in the trace
+     * index, so that bookmarks anywhere in the trace can be set straight away.
+     */
+    bool importSignatures(const std::string &data);
+
+    /**
+     * Flags of the function with the given name.
+     */
+    static CallFlags
+    lookupCallFlags(const char *name);
+
 protected:
+    void clear_signatures(void);
+    void clear_blobs(void);
+    void clear_blob_cache(void);
+
     Call *parse_call(Mode mode);
 
     FunctionSigFlags *parse_function_sig(void);
+    void setup_function_sig(FunctionSigState *sig);
     StructSig *parse_struct_sig();
     EnumSig *parse_old_enum_sig();
     EnumSig *parse_enum_sig();
     BitmaskSig *parse_bitmask_sig();
-    
-    static CallFlags
-    lookupCallFlags(const char *name);
 
     Call *parse_Call(Mode mode);
 
@@ -149,9 +269,11 @@ protected:
     Call *parse_leave(Mode mode);
 
     bool parse_call_details(Call *call, Mode mode);
+    bool copy_call_details(Call *call);
 
     bool parse_call_backtrace(Call *call, Mode mode);
     StackFrame * parse_backtrace_frame(Mode mode);
+    Stack * parse_stack(Mode mode);
 
     void adjust_call_flags(Call *call);
 
@@ -192,8 +314,18 @@ protected:
     Value *parse_array(void);
     void scan_array(void);
 
-    Value *parse_blob(void);
-    void scan_blob(void);
+    PackedArray::Kind read_packed_array_type(size_t &elementSize);
+    Value *parse_packed_array(void);
+    void scan_packed_array(void);
+
+    Value *parse_blob(int type);
+    void scan_blob(int type);
+
+    BlobDigest read_digest(void);
+    BlobSlot *get_blob_slot(const BlobDigest &digest);
+    void add_blob(const BlobDigest &digest, size_t size);
+    BlobSlot *refer_blob(const BlobDigest &digest, size_t size);
+    File::Chunk *lookup_blob(const BlobDigest &digest, size_t size);
 
     Value *parse_struct();
     void scan_struct();
@@ -207,6 +339,13 @@ protected:
     Value *parse_wstring();
     void scan_wstring();
 
+    void copy_value(void);
+    inline void copy_byte(int c);
+    void copy_uint(unsigned long long value);
+    void copy_sint(signed long long value);
+    void copy_bytes(size_t length);
+    RawCall::SigRef &copy_sig(RawCall::SigKind kind);
+
     const char * read_string(void);
     void skip_string(void);
 
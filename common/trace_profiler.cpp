@@ -26,11 +26,20 @@
 
 #include "trace_profiler.hpp"
 #include "os_time.hpp"
+#include "os_binary.hpp"
 #include <iostream>
 #include <string.h>
-#include <sstream>
+#include <stdio.h>
 
 namespace trace {
+
+#define PROFILE_MAGIC_LENGTH (sizeof PROFILE_MAGIC - 1)
+
+/*
+ * Binary events are flushed once this much is buffered, or at frame ends.
+ */
+#define PROFILE_BUFFER_SIZE (64*1024)
+
 Profiler::Profiler()
     : baseGpuTime(0),
       baseCpuTime(0),
@@ -40,22 +49,32 @@ Profiler::Profiler()
       cpuTimes(false),
       gpuTimes(true),
       pixelsDrawn(false),
-      memoryUsage(false)
+      memoryUsage(false),
+      binary(false),
+      out(std::cout.rdbuf())
 {
 }
 
 Profiler::~Profiler()
 {
+    flush();
 }
 
-void Profiler::setup(bool cpuTimes_, bool gpuTimes_, bool pixelsDrawn_, bool memoryUsage_)
+void Profiler::setup(bool cpuTimes_, bool gpuTimes_, bool pixelsDrawn_, bool memoryUsage_, bool binary_)
 {
     cpuTimes = cpuTimes_;
     gpuTimes = gpuTimes_;
     pixelsDrawn = pixelsDrawn_;
     memoryUsage = memoryUsage_;
+    binary = binary_;
 
-    std::cout << "# call no gpu_start gpu_dura cpu_start cpu_dura vsize_start vsize_dura rss_start rss_dura pixels program name" << std::endl;
+    if (binary) {
+        os::setBinaryMode(stdout);
+        buffer.append(PROFILE_MAGIC, PROFILE_MAGIC_LENGTH);
+    } else {
+        writeHeader(out);
+        out.flush();
+    }
 }
 
 int64_t Profiler::getBaseCpuTime()
@@ -103,6 +122,23 @@ bool Profiler::hasBaseTimes()
     return baseCpuTime != 0 || baseGpuTime != 0;
 }
 
+void Profiler::writeUInt(uint64_t value)
+{
+    do {
+        char c = value & 0x7f;
+        value >>= 7;
+        if (value) {
+            c |= 0x80;
+        }
+        buffer += c;
+    } while (value);
+}
+
+void Profiler::writeSInt(int64_t value)
+{
+    writeUInt(((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+}
+
 void Profiler::addCall(unsigned no,
                        const char *name,
                        unsigned program,
@@ -141,120 +177,466 @@ void Profiler::addCall(unsigned no,
         rssDuration = 0;
     }
 
-    std::cout << "call"
-              << " " << no
-              << " " << gpuStart
-              << " " << gpuDuration
-              << " " << cpuStart
-              << " " << cpuDuration
-              << " " << vsizeStart
-              << " " << vsizeDuration
-              << " " << rssStart
-              << " " << rssDuration
-              << " " << pixels
-              << " " << program
-              << " " << name
-              << std::endl;
+    if (!binary) {
+        call.no = no;
+        call.program = program;
+        call.gpuStart = gpuStart;
+        call.gpuDuration = gpuDuration;
+        call.cpuStart = cpuStart;
+        call.cpuDuration = cpuDuration;
+        call.vsizeStart = vsizeStart;
+        call.vsizeDuration = vsizeDuration;
+        call.rssStart = rssStart;
+        call.rssDuration = rssDuration;
+        call.pixels = pixels;
+        call.name = name;
+        writeCall(out, call);
+        out.flush();
+        return;
+    }
+
+    buffer += (char)PROFILE_CALL;
+    writeSInt((int64_t)no - (int64_t)lastCall.no);
+
+    // Signature names outlive the calls, but not necessarily the trace they
+    // came from, so check the name itself too.
+    NameMap::iterator it = nameIds.find(name);
+    if (it != nameIds.end() && names[it->second] == name) {
+        writeUInt(it->second);
+    } else {
+        unsigned id = unsigned(names.size());
+        names.push_back(name);
+        nameIds[name] = id;
+        size_t length = names.back().length();
+        writeUInt(id);
+        writeUInt(length);
+        buffer.append(name, length);
+    }
+
+    writeUInt(program);
+    writeSInt(pixels);
+    writeSInt(gpuStart - lastCall.gpuStart);
+    writeSInt(gpuDuration);
+    writeSInt(cpuStart - lastCall.cpuStart);
+    writeSInt(cpuDuration);
+    writeSInt(vsizeStart - lastCall.vsizeStart);
+    writeSInt(vsizeDuration);
+    writeSInt(rssStart - lastCall.rssStart);
+    writeSInt(rssDuration);
+
+    lastCall.no = no;
+    lastCall.gpuStart = gpuStart;
+    lastCall.cpuStart = cpuStart;
+    lastCall.vsizeStart = vsizeStart;
+    lastCall.rssStart = rssStart;
+
+    if (buffer.size() >= PROFILE_BUFFER_SIZE) {
+        flush();
+    }
 }
 
 void Profiler::addFrameEnd()
 {
-    std::cout << "frame_end" << std::endl;
+    if (binary) {
+        buffer += (char)PROFILE_FRAME_END;
+    } else {
+        writeFrameEnd(out);
+    }
+    flush();
+}
+
+void Profiler::flush()
+{
+    if (!buffer.empty()) {
+        out.write(buffer.data(), buffer.size());
+        buffer.clear();
+    }
+    out.flush();
+}
+
+void Profiler::writeHeader(std::ostream &os)
+{
+    os << "# call no gpu_start gpu_dura cpu_start cpu_dura vsize_start vsize_dura rss_start rss_dura pixels program name\n";
+}
+
+void Profiler::writeCall(std::ostream &os, const Profile::Call &call)
+{
+    os << "call"
+       << " " << call.no
+       << " " << call.gpuStart
+       << " " << call.gpuDuration
+       << " " << call.cpuStart
+       << " " << call.cpuDuration
+       << " " << call.vsizeStart
+       << " " << call.vsizeDuration
+       << " " << call.rssStart
+       << " " << call.rssDuration
+       << " " << call.pixels
+       << " " << call.program
+       << " " << call.name
+       << "\n";
+}
+
+void Profiler::writeFrameEnd(std::ostream &os)
+{
+    os << "frame_end\n";
 }
 
 void Profiler::parseLine(const char* in, Profile* profile)
 {
-    std::stringstream line(in, std::ios_base::in);
-    std::string type;
-    static int64_t lastGpuTime;
-    static int64_t lastCpuTime;
-    static int64_t lastVsizeUsage;
-    static int64_t lastRssUsage;
+    static ProfileBuilder *builder = NULL;
+    static Profile *builderProfile = NULL;
+
+    if (!builder || builderProfile != profile ||
+        (profile->programs.size() == 0 && profile->calls.size() == 0 && profile->frames.size() == 0)) {
+        delete builder;
+        builder = new ProfileBuilder(profile);
+        builderProfile = profile;
+    }
+
+    builder->parseLine(in, in + strlen(in));
+}
 
-    if (in[0] == '#' || strlen(in) < 4)
-        return;
 
-    if (profile->programs.size() == 0 && profile->calls.size() == 0 && profile->frames.size() == 0) {
-        lastGpuTime = 0;
-        lastCpuTime = 0;
-        lastVsizeUsage = 0;
-        lastRssUsage = 0;
+ProfileParser::ProfileParser() :
+    format(FORMAT_UNKNOWN),
+    failed(false)
+{
+}
+
+ProfileParser::~ProfileParser()
+{
+}
+
+void ProfileParser::parse(const char *data, size_t size)
+{
+    if (pending.empty()) {
+        size_t consumed = parseSome(data, size);
+        pending.assign(data + consumed, size - consumed);
+    } else {
+        pending.append(data, size);
+        size_t consumed = parseSome(pending.data(), pending.size());
+        pending.erase(0, consumed);
     }
+}
 
-    line >> type;
+bool ProfileParser::finish(void)
+{
+    if (format == FORMAT_TEXT && !pending.empty()) {
+        // Last line without a line break
+        parseLine(pending.data(), pending.data() + pending.size());
+        pending.clear();
+    }
+    return !failed && pending.empty();
+}
 
-    if (type.compare("call") == 0) {
-        Profile::Call call;
+size_t ProfileParser::parseSome(const char *data, size_t size)
+{
+    if (failed) {
+        return size;
+    }
 
-        line >> call.no
-             >> call.gpuStart
-             >> call.gpuDuration
-             >> call.cpuStart
-             >> call.cpuDuration
-             >> call.vsizeStart
-             >> call.vsizeDuration
-             >> call.rssStart
-             >> call.rssDuration
-             >> call.pixels
-             >> call.program
-             >> call.name;
-
-        if (lastGpuTime < call.gpuStart + call.gpuDuration) {
-            lastGpuTime = call.gpuStart + call.gpuDuration;
+    size_t consumed = 0;
+    if (format == FORMAT_UNKNOWN) {
+        if (size < PROFILE_MAGIC_LENGTH &&
+            memcmp(data, PROFILE_MAGIC, size) == 0) {
+            // Wait for the rest of the magic
+            return 0;
         }
-
-        if (lastCpuTime < call.cpuStart + call.cpuDuration) {
-            lastCpuTime = call.cpuStart + call.cpuDuration;
+        if (size >= PROFILE_MAGIC_LENGTH &&
+            memcmp(data, PROFILE_MAGIC, PROFILE_MAGIC_LENGTH) == 0) {
+            format = FORMAT_BINARY;
+            consumed = PROFILE_MAGIC_LENGTH;
+        } else {
+            format = FORMAT_TEXT;
         }
+    }
+
+    if (format == FORMAT_BINARY) {
+        consumed += parseEvents(data + consumed, size - consumed);
+    } else {
+        consumed += parseLines(data + consumed, size - consumed);
+    }
+    return consumed;
+}
+
+size_t ProfileParser::parseLines(const char *data, size_t size)
+{
+    const char *p = data;
+    const char *end = data + size;
+    const char *eol;
+    while ((eol = (const char *)memchr(p, '\n', end - p)) != NULL) {
+        parseLine(p, eol);
+        p = eol + 1;
+    }
+    return p - data;
+}
+
+static inline bool
+isSpace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
 
-        if (lastVsizeUsage < call.vsizeStart + call.vsizeDuration) {
-            lastVsizeUsage = call.vsizeStart + call.vsizeDuration;
+static inline const char *
+skipSpace(const char *p, const char *end)
+{
+    while (p < end && isSpace(*p)) {
+        ++p;
+    }
+    return p;
+}
+
+template< class T >
+static inline const char *
+parseInt(const char *p, const char *end, T &value)
+{
+    p = skipSpace(p, end);
+    bool negative = p < end && *p == '-';
+    if (negative) {
+        ++p;
+    }
+    T result = 0;
+    while (p < end && *p >= '0' && *p <= '9') {
+        result = result * 10 + (*p - '0');
+        ++p;
+    }
+    value = negative ? -result : result;
+    return p;
+}
+
+void ProfileParser::parseLine(const char *line, const char *end)
+{
+    if (end - line < 4 || line[0] == '#') {
+        return;
+    }
+
+    const char *p = skipSpace(line, end);
+    const char *type = p;
+    while (p < end && !isSpace(*p)) {
+        ++p;
+    }
+    size_t typeLength = p - type;
+
+    if (typeLength == 4 && memcmp(type, "call", 4) == 0) {
+        Profile::Call call;
+        p = parseInt(p, end, call.no);
+        p = parseInt(p, end, call.gpuStart);
+        p = parseInt(p, end, call.gpuDuration);
+        p = parseInt(p, end, call.cpuStart);
+        p = parseInt(p, end, call.cpuDuration);
+        p = parseInt(p, end, call.vsizeStart);
+        p = parseInt(p, end, call.vsizeDuration);
+        p = parseInt(p, end, call.rssStart);
+        p = parseInt(p, end, call.rssDuration);
+        p = parseInt(p, end, call.pixels);
+        p = parseInt(p, end, call.program);
+        p = skipSpace(p, end);
+        const char *name = p;
+        while (p < end && !isSpace(*p)) {
+            ++p;
         }
+        call.name.assign(name, p - name);
+        handleCall(call);
+    } else if (typeLength == 9 && memcmp(type, "frame_end", 9) == 0) {
+        handleFrameEnd();
+    }
+}
 
-        if (lastRssUsage < call.rssStart + call.rssDuration) {
-            lastRssUsage = call.rssStart + call.rssDuration;
+static inline bool
+readUInt(const char *&p, const char *end, uint64_t &value)
+{
+    value = 0;
+    unsigned shift = 0;
+    while (p < end) {
+        unsigned char c = *p++;
+        value |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            return true;
         }
+        shift += 7;
+    }
+    return false;
+}
 
-        profile->calls.push_back(call);
+static inline bool
+readSInt(const char *&p, const char *end, int64_t &value)
+{
+    uint64_t zigzag;
+    if (!readUInt(p, end, zigzag)) {
+        return false;
+    }
+    value = (int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1);
+    return true;
+}
 
-        if (call.pixels >= 0) {
-            if (profile->programs.size() <= call.program) {
-                profile->programs.resize(call.program + 1);
-            }
+size_t ProfileParser::parseEvents(const char *data, size_t size)
+{
+    const char *p = data;
+    const char *end = data + size;
+    while (p < end && parseEvent(p, end)) {
+    }
+    if (failed) {
+        return size;
+    }
+    return p - data;
+}
+
+/*
+ * Parse a single event, advancing p past it, or return false leaving p
+ * untouched if it is incomplete.
+ */
+bool ProfileParser::parseEvent(const char *&p, const char *end)
+{
+    const char *q = p;
+    int event = (unsigned char)*q++;
+
+    if (event == PROFILE_FRAME_END) {
+        p = q;
+        handleFrameEnd();
+        return true;
+    }
+
+    if (event != PROFILE_CALL) {
+        std::cerr << "error: unexpected profile event " << event << "\n";
+        failed = true;
+        return false;
+    }
 
-            Profile::Program& program = profile->programs[call.program];
-            program.cpuTotal += call.cpuDuration;
-            program.gpuTotal += call.gpuDuration;
-            program.pixelTotal += call.pixels;
-            program.vsizeTotal += call.vsizeDuration;
-            program.rssTotal += call.rssDuration;
-            program.calls.push_back((unsigned int)(profile->calls.size() - 1));
+    int64_t noDelta;
+    uint64_t nameId;
+    if (!readSInt(q, end, noDelta) ||
+        !readUInt(q, end, nameId)) {
+        return false;
+    }
+
+    const char *name = NULL;
+    uint64_t nameLength = 0;
+    if (nameId == names.size()) {
+        if (!readUInt(q, end, nameLength) ||
+            (uint64_t)(end - q) < nameLength) {
+            return false;
         }
-    } else if (type.compare("frame_end") == 0) {
-        Profile::Frame frame;
-        frame.no = unsigned(profile->frames.size());
-
-        if (frame.no == 0) {
-            frame.gpuStart = 0;
-            frame.cpuStart = 0;
-            frame.vsizeStart = 0;
-            frame.rssStart = 0;
-            frame.calls.begin = 0;
-        } else {
-            frame.gpuStart = profile->frames.back().gpuStart + profile->frames.back().gpuDuration;
-            frame.cpuStart = profile->frames.back().cpuStart + profile->frames.back().cpuDuration;
-            frame.vsizeStart = profile->frames.back().vsizeStart + profile->frames.back().vsizeDuration;
-            frame.rssStart = profile->frames.back().rssStart + profile->frames.back().rssDuration;
-            frame.calls.begin = profile->frames.back().calls.end + 1;
+        name = q;
+        q += nameLength;
+    } else if (nameId > names.size()) {
+        std::cerr << "error: unexpected profile name " << nameId << "\n";
+        failed = true;
+        return false;
+    }
+
+    uint64_t program;
+    int64_t pixels;
+    int64_t gpuStartDelta, cpuStartDelta, vsizeStartDelta, rssStartDelta;
+    Profile::Call &call = lastCall;
+    Profile::Call next;
+    if (!readUInt(q, end, program) ||
+        !readSInt(q, end, pixels) ||
+        !readSInt(q, end, gpuStartDelta) ||
+        !readSInt(q, end, next.gpuDuration) ||
+        !readSInt(q, end, cpuStartDelta) ||
+        !readSInt(q, end, next.cpuDuration) ||
+        !readSInt(q, end, vsizeStartDelta) ||
+        !readSInt(q, end, next.vsizeDuration) ||
+        !readSInt(q, end, rssStartDelta) ||
+        !readSInt(q, end, next.rssDuration)) {
+        return false;
+    }
+
+    p = q;
+
+    if (name) {
+        names.push_back(std::string(name, nameLength));
+    }
+
+    call.no = unsigned(call.no + noDelta);
+    call.program = unsigned(program);
+    call.pixels = pixels;
+    call.gpuStart += gpuStartDelta;
+    call.gpuDuration = next.gpuDuration;
+    call.cpuStart += cpuStartDelta;
+    call.cpuDuration = next.cpuDuration;
+    call.vsizeStart += vsizeStartDelta;
+    call.vsizeDuration = next.vsizeDuration;
+    call.rssStart += rssStartDelta;
+    call.rssDuration = next.rssDuration;
+    call.name = names[nameId];
+
+    handleCall(call);
+    return true;
+}
+
+
+ProfileBuilder::ProfileBuilder(Profile *profile_) :
+    profile(profile_),
+    lastGpuTime(0),
+    lastCpuTime(0),
+    lastVsizeUsage(0),
+    lastRssUsage(0)
+{
+}
+
+void ProfileBuilder::handleCall(const Profile::Call &call)
+{
+    if (lastGpuTime < call.gpuStart + call.gpuDuration) {
+        lastGpuTime = call.gpuStart + call.gpuDuration;
+    }
+
+    if (lastCpuTime < call.cpuStart + call.cpuDuration) {
+        lastCpuTime = call.cpuStart + call.cpuDuration;
+    }
+
+    if (lastVsizeUsage < call.vsizeStart + call.vsizeDuration) {
+        lastVsizeUsage = call.vsizeStart + call.vsizeDuration;
+    }
+
+    if (lastRssUsage < call.rssStart + call.rssDuration) {
+        lastRssUsage = call.rssStart + call.rssDuration;
+    }
+
+    profile->calls.push_back(call);
+
+    if (call.pixels >= 0) {
+        if (profile->programs.size() <= call.program) {
+            profile->programs.resize(call.program + 1);
         }
 
-        frame.gpuDuration = lastGpuTime - frame.gpuStart;
-        frame.cpuDuration = lastCpuTime - frame.cpuStart;
-        frame.vsizeDuration = lastVsizeUsage - frame.vsizeStart;
-        frame.rssDuration = lastRssUsage - frame.rssStart;
-        frame.calls.end = (unsigned int)(profile->calls.size() - 1);
+        Profile::Program& program = profile->programs[call.program];
+        program.cpuTotal += call.cpuDuration;
+        program.gpuTotal += call.gpuDuration;
+        program.pixelTotal += call.pixels;
+        program.vsizeTotal += call.vsizeDuration;
+        program.rssTotal += call.rssDuration;
+        program.calls.push_back((unsigned int)(profile->calls.size() - 1));
+    }
+}
 
-        profile->frames.push_back(frame);
+void ProfileBuilder::handleFrameEnd(void)
+{
+    Profile::Frame frame;
+    frame.no = unsigned(profile->frames.size());
+
+    if (frame.no == 0) {
+        frame.gpuStart = 0;
+        frame.cpuStart = 0;
+        frame.vsizeStart = 0;
+        frame.rssStart = 0;
+        frame.calls.begin = 0;
+    } else {
+        frame.gpuStart = profile->frames.back().gpuStart + profile->frames.back().gpuDuration;
+        frame.cpuStart = profile->frames.back().cpuStart + profile->frames.back().cpuDuration;
+        frame.vsizeStart = profile->frames.back().vsizeStart + profile->frames.back().vsizeDuration;
+        frame.rssStart = profile->frames.back().rssStart + profile->frames.back().rssDuration;
+        frame.calls.begin = profile->frames.back().calls.end + 1;
     }
+
+    frame.gpuDuration = lastGpuTime - frame.gpuStart;
+    frame.cpuDuration = lastCpuTime - frame.cpuStart;
+    frame.vsizeDuration = lastVsizeUsage - frame.vsizeStart;
+    frame.rssDuration = lastRssUsage - frame.rssStart;
+    frame.calls.end = (unsigned int)(profile->calls.size() - 1);
+
+    profile->frames.push_back(frame);
 }
+
 }
@@ -27,6 +27,8 @@
 #ifndef TRACE_PROFILER_H
 #define TRACE_PROFILER_H
 
+#include <ostream>
+#include <map>
 #include <string>
 #include <vector>
 #include <stdint.h>
@@ -34,8 +36,40 @@
 namespace trace
 {
 
+/*
+ * Binary profile stream, a compact alternative to the text lines.
+ *
+ * It starts with PROFILE_MAGIC, followed by events, each made of a byte
+ * identifying it and of variable length integers encoded as in the trace
+ * format, signed ones being zigzag encoded:
+ *
+ *   call = PROFILE_CALL no_delta name program pixels
+ *          gpu_start_delta gpu_dura cpu_start_delta cpu_dura
+ *          vsize_start_delta vsize_dura rss_start_delta rss_dura
+ *   name = id [length chars]   // only on its first use
+ *   frame_end = PROFILE_FRAME_END
+ *
+ * Call numbers and start values are deltas from the previous call's.  Names
+ * are numbered in order of appearance.
+ */
+#define PROFILE_MAGIC "\x89" "apiprof"
+
+enum ProfileEvent {
+    PROFILE_CALL = 1,
+    PROFILE_FRAME_END
+};
+
 struct Profile {
     struct Call {
+        Call() :
+            no(0), program(0),
+            gpuStart(0), gpuDuration(0),
+            cpuStart(0), cpuDuration(0),
+            vsizeStart(0), vsizeDuration(0),
+            rssStart(0), rssDuration(0),
+            pixels(0)
+        {}
+
         unsigned no;
 
         unsigned program;
@@ -78,7 +112,7 @@ struct Profile {
     };
 
     struct Program {
-        Program() : gpuTotal(0), cpuTotal(0), pixelTotal(0) {}
+        Program() : gpuTotal(0), cpuTotal(0), pixelTotal(0), vsizeTotal(0), rssTotal(0) {}
 
         uint64_t gpuTotal;
         uint64_t cpuTotal;
@@ -101,7 +135,7 @@ public:
     Profiler();
     ~Profiler();
 
-    void setup(bool cpuTimes_, bool gpuTimes_, bool pixelsDrawn_, bool memoryUsage_);
+    void setup(bool cpuTimes_, bool gpuTimes_, bool pixelsDrawn_, bool memoryUsage_, bool binary_ = false);
 
     void addCall(unsigned no,
                  const char* name,
@@ -114,6 +148,8 @@ public:
 
     void addFrameEnd();
 
+    void flush();
+
     bool hasBaseTimes();
 
     void setBaseCpuTime(int64_t cpuStart);
@@ -128,6 +164,10 @@ public:
 
     static void parseLine(const char* line, Profile* profile);
 
+    static void writeHeader(std::ostream &os);
+    static void writeCall(std::ostream &os, const Profile::Call &call);
+    static void writeFrameEnd(std::ostream &os);
+
 private:
     int64_t baseGpuTime;
     int64_t baseCpuTime;
@@ -139,7 +179,93 @@ private:
     bool gpuTimes;
     bool pixelsDrawn;
     bool memoryUsage;
+    bool binary;
+
+    /* Stream on the stdout the profile was set up with, which stays put when
+     * std::cout gets redirected. */
+    std::ostream out;
+
+    std::string buffer;
+    Profile::Call call;
+    Profile::Call lastCall;
+    typedef std::map<const char *, unsigned> NameMap;
+    NameMap nameIds;
+    std::vector<std::string> names;
+
+    void writeUInt(uint64_t value);
+    void writeSInt(int64_t value);
 };
+
+
+/**
+ * Incremental parser of the profiles written by Profiler, in either format.
+ */
+class ProfileParser
+{
+public:
+    ProfileParser();
+    virtual ~ProfileParser();
+
+    /**
+     * Parse the next bytes of the profile, as they come.
+     */
+    void parse(const char *data, size_t size);
+
+    /**
+     * Parse a single line of a text profile.
+     */
+    void parseLine(const char *line, const char *end);
+
+    /**
+     * Whether all bytes were consumed by complete events.
+     */
+    bool finish(void);
+
+protected:
+    virtual void handleCall(const Profile::Call &call) = 0;
+    virtual void handleFrameEnd(void) = 0;
+
+private:
+    enum {
+        FORMAT_UNKNOWN,
+        FORMAT_TEXT,
+        FORMAT_BINARY
+    } format;
+    bool failed;
+
+    std::string pending;
+    Profile::Call lastCall;
+    std::vector<std::string> names;
+
+    size_t parseSome(const char *data, size_t size);
+    size_t parseLines(const char *data, size_t size);
+    size_t parseEvents(const char *data, size_t size);
+    bool parseEvent(const char *&p, const char *end);
+};
+
+
+/**
+ * Parser that accumulates the profile into a Profile structure, with
+ * per-frame and per-program totals.
+ */
+class ProfileBuilder : public ProfileParser
+{
+public:
+    ProfileBuilder(Profile *profile);
+
+protected:
+    void handleCall(const Profile::Call &call);
+    void handleFrameEnd(void);
+
+private:
+    Profile *profile;
+
+    int64_t lastGpuTime;
+    int64_t lastCpuTime;
+    int64_t lastVsizeUsage;
+    int64_t lastRssUsage;
+};
+
 }
 
 #endif // TRACE_PROFILER_H
@@ -0,0 +1,286 @@
+/**************************************************************************
+ *
+ * Copyright 2015 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+
+#include <assert.h>
+
+#include <vector>
+
+#include "os_thread.hpp"
+#include "trace_scanner.hpp"
+
+
+/*
+ * Number of index call bookmarks, and therefore of file chunks, per range.
+ * Each range starts by decompressing its first chunk, and usually ends in
+ * the middle of the chunk after its last, so ranges should span a few.
+ */
+#define SCANNER_RANGE_CHUNKS 4
+
+
+namespace trace {
+
+
+namespace {
+
+
+enum RangeState {
+    RANGE_PENDING,
+    RANGE_DONE,
+    RANGE_FAILED
+};
+
+
+struct Range {
+    const ParseBookmark *start;
+    const ParseBookmark *end;
+    RangeVisitor *visitor;
+    RangeState state;
+};
+
+
+typedef os::unique_lock<os::mutex> Lock;
+
+
+/*
+ * State shared between the calling thread and the workers.
+ */
+struct ScanState {
+    const char *filename;
+    const Index *index;
+    bool parse;
+
+    std::vector<Range> ranges;
+
+    os::mutex mutex;
+    os::condition_variable rangePending;
+    os::condition_variable rangeDone;
+
+    // Ranges before this one were given a visitor
+    size_t numSubmitted;
+    // Ranges before this one were taken by a worker
+    size_t numTaken;
+    bool stop;
+};
+
+
+} /* anonymous namespace */
+
+
+static bool
+openParser(Parser &parser, const ScanState &state)
+{
+    return parser.open(state.filename) &&
+           parser.importSignatures(state.index->signatures);
+}
+
+
+static void
+scanRange(Parser &parser, Range &range, bool parse)
+{
+    parser.setBookmark(*range.start);
+
+    Call *call;
+    while ((call = parse ? parser.parse_call() : parser.scan_call())) {
+        range.visitor->visitCall(call);
+        delete call;
+
+        if (range.visitor->isDone() && !parser.hasPendingCalls()) {
+            break;
+        }
+
+        if (range.end) {
+            ParseBookmark bookmark;
+            parser.getBookmark(bookmark);
+            if (bookmark.offset >= range.end->offset) {
+                break;
+            }
+        }
+    }
+}
+
+
+static void *
+workerThread(void *arg)
+{
+    ScanState &state = *static_cast<ScanState *>(arg);
+
+    Parser parser;
+    bool opened = openParser(parser, state);
+
+    Lock lock(state.mutex);
+    while (!state.stop) {
+        if (state.numTaken < state.numSubmitted) {
+            Range &range = state.ranges[state.numTaken++];
+
+            lock.unlock();
+            if (opened) {
+                scanRange(parser, range, state.parse);
+            }
+            lock.lock();
+
+            range.state = opened ? RANGE_DONE : RANGE_FAILED;
+            state.rangeDone.signal();
+        } else {
+            state.rangePending.wait(lock);
+        }
+    }
+
+    // Wake up the next worker so that it stops too
+    state.rangePending.signal();
+
+    return 0;
+}
+
+
+ParallelScanner::ParallelScanner() :
+    cancelled(false)
+{
+}
+
+
+ParallelScanner::~ParallelScanner()
+{
+}
+
+
+bool
+ParallelScanner::scan(const char *filename,
+                      const Index &index,
+                      unsigned numThreads,
+                      bool parse,
+                      unsigned firstCallNo,
+                      unsigned lastCallNo)
+{
+    ScanState state;
+    state.filename = filename;
+    state.index = &index;
+    state.parse = parse;
+    state.numSubmitted = 0;
+    state.numTaken = 0;
+    state.stop = false;
+
+    cancelled = false;
+
+    // Start the ranges from the last bookmark before the first call
+    const std::vector<ParseBookmark> &bookmarks = index.callBookmarks;
+    size_t first = 0;
+    while (first + 1 < bookmarks.size() &&
+           bookmarks[first + 1].next_call_no <= firstCallNo) {
+        ++first;
+    }
+
+    for (size_t i = first; i < bookmarks.size(); i += SCANNER_RANGE_CHUNKS) {
+        Range range;
+        range.start = &bookmarks[i];
+        range.end = i + SCANNER_RANGE_CHUNKS < bookmarks.size() ? &bookmarks[i + SCANNER_RANGE_CHUNKS] : NULL;
+        range.visitor = NULL;
+        range.state = RANGE_PENDING;
+
+        if (range.start->next_call_no <= lastCallNo &&
+            (!range.end || range.end->next_call_no > firstCallNo)) {
+            state.ranges.push_back(range);
+        }
+    }
+
+    if (numThreads < 2) {
+        Parser parser;
+        if (!openParser(parser, state)) {
+            return false;
+        }
+        for (size_t i = 0; i < state.ranges.size(); ++i) {
+            Range &range = state.ranges[i];
+            range.visitor = createVisitor();
+            scanRange(parser, range, parse);
+            finishVisitor(range.visitor);
+            if (cancelled) {
+                break;
+            }
+        }
+        return true;
+    }
+
+    std::vector<os::thread> threads(numThreads);
+    for (unsigned i = 0; i < numThreads; ++i) {
+        threads[i] = os::thread(workerThread, &state);
+    }
+
+    // Bound the ranges in flight, as their visitors may accumulate a lot
+    size_t maxRanges = 2*numThreads;
+    size_t numFinished = 0;
+    bool failed = false;
+
+    {
+        Lock lock(state.mutex);
+        while (numFinished < state.ranges.size()) {
+            while (state.numSubmitted < state.ranges.size() &&
+                   state.numSubmitted - numFinished < maxRanges) {
+                lock.unlock();
+                RangeVisitor *visitor = createVisitor();
+                lock.lock();
+
+                state.ranges[state.numSubmitted++].visitor = visitor;
+                state.rangePending.signal();
+            }
+
+            Range &range = state.ranges[numFinished];
+            while (range.state == RANGE_PENDING) {
+                state.rangeDone.wait(lock);
+            }
+            if (range.state == RANGE_FAILED) {
+                failed = true;
+                break;
+            }
+
+            lock.unlock();
+            finishVisitor(range.visitor);
+            range.visitor = NULL;
+            lock.lock();
+
+            ++numFinished;
+
+            if (cancelled) {
+                break;
+            }
+        }
+
+        state.stop = true;
+        state.rangePending.signal();
+    }
+
+    for (unsigned i = 0; i < numThreads; ++i) {
+        threads[i].join();
+    }
+
+    // Discard the visitors of any ranges left behind on failure
+    for (size_t i = numFinished; i < state.numSubmitted; ++i) {
+        delete state.ranges[i].visitor;
+    }
+
+    return !failed;
+}
+
+
+} /* namespace trace */
@@ -0,0 +1,125 @@
+/**************************************************************************
+ *
+ * Copyright 2015 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+/*
+ * Parallel trace scanning.
+ */
+
+#ifndef _TRACE_SCANNER_HPP_
+#define _TRACE_SCANNER_HPP_
+
+
+#include "trace_index.hpp"
+
+
+namespace trace {
+
+
+/**
+ * Visitor of the calls in one range of the trace.
+ */
+class RangeVisitor
+{
+public:
+    virtual ~RangeVisitor() {}
+
+    /**
+     * Called from a worker thread for every call of the range, in the same
+     * order Parser would return them.  The call is deleted afterwards.
+     */
+    virtual void visitCall(Call *call) = 0;
+
+    /**
+     * Whether the rest of the range is of no interest.  Scanning then stops
+     * as soon as no call is pending, so that no lower numbered call is
+     * skipped.
+     */
+    virtual bool isDone(void) const {
+        return false;
+    }
+};
+
+
+/**
+ * Scan a trace on several threads, using the call bookmarks of its index.
+ *
+ * No call is pending at the index call bookmarks, so the ranges of calls
+ * between them are parsed independently, each by a single worker thread with
+ * its own parser primed with the index signatures.  Each range gets its own
+ * visitor, and visitors are created and finished in trace order on the calling
+ * thread, so results can be merged or output without sorting.
+ */
+class ParallelScanner
+{
+private:
+    bool cancelled;
+
+public:
+    ParallelScanner();
+    virtual ~ParallelScanner();
+
+    /**
+     * Scan the ranges that hold any of the calls from firstCallNo to
+     * lastCallNo, fully parsing the calls when parse is set.
+     *
+     * With less than two threads everything is done on the calling thread.
+     */
+    bool
+    scan(const char *filename,
+         const Index &index,
+         unsigned numThreads,
+         bool parse = false,
+         unsigned firstCallNo = 0,
+         unsigned lastCallNo = ~0U);
+
+protected:
+    /**
+     * Create the visitor of the next range.
+     */
+    virtual RangeVisitor *
+    createVisitor(void) = 0;
+
+    /**
+     * Called once all calls of the range were visited, taking ownership of
+     * the visitor.
+     */
+    virtual void
+    finishVisitor(RangeVisitor *visitor) = 0;
+
+    /**
+     * Stop scanning once the current visitor is finished, e.g. once the
+     * sought call was found.  The ranges already being scanned are
+     * discarded.
+     */
+    void
+    cancel(void) {
+        cancelled = true;
+    }
+};
+
+
+} /* namespace trace */
+
+#endif /* _TRACE_SCANNER_HPP_ */
@@ -0,0 +1,498 @@
+/**************************************************************************
+ *
+ * Copyright 2015 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+
+#include <stdarg.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "trace_scanner.hpp"
+#include "trace_search.hpp"
+
+
+/*
+ * Number of index call bookmarks, per thread, searched at once when
+ * searching backwards.
+ */
+#define SEARCH_WINDOW_BOOKMARKS 8
+
+
+namespace trace {
+
+
+static inline char
+toLower(char c) {
+    return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+
+/**
+ * Append a Unicode code point as UTF-8.
+ */
+static void
+appendUTF8(std::string &text, unsigned long c) {
+    if (c < 0x80) {
+        text += (char)c;
+    } else if (c < 0x800) {
+        text += (char)(0xc0 | (c >> 6));
+        text += (char)(0x80 | (c & 0x3f));
+    } else if (c < 0x10000) {
+        text += (char)(0xe0 | (c >> 12));
+        text += (char)(0x80 | ((c >> 6) & 0x3f));
+        text += (char)(0x80 | (c & 0x3f));
+    } else {
+        text += (char)(0xf0 | ((c >> 18) & 0x07));
+        text += (char)(0x80 | ((c >> 12) & 0x3f));
+        text += (char)(0x80 | ((c >> 6) & 0x3f));
+        text += (char)(0x80 | (c & 0x3f));
+    }
+}
+
+
+/**
+ * Renders values like the GUI does (see apiVariantToString), except that
+ * strings are not escaped for HTML.
+ */
+class TextRenderer : public Visitor
+{
+protected:
+    std::string &text;
+
+    void
+    format(const char *fmt, ...) {
+        char buf[64];
+        va_list ap;
+        va_start(ap, fmt);
+        int len = vsnprintf(buf, sizeof buf, fmt, ap);
+        va_end(ap);
+        if (len > 0) {
+            text.append(buf, std::min(len, (int)sizeof buf - 1));
+        }
+    }
+
+    template<class Char>
+    void
+    appendString(const Char *str) {
+        // Strings with whitespace are quoted, with newlines and tabs escaped
+        size_t start = text.size();
+        bool quote = false;
+        for (const Char *p = str; *p; ++p) {
+            switch (*p) {
+            case '\n':
+                text += "\\n";
+                quote = true;
+                break;
+            case '\t':
+                text += "\\t";
+                quote = true;
+                break;
+            case ' ':
+            case '\r':
+            case '\v':
+            case '\f':
+                text += ' ';
+                quote = true;
+                break;
+            default:
+                // Narrow strings are Latin-1
+                appendUTF8(text, sizeof(Char) == 1 ? (unsigned char)*p : (unsigned long)*p);
+                break;
+            }
+        }
+        if (quote) {
+            text.insert(start, 1, '"');
+            text += '"';
+        }
+    }
+
+public:
+    TextRenderer(std::string &_text) :
+        text(_text)
+    {}
+
+    void
+    visit(Null *) {
+        text += "NULL";
+    }
+
+    void
+    visit(Bool *node) {
+        text += node->value ? "true" : "false";
+    }
+
+    void
+    visit(SInt *node) {
+        format("%lli", node->value);
+    }
+
+    void
+    visit(UInt *node) {
+        format("%llu", node->value);
+    }
+
+    void
+    visit(Float *node) {
+        format("%g", node->value);
+    }
+
+    void
+    visit(Double *node) {
+        format("%g", node->value);
+    }
+
+    void
+    visit(String *node) {
+        appendString(node->value);
+    }
+
+    void
+    visit(WString *node) {
+        appendString(node->value);
+    }
+
+    void
+    visit(Enum *node) {
+        const EnumValue *it = node->lookup();
+        if (it) {
+            text += it->name;
+        } else {
+            format("%lli", node->value);
+        }
+    }
+
+    void
+    visit(Bitmask *bitmask) {
+        const BitmaskSig *sig = bitmask->sig;
+        unsigned long long value = bitmask->value;
+        bool first = true;
+        for (const BitmaskFlag *it = sig->flags; it != sig->flags + sig->num_flags; ++it) {
+            if ((it->value && (value & it->value) == it->value) ||
+                (!it->value && value == 0)) {
+                if (!first) {
+                    text += " | ";
+                }
+                text += it->name;
+                value &= ~it->value;
+                first = false;
+            }
+            if (value == 0) {
+                break;
+            }
+        }
+        if (value || first) {
+            if (!first) {
+                text += " | ";
+            }
+            format("0x%llx", value);
+        }
+    }
+
+    void
+    visit(Struct *s) {
+        text += '{';
+        for (unsigned i = 0; i < s->members.size(); ++i) {
+            if (i) {
+                text += ", ";
+            }
+            text += s->sig->member_names[i];
+            text += " = ";
+            _visit(s->members[i]);
+        }
+        text += '}';
+    }
+
+    void
+    visit(Array *array) {
+        text += '[';
+        for (unsigned i = 0; i < array->values.size(); ++i) {
+            if (i) {
+                text += ", ";
+            }
+            _visit(array->values[i]);
+        }
+        text += ']';
+    }
+
+    void
+    visit(Blob *blob) {
+        if (blob->size < 1024) {
+            format("[binary data, size = %u bytes]", (unsigned)blob->size);
+        } else {
+            format("[binary data, size = %g kb]", blob->size / 1024.);
+        }
+    }
+
+    void
+    visit(Pointer *p) {
+        if (p->value) {
+            format("0x%llx", p->value);
+        } else {
+            text += "NULL";
+        }
+    }
+
+    void
+    visit(Repr *r) {
+        _visit(r->humanValue);
+    }
+
+    void
+    render(Call *call) {
+        const FunctionSig *sig = call->sig;
+        text += sig->name;
+        text += '(';
+        for (unsigned i = 0; i < sig->num_args; ++i) {
+            if (i) {
+                text += ", ";
+            }
+            text += sig->arg_names[i];
+            text += " = ";
+            Value *value = i < call->args.size() ? call->args[i].value : NULL;
+            if (value) {
+                value->visit(*this);
+            } else {
+                text += '?';
+            }
+        }
+        text += ')';
+        if (call->ret) {
+            text += " = ";
+            call->ret->visit(*this);
+        }
+    }
+};
+
+
+CallMatcher::CallMatcher(const std::string &_pattern, bool _caseSensitive) :
+    pattern(_pattern),
+    caseSensitive(_caseSensitive),
+    foldedPattern(_pattern),
+    asciiPattern(true)
+{
+    for (size_t i = 0; i < foldedPattern.size(); ++i) {
+        char c = foldedPattern[i];
+        if (c & 0x80) {
+            asciiPattern = false;
+        } else {
+            foldedPattern[i] = toLower(c);
+        }
+    }
+}
+
+
+CallMatcher *
+CallMatcher::clone(void) const {
+    return new CallMatcher(*this);
+}
+
+
+bool
+CallMatcher::containsIgnoringCase(const std::string &foldedText) const {
+    return foldedText.find(foldedPattern) != std::string::npos;
+}
+
+
+bool
+CallMatcher::matches(Call *call) {
+    text.clear();
+    TextRenderer renderer(text);
+    renderer.render(call);
+
+    if (caseSensitive) {
+        return text.find(pattern) != std::string::npos;
+    }
+
+    // Folding ASCII letters is all it takes when neither has anything else
+    bool ascii = asciiPattern;
+    for (size_t i = 0; i < text.size(); ++i) {
+        char c = text[i];
+        if (c & 0x80) {
+            ascii = false;
+        } else {
+            text[i] = toLower(c);
+        }
+    }
+    if (ascii) {
+        return text.find(foldedPattern) != std::string::npos;
+    }
+    return containsIgnoringCase(text);
+}
+
+
+namespace {
+
+
+class SearchVisitor : public RangeVisitor
+{
+public:
+    CallMatcher *matcher;
+    bool backwards;
+    unsigned firstCallNo;
+    unsigned lastCallNo;
+
+    bool found;
+    unsigned callNo;
+
+    SearchVisitor(const CallMatcher &_matcher, bool _backwards,
+                  unsigned _firstCallNo, unsigned _lastCallNo) :
+        matcher(_matcher.clone()),
+        backwards(_backwards),
+        firstCallNo(_firstCallNo),
+        lastCallNo(_lastCallNo),
+        found(false),
+        callNo(0)
+    {}
+
+    ~SearchVisitor() {
+        delete matcher;
+    }
+
+    void
+    visitCall(Call *call) {
+        if (call->no < firstCallNo || call->no > lastCallNo) {
+            return;
+        }
+        // Calls are visited in leave order, so keep the lowest/highest number
+        if (found &&
+            (backwards ? call->no < callNo : call->no > callNo)) {
+            return;
+        }
+        if (matcher->matches(call)) {
+            found = true;
+            callNo = call->no;
+        }
+    }
+
+    bool
+    isDone(void) const {
+        return found && !backwards;
+    }
+};
+
+
+class CallFinder : public ParallelScanner
+{
+protected:
+    const CallMatcher &matcher;
+    bool backwards;
+    unsigned firstCallNo;
+    unsigned lastCallNo;
+
+public:
+    bool found;
+    unsigned callNo;
+
+    CallFinder(const CallMatcher &_matcher, bool _backwards,
+               unsigned _firstCallNo, unsigned _lastCallNo) :
+        matcher(_matcher),
+        backwards(_backwards),
+        firstCallNo(_firstCallNo),
+        lastCallNo(_lastCallNo),
+        found(false),
+        callNo(0)
+    {}
+
+protected:
+    RangeVisitor *
+    createVisitor(void) {
+        return new SearchVisitor(matcher, backwards, firstCallNo, lastCallNo);
+    }
+
+    void
+    finishVisitor(RangeVisitor *visitor) {
+        SearchVisitor *search = static_cast<SearchVisitor *>(visitor);
+        if (search->found) {
+            found = true;
+            callNo = search->callNo;
+            if (!backwards) {
+                cancel();
+            }
+        }
+        delete search;
+    }
+};
+
+
+} /* anonymous namespace */
+
+
+bool
+findCall(const char *filename,
+         const Index &index,
+         unsigned numThreads,
+         const CallMatcher &matcher,
+         bool backwards,
+         unsigned firstCallNo,
+         unsigned lastCallNo,
+         unsigned &callNo)
+{
+    if (!backwards) {
+        CallFinder finder(matcher, false, firstCallNo, lastCallNo);
+        if (!finder.scan(filename, index, numThreads, true, firstCallNo, lastCallNo) ||
+            !finder.found) {
+            return false;
+        }
+        callNo = finder.callNo;
+        return true;
+    }
+
+    // Search backwards a window of bookmarks at a time, as the last match
+    // is usually close to the last call
+    const std::vector<ParseBookmark> &bookmarks = index.callBookmarks;
+    size_t windowSize = SEARCH_WINDOW_BOOKMARKS * std::max(numThreads, 1U);
+    size_t end = bookmarks.size();
+    while (end > 1 && bookmarks[end - 1].next_call_no > lastCallNo) {
+        --end;
+    }
+    while (firstCallNo <= lastCallNo) {
+        size_t begin = end > windowSize ? end - windowSize : 0;
+        unsigned windowFirstCallNo = firstCallNo;
+        if (begin > 0) {
+            windowFirstCallNo = std::max(bookmarks[begin].next_call_no, firstCallNo);
+        }
+
+        CallFinder finder(matcher, true, windowFirstCallNo, lastCallNo);
+        if (!finder.scan(filename, index, numThreads, true, windowFirstCallNo, lastCallNo)) {
+            return false;
+        }
+        if (finder.found) {
+            callNo = finder.callNo;
+            return true;
+        }
+
+        if (windowFirstCallNo == firstCallNo || windowFirstCallNo == 0) {
+            break;
+        }
+        lastCallNo = windowFirstCallNo - 1;
+        end = begin;
+    }
+
+    return false;
+}
+
+
+} /* namespace trace */
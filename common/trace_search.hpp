@@ -0,0 +1,107 @@
+/**************************************************************************
+ *
+ * Copyright 2015 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+/*
+ * Searching calls by their text.
+ */
+
+#ifndef _TRACE_SEARCH_HPP_
+#define _TRACE_SEARCH_HPP_
+
+
+#include <string>
+
+#include "trace_model.hpp"
+#include "trace_index.hpp"
+
+
+namespace trace {
+
+
+/**
+ * Matches calls whose text contains a given string.
+ *
+ * The text is that of the GUI's call list, e.g.
+ * `glUseProgram(program = 17)`, with string literals and wide strings in
+ * UTF-8.  It is rendered straight from the call values into a reused
+ * buffer.
+ *
+ * Only ASCII letters are folded when ignoring case; frontends with Unicode
+ * case folding at hand override containsIgnoringCase() for text beyond
+ * ASCII.
+ */
+class CallMatcher
+{
+protected:
+    std::string pattern;
+    bool caseSensitive;
+    std::string foldedPattern;
+    bool asciiPattern;
+    std::string text;
+
+    /**
+     * Whether the text, which isn't all ASCII, contains the pattern ignoring
+     * case.  Its ASCII letters were already lowered.
+     */
+    virtual bool
+    containsIgnoringCase(const std::string &text) const;
+
+public:
+    CallMatcher(const std::string &pattern, bool caseSensitive = true);
+    virtual ~CallMatcher() {}
+
+    /**
+     * Copy the matcher, for searching on another thread.
+     */
+    virtual CallMatcher *
+    clone(void) const;
+
+    bool
+    matches(Call *call);
+};
+
+
+/**
+ * Find the first call the matcher matches, or the last when backwards is set,
+ * among the calls from firstCallNo to lastCallNo of an indexed trace.  The
+ * ranges of the trace are searched on several threads, with a clone of the
+ * matcher each.
+ *
+ * Returns false if no call matched.
+ */
+bool
+findCall(const char *filename,
+         const Index &index,
+         unsigned numThreads,
+         const CallMatcher &matcher,
+         bool backwards,
+         unsigned firstCallNo,
+         unsigned lastCallNo,
+         unsigned &callNo);
+
+
+} /* namespace trace */
+
+#endif /* _TRACE_SEARCH_HPP_ */
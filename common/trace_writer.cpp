@@ -29,6 +29,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+
+#include <algorithm>
 #include <vector>
 
 #include "os.hpp"
@@ -39,8 +41,20 @@
 namespace trace {
 
 
+/*
+ * Blobs smaller than this are always written in full, as references would
+ * hardly save anything.
+ */
+#define BLOB_DIGEST_MIN_SIZE 256
+
+/*
+ * Number of threads whose blob digest tables are kept at once.
+ */
+#define BLOB_DIGEST_MAX_TABLES 16
+
 Writer::Writer() :
-    call_no(0)
+    call_no(0),
+    blobThread(0)
 {
     m_file = File::createSnappy();
     close();
@@ -67,18 +81,18 @@ Writer::open(const char *filename) {
     }
 
     call_no = 0;
-    functions.clear();
-    structs.clear();
-    enums.clear();
-    bitmasks.clear();
-    frames.clear();
+    for (unsigned kind = 0; kind < SIG_KIND_COUNT; ++kind) {
+        defined[kind].clear();
+    }
+    blobDigests.clear();
+    blobThreads.clear();
 
     _writeUInt(TRACE_VERSION);
 
     return true;
 }
 
-void inline
+void
 Writer::_write(const void *sBuffer, size_t dwBytesToWrite) {
     m_file->write(sBuffer, dwBytesToWrite);
 }
@@ -135,6 +149,14 @@ inline bool lookup(std::vector<bool> &map, size_t index) {
     }
 }
 
+bool Writer::beginDefinition(SigKind kind, unsigned id) {
+    if (lookup(defined[kind], id)) {
+        return false;
+    }
+    defined[kind][id] = true;
+    return true;
+}
+
 void Writer::beginBacktrace(unsigned num_frames) {
     if (num_frames) {
         _writeByte(trace::CALL_BACKTRACE);
@@ -144,7 +166,7 @@ void Writer::beginBacktrace(unsigned num_frames) {
 
 void Writer::writeStackFrame(const RawStackFrame *frame) {
     _writeUInt(frame->id);
-    if (!lookup(frames, frame->id)) {
+    if (beginDefinition(SIG_FRAME, frame->id)) {
         if (frame->module != NULL) {
             _writeByte(trace::BACKTRACE_MODULE);
             _writeString(frame->module);
@@ -166,21 +188,42 @@ void Writer::writeStackFrame(const RawStackFrame *frame) {
             _writeUInt(frame->offset);
         }
         _writeByte(trace::BACKTRACE_END);
-        frames[frame->id] = true;
+        endDefinition();
     }
 }
 
+bool Writer::beginStack(Id id, unsigned num_frames) {
+    _writeByte(trace::CALL_STACK);
+    _writeUInt(id);
+    if (!beginDefinition(SIG_STACK, id)) {
+        return false;
+    }
+    _writeUInt(num_frames);
+    return true;
+}
+
+void Writer::endStack(void) {
+    endDefinition();
+}
+
+void Writer::writeTime(unsigned long long start, unsigned long long duration) {
+    _writeByte(trace::CALL_TIME);
+    _writeUInt(start);
+    _writeUInt(duration);
+}
+
 unsigned Writer::beginEnter(const FunctionSig *sig, unsigned thread_id) {
+    blobThread = thread_id;
     _writeByte(trace::EVENT_ENTER);
     _writeUInt(thread_id);
     _writeUInt(sig->id);
-    if (!lookup(functions, sig->id)) {
+    if (beginDefinition(SIG_FUNCTION, sig->id)) {
         _writeString(sig->name);
         _writeUInt(sig->num_args);
         for (unsigned i = 0; i < sig->num_args; ++i) {
             _writeString(sig->arg_names[i]);
         }
-        functions[sig->id] = true;
+        endDefinition();
     }
 
     return call_no++;
@@ -213,16 +256,39 @@ void Writer::beginArray(size_t length) {
     _writeUInt(length);
 }
 
+void Writer::writePackedArray(PackedArray::Kind kind, size_t elementSize,
+                              const void *values, size_t count) {
+    _writeByte(trace::TYPE_PACKED_ARRAY);
+    switch (kind) {
+    case PackedArray::KIND_SINT:
+        _writeByte(trace::TYPE_SINT);
+        break;
+    case PackedArray::KIND_UINT:
+        _writeByte(trace::TYPE_UINT);
+        break;
+    case PackedArray::KIND_FLOAT:
+        _writeByte(elementSize == sizeof(float) ? trace::TYPE_FLOAT : trace::TYPE_DOUBLE);
+        break;
+    }
+    _writeUInt(elementSize);
+    _writeUInt(count);
+    _write(values, elementSize * count);
+}
+
 void Writer::beginStruct(const StructSig *sig) {
     _writeByte(trace::TYPE_STRUCT);
+    _writeStructSig(sig);
+}
+
+void Writer::_writeStructSig(const StructSig *sig) {
     _writeUInt(sig->id);
-    if (!lookup(structs, sig->id)) {
+    if (beginDefinition(SIG_STRUCT, sig->id)) {
         _writeString(sig->name);
         _writeUInt(sig->num_members);
         for (unsigned i = 0; i < sig->num_members; ++i) {
             _writeString(sig->member_names[i]);
         }
-        structs[sig->id] = true;
+        endDefinition();
     }
 }
 
@@ -311,11 +377,140 @@ void Writer::writeWString(const wchar_t *str) {
     writeWString(str, len);
 }
 
+static inline unsigned long long
+rotl64(unsigned long long x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline unsigned long long
+fmix64(unsigned long long k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+/*
+ * MurmurHash3_x64_128, by Austin Appleby, which is in the public domain.
+ *
+ * Readers take blobs with the same size and digest for the same, so the
+ * digest must be wide enough for collisions to be out of the question.
+ */
+static BlobDigest
+hashBlob(const void *data, size_t size) {
+    const unsigned long long c1 = 0x87c37b91114253d5ULL;
+    const unsigned long long c2 = 0x4cf5ad432745937fULL;
+
+    unsigned long long h1 = 0;
+    unsigned long long h2 = 0;
+
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+    const unsigned char *end = p + (size & ~(size_t)15);
+    while (p != end) {
+        unsigned long long k1;
+        unsigned long long k2;
+        memcpy(&k1, p, sizeof k1);
+        memcpy(&k2, p + 8, sizeof k2);
+        p += 16;
+
+        k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = rotl64(h1, 27); h1 += h2; h1 = h1*5 + 0x52dce729;
+
+        k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = rotl64(h2, 31); h2 += h1; h2 = h2*5 + 0x38495ab5;
+    }
+
+    unsigned long long k1 = 0;
+    unsigned long long k2 = 0;
+    switch (size & 15) {
+    case 15: k2 ^= (unsigned long long)p[14] << 48;
+    case 14: k2 ^= (unsigned long long)p[13] << 40;
+    case 13: k2 ^= (unsigned long long)p[12] << 32;
+    case 12: k2 ^= (unsigned long long)p[11] << 24;
+    case 11: k2 ^= (unsigned long long)p[10] << 16;
+    case 10: k2 ^= (unsigned long long)p[9] << 8;
+    case  9: k2 ^= (unsigned long long)p[8];
+             k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+    case  8: k1 ^= (unsigned long long)p[7] << 56;
+    case  7: k1 ^= (unsigned long long)p[6] << 48;
+    case  6: k1 ^= (unsigned long long)p[5] << 40;
+    case  5: k1 ^= (unsigned long long)p[4] << 32;
+    case  4: k1 ^= (unsigned long long)p[3] << 24;
+    case  3: k1 ^= (unsigned long long)p[2] << 16;
+    case  2: k1 ^= (unsigned long long)p[1] << 8;
+    case  1: k1 ^= (unsigned long long)p[0];
+             k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+    }
+
+    h1 ^= size;
+    h2 ^= size;
+    h1 += h2;
+    h2 += h1;
+    h1 = fmix64(h1);
+    h2 = fmix64(h2);
+    h1 += h2;
+    h2 += h1;
+
+    BlobDigest digest = {h1, h2};
+    return digest;
+}
+
+bool Writer::BlobDigests::lookup(const BlobDigest &digest, size_t size) {
+    if (entries.empty()) {
+        Entry empty = {{0, 0}, 0};
+        entries.resize(BLOB_DIGEST_TABLE_SIZE, empty);
+    }
+    Entry &entry = entries[digest.low & (BLOB_DIGEST_TABLE_SIZE - 1)];
+    if (entry.digest == digest && entry.size == size) {
+        return true;
+    }
+    entry.digest = digest;
+    entry.size = size;
+    return false;
+}
+
+bool Writer::lookupBlob(const BlobDigest &digest, size_t size) {
+    if (blobThread >= blobDigests.size()) {
+        blobDigests.resize(blobThread + 1);
+    }
+
+    // Forgetting a table is safe, as blobs are then just written in full
+    std::vector<unsigned>::iterator it =
+        std::find(blobThreads.begin(), blobThreads.end(), blobThread);
+    if (it == blobThreads.end()) {
+        if (blobThreads.size() >= BLOB_DIGEST_MAX_TABLES) {
+            blobDigests[blobThreads.back()] = BlobDigests();
+            blobThreads.pop_back();
+        }
+        blobThreads.insert(blobThreads.begin(), blobThread);
+    } else if (it != blobThreads.begin()) {
+        std::rotate(blobThreads.begin(), it, it + 1);
+    }
+
+    return blobDigests[blobThread].lookup(digest, size);
+}
+
 void Writer::writeBlob(const void *data, size_t size) {
     if (!data) {
         Writer::writeNull();
         return;
     }
+    if (size >= BLOB_DIGEST_MIN_SIZE) {
+        BlobDigest digest = hashBlob(data, size);
+        if (lookupBlob(digest, size)) {
+            _writeByte(trace::TYPE_BLOB_REF);
+            _writeUInt(size);
+            _writeDigest(digest);
+        } else {
+            _writeByte(trace::TYPE_HASHED_BLOB);
+            _writeUInt(size);
+            _writeDigest(digest);
+            _write(data, size);
+        }
+        return;
+    }
     _writeByte(trace::TYPE_BLOB);
     _writeUInt(size);
     if (size) {
@@ -323,24 +518,38 @@ void Writer::writeBlob(const void *data, size_t size) {
     }
 }
 
+void Writer::_writeDigest(const BlobDigest &digest) {
+    _write(&digest.low, sizeof digest.low);
+    _write(&digest.high, sizeof digest.high);
+}
+
 void Writer::writeEnum(const EnumSig *sig, signed long long value) {
     _writeByte(trace::TYPE_ENUM);
+    _writeEnumSig(sig);
+    writeSInt(value);
+}
+
+void Writer::_writeEnumSig(const EnumSig *sig) {
     _writeUInt(sig->id);
-    if (!lookup(enums, sig->id)) {
+    if (beginDefinition(SIG_ENUM, sig->id)) {
         _writeUInt(sig->num_values);
         for (unsigned i = 0; i < sig->num_values; ++i) {
             _writeString(sig->values[i].name);
             writeSInt(sig->values[i].value);
         }
-        enums[sig->id] = true;
+        endDefinition();
     }
-    writeSInt(value);
 }
 
 void Writer::writeBitmask(const BitmaskSig *sig, unsigned long long value) {
     _writeByte(trace::TYPE_BITMASK);
+    _writeBitmaskSig(sig);
+    _writeUInt(value);
+}
+
+void Writer::_writeBitmaskSig(const BitmaskSig *sig) {
     _writeUInt(sig->id);
-    if (!lookup(bitmasks, sig->id)) {
+    if (beginDefinition(SIG_BITMASK, sig->id)) {
         _writeUInt(sig->num_flags);
         for (unsigned i = 0; i < sig->num_flags; ++i) {
             if (i != 0 && sig->flags[i].value == 0) {
@@ -349,9 +558,8 @@ void Writer::writeBitmask(const BitmaskSig *sig, unsigned long long value) {
             _writeString(sig->flags[i].name);
             _writeUInt(sig->flags[i].value);
         }
-        bitmasks[sig->id] = true;
+        endDefinition();
     }
-    _writeUInt(value);
 }
 
 void Writer::writeNull(void) {
@@ -367,6 +575,61 @@ void Writer::writePointer(unsigned long long addr) {
     _writeUInt(addr);
 }
 
+/**
+ * Write the encoded details in [begin, end) of a raw call, along with the
+ * signatures referred by them, defining those used for the first time.
+ */
+void Writer::_writeRawDetails(const RawCall *raw, size_t begin, size_t end,
+                              size_t firstSig, size_t lastSig) {
+    const char *data = raw->data.data();
+    size_t offset = begin;
+    for (size_t i = firstSig; i < lastSig; ++i) {
+        const RawCall::SigRef &ref = raw->sigs[i];
+        assert(ref.offset >= offset && ref.offset <= end);
+        _write(data + offset, ref.offset - offset);
+        offset = ref.offset;
+        switch (ref.kind) {
+        case RawCall::SIG_STRUCT:
+            _writeStructSig(ref.structSig);
+            break;
+        case RawCall::SIG_ENUM:
+            _writeEnumSig(ref.enumSig);
+            break;
+        case RawCall::SIG_BITMASK:
+            _writeBitmaskSig(ref.bitmaskSig);
+            break;
+        case RawCall::SIG_FRAME:
+            writeStackFrame(ref.frame);
+            break;
+        case RawCall::SIG_STACK:
+            if (beginStack(ref.stack->id, ref.stack->frames.size())) {
+                for (unsigned j = 0; j < ref.stack->frames.size(); ++j) {
+                    writeStackFrame(ref.stack->frames[j]);
+                }
+                endStack();
+            }
+            break;
+        case RawCall::SIG_BLOB:
+            writeBlob(data + offset, ref.blobSize);
+            offset += ref.blobSize;
+            break;
+        }
+    }
+    _write(data + offset, end - offset);
+}
+
+void Writer::_writeRawCall(const Call *call) {
+    const RawCall *raw = call->raw;
+
+    unsigned call_no = beginEnter(call->sig, call->thread_id);
+    _writeRawDetails(raw, 0, raw->leaveOffset, 0, raw->leaveSig);
+    endEnter();
+
+    beginLeave(call_no);
+    _writeRawDetails(raw, raw->leaveOffset, raw->data.size(), raw->leaveSig, raw->sigs.size());
+    endLeave();
+}
+
 
 } /* namespace trace */
 
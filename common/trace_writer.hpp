@@ -33,6 +33,7 @@
 
 #include <stddef.h>
 
+#include <limits>
 #include <vector>
 
 #include "trace_model.hpp"
@@ -45,15 +46,65 @@ namespace trace {
         File *m_file;
         unsigned call_no;
 
-        std::vector<bool> functions;
-        std::vector<bool> structs;
-        std::vector<bool> enums;
-        std::vector<bool> bitmasks;
-        std::vector<bool> frames;
+        /**
+         * Kinds of signatures, whose definitions are written only on their
+         * first use.
+         */
+        enum SigKind {
+            SIG_FUNCTION = 0,
+            SIG_STRUCT,
+            SIG_ENUM,
+            SIG_BITMASK,
+            SIG_FRAME,
+            SIG_STACK,
+            SIG_KIND_COUNT
+        };
+
+        /**
+         * Which signatures have been defined, per kind.
+         */
+        std::vector<bool> defined[SIG_KIND_COUNT];
+
+        /**
+         * Digests of the blobs a thread wrote recently, so that blobs with
+         * the same contents are written as references to them.
+         *
+         * It is a direct mapped table, where a digest is forgotten once
+         * another one takes its slot.  Readers keep the same table, so it must
+         * see the thread's blobs in the order they are written.
+         */
+        class BlobDigests {
+        protected:
+            struct Entry {
+                BlobDigest digest;
+                size_t size;
+            };
+            std::vector<Entry> entries;
+
+        public:
+            /**
+             * Whether the digest is in the table, adding it otherwise.
+             */
+            bool lookup(const BlobDigest &digest, size_t size);
+
+            void clear(void) {
+                entries.clear();
+            }
+        };
+
+        /**
+         * Blob digest tables by thread, and the thread of the call being
+         * written.  Only the threads that wrote blobs most recently keep
+         * their tables, most recent first, so that traces with many threads
+         * don't need one each.
+         */
+        std::vector<BlobDigests> blobDigests;
+        std::vector<unsigned> blobThreads;
+        unsigned blobThread;
 
     public:
         Writer();
-        ~Writer();
+        virtual ~Writer();
 
         bool open(const char *filename);
         void close(void);
@@ -74,6 +125,20 @@ namespace trace {
         void writeStackFrame(const RawStackFrame *frame);
         inline void endBacktrace(void) {}
 
+        /**
+         * Refer to a backtrace shared with other calls.  Returns true when
+         * it is used for the first time, in which case its frames are to be
+         * written next with writeStackFrame, followed by endStack.
+         */
+        bool beginStack(Id id, unsigned num_frames);
+        void endStack(void);
+
+        /**
+         * Record when the call started, since tracing did, and how long it
+         * took, in nanoseconds.
+         */
+        void writeTime(unsigned long long start, unsigned long long duration);
+
         void beginArray(size_t length);
         inline void endArray(void) {}
 
@@ -101,10 +166,80 @@ namespace trace {
         void writeNull(void);
         void writePointer(unsigned long long addr);
 
+        /**
+         * Write an array of integer or floating point numbers as raw bytes.
+         */
+        void writePackedArray(PackedArray::Kind kind, size_t elementSize,
+                              const void *values, size_t count);
+
+        /**
+         * Write an array of numbers, packed unless it has a single element,
+         * which is smaller written on its own.
+         */
+        template< class T >
+        inline void
+        writeArray(const T *values, size_t count) {
+            typedef std::numeric_limits<T> limits;
+            bool isFloat = limits::is_specialized && !limits::is_integer;
+            bool packable = limits::is_specialized &&
+                            (isFloat ? sizeof(T) == sizeof(float) || sizeof(T) == sizeof(double)
+                                     : sizeof(T) <= sizeof(long long));
+            if (!packable || count < 2) {
+                // Enums lack numeric_limits, and are written as integers.
+                beginArray(count);
+                for (size_t i = 0; i < count; ++i) {
+                    if (isFloat) {
+                        if (sizeof(T) == sizeof(float)) {
+                            writeFloat(values[i]);
+                        } else {
+                            writeDouble(values[i]);
+                        }
+                    } else if (limits::is_signed || !limits::is_specialized) {
+                        writeSInt(static_cast<signed long long>(values[i]));
+                    } else {
+                        writeUInt(static_cast<unsigned long long>(values[i]));
+                    }
+                }
+                endArray();
+                return;
+            }
+            PackedArray::Kind kind = isFloat ? PackedArray::KIND_FLOAT :
+                                     limits::is_signed ? PackedArray::KIND_SINT :
+                                                        PackedArray::KIND_UINT;
+            writePackedArray(kind, sizeof(T), values, count);
+        }
+
+        /**
+         * Write a whole call.  Calls parsed with Parser::parse_raw_call are
+         * copied from their encoded details.
+         */
         void writeCall(Call *call);
 
     protected:
-        void inline _write(const void *sBuffer, size_t dwBytesToWrite);
+        /**
+         * Whether the definition of the given signature must be written.
+         * endDefinition() is invoked after it has been.  Definitions may
+         * nest, as backtraces define their frames.
+         */
+        virtual bool beginDefinition(SigKind kind, unsigned id);
+        virtual void endDefinition(void) {}
+
+        /**
+         * Whether a blob with the given digest was recently written, and can
+         * therefore be referred to.  Otherwise it is remembered as written.
+         */
+        virtual bool lookupBlob(const BlobDigest &digest, size_t size);
+
+        void _writeStructSig(const StructSig *sig);
+        void _writeEnumSig(const EnumSig *sig);
+        void _writeDigest(const BlobDigest &digest);
+        void _writeBitmaskSig(const BitmaskSig *sig);
+
+        void _writeRawDetails(const RawCall *raw, size_t begin, size_t end,
+                              size_t firstSig, size_t lastSig);
+        void _writeRawCall(const Call *call);
+
+        virtual void _write(const void *sBuffer, size_t dwBytesToWrite);
         void inline _writeByte(char c);
         void inline _writeUInt(unsigned long long value);
         void inline _writeFloat(float value);
@@ -30,11 +30,17 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
+#include <string>
+#include <vector>
+
 #include "os.hpp"
 #include "os_thread.hpp"
 #include "os_string.hpp"
+#include "os_time.hpp"
 #include "os_version.hpp"
 #include "trace_file.hpp"
+#include "trace_parser.hpp"
 #include "trace_writer_local.hpp"
 #include "trace_format.hpp"
 #include "os_backtrace.hpp"
@@ -56,6 +62,879 @@ static const char *realloc_args[2] = {"ptr", "size"};
 const FunctionSig realloc_sig = {3, "realloc", 2, realloc_args};
 
 
+/**
+ * A serialized enter or leave event.
+ */
+struct LocalWriter::Buffer {
+    std::vector<char> data;
+
+    /**
+     * Where signature definitions lie in data, so that they can be dropped
+     * if another thread's call already defined them in the file.  When
+     * recording, signatures this thread defined before are listed too, as
+     * empty ranges, where they are to be defined if the recording doesn't
+     * include the call that did.
+     */
+    struct Definition {
+        SigKind kind;
+        unsigned id;
+        size_t begin;
+        size_t end;
+    };
+    std::vector<Definition> definitions;
+
+    /**
+     * Definitions being written, innermost last.
+     */
+    std::vector<unsigned> open;
+
+    /**
+     * Where each argument and the return value begin in data, when recording.
+     */
+    std::vector<size_t> args;
+
+    void clear(void) {
+        // Release the memory of exceptionally large calls
+        if (data.capacity() > 1024*1024) {
+            std::vector<char>().swap(data);
+        } else {
+            data.clear();
+        }
+        definitions.clear();
+        open.clear();
+        args.clear();
+    }
+};
+
+
+struct LocalWriter::ThreadState {
+    unsigned thread_id;
+
+    /**
+     * Greater than zero while serializing a call.
+     */
+    int acquired;
+
+    /**
+     * Number of the call being serialized.
+     */
+    unsigned call_no;
+
+    Buffer buffer;
+
+    /**
+     * Signatures this thread used.  These are certainly defined in the file
+     * before any subsequent call of this thread, as its calls are written in
+     * order.
+     */
+    std::vector<bool> used[SIG_KIND_COUNT];
+
+    /**
+     * Blobs this thread wrote recently, which for the same reason can be
+     * referred to by its subsequent calls.
+     */
+    BlobDigests blobDigests;
+
+    unsigned generation;
+
+    unsigned frameEpoch;
+
+    /**
+     * Number of times this thread made a context current, as the objects it
+     * bound are only known until it does.
+     */
+    unsigned contextNo;
+
+    /**
+     * Whether the call being serialized may be recorded past the frame it
+     * belongs to, and must therefore write whole blobs.
+     */
+    bool keepable;
+
+    /**
+     * Whether this thread is updating the recording, with the mutex held.
+     */
+    bool recording;
+
+    /**
+     * Whether the call being serialized is to be timed.
+     */
+    bool timed;
+
+    /**
+     * Numbers of the timed calls in progress and when they started,
+     * innermost last.
+     */
+    std::vector< std::pair<unsigned, long long> > callStarts;
+
+    ThreadState() :
+        thread_id(0),
+        acquired(0),
+        call_no(0),
+        generation(0),
+        frameEpoch(0),
+        contextNo(0),
+        keepable(false),
+        recording(false),
+        timed(false)
+    {}
+};
+
+
+/**
+ * A call recorded in memory, as a flight recorder.
+ */
+struct LocalWriter::RecordedCall {
+    unsigned no;
+    unsigned sig;
+    unsigned callClass;
+    unsigned thread;
+
+    /**
+     * Number of kept calls recorded before this one.
+     */
+    unsigned keptBefore;
+
+    /**
+     * The thread's context number when this call was made.
+     */
+    unsigned contextNo;
+
+    /**
+     * Serialized events, if submitted.  These are only set once complete, as
+     * the recording may be written by a signal handler interrupting this.
+     */
+    Buffer *enter;
+    Buffer *leave;
+
+    /**
+     * Order in which the events were submitted, which is the order they would
+     * have been written in.
+     */
+    unsigned enterOrder;
+    unsigned leaveOrder;
+
+    /**
+     * Number in the written recording.
+     */
+    unsigned writtenNo;
+
+    /**
+     * For state setting calls kept from dropped frames, the state they set,
+     * and the arguments they set it to.
+     */
+    std::string key;
+    std::string value;
+
+    /**
+     * Selecting calls whose state this one depended on, and the number of
+     * kept calls depending on this one, which pin it even once superseded.
+     */
+    std::vector<RecordedCall *> context;
+    unsigned dependents;
+    bool superseded;
+
+    /**
+     * Calls kept for the sake of this one, which depend on it in turn, e.g.,
+     * the calls unmapping the buffer this one mapped, or deleting the objects
+     * this one created.
+     */
+    std::vector<RecordedCall *> followers;
+
+    RecordedCall() :
+        enter(NULL),
+        leave(NULL),
+        enterOrder(0),
+        leaveOrder(0),
+        writtenNo(0),
+        dependents(0),
+        superseded(false)
+    {}
+
+    ~RecordedCall() {
+        delete enter;
+        delete leave;
+    }
+};
+
+
+enum {
+    CALL_CLASS_KNOWN     = (1 << 0),
+    CALL_CLASS_KEEP      = (1 << 1),
+    CALL_CLASS_STATE     = (1 << 2),
+    CALL_CLASS_END_FRAME = (1 << 3),
+    CALL_CLASS_MAKE_CURRENT = (1 << 4)
+};
+
+
+/**
+ * Prefixes of the functions whose calls are kept when recording, as they
+ * create objects or programs, or upload their contents, which frames recorded
+ * long afterwards may still use.  Those tracked by objectFunctions below are
+ * only kept until the objects are deleted or overwritten instead.
+ */
+static const char *
+keptCallPrefixes[] = {
+    "CGLChoosePixelFormat",
+    "CGLCreate",
+    "CGLSetCurrentContext",
+    "CreateDXGIFactory",
+    "D3D10CreateDevice",
+    "D3D11CreateDevice",
+    "Direct3DCreate",
+    "eglBindAPI",
+    "eglChooseConfig",
+    "eglCreate",
+    "eglDestroy",
+    "eglGetDisplay",
+    "eglGetPlatformDisplay",
+    "eglInitialize",
+    "eglMakeCurrent",
+    "glAttachShader",
+    "glBindAttribLocation",
+    "glBindFragDataLocation",
+    "glBufferData",
+    "glBufferStorage",
+    "glCompileShader",
+    "glCompressedTexImage",
+    "glCreate",
+    "glDelete",
+    "glDetachShader",
+    "glGen",
+    "glLinkProgram",
+    "glNamedBufferData",
+    "glNamedBufferStorage",
+    "glProgramBinary",
+    "glShaderBinary",
+    "glShaderSource",
+    "glTexImage",
+    "glTexStorage",
+    "glTextureStorage",
+    "glTransformFeedbackVaryings",
+    "glUniformBlockBinding",
+    "glXChooseFBConfig",
+    "glXChooseVisual",
+    "glXCreate",
+    "glXDestroy",
+    "glXMakeContextCurrent",
+    "glXMakeCurrent",
+    "wglChoosePixelFormat",
+    "wglCreate",
+    "wglDelete",
+    "wglMakeContextCurrent",
+    "wglMakeCurrent",
+    "wglSetPixelFormat",
+    "wglShareLists",
+};
+
+
+static bool
+isKeptCall(const char *name)
+{
+    // Methods creating objects, e.g., ID3D11Device::CreateTexture2D
+    const char *method = strrchr(name, ':');
+    if (method) {
+        return strncmp(method + 1, "Create", strlen("Create")) == 0;
+    }
+
+    for (unsigned i = 0; i < sizeof keptCallPrefixes / sizeof keptCallPrefixes[0]; ++i) {
+        const char *prefix = keptCallPrefixes[i];
+        if (strncmp(name, prefix, strlen(prefix)) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/**
+ * State that calls select for the calls that follow, such as the bound
+ * objects which the parameters set apply to.
+ */
+enum {
+    SELECT_ACTIVE_TEXTURE        = (1 << 0),
+    SELECT_CLIENT_ACTIVE_TEXTURE = (1 << 1),
+    SELECT_MATRIX_MODE           = (1 << 2),
+    SELECT_PROGRAM               = (1 << 3),
+    SELECT_VERTEX_ARRAY          = (1 << 4),
+    SELECT_BUFFER                = (1 << 5),
+    SELECT_TEXTURE               = (1 << 6),
+    SELECT_FRAMEBUFFER           = (1 << 7),
+    SELECT_RENDERBUFFER          = (1 << 8),
+    SELECT_PIXEL_STORE           = (1 << 9),
+    SELECT_COUNT                 = 10,
+    SELECT_ALL                   = (1 << SELECT_COUNT) - 1
+};
+
+
+/**
+ * How the state setting calls of the functions with the given prefixes
+ * (followed by type or vendor suffixes only) are told apart when dropping
+ * frames: by their first arguments, the remaining ones being values, and by
+ * the selected state which tells what they apply to.  They also depend on the
+ * selected state they use.  Calls of any other function are told apart by all
+ * their arguments and all the selected state, which is always safe, only less
+ * compact.
+ */
+struct StateFunction {
+    const char *prefix;
+    unsigned char keyArgs;
+    unsigned short selects;
+    unsigned short appliesTo;
+    unsigned short uses;
+};
+
+static const StateFunction
+stateFunctions[] = {
+    {"glActiveTexture",             0, SELECT_ACTIVE_TEXTURE,        0, 0},
+    {"glClientActiveTexture",       0, SELECT_CLIENT_ACTIVE_TEXTURE, 0, 0},
+    {"glMatrixMode",                0, SELECT_MATRIX_MODE,           0, 0},
+    {"glUseProgram",                0, SELECT_PROGRAM,               0, 0},
+    {"glUseProgramObject",          0, SELECT_PROGRAM,               0, 0},
+    {"glBindProgram",               1, SELECT_PROGRAM,               0, 0},
+    {"glBindProgramPipeline",       0, SELECT_PROGRAM,               0, 0},
+    {"glActiveShaderProgram",       1, SELECT_PROGRAM,               0, 0},
+    {"glBindVertexArray",           0, SELECT_VERTEX_ARRAY,          0, 0},
+    {"glBindBuffer",                1, SELECT_BUFFER,                SELECT_VERTEX_ARRAY, 0},
+    {"glBindTextures",              2, SELECT_TEXTURE,               0, 0},
+    {"glBindTexture",               1, SELECT_TEXTURE,               SELECT_ACTIVE_TEXTURE, 0},
+    {"glBindTextureUnit",           1, SELECT_TEXTURE,               0, 0},
+    {"glBindMultiTexture",          2, SELECT_TEXTURE,               0, 0},
+    {"glBindFramebuffer",           1, SELECT_FRAMEBUFFER,           0, 0},
+    {"glBindRenderbuffer",          1, SELECT_RENDERBUFFER,          0, 0},
+    {"glBindVertexBuffers",         2, 0, SELECT_VERTEX_ARRAY, 0},
+    {"glBindVertexBuffer",          1, 0, SELECT_VERTEX_ARRAY, 0},
+    {"glEnablei",                   2, 0, 0, 0},
+    {"glDisablei",                  2, 0, 0, 0},
+    {"glEnable",                    1, 0, SELECT_ACTIVE_TEXTURE, 0},
+    {"glDisable",                   1, 0, SELECT_ACTIVE_TEXTURE, 0},
+    {"glEnableVertexAttribArray",   1, 0, SELECT_VERTEX_ARRAY, 0},
+    {"glDisableVertexAttribArray",  1, 0, SELECT_VERTEX_ARRAY, 0},
+    {"glVertexAttribPointer",       1, 0, SELECT_VERTEX_ARRAY, SELECT_BUFFER},
+    {"glVertexAttribIPointer",      1, 0, SELECT_VERTEX_ARRAY, SELECT_BUFFER},
+    {"glVertexAttribLPointer",      1, 0, SELECT_VERTEX_ARRAY, SELECT_BUFFER},
+    {"glVertexAttribFormat",        1, 0, SELECT_VERTEX_ARRAY, 0},
+    {"glVertexAttribIFormat",       1, 0, SELECT_VERTEX_ARRAY, 0},
+    {"glVertexAttribLFormat",       1, 0, SELECT_VERTEX_ARRAY, 0},
+    {"glVertexAttribBinding",       1, 0, SELECT_VERTEX_ARRAY, 0},
+    {"glVertexAttribDivisor",       1, 0, SELECT_VERTEX_ARRAY, 0},
+    {"glVertexAttrib",              1, 0, 0, 0},
+    {"glUniform",                   1, 0, SELECT_PROGRAM, 0},
+    {"glUniformMatrix",             1, 0, SELECT_PROGRAM, 0},
+    {"glProgramUniform",            2, 0, 0, 0},
+    {"glProgramUniformMatrix",      2, 0, 0, 0},
+    {"glTexParameter",              2, 0, SELECT_ACTIVE_TEXTURE | SELECT_TEXTURE, 0},
+    {"glTextureParameter",          2, 0, 0, 0},
+    {"glSamplerParameter",          2, 0, 0, 0},
+    {"glFramebufferTexture",        2, 0, SELECT_FRAMEBUFFER, 0},
+    {"glFramebufferRenderbuffer",   2, 0, SELECT_FRAMEBUFFER, 0},
+    {"glPixelStore",                1, SELECT_PIXEL_STORE,           0, 0},
+    {"glHint",                      1, 0, 0, 0},
+    {"glBufferData",                1, 0, SELECT_BUFFER, 0},
+    {"glBufferStorage",             1, 0, SELECT_BUFFER, 0},
+    {"glBufferSubData",             3, 0, SELECT_BUFFER, 0},
+    {"glNamedBufferData",           1, 0, 0, 0},
+    {"glNamedBufferStorage",        1, 0, 0, 0},
+    {"glNamedBufferSubData",        3, 0, 0, 0},
+    {"glMapBuffer",                 1, 0, SELECT_BUFFER, 0},
+    {"glMapBufferRange",            1, 0, SELECT_BUFFER, 0},
+    {"glFlushMappedBufferRange",    1, 0, SELECT_BUFFER, 0},
+    {"glUnmapBuffer",               1, 0, SELECT_BUFFER, 0},
+    {"glMapNamedBuffer",            1, 0, 0, 0},
+    {"glMapNamedBufferRange",       1, 0, 0, 0},
+    {"glFlushMappedNamedBufferRange", 1, 0, 0, 0},
+    {"glUnmapNamedBuffer",          1, 0, 0, 0},
+    {"glTexImage",                  2, 0, SELECT_ACTIVE_TEXTURE | SELECT_TEXTURE, SELECT_BUFFER | SELECT_PIXEL_STORE},
+    {"glCompressedTexImage",        2, 0, SELECT_ACTIVE_TEXTURE | SELECT_TEXTURE, SELECT_BUFFER | SELECT_PIXEL_STORE},
+    {"glTexSubImage1D",             4, 0, SELECT_ACTIVE_TEXTURE | SELECT_TEXTURE, SELECT_BUFFER | SELECT_PIXEL_STORE},
+    {"glTexSubImage2D",             6, 0, SELECT_ACTIVE_TEXTURE | SELECT_TEXTURE, SELECT_BUFFER | SELECT_PIXEL_STORE},
+    {"glTexSubImage3D",             8, 0, SELECT_ACTIVE_TEXTURE | SELECT_TEXTURE, SELECT_BUFFER | SELECT_PIXEL_STORE},
+    {"glCompressedTexSubImage1D",   4, 0, SELECT_ACTIVE_TEXTURE | SELECT_TEXTURE, SELECT_BUFFER | SELECT_PIXEL_STORE},
+    {"glCompressedTexSubImage2D",   6, 0, SELECT_ACTIVE_TEXTURE | SELECT_TEXTURE, SELECT_BUFFER | SELECT_PIXEL_STORE},
+    {"glCompressedTexSubImage3D",   8, 0, SELECT_ACTIVE_TEXTURE | SELECT_TEXTURE, SELECT_BUFFER | SELECT_PIXEL_STORE},
+    {"glTexStorage",                1, 0, SELECT_ACTIVE_TEXTURE | SELECT_TEXTURE, 0},
+    {"glTextureImage",              3, 0, 0, SELECT_BUFFER | SELECT_PIXEL_STORE},
+    {"glCompressedTextureImage",    3, 0, 0, SELECT_BUFFER | SELECT_PIXEL_STORE},
+    {"glTextureSubImage",           2, 0, 0, SELECT_BUFFER | SELECT_PIXEL_STORE},
+    {"glCompressedTextureSubImage", 2, 0, 0, SELECT_BUFFER | SELECT_PIXEL_STORE},
+    {"glTextureStorage",            1, 0, 0, 0},
+    // Told apart by the buffer range it fills, as the tables below tell
+    {"memcpy",                      0, 0, 0, 0},
+    {NULL,                       0xff, 0, SELECT_ALL, 0}
+};
+
+
+static bool
+matchesFunction(const char *name, const char *prefix)
+{
+    size_t length = strlen(prefix);
+    if (strncmp(name, prefix, length) != 0) {
+        return false;
+    }
+
+    // Allow type suffixes, e.g. 4fv, and vendor ones, e.g. ARB, but not
+    // other functions, e.g. glBindBufferBase.
+    const char *suffix = name + length;
+    while ((*suffix >= '0' && *suffix <= '9') ||
+           (*suffix >= 'a' && *suffix <= 'z')) {
+        ++suffix;
+    }
+    while (*suffix >= 'A' && *suffix <= 'Z') {
+        ++suffix;
+    }
+    return *suffix == '\0';
+}
+
+
+static unsigned char
+lookupStateFunction(const char *name)
+{
+    unsigned i;
+    for (i = 0; stateFunctions[i].prefix; ++i) {
+        if (matchesFunction(name, stateFunctions[i].prefix)) {
+            break;
+        }
+    }
+    return i;
+}
+
+
+/*
+ * OpenGL enums telling which objects the calls below apply to.
+ */
+enum {
+    GL_TEXTURE0                    = 0x84C0,
+    GL_TEXTURE_CUBE_MAP            = 0x8513,
+    GL_TEXTURE_CUBE_MAP_POSITIVE_X = 0x8515,
+    GL_TEXTURE_CUBE_MAP_NEGATIVE_Z = 0x851A,
+    GL_ELEMENT_ARRAY_BUFFER        = 0x8893,
+    GL_PIXEL_UNPACK_BUFFER         = 0x88EC
+};
+
+
+/**
+ * What calls do to the objects of some kind, when dropping frames.
+ */
+enum {
+    OBJECT_NONE,
+    OBJECT_BIND,     // Binds the object named to the target
+    OBJECT_UNBIND,   // Binds objects to targets not told apart
+    OBJECT_CREATE,   // Creates the objects named
+    OBJECT_DELETE,   // Deletes the objects named
+    OBJECT_USE,      // Uses the object named, only while it exists
+    OBJECT_WRITE,    // Writes the object named or bound to the target
+    OBJECT_STORAGE,  // Allocates the object named or bound for good
+    OBJECT_MAP,      // Maps the buffer named or bound to the target
+    OBJECT_FLUSH,
+    OBJECT_UNMAP,
+    OBJECT_MEMCPY    // Fills the memory a buffer is mapped to
+};
+
+enum {
+    ARG_NONE = -1,
+    ARG_RETURN = -2,         // The return value, for the objects created
+    ARG_UNPACK_BUFFER = -3   // The pixel unpack buffer, for the source
+};
+
+
+/**
+ * How the calls of the functions with the given prefixes (followed by type or
+ * vendor suffixes only) create, bind, write or map objects, by the arguments
+ * which name them (or the target they are bound to, and the texture unit the
+ * binding applies to), the level written, the offsets and sizes of the
+ * region written, in up to three dimensions, or all of the level, and the
+ * buffer read, if any, named or bound like the object written.
+ *
+ * A later call writing the same region of the object replaces a call kept
+ * from a dropped frame, and deleting the object releases the calls which
+ * created, wrote or used it, unless kept calls were made in between.
+ */
+struct ObjectFunction {
+    const char *prefix;
+    unsigned char action;
+    const char *objects;
+    signed char name;
+    signed char target;
+    signed char level;
+    signed char offset;
+    signed char size;
+    signed char source;
+};
+
+static const ObjectFunction
+objectFunctions[] = {
+    // prefix                       action          objects        name target level offset size source
+    {"glActiveTexture",             OBJECT_BIND,    "TextureUnits",       0, -1, -1, -1, -1, -1},
+    {"glBindVertexArray",           OBJECT_BIND,    "VertexArrays",       0, -1, -1, -1, -1, -1},
+    {"glBindBuffersBase",           OBJECT_UNBIND,  "Buffers",           -1, -1, -1, -1, -1, -1},
+    {"glBindBuffersRange",          OBJECT_UNBIND,  "Buffers",           -1, -1, -1, -1, -1, -1},
+    {"glBindBufferBase",            OBJECT_BIND,    "Buffers",            2,  0, -1, -1, -1, -1},
+    {"glBindBufferRange",           OBJECT_BIND,    "Buffers",            2,  0, -1, -1, -1, -1},
+    {"glBindBufferOffset",          OBJECT_BIND,    "Buffers",            2,  0, -1, -1, -1, -1},
+    {"glBindBuffer",                OBJECT_BIND,    "Buffers",            1,  0, -1, -1, -1, -1},
+    {"glBindTextures",              OBJECT_UNBIND,  "Textures",          -1, -1, -1, -1, -1, -1},
+    {"glBindTextureUnit",           OBJECT_UNBIND,  "Textures",          -1, -1, -1, -1, -1, -1},
+    {"glBindTexture",               OBJECT_BIND,    "Textures",           1,  0, -1, -1, -1, -1},
+    {"glBindMultiTexture",          OBJECT_BIND,    "Textures",           2,  1,  0, -1, -1, -1},
+    {"glGenBuffers",                OBJECT_CREATE,  "Buffers",            1, -1, -1, -1, -1, -1},
+    {"glCreateBuffers",             OBJECT_CREATE,  "Buffers",            1, -1, -1, -1, -1, -1},
+    {"glDeleteBuffers",             OBJECT_DELETE,  "Buffers",            1, -1, -1, -1, -1, -1},
+    {"glGenTextures",               OBJECT_CREATE,  "Textures",           1, -1, -1, -1, -1, -1},
+    {"glCreateTextures",            OBJECT_CREATE,  "Textures",           2, -1, -1, -1, -1, -1},
+    {"glDeleteTextures",            OBJECT_DELETE,  "Textures",           1, -1, -1, -1, -1, -1},
+    {"glGenVertexArrays",           OBJECT_CREATE,  "VertexArrays",       1, -1, -1, -1, -1, -1},
+    {"glCreateVertexArrays",        OBJECT_CREATE,  "VertexArrays",       1, -1, -1, -1, -1, -1},
+    {"glDeleteVertexArrays",        OBJECT_DELETE,  "VertexArrays",       1, -1, -1, -1, -1, -1},
+    {"glGenFramebuffers",           OBJECT_CREATE,  "Framebuffers",       1, -1, -1, -1, -1, -1},
+    {"glCreateFramebuffers",        OBJECT_CREATE,  "Framebuffers",       1, -1, -1, -1, -1, -1},
+    {"glDeleteFramebuffers",        OBJECT_DELETE,  "Framebuffers",       1, -1, -1, -1, -1, -1},
+    {"glGenRenderbuffers",          OBJECT_CREATE,  "Renderbuffers",      1, -1, -1, -1, -1, -1},
+    {"glCreateRenderbuffers",       OBJECT_CREATE,  "Renderbuffers",      1, -1, -1, -1, -1, -1},
+    {"glDeleteRenderbuffers",       OBJECT_DELETE,  "Renderbuffers",      1, -1, -1, -1, -1, -1},
+    {"glGenSamplers",               OBJECT_CREATE,  "Samplers",           1, -1, -1, -1, -1, -1},
+    {"glCreateSamplers",            OBJECT_CREATE,  "Samplers",           1, -1, -1, -1, -1, -1},
+    {"glDeleteSamplers",            OBJECT_DELETE,  "Samplers",           1, -1, -1, -1, -1, -1},
+    {"glGenQueries",                OBJECT_CREATE,  "Queries",            1, -1, -1, -1, -1, -1},
+    {"glCreateQueries",             OBJECT_CREATE,  "Queries",            2, -1, -1, -1, -1, -1},
+    {"glDeleteQueries",             OBJECT_DELETE,  "Queries",            1, -1, -1, -1, -1, -1},
+    {"glBeginQueryIndexed",         OBJECT_USE,     "Queries",            2, -1, -1, -1, -1, -1},
+    {"glBeginQuery",                OBJECT_USE,     "Queries",            1, -1, -1, -1, -1, -1},
+    {"glQueryCounter",              OBJECT_USE,     "Queries",            0, -1, -1, -1, -1, -1},
+    {"glGenTransformFeedbacks",     OBJECT_CREATE,  "TransformFeedbacks", 1, -1, -1, -1, -1, -1},
+    {"glCreateTransformFeedbacks",  OBJECT_CREATE,  "TransformFeedbacks", 1, -1, -1, -1, -1, -1},
+    {"glDeleteTransformFeedbacks",  OBJECT_DELETE,  "TransformFeedbacks", 1, -1, -1, -1, -1, -1},
+    {"glGenProgramPipelines",       OBJECT_CREATE,  "ProgramPipelines",   1, -1, -1, -1, -1, -1},
+    {"glCreateProgramPipelines",    OBJECT_CREATE,  "ProgramPipelines",   1, -1, -1, -1, -1, -1},
+    {"glDeleteProgramPipelines",    OBJECT_DELETE,  "ProgramPipelines",   1, -1, -1, -1, -1, -1},
+    {"glFenceSync",                 OBJECT_CREATE,  "Syncs",     ARG_RETURN, -1, -1, -1, -1, -1},
+    {"glDeleteSync",                OBJECT_DELETE,  "Syncs",              0, -1, -1, -1, -1, -1},
+    {"glClientWaitSync",            OBJECT_USE,     "Syncs",              0, -1, -1, -1, -1, -1},
+    {"glWaitSync",                  OBJECT_USE,     "Syncs",              0, -1, -1, -1, -1, -1},
+    {"glBufferData",                OBJECT_WRITE,   "Buffers",           -1,  0, -1, -1, -1, -1},
+    {"glBufferStorage",             OBJECT_STORAGE, "Buffers",           -1,  0, -1, -1, -1, -1},
+    {"glBufferSubData",             OBJECT_WRITE,   "Buffers",           -1,  0, -1,  1,  2, -1},
+    {"glNamedBufferData",           OBJECT_WRITE,   "Buffers",            0, -1, -1, -1, -1, -1},
+    {"glNamedBufferStorage",        OBJECT_STORAGE, "Buffers",            0, -1, -1, -1, -1, -1},
+    {"glNamedBufferSubData",        OBJECT_WRITE,   "Buffers",            0, -1, -1,  1,  2, -1},
+    {"glCopyBufferSubData",         OBJECT_WRITE,   "Buffers",           -1,  1, -1,  3,  4,  0},
+    {"glCopyNamedBufferSubData",    OBJECT_WRITE,   "Buffers",            1, -1, -1,  3,  4,  0},
+    {"glNamedCopyBufferSubData",    OBJECT_WRITE,   "Buffers",            1, -1, -1,  3,  4,  0},
+    {"glMapBuffer",                 OBJECT_MAP,     "Buffers",           -1,  0, -1, -1, -1, -1},
+    {"glMapBufferRange",            OBJECT_MAP,     "Buffers",           -1,  0, -1,  1,  2, -1},
+    {"glMapNamedBuffer",            OBJECT_MAP,     "Buffers",            0, -1, -1, -1, -1, -1},
+    {"glMapNamedBufferRange",       OBJECT_MAP,     "Buffers",            0, -1, -1,  1,  2, -1},
+    {"glFlushMappedBufferRange",    OBJECT_FLUSH,   "Buffers",           -1,  0, -1,  1,  2, -1},
+    {"glFlushMappedNamedBufferRange", OBJECT_FLUSH, "Buffers",            0, -1, -1,  1,  2, -1},
+    {"glUnmapBuffer",               OBJECT_UNMAP,   "Buffers",           -1,  0, -1, -1, -1, -1},
+    {"glUnmapNamedBuffer",          OBJECT_UNMAP,   "Buffers",            0, -1, -1, -1, -1, -1},
+    {"memcpy",                      OBJECT_MEMCPY,  "Buffers",            0, -1, -1, -1,  2, -1},
+    {"glTexImage",                  OBJECT_WRITE,   "Textures",          -1,  0,  1, -1, -1, ARG_UNPACK_BUFFER},
+    {"glCompressedTexImage",        OBJECT_WRITE,   "Textures",          -1,  0,  1, -1, -1, ARG_UNPACK_BUFFER},
+    {"glTexSubImage1D",             OBJECT_WRITE,   "Textures",          -1,  0,  1,  2,  3, ARG_UNPACK_BUFFER},
+    {"glTexSubImage2D",             OBJECT_WRITE,   "Textures",          -1,  0,  1,  2,  4, ARG_UNPACK_BUFFER},
+    {"glTexSubImage3D",             OBJECT_WRITE,   "Textures",          -1,  0,  1,  2,  5, ARG_UNPACK_BUFFER},
+    {"glCompressedTexSubImage1D",   OBJECT_WRITE,   "Textures",          -1,  0,  1,  2,  3, ARG_UNPACK_BUFFER},
+    {"glCompressedTexSubImage2D",   OBJECT_WRITE,   "Textures",          -1,  0,  1,  2,  4, ARG_UNPACK_BUFFER},
+    {"glCompressedTexSubImage3D",   OBJECT_WRITE,   "Textures",          -1,  0,  1,  2,  5, ARG_UNPACK_BUFFER},
+    {"glTexStorage",                OBJECT_STORAGE, "Textures",          -1,  0, -1, -1, -1, -1},
+    // EXT_direct_state_access variants, which also take the target
+    {"glTextureImage",              OBJECT_WRITE,   "Textures",           0,  1,  2, -1, -1, ARG_UNPACK_BUFFER},
+    {"glCompressedTextureImage",    OBJECT_WRITE,   "Textures",           0,  1,  2, -1, -1, ARG_UNPACK_BUFFER},
+    {"glTextureSubImage1DEXT",      OBJECT_WRITE,   "Textures",           0,  1,  2,  3,  4, ARG_UNPACK_BUFFER},
+    {"glTextureSubImage2DEXT",      OBJECT_WRITE,   "Textures",           0,  1,  2,  3,  5, ARG_UNPACK_BUFFER},
+    {"glTextureSubImage3DEXT",      OBJECT_WRITE,   "Textures",           0,  1,  2,  3,  6, ARG_UNPACK_BUFFER},
+    {"glCompressedTextureSubImage1DEXT", OBJECT_WRITE, "Textures",        0,  1,  2,  3,  4, ARG_UNPACK_BUFFER},
+    {"glCompressedTextureSubImage2DEXT", OBJECT_WRITE, "Textures",        0,  1,  2,  3,  5, ARG_UNPACK_BUFFER},
+    {"glCompressedTextureSubImage3DEXT", OBJECT_WRITE, "Textures",        0,  1,  2,  3,  6, ARG_UNPACK_BUFFER},
+    {"glTextureSubImage1D",         OBJECT_WRITE,   "Textures",           0, -1,  1,  2,  3, ARG_UNPACK_BUFFER},
+    {"glTextureSubImage2D",         OBJECT_WRITE,   "Textures",           0, -1,  1,  2,  4, ARG_UNPACK_BUFFER},
+    {"glTextureSubImage3D",         OBJECT_WRITE,   "Textures",           0, -1,  1,  2,  5, ARG_UNPACK_BUFFER},
+    {"glCompressedTextureSubImage1D", OBJECT_WRITE, "Textures",           0, -1,  1,  2,  3, ARG_UNPACK_BUFFER},
+    {"glCompressedTextureSubImage2D", OBJECT_WRITE, "Textures",           0, -1,  1,  2,  4, ARG_UNPACK_BUFFER},
+    {"glCompressedTextureSubImage3D", OBJECT_WRITE, "Textures",           0, -1,  1,  2,  5, ARG_UNPACK_BUFFER},
+    {"glTextureStorage",            OBJECT_STORAGE, "Textures",           0, -1, -1, -1, -1, -1},
+    {NULL,                          OBJECT_NONE,    NULL,                -1, -1, -1, -1, -1, -1}
+};
+
+
+static unsigned char
+lookupObjectFunction(const char *name)
+{
+    unsigned i;
+    for (i = 0; objectFunctions[i].prefix; ++i) {
+        if (matchesFunction(name, objectFunctions[i].prefix)) {
+            break;
+        }
+    }
+    return i;
+}
+
+
+/**
+ * Append the serialized bytes of an event between the given offsets to the
+ * key, leaving out the signature definitions, which only the first calls
+ * include.
+ */
+static void
+appendBytes(std::string &key, const LocalWriter::Buffer &buffer, size_t begin, size_t end)
+{
+    for (unsigned i = 0; i < buffer.definitions.size() && begin < end; ++i) {
+        const LocalWriter::Buffer::Definition &definition = buffer.definitions[i];
+        if (definition.end <= begin || definition.begin == definition.end) {
+            continue;
+        }
+        if (definition.begin >= end) {
+            break;
+        }
+        key.append(&buffer.data[begin], definition.begin - begin);
+        begin = definition.end;
+    }
+    if (begin < end) {
+        key.append(&buffer.data[begin], end - begin);
+    }
+}
+
+
+/**
+ * Read a number serialized by Writer::_writeUInt.
+ */
+static bool
+readVarUInt(const std::vector<char> &data, size_t &pos, unsigned long long &value)
+{
+    value = 0;
+    for (unsigned shift = 0; pos < data.size() && shift < 64; shift += 7) {
+        unsigned char c = data[pos++];
+        value |= (unsigned long long)(c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/**
+ * Read an integer, enum, bitmask or pointer value from an event, skipping the
+ * signature definition it may include.
+ */
+static bool
+readNumber(const LocalWriter::Buffer &buffer, size_t &pos, unsigned long long &value)
+{
+    const std::vector<char> &data = buffer.data;
+    if (pos >= data.size()) {
+        return false;
+    }
+
+    unsigned char type = data[pos++];
+    switch (type) {
+    case trace::TYPE_NULL:
+    case trace::TYPE_FALSE:
+        value = 0;
+        return true;
+    case trace::TYPE_TRUE:
+        value = 1;
+        return true;
+    case trace::TYPE_SINT:
+        if (!readVarUInt(data, pos, value)) {
+            return false;
+        }
+        value = -value;
+        return true;
+    case trace::TYPE_UINT:
+    case trace::TYPE_OPAQUE:
+        return readVarUInt(data, pos, value);
+    case trace::TYPE_ENUM:
+    case trace::TYPE_BITMASK:
+        if (!readVarUInt(data, pos, value)) {
+            return false;
+        }
+        for (unsigned i = 0; i < buffer.definitions.size(); ++i) {
+            if (buffer.definitions[i].begin == pos) {
+                pos = buffer.definitions[i].end;
+            }
+        }
+        if (type == trace::TYPE_BITMASK) {
+            return readVarUInt(data, pos, value);
+        }
+        return readNumber(buffer, pos, value);
+    default:
+        return false;
+    }
+}
+
+
+/**
+ * Find where the value of the given argument, or the return value, begins in
+ * an event.
+ */
+static bool
+findValue(const LocalWriter::Buffer &buffer, int index, size_t &pos)
+{
+    const std::vector<char> &data = buffer.data;
+    for (unsigned i = 0; i < buffer.args.size(); ++i) {
+        size_t begin = buffer.args[i];
+        if (begin >= data.size()) {
+            continue;
+        }
+        if (data[begin] == trace::CALL_RET) {
+            if (index == ARG_RETURN) {
+                pos = begin + 1;
+                return true;
+            }
+            continue;
+        }
+        unsigned long long argIndex;
+        pos = begin + 1;
+        if (data[begin] == trace::CALL_ARG &&
+            readVarUInt(data, pos, argIndex) &&
+            argIndex == (unsigned long long)index) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+static bool
+readValue(const LocalWriter::Buffer &buffer, int index, unsigned long long &value)
+{
+    size_t pos;
+    return index != ARG_NONE &&
+           findValue(buffer, index, pos) &&
+           readNumber(buffer, pos, value);
+}
+
+
+/**
+ * Read the object names an argument or the return value holds, whether a
+ * single one or an array.
+ */
+static bool
+readNames(const LocalWriter::Buffer &buffer, int index, std::vector<unsigned long long> &names)
+{
+    const std::vector<char> &data = buffer.data;
+    size_t pos;
+    if (!findValue(buffer, index, pos) || pos >= data.size()) {
+        return false;
+    }
+
+    unsigned long long count;
+    unsigned long long name;
+    switch (data[pos]) {
+    case trace::TYPE_NULL:
+        return true;
+    case trace::TYPE_ARRAY:
+        ++pos;
+        if (!readVarUInt(data, pos, count)) {
+            return false;
+        }
+        for (unsigned long long i = 0; i < count; ++i) {
+            if (!readNumber(buffer, pos, name)) {
+                return false;
+            }
+            names.push_back(name);
+        }
+        return true;
+    case trace::TYPE_PACKED_ARRAY: {
+        pos += 2;
+        unsigned long long size;
+        if (!readVarUInt(data, pos, size) ||
+            !readVarUInt(data, pos, count) ||
+            (size != 1 && size != 2 && size != 4 && size != 8) ||
+            count > (data.size() - pos) / size) {
+            return false;
+        }
+        for (unsigned long long i = 0; i < count; ++i, pos += size) {
+            uint8_t value8;
+            uint16_t value16;
+            uint32_t value32;
+            uint64_t value64;
+            switch (size) {
+            case 1: memcpy(&value8, &data[pos], size); name = value8; break;
+            case 2: memcpy(&value16, &data[pos], size); name = value16; break;
+            case 4: memcpy(&value32, &data[pos], size); name = value32; break;
+            default: memcpy(&value64, &data[pos], size); name = value64; break;
+            }
+            names.push_back(name);
+        }
+        return true;
+    }
+    default:
+        if (!readNumber(buffer, pos, name)) {
+            return false;
+        }
+        names.push_back(name);
+        return true;
+    }
+}
+
+
+/**
+ * Keys telling apart the objects of a kind each thread names, and the targets
+ * (of a texture unit or vertex array) it binds them to.
+ */
+static std::string
+objectKey(unsigned thread, const char *objects, unsigned long long name)
+{
+    std::string key(reinterpret_cast<const char *>(&thread), sizeof thread);
+    key += objects;
+    key += '\0';
+    key.append(reinterpret_cast<const char *>(&name), sizeof name);
+    return key;
+}
+
+static std::string
+bindingKey(unsigned thread, const char *objects, unsigned long long unit, unsigned long long target)
+{
+    std::string key = objectKey(thread, objects, unit);
+    key.append(reinterpret_cast<const char *>(&target), sizeof target);
+    return key;
+}
+
+
+static const unsigned long long UNKNOWN_NAME = ~0ULL;
+
+
+static std::string
+imageKey(const std::string &object, unsigned long long target, unsigned long long level)
+{
+    std::string key = object;
+    key.append(reinterpret_cast<const char *>(&target), sizeof target);
+    key.append(reinterpret_cast<const char *>(&level), sizeof level);
+    return key;
+}
+
+
+static bool
+coversRegion(const LocalWriter::Region &a, const LocalWriter::Region &b)
+{
+    if (a.whole || b.whole) {
+        // Only writes of the whole object or level define its layout
+        return a.whole;
+    }
+    for (unsigned i = 0; i < 3; ++i) {
+        if (a.begin[i] > b.begin[i] || a.end[i] < b.end[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+struct RecordedEvent {
+    unsigned order;
+    LocalWriter::RecordedCall *call;
+    bool leave;
+};
+
+
+static bool
+recordedBefore(const RecordedEvent &a, const RecordedEvent &b)
+{
+    return a.order < b.order;
+}
+
+
 static void exceptionCallback(void)
 {
     localWriter.flush();
@@ -63,11 +942,31 @@ static void exceptionCallback(void)
 
 
 LocalWriter::LocalWriter() :
-    acquired(0)
+    nextWriteNo(0),
+    generation(0),
+    recordFrames(0),
+    keptCount(0),
+    frameEpoch(0),
+    recordedEvents(0),
+    recordingWritten(false),
+    callTimes(false),
+    startTime(os::getTime())
 {
     os::String process = os::getProcessName();
     os::log("apitrace: loaded into %s\n", process.str());
 
+    const char *frames = getenv("APITRACE_FLIGHT_RECORDER");
+    if (frames && atoi(frames) > 0) {
+        recordFrames = atoi(frames);
+        os::log("apitrace: recording the last %u frames\n", recordFrames);
+    }
+
+    const char *times = getenv("APITRACE_CALL_TIMES");
+    if (times && atoi(times) > 0) {
+        callTimes = true;
+        os::log("apitrace: recording call times\n");
+    }
+
     // Install the signal handlers as early as possible, to prevent
     // interfering with the application's signal handling.
     os::setExceptionCallback(exceptionCallback);
@@ -77,6 +976,12 @@ LocalWriter::~LocalWriter()
 {
     os::resetExceptionCallback();
     checkProcessId();
+    if (recordFrames && m_file->isOpened()) {
+        os::unique_lock<os::recursive_mutex> lock(mutex);
+        writeRecording();
+    }
+    clearRecording();
+    clearPending();
 }
 
 void
@@ -136,6 +1041,13 @@ LocalWriter::open(void) {
 
     os::log("apitrace: tracing to %s\n", lpFileName);
 
+    // Calls serialized for a previous file are of no use
+    clearPending();
+    clearRecording();
+    recordingWritten = false;
+    nextWriteNo = 0;
+    ++generation;
+
     if (!Writer::open(lpFileName)) {
         os::log("apitrace: error: failed to open %s\n", lpFileName);
         os::abort();
@@ -149,10 +1061,52 @@ LocalWriter::open(void) {
 #endif
 }
 
-static uintptr_t next_thread_num = 1;
+static unsigned next_thread_num = 0;
+
+static OS_THREAD_SPECIFIC_PTR(LocalWriter::ThreadState)
+thread_state;
+
+#ifndef _WIN32
+
+/*
+ * Compiler TLS has no destructors, so a key of its own frees the thread's
+ * state when it exits.  Its events were all submitted by then, unless it
+ * exited while serializing a call, in which case the state is left alone
+ * for the exception handler to find.
+ */
+static pthread_key_t thread_state_key;
+static pthread_once_t thread_state_key_once = PTHREAD_ONCE_INIT;
+
+static void
+destroyThreadState(void *ptr) {
+    LocalWriter::ThreadState *state =
+        static_cast<LocalWriter::ThreadState *>(ptr);
+    if (state != thread_state || state->acquired) {
+        return;
+    }
+    thread_state = NULL;
+    delete state;
+}
+
+static void
+createThreadStateKey(void) {
+    pthread_key_create(&thread_state_key, destroyThreadState);
+}
+
+#endif
 
-static OS_THREAD_SPECIFIC(uintptr_t)
-thread_num;
+LocalWriter::ThreadState *LocalWriter::getThreadState(void) {
+    ThreadState *state = thread_state;
+    if (!state) {
+        state = new ThreadState;
+        thread_state = state;
+#ifndef _WIN32
+        pthread_once(&thread_state_key_once, createThreadStateKey);
+        pthread_setspecific(thread_state_key, state);
+#endif
+    }
+    return state;
+}
 
 void LocalWriter::checkProcessId(void) {
     if (m_file->isOpened() &&
@@ -168,76 +1122,1182 @@ void LocalWriter::checkProcessId(void) {
     }
 }
 
-unsigned LocalWriter::beginEnter(const FunctionSig *sig, bool fake) {
-    mutex.lock();
-    ++acquired;
+/*
+ * Calls are serialized into the calling thread's buffer, but anything else
+ * (i.e., the file header) is written directly.
+ */
 
-    checkProcessId();
-    if (!m_file->isOpened()) {
-        open();
+void LocalWriter::_write(const void *sBuffer, size_t dwBytesToWrite) {
+    ThreadState *state = thread_state;
+    if (!state || !state->acquired) {
+        m_file->write(sBuffer, dwBytesToWrite);
+        return;
     }
 
-    uintptr_t this_thread_num = thread_num;
-    if (!this_thread_num) {
-        this_thread_num = next_thread_num++;
-        thread_num = this_thread_num;
+    std::vector<char> &data = state->buffer.data;
+    const char *bytes = static_cast<const char *>(sBuffer);
+    data.insert(data.end(), bytes, bytes + dwBytesToWrite);
+}
+
+bool LocalWriter::beginDefinition(SigKind kind, unsigned id) {
+    ThreadState *state = thread_state;
+    std::vector<bool> &used = state->used[kind];
+    if (id >= used.size()) {
+        used.resize(id + 1);
     }
+    bool define = !used[id];
+    if (!define && !recordFrames) {
+        return false;
+    }
+    used[id] = true;
 
-    assert(this_thread_num);
-    unsigned thread_id = this_thread_num - 1;
-    unsigned call_no = Writer::beginEnter(sig, thread_id);
-    if (!fake && os::backtrace_is_needed(sig->name)) {
-        std::vector<RawStackFrame> backtrace = os::get_backtrace();
-        beginBacktrace(backtrace.size());
-        for (unsigned i = 0; i < backtrace.size(); ++i) {
-            writeStackFrame(&backtrace[i]);
-        }
-        endBacktrace();
+    Buffer::Definition definition;
+    definition.kind = kind;
+    definition.id = id;
+    definition.begin = state->buffer.data.size();
+    definition.end = definition.begin;
+    if (define) {
+        state->buffer.open.push_back(state->buffer.definitions.size());
     }
-    return call_no;
+    state->buffer.definitions.push_back(definition);
+    return define;
 }
 
-void LocalWriter::endEnter(void) {
-    Writer::endEnter();
-    --acquired;
-    mutex.unlock();
+void LocalWriter::endDefinition(void) {
+    Buffer &buffer = thread_state->buffer;
+    assert(!buffer.open.empty());
+    buffer.definitions[buffer.open.back()].end = buffer.data.size();
+    buffer.open.pop_back();
 }
 
-void LocalWriter::beginLeave(unsigned call) {
-    mutex.lock();
-    ++acquired;
-    Writer::beginLeave(call);
+bool LocalWriter::lookupBlob(const BlobDigest &digest, size_t size) {
+    ThreadState *state = thread_state;
+    bool found = state->blobDigests.lookup(digest, size);
+    return found && !state->keepable;
 }
 
-void LocalWriter::endLeave(void) {
-    Writer::endLeave();
-    --acquired;
-    mutex.unlock();
+/**
+ * Copy a serialized event from the given offset into the file, leaving out
+ * the signature definitions that are already there.
+ *
+ * Must be called with the mutex held.
+ */
+void LocalWriter::writeBuffer(Buffer &buffer, size_t begin) {
+    const char *data = buffer.data.empty() ? NULL : &buffer.data[0];
+    size_t pos = begin;
+    for (unsigned i = 0; i < buffer.definitions.size(); ++i) {
+        const Buffer::Definition &definition = buffer.definitions[i];
+        if (definition.begin < pos) {
+            // Nested in a definition left out, so already defined too
+            continue;
+        }
+        std::vector<bool> &map = defined[definition.kind];
+        if (definition.id >= map.size()) {
+            map.resize(definition.id + 1);
+        }
+        if (map[definition.id]) {
+            m_file->write(data + pos, definition.begin - pos);
+            pos = definition.end;
+        } else {
+            map[definition.id] = true;
+            if (definition.begin == definition.end) {
+                // Defined by a call that wasn't recorded
+                std::vector<char> &bytes = recordedDefinitions[definition.kind][definition.id];
+                assert(!bytes.empty());
+                m_file->write(data + pos, definition.begin - pos);
+                m_file->write(&bytes[0], bytes.size());
+                pos = definition.end;
+            }
+        }
+    }
+    m_file->write(data + pos, buffer.data.size() - pos);
 }
 
-void LocalWriter::flush(void) {
-    /*
-     * Do nothing if the mutex is already acquired (e.g., if a segfault happen
-     * while writing the file) as state could be inconsistent, therefore yield
-     * inconsistent trace files and/or repeated segfaults till infinity.
-     */
+/**
+ * Write a serialized event into the file, or into its recorded call.
+ *
+ * Must be called with the mutex held.
+ */
+void LocalWriter::commitBuffer(Buffer &buffer, unsigned call, bool leave) {
+    if (!recordFrames) {
+        writeBuffer(buffer);
+        return;
+    }
 
-    mutex.lock();
-    if (acquired) {
-        os::log("apitrace: ignoring exception while tracing\n");
+    RecordedCallMap::iterator it = recordedCalls.find(call);
+    if (it == recordedCalls.end()) {
+        // Dropped along with its frame
+        return;
+    }
+
+    ThreadState *state = thread_state;
+
+    for (unsigned i = 0; i < buffer.definitions.size(); ++i) {
+        const Buffer::Definition &definition = buffer.definitions[i];
+        if (definition.begin == definition.end) {
+            continue;
+        }
+        std::vector< std::vector<char> > &definitions = recordedDefinitions[definition.kind];
+        if (definition.id >= definitions.size() ||
+            definitions[definition.id].empty()) {
+            state->recording = true;
+            if (definition.id >= definitions.size()) {
+                definitions.resize(definition.id + 1);
+            }
+            definitions[definition.id].assign(buffer.data.begin() + definition.begin,
+                                              buffer.data.begin() + definition.end);
+            state->recording = false;
+        }
+    }
+
+    Buffer *event = new Buffer;
+    event->data = buffer.data;
+    event->definitions = buffer.definitions;
+    event->args = buffer.args;
+
+    RecordedCall *recorded = it->second;
+    if (leave) {
+        recorded->leaveOrder = recordedEvents++;
+        recorded->leave = event;
     } else {
-        ++acquired;
-        if (m_file->isOpened()) {
-            if (os::getCurrentProcessId() != pid) {
-                os::log("apitrace: ignoring exception in child process\n");
-            } else {
-                os::log("apitrace: flushing trace due to an exception\n");
-                m_file->flush();
+        recorded->enterOrder = recordedEvents++;
+        recorded->enter = event;
+    }
+}
+
+unsigned LocalWriter::classifyCall(const FunctionSig *sig, bool fake) {
+    if (sig->id >= callClasses.size()) {
+        callClasses.resize(sig->id + 1);
+    }
+
+    unsigned char &callClass = callClasses[sig->id];
+    if (!callClass) {
+        CallFlags flags = Parser::lookupCallFlags(sig->name);
+        unsigned char objectFunction = lookupObjectFunction(sig->name);
+        callClass = CALL_CLASS_KNOWN;
+        if (flags & CALL_FLAG_END_FRAME) {
+            callClass |= CALL_CLASS_END_FRAME;
+        } else if (objectFunctions[objectFunction].prefix) {
+            // Including the memcpy calls filling mapped buffers
+            callClass |= CALL_CLASS_STATE;
+        } else if (isKeptCall(sig->name)) {
+            callClass |= CALL_CLASS_KEEP;
+        } else if (!fake &&
+                   !(flags & (CALL_FLAG_NO_SIDE_EFFECTS | CALL_FLAG_RENDER | CALL_FLAG_MARKER))) {
+            callClass |= CALL_CLASS_STATE;
+        }
+        if (callClass & CALL_CLASS_STATE) {
+            if (sig->id >= stateFunctionIds.size()) {
+                stateFunctionIds.resize(sig->id + 1);
+                objectFunctionIds.resize(sig->id + 1);
             }
+            stateFunctionIds[sig->id] = lookupStateFunction(sig->name);
+            objectFunctionIds[sig->id] = objectFunction;
+        }
+        if (strstr(sig->name, "MakeCurrent") ||
+            strstr(sig->name, "MakeContextCurrent") ||
+            strcmp(sig->name, "CGLSetCurrentContext") == 0) {
+            callClass |= CALL_CLASS_MAKE_CURRENT;
         }
-        --acquired;
     }
-    mutex.unlock();
+    return callClass;
+}
+
+/**
+ * Record a call that was just numbered, starting a new frame after it if it
+ * ends one, and dropping the oldest frame once there are too many.
+ *
+ * Must be called with the mutex held.
+ */
+void LocalWriter::recordCall(unsigned call, const FunctionSig *sig, unsigned callClass, bool keep) {
+    if (recordingWritten) {
+        return;
+    }
+
+    RecordedCall *recorded = new RecordedCall;
+    recorded->no = call;
+    recorded->sig = sig->id;
+    recorded->callClass = callClass;
+    recorded->thread = thread_state->thread_id;
+    recorded->keptBefore = keptCount;
+    if (callClass & CALL_CLASS_MAKE_CURRENT) {
+        ++thread_state->contextNo;
+    }
+    recorded->contextNo = thread_state->contextNo;
+    recordedCalls[call] = recorded;
+
+    if (keep) {
+        keptCalls[call] = recorded;
+        ++keptCount;
+        if (frames.empty() && (callClass & CALL_CLASS_STATE)) {
+            // Tracked once the first frame ends
+            initialCalls.push_back(recorded);
+        }
+    } else {
+        frames.back().push_back(recorded);
+    }
+
+    if (callClass & CALL_CLASS_END_FRAME) {
+        frames.push_back(RecordedCalls());
+        while (frames.size() > recordFrames + 1) {
+            dropFrame(frames.front());
+            frames.pop_front();
+        }
+        ++frameEpoch;
+    }
+}
+
+/**
+ * Drop the calls of a frame, except for the state setting calls which may be
+ * needed to replay kept calls, or the recorded frames.
+ */
+void LocalWriter::dropFrame(RecordedCalls &frame) {
+    // Kept for good, but telling which objects later calls apply to
+    for (unsigned i = 0; i < initialCalls.size(); ++i) {
+        RecordedCall *recorded = initialCalls[i];
+        if (recorded->enter) {
+            ++recorded->dependents;
+            trackObjects(recorded);
+        }
+    }
+    initialCalls.clear();
+
+    for (unsigned i = 0; i < frame.size(); ++i) {
+        RecordedCall *recorded = frame[i];
+
+        if (!(recorded->callClass & CALL_CLASS_STATE)) {
+            recordedCalls.erase(recorded->no);
+            delete recorded;
+            continue;
+        }
+
+        keptCalls[recorded->no] = recorded;
+
+        if (!recorded->enter) {
+            // Still being serialized, so there's no telling what it sets
+            continue;
+        }
+
+        const StateFunction &function = stateFunctions[stateFunctionIds[recorded->sig]];
+        unsigned char action = objectFunctions[objectFunctionIds[recorded->sig]].action;
+        const Buffer &enter = *recorded->enter;
+        size_t end = enter.data.size() - 1;
+        size_t begin = enter.args.empty() ? end : enter.args[0];
+        size_t keyEnd = function.keyArgs < enter.args.size() ? enter.args[function.keyArgs] : end;
+
+        std::string thread(reinterpret_cast<const char *>(&recorded->thread), sizeof recorded->thread);
+        std::string &key = recorded->key;
+        key = thread;
+        key.append(reinterpret_cast<const char *>(&recorded->sig), sizeof recorded->sig);
+        appendBytes(key, enter, begin, keyEnd);
+
+        // The state selected by this thread's dropped calls, which kept calls
+        // can't change without preventing the replacement below anyway, and
+        // which creating, deleting or using objects doesn't depend on
+        bool selected = action != OBJECT_CREATE && action != OBJECT_DELETE && action != OBJECT_USE;
+        for (unsigned select = 0; selected && select < SELECT_COUNT; ++select) {
+            unsigned mask = 1 << select;
+            if (!((function.appliesTo | function.uses) & mask)) {
+                continue;
+            }
+            std::string prefix = char(select) + thread;
+            for (SelectedStateMap::iterator it = selectedStates.lower_bound(prefix);
+                 it != selectedStates.end() && it->first.compare(0, prefix.size(), prefix) == 0;
+                 ++it) {
+                RecordedCall *selecting = it->second;
+                if (function.appliesTo & mask) {
+                    key += selecting->key;
+                    key += selecting->value;
+                }
+                recorded->context.push_back(selecting);
+                ++selecting->dependents;
+            }
+        }
+
+        if (function.selects) {
+            appendBytes(recorded->value, enter, begin, end);
+            for (unsigned select = 0; select < SELECT_COUNT; ++select) {
+                if (function.selects & (1 << select)) {
+                    selectedStates[char(select) + key] = recorded;
+                }
+            }
+        }
+
+        if (trackObjects(recorded)) {
+            continue;
+        }
+
+        RecordedCall *&latest = latestStateCalls[key];
+        if (latest && latest->keptBefore == recorded->keptBefore) {
+            // No kept call could have depended on it
+            supersedeCall(latest);
+        }
+        latest = recorded;
+    }
+}
+
+/**
+ * Forget a state setting call kept from a dropped frame, once superseded,
+ * along with the superseded calls that were only kept for its sake.
+ */
+void LocalWriter::releaseStateCall(RecordedCall *recorded) {
+    assert(recorded->superseded && !recorded->dependents);
+    for (unsigned i = 0; i < recorded->context.size(); ++i) {
+        RecordedCall *selecting = recorded->context[i];
+        if (--selecting->dependents == 0 && selecting->superseded) {
+            releaseStateCall(selecting);
+        }
+    }
+    for (unsigned i = 0; i < recorded->followers.size(); ++i) {
+        RecordedCall *follower = recorded->followers[i];
+        if (--follower->dependents == 0 && follower->superseded) {
+            releaseStateCall(follower);
+        }
+    }
+    keptCalls.erase(recorded->no);
+    recordedCalls.erase(recorded->no);
+    delete recorded;
+}
+
+void LocalWriter::supersedeCall(RecordedCall *recorded) {
+    recorded->superseded = true;
+    if (!recorded->dependents) {
+        releaseStateCall(recorded);
+    }
+}
+
+static void
+followCall(LocalWriter::RecordedCall *leader, LocalWriter::RecordedCall *follower)
+{
+    leader->followers.push_back(follower);
+    ++follower->dependents;
+}
+
+/**
+ * Look up the object a thread bound to a target, leaving the name alone if it
+ * bound none in the calls tracked so far.  Returns false if there's no
+ * telling, e.g., as it made another context current since.
+ */
+bool LocalWriter::lookupBinding(const RecordedCall *recorded, const char *objects,
+                                unsigned long long unit, unsigned long long target,
+                                unsigned long long &name) {
+    BindingMap::const_iterator it = bindings.find(bindingKey(recorded->thread, objects, unit, target));
+    if (it != bindings.end()) {
+        if (it->second.contextNo != recorded->contextNo) {
+            return false;
+        }
+        name = it->second.name;
+    }
+    return name != UNKNOWN_NAME;
+}
+
+/**
+ * Tell which texture unit, or vertex array, binding an object to the target
+ * applies to.
+ */
+bool LocalWriter::lookupBindingUnit(const RecordedCall *recorded, const char *objects,
+                                    unsigned long long target, unsigned long long &unit) {
+    unit = 0;
+    if (strcmp(objects, "Textures") == 0) {
+        unit = GL_TEXTURE0;
+        if (!lookupBinding(recorded, "TextureUnits", 0, 0, unit)) {
+            return false;
+        }
+        unit -= GL_TEXTURE0;
+    } else if (strcmp(objects, "Buffers") == 0 && target == GL_ELEMENT_ARRAY_BUFFER) {
+        return lookupBinding(recorded, "VertexArrays", 0, 0, unit);
+    }
+    return true;
+}
+
+/**
+ * Rebind the targets a thread bound an object to, or all of them if the name
+ * is unknown.
+ */
+void LocalWriter::resetBindings(const RecordedCall *recorded, const char *objects,
+                                unsigned long long name, unsigned long long value) {
+    std::string prefix = objectKey(recorded->thread, objects, 0);
+    prefix.resize(prefix.size() - sizeof name);
+    for (BindingMap::iterator it = bindings.lower_bound(prefix);
+         it != bindings.end() && it->first.compare(0, prefix.size(), prefix) == 0;
+         ++it) {
+        if (name == UNKNOWN_NAME || it->second.name == name) {
+            it->second.name = value;
+        }
+    }
+}
+
+/**
+ * Tell which object a call names, or writes through the target it's bound to.
+ */
+bool LocalWriter::findObject(const RecordedCall *recorded, const char *objects,
+                             int nameArg, int targetArg,
+                             std::string &object, unsigned long long &target) {
+    const Buffer &enter = *recorded->enter;
+    unsigned long long name = UNKNOWN_NAME;
+    target = 0;
+    if (targetArg != ARG_NONE && !readValue(enter, targetArg, target)) {
+        return false;
+    }
+    if (nameArg != ARG_NONE) {
+        if (!readValue(enter, nameArg, name)) {
+            return false;
+        }
+    } else {
+        unsigned long long bound = target;
+        if (target >= GL_TEXTURE_CUBE_MAP_POSITIVE_X &&
+            target <= GL_TEXTURE_CUBE_MAP_NEGATIVE_Z) {
+            bound = GL_TEXTURE_CUBE_MAP;
+        }
+        unsigned long long unit;
+        if (!lookupBindingUnit(recorded, objects, target, unit) ||
+            !lookupBinding(recorded, objects, unit, bound, name)) {
+            return false;
+        }
+    }
+    object = objectKey(recorded->thread, objects, name);
+    return true;
+}
+
+/**
+ * Record a call writing a region of an object, superseding the calls which
+ * wrote within it before, unless kept calls were made in between.
+ */
+void LocalWriter::writeObject(ObjectWrites &writes, RecordedCall *recorded, const Region &region) {
+    unsigned count = 0;
+    for (unsigned i = 0; i < writes.size(); ++i) {
+        RecordedCall *written = writes[i].call;
+        if (written->keptBefore == recorded->keptBefore &&
+            coversRegion(region, writes[i].region)) {
+            supersedeCall(written);
+        } else {
+            writes[count++] = writes[i];
+        }
+    }
+    writes.resize(count);
+    ObjectWrite write = {region, recorded};
+    writes.push_back(write);
+}
+
+/**
+ * Pin the calls which created and wrote an object a call reads.
+ */
+void LocalWriter::readObject(RecordedCall *recorded, const std::string &object) {
+    for (ObjectWriteMap::iterator it = objectWrites.lower_bound(object);
+         it != objectWrites.end() && it->first.compare(0, object.size(), object) == 0;
+         ++it) {
+        for (unsigned i = 0; i < it->second.size(); ++i) {
+            RecordedCall *written = it->second[i].call;
+            recorded->context.push_back(written);
+            ++written->dependents;
+        }
+    }
+    StateCallMap::iterator it = objectCreators.find(object);
+    if (it != objectCreators.end()) {
+        recorded->context.push_back(it->second);
+        ++it->second->dependents;
+    }
+}
+
+/**
+ * Forget a buffer mapping the given call closes, releasing the calls mapping,
+ * flushing and unmapping it once no kept call depends on them.
+ */
+void LocalWriter::closeMapping(MappingMap::iterator it, RecordedCall *closing, bool follow) {
+    RecordedCall *mapping = it->second.call;
+    ObjectWrites &flushes = it->second.flushes;
+    for (unsigned i = 0; i < flushes.size(); ++i) {
+        followCall(mapping, flushes[i].call);
+        flushes[i].call->superseded = true;
+    }
+    if (follow) {
+        followCall(mapping, closing);
+        closing->superseded = true;
+    }
+    mappings.erase(it);
+    if (mapping->keptBefore == closing->keptBefore) {
+        supersedeCall(mapping);
+    }
+}
+
+/**
+ * Forget the calls selecting an object a call deletes, so that the calls
+ * following it don't tell it apart by them.
+ */
+void LocalWriter::unselectObject(const RecordedCall *recorded, const char *objects, unsigned long long name) {
+    SelectedStateMap::iterator it = selectedStates.begin();
+    while (it != selectedStates.end()) {
+        const RecordedCall *selecting = it->second;
+        const ObjectFunction &function = objectFunctions[objectFunctionIds[selecting->sig]];
+        unsigned long long selected;
+        if (selecting->thread == recorded->thread &&
+            function.action == OBJECT_BIND &&
+            strcmp(function.objects, objects) == 0 &&
+            readValue(*selecting->enter, function.name, selected) &&
+            selected == name) {
+            selectedStates.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+}
+
+/**
+ * Forget an object the given call deletes, releasing the calls which wrote it
+ * unless kept calls may depend on them.
+ */
+void LocalWriter::deleteObject(const std::string &object, RecordedCall *deleting, bool release) {
+    // Deleting a mapped buffer unmaps it
+    MappingMap::iterator mapping = mappings.begin();
+    while (mapping != mappings.end()) {
+        if (mapping->second.object == object) {
+            closeMapping(mapping++, deleting, false);
+        } else {
+            ++mapping;
+        }
+    }
+
+    ObjectWriteMap::iterator it = objectWrites.lower_bound(object);
+    while (it != objectWrites.end() && it->first.compare(0, object.size(), object) == 0) {
+        for (unsigned i = 0; release && i < it->second.size(); ++i) {
+            supersedeCall(it->second[i].call);
+        }
+        objectWrites.erase(it++);
+    }
+}
+
+/**
+ * Account for what a call kept from a dropped frame does to objects, and
+ * release the calls this makes redundant.  Returns whether that also tells
+ * when the call itself can be released, rather than the state it sets.
+ *
+ * Must be called with the mutex held.
+ */
+bool LocalWriter::trackObjects(RecordedCall *recorded) {
+    const ObjectFunction &function = objectFunctions[objectFunctionIds[recorded->sig]];
+    const Buffer &enter = *recorded->enter;
+    std::vector<unsigned long long> names;
+    std::string object;
+    unsigned long long name;
+    unsigned long long target = 0;
+    unsigned long long unit = 0;
+    unsigned long long size;
+    MappingMap::iterator it;
+
+    switch (function.action) {
+    case OBJECT_NONE:
+        return false;
+
+    case OBJECT_BIND: {
+        bool known = readValue(enter, function.name, name) &&
+                     (function.target == ARG_NONE || readValue(enter, function.target, target));
+        if (known && function.level != ARG_NONE) {
+            known = readValue(enter, function.level, unit);
+            unit -= GL_TEXTURE0;
+        } else if (known) {
+            known = lookupBindingUnit(recorded, function.objects, target, unit);
+        }
+        if (known) {
+            Binding binding = {name, recorded->contextNo};
+            bindings[bindingKey(recorded->thread, function.objects, unit, target)] = binding;
+        } else {
+            resetBindings(recorded, function.objects, UNKNOWN_NAME, UNKNOWN_NAME);
+        }
+        return false;
+    }
+
+    case OBJECT_UNBIND:
+        resetBindings(recorded, function.objects, UNKNOWN_NAME, UNKNOWN_NAME);
+        return false;
+
+    case OBJECT_CREATE:
+        if (!recorded->leave || !readNames(*recorded->leave, function.name, names)) {
+            // Kept for good
+            return true;
+        }
+        for (unsigned i = 0; i < names.size(); ++i) {
+            objectCreators[objectKey(recorded->thread, function.objects, names[i])] = recorded;
+            if (strcmp(function.objects, "VertexArrays") == 0) {
+                Binding binding = {0, recorded->contextNo};
+                bindings[bindingKey(recorded->thread, "Buffers", names[i], GL_ELEMENT_ARRAY_BUFFER)] = binding;
+            }
+        }
+        // Released once all of them are deleted
+        recorded->dependents += names.size();
+        supersedeCall(recorded);
+        return true;
+
+    case OBJECT_DELETE: {
+        if (!readNames(enter, function.name, names)) {
+            return true;
+        }
+        bool release = true;
+        for (unsigned i = 0; i < names.size(); ++i) {
+            object = objectKey(recorded->thread, function.objects, names[i]);
+            resetBindings(recorded, function.objects, names[i], 0);
+            unselectObject(recorded, function.objects, names[i]);
+
+            StateCallMap::iterator creator = objectCreators.find(object);
+            RecordedCall *creating = NULL;
+            if (creator != objectCreators.end()) {
+                creating = creator->second;
+                objectCreators.erase(creator);
+            }
+
+            // Kept calls made since it was created may refer to it
+            bool created = creating && creating->keptBefore == recorded->keptBefore;
+            deleteObject(object, recorded, created);
+            if (!created) {
+                release = false;
+                continue;
+            }
+            followCall(creating, recorded);
+            if (--creating->dependents == 0) {
+                releaseStateCall(creating);
+            }
+        }
+        if (release) {
+            supersedeCall(recorded);
+        }
+        return true;
+    }
+
+    case OBJECT_USE: {
+        if (!readValue(enter, function.name, name)) {
+            return true;
+        }
+        StateCallMap::iterator creator = objectCreators.find(objectKey(recorded->thread, function.objects, name));
+        if (creator != objectCreators.end() &&
+            creator->second->keptBefore == recorded->keptBefore) {
+            followCall(creator->second, recorded);
+            recorded->superseded = true;
+        }
+        return true;
+    }
+
+    case OBJECT_WRITE:
+    case OBJECT_STORAGE: {
+        unsigned long long level = 0;
+        Region region = {function.size == ARG_NONE, {0, 0, 0}, {1, 1, 1}};
+        if (!findObject(recorded, function.objects, function.name, function.target, object, target) ||
+            (function.level != ARG_NONE && !readValue(enter, function.level, level))) {
+            return false;
+        }
+        for (int i = 0; !region.whole && i < function.size - function.offset; ++i) {
+            if (!readValue(enter, function.offset + i, region.begin[i]) ||
+                !readValue(enter, function.size + i, size)) {
+                return false;
+            }
+            region.end[i] = region.begin[i] + size;
+        }
+
+        if (function.source == ARG_UNPACK_BUFFER) {
+            name = 0;
+            if (lookupBinding(recorded, "Buffers", 0, GL_PIXEL_UNPACK_BUFFER, name) && name) {
+                readObject(recorded, objectKey(recorded->thread, "Buffers", name));
+            }
+        } else if (function.source != ARG_NONE) {
+            std::string source;
+            bool named = function.name != ARG_NONE;
+            if (findObject(recorded, function.objects,
+                           named ? function.source : ARG_NONE,
+                           named ? ARG_NONE : function.source,
+                           source, unit)) {
+                readObject(recorded, source);
+            }
+        }
+
+        if (region.whole && strcmp(function.objects, "Buffers") == 0) {
+            // Respecifying a mapped buffer unmaps it
+            it = mappings.begin();
+            while (it != mappings.end()) {
+                if (it->second.object == object) {
+                    closeMapping(it++, recorded, false);
+                } else {
+                    ++it;
+                }
+            }
+        }
+
+        if (function.action == OBJECT_STORAGE) {
+            // Never superseded, as it can't be respecified
+            ObjectWrite write = {region, recorded};
+            objectWrites[imageKey(object, ~0ULL, ~0ULL)].push_back(write);
+            return true;
+        }
+
+        if (target < GL_TEXTURE_CUBE_MAP_POSITIVE_X ||
+            target > GL_TEXTURE_CUBE_MAP_NEGATIVE_Z) {
+            // Only cube map faces tell apart images of the same level
+            target = 0;
+        }
+        writeObject(objectWrites[imageKey(object, target, level)], recorded, region);
+        return true;
+    }
+
+    case OBJECT_MAP: {
+        unsigned long long pointer;
+        if (!recorded->leave ||
+            !readValue(*recorded->leave, ARG_RETURN, pointer) ||
+            !pointer) {
+            return true;
+        }
+        Mapping mapping;
+        mapping.call = recorded;
+        mapping.offset = 0;
+        mapping.size = ~0ULL;
+        if (!findObject(recorded, function.objects, function.name, function.target, mapping.object, target) ||
+            (function.offset != ARG_NONE &&
+             (!readValue(enter, function.offset, mapping.offset) ||
+              !readValue(enter, function.size, mapping.size)))) {
+            // Only to keep the memcpy calls filling it
+            mapping.object.clear();
+        }
+        if (mapping.size != ~0ULL) {
+            // Unmapped since, unless told
+            mappings.erase(mappings.lower_bound(pointer), mappings.lower_bound(pointer + mapping.size));
+        }
+        mappings[pointer] = mapping;
+        return true;
+    }
+
+    case OBJECT_FLUSH:
+    case OBJECT_UNMAP: {
+        if (!findObject(recorded, function.objects, function.name, function.target, object, target)) {
+            if (function.action == OBJECT_UNMAP) {
+                // There's no telling which memory is still mapped
+                it = mappings.begin();
+                while (it != mappings.end()) {
+                    if (it->second.call->thread == recorded->thread) {
+                        mappings.erase(it++);
+                    } else {
+                        ++it;
+                    }
+                }
+            }
+            return true;
+        }
+
+        it = mappings.begin();
+        while (it != mappings.end() && it->second.object != object) {
+            ++it;
+        }
+        if (it == mappings.end()) {
+            return true;
+        }
+
+        if (function.action == OBJECT_UNMAP) {
+            closeMapping(it, recorded, true);
+            return true;
+        }
+
+        // Flushing a range again makes flushing it before redundant
+        Region region = {false, {0, 0, 0}, {0, 1, 1}};
+        if (readValue(enter, function.offset, region.begin[0]) &&
+            readValue(enter, function.size, size)) {
+            region.end[0] = region.begin[0] + size;
+            writeObject(it->second.flushes, recorded, region);
+        }
+        return true;
+    }
+
+    case OBJECT_MEMCPY: {
+        unsigned long long dest;
+        if (!readValue(enter, function.name, dest) ||
+            !readValue(enter, function.size, size)) {
+            return true;
+        }
+        it = mappings.upper_bound(dest);
+        if (it == mappings.begin()) {
+            return true;
+        }
+        --it;
+        Mapping &mapping = it->second;
+        unsigned long long offset = mapping.offset + (dest - it->first);
+        if (mapping.object.empty() ||
+            (mapping.size != ~0ULL && dest - it->first + size > mapping.size)) {
+            return true;
+        }
+        recorded->context.push_back(mapping.call);
+        ++mapping.call->dependents;
+        Region region = {false, {offset, 0, 0}, {offset + size, 1, 1}};
+        writeObject(objectWrites[imageKey(mapping.object, 0, 0)], recorded, region);
+        return true;
+    }
+    }
+
+    return false;
+}
+
+/**
+ * Write the recorded calls into the file, numbering them anew.
+ *
+ * Must be called with the mutex held.
+ */
+void LocalWriter::writeRecording(void) {
+    if (!recordFrames || recordingWritten) {
+        return;
+    }
+    recordingWritten = true;
+
+    // Write the events in the order they were submitted, rather than each
+    // leave event right after its enter event, as readers must see each
+    // thread's blobs in the order it wrote them.
+    RecordedCalls calls;
+    for (RecordedCallMap::iterator it = keptCalls.begin(); it != keptCalls.end(); ++it) {
+        calls.push_back(it->second);
+    }
+    for (unsigned i = 0; i < frames.size(); ++i) {
+        calls.insert(calls.end(), frames[i].begin(), frames[i].end());
+    }
+
+    std::vector<RecordedEvent> events;
+    for (unsigned i = 0; i < calls.size(); ++i) {
+        RecordedCall *recorded = calls[i];
+        if (!recorded->enter) {
+            // Still waiting for calls of other threads
+            continue;
+        }
+        RecordedEvent event = {recorded->enterOrder, recorded, false};
+        events.push_back(event);
+        if (recorded->leave) {
+            event.order = recorded->leaveOrder;
+            event.leave = true;
+            events.push_back(event);
+        }
+    }
+    std::sort(events.begin(), events.end(), recordedBefore);
+
+    unsigned call_no = 0;
+    for (unsigned i = 0; i < events.size(); ++i) {
+        RecordedCall *recorded = events[i].call;
+
+        if (!events[i].leave) {
+            recorded->writtenNo = call_no++;
+            writeBuffer(*recorded->enter);
+            continue;
+        }
+
+        std::vector<char> &leave = recorded->leave->data;
+        // Replace the leave event header, as it refers to the call by its
+        // original number
+        size_t begin = 1;
+        while (begin < leave.size() && (leave[begin] & 0x80)) {
+            ++begin;
+        }
+        ++begin;
+
+        char header[1 + 2 * sizeof call_no];
+        unsigned len = 0;
+        unsigned value = recorded->writtenNo;
+        header[len++] = trace::EVENT_LEAVE;
+        do {
+            header[len++] = 0x80 | (value & 0x7f);
+            value >>= 7;
+        } while (value);
+        header[len - 1] &= 0x7f;
+
+        m_file->write(header, len);
+        writeBuffer(*recorded->leave, begin);
+    }
+
+    os::log("apitrace: wrote %u recorded calls\n", call_no);
+    m_file->flush();
+
+    clearRecording();
+}
+
+void LocalWriter::clearRecording(void) {
+    for (RecordedCallMap::iterator it = keptCalls.begin(); it != keptCalls.end(); ++it) {
+        delete it->second;
+    }
+    for (unsigned i = 0; i < frames.size(); ++i) {
+        for (unsigned j = 0; j < frames[i].size(); ++j) {
+            delete frames[i][j];
+        }
+    }
+    keptCalls.clear();
+    frames.clear();
+    recordedCalls.clear();
+    latestStateCalls.clear();
+    selectedStates.clear();
+    initialCalls.clear();
+    objectWrites.clear();
+    objectCreators.clear();
+    bindings.clear();
+    mappings.clear();
+    keptCount = 0;
+    recordedEvents = 0;
+    for (unsigned kind = 0; kind < SIG_KIND_COUNT; ++kind) {
+        recordedDefinitions[kind].clear();
+    }
+}
+
+/**
+ * Write the thread's enter event, or keep it until all calls before it are
+ * written, followed by any other calls this unblocks.
+ */
+void LocalWriter::submitEnter(ThreadState *state) {
+    os::unique_lock<os::recursive_mutex> lock(mutex);
+
+    if (state->generation != generation) {
+        // Serialized for a previous file
+        return;
+    }
+
+    if (state->call_no != nextWriteNo) {
+        PendingCall &call = pending[state->call_no];
+        call.enter = new Buffer;
+        call.leave = NULL;
+        std::swap(call.enter->data, state->buffer.data);
+        std::swap(call.enter->definitions, state->buffer.definitions);
+        std::swap(call.enter->args, state->buffer.args);
+        return;
+    }
+
+    commitBuffer(state->buffer, state->call_no, false);
+    ++nextWriteNo;
+
+    PendingMap::iterator it = pending.begin();
+    while (it != pending.end() && it->first == nextWriteNo) {
+        assert(it->second.enter);
+        commitBuffer(*it->second.enter, it->first, false);
+        delete it->second.enter;
+        if (it->second.leave) {
+            commitBuffer(*it->second.leave, it->first, true);
+            delete it->second.leave;
+        }
+        pending.erase(it++);
+        ++nextWriteNo;
+    }
+}
+
+/**
+ * Write the thread's leave event, or keep it until its enter event is
+ * written.
+ */
+void LocalWriter::submitLeave(ThreadState *state) {
+    os::unique_lock<os::recursive_mutex> lock(mutex);
+
+    if (state->generation != generation) {
+        return;
+    }
+
+    if (state->call_no < nextWriteNo) {
+        commitBuffer(state->buffer, state->call_no, true);
+        return;
+    }
+
+    PendingMap::iterator it = pending.find(state->call_no);
+    assert(it != pending.end());
+    if (it != pending.end()) {
+        assert(!it->second.leave);
+        Buffer *leave = new Buffer;
+        std::swap(leave->data, state->buffer.data);
+        std::swap(leave->definitions, state->buffer.definitions);
+        std::swap(leave->args, state->buffer.args);
+        it->second.leave = leave;
+    }
+}
+
+void LocalWriter::clearPending(void) {
+    for (PendingMap::iterator it = pending.begin(); it != pending.end(); ++it) {
+        delete it->second.enter;
+        delete it->second.leave;
+    }
+    pending.clear();
+}
+
+unsigned LocalWriter::beginEnter(const FunctionSig *sig, bool fake) {
+    ThreadState *state = getThreadState();
+    assert(!state->acquired);
+
+    // Unwind before taking the mutex, as it can be slow.  Recorded
+    // definitions are spliced one by one, so don't nest frame definitions in
+    // stack ones when recording.
+    bool withBacktrace = !fake && os::backtrace_is_needed(sig->name);
+    const os::RawStack *stack = NULL;
+    std::vector<RawStackFrame> backtrace;
+    if (withBacktrace) {
+        stack = recordFrames ? NULL : os::get_stack();
+        if (!stack) {
+            backtrace = os::get_backtrace();
+        }
+    }
+
+    {
+        os::unique_lock<os::recursive_mutex> lock(mutex);
+
+        checkProcessId();
+        if (!m_file->isOpened()) {
+            open();
+        }
+
+        ++state->acquired;
+
+        if (!state->thread_id) {
+            state->thread_id = ++next_thread_num;
+        }
+
+        if (state->generation != generation) {
+            for (unsigned kind = 0; kind < SIG_KIND_COUNT; ++kind) {
+                state->used[kind].clear();
+            }
+            state->blobDigests.clear();
+            state->generation = generation;
+        }
+
+        unsigned callClass = 0;
+        bool keep = false;
+        if (recordFrames) {
+            state->recording = true;
+            if (state->frameEpoch != frameEpoch) {
+                state->blobDigests.clear();
+                state->frameEpoch = frameEpoch;
+            }
+            callClass = classifyCall(sig, fake);
+            state->keepable = (callClass & (CALL_CLASS_KEEP | CALL_CLASS_STATE)) != 0;
+            keep = (callClass & CALL_CLASS_KEEP) || frames.empty();
+        }
+
+        state->timed = callTimes && !fake;
+
+        unsigned thread_id = state->thread_id - 1;
+        state->call_no = Writer::beginEnter(sig, thread_id);
+        if (recordFrames) {
+            recordCall(state->call_no, sig, callClass, keep);
+            state->recording = false;
+        }
+        if (withBacktrace) {
+            if (stack) {
+                if (!stack->frames.empty() &&
+                    beginStack(stack->id, stack->frames.size())) {
+                    for (unsigned i = 0; i < stack->frames.size(); ++i) {
+                        writeStackFrame(stack->frames[i]);
+                    }
+                    endStack();
+                }
+            } else {
+                beginBacktrace(backtrace.size());
+                for (unsigned i = 0; i < backtrace.size(); ++i) {
+                    writeStackFrame(&backtrace[i]);
+                }
+                endBacktrace();
+            }
+        }
+    }
+
+    return state->call_no;
+}
+
+void LocalWriter::beginArg(unsigned index) {
+    if (recordFrames) {
+        Buffer &buffer = thread_state->buffer;
+        buffer.args.push_back(buffer.data.size());
+    }
+    Writer::beginArg(index);
+}
+
+void LocalWriter::beginReturn(void) {
+    if (recordFrames) {
+        Buffer &buffer = thread_state->buffer;
+        buffer.args.push_back(buffer.data.size());
+    }
+    Writer::beginReturn();
+}
+
+void LocalWriter::endEnter(void) {
+    ThreadState *state = thread_state;
+    Writer::endEnter();
+    submitEnter(state);
+    state->buffer.clear();
+    --state->acquired;
+
+    if (state->timed) {
+        state->callStarts.push_back(std::make_pair(state->call_no, os::getTime()));
+    }
+}
+
+static inline unsigned long long
+nanoseconds(long long time) {
+    return time / os::timeFrequency * 1000000000LL +
+           time % os::timeFrequency * 1000000000LL / os::timeFrequency;
+}
+
+void LocalWriter::beginLeave(unsigned call) {
+    long long endTime = callTimes ? os::getTime() : 0;
+
+    ThreadState *state = getThreadState();
+    ++state->acquired;
+    state->call_no = call;
+    Writer::beginLeave(call);
+
+    if (callTimes) {
+        // Forget the calls which started later but were never left, e.g.,
+        // because they were longjmp'ed out of.
+        std::vector< std::pair<unsigned, long long> > &starts = state->callStarts;
+        while (!starts.empty() && starts.back().first > call) {
+            starts.pop_back();
+        }
+        if (!starts.empty() && starts.back().first == call) {
+            long long callStart = starts.back().second;
+            starts.pop_back();
+            writeTime(nanoseconds(callStart - startTime),
+                      nanoseconds(endTime - callStart));
+        }
+    }
+}
+
+void LocalWriter::endLeave(void) {
+    ThreadState *state = thread_state;
+    Writer::endLeave();
+    submitLeave(state);
+    state->buffer.clear();
+    --state->acquired;
+}
+
+void LocalWriter::flush(void) {
+    /*
+     * Do nothing if this thread was serializing a call (e.g., if a segfault
+     * happen while writing the file) as state could be inconsistent,
+     * therefore yield inconsistent trace files and/or repeated segfaults till
+     * infinity.
+     *
+     * Calls still waiting for other threads' preceding calls can't be written
+     * without breaking the call numbering, so only what precedes them is
+     * flushed.
+     *
+     * The recording is only updated with the mutex held, so it can still be
+     * written unless this thread was doing so, leaving out the call being
+     * serialized.
+     */
+
+    ThreadState *state = thread_state;
+    if (state && state->acquired &&
+        (!recordFrames || state->recording)) {
+        os::log("apitrace: ignoring exception while tracing\n");
+        return;
+    }
+
+    if (state) {
+        ++state->acquired;
+    }
+    mutex.lock();
+    if (m_file->isOpened()) {
+        if (os::getCurrentProcessId() != pid) {
+            os::log("apitrace: ignoring exception in child process\n");
+        } else if (recordFrames) {
+            os::log("apitrace: writing recorded calls due to an exception\n");
+            writeRecording();
+        } else {
+            os::log("apitrace: flushing trace due to an exception\n");
+            m_file->flush();
+        }
+    }
+    mutex.unlock();
+    if (state) {
+        --state->acquired;
+    }
 }
 
 
@@ -33,6 +33,11 @@
 
 #include <stdint.h>
 
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
 #include "os_thread.hpp"
 #include "os_process.hpp"
 #include "trace_writer.hpp"
@@ -50,34 +55,259 @@ namespace trace {
      *
      * In particular:
      * - it creates a trace file based on the current process name
-     * - uses mutexes to allow tracing from multiple threades
+     * - serializes each thread's calls into a buffer of its own, and merges
+     *   them into the trace file in call number order
      * - flushes the output to ensure the last call is traced in event of
      *   abnormal termination
+     * - optionally acts as a flight recorder, keeping only the last frames in
+     *   memory, and writing them when the process crashes or exits
      */
     class LocalWriter : public Writer {
+    public:
+        struct Buffer;
+        struct ThreadState;
+        struct RecordedCall;
+
+        /**
+         * Which part of an object a recorded call writes, by offsets and
+         * sizes in up to three dimensions, or all of it.
+         */
+        struct Region {
+            bool whole;
+            unsigned long long begin[3];
+            unsigned long long end[3];
+        };
+
     protected:
         /**
          * This mutex guarantees that only one thread writes to the trace file
-         * at one given instance.
+         * at one given instance.  It is only held while numbering calls and
+         * while copying serialized calls into the file.
          *
          * We need a recursive mutex so that we dont't dead lock in the event
          * of a segfault happens while the mutex is held.
          *
          * To prevent deadlocks, the call for the real function (the one being
-         * traced) should not be done with the mutex held. That is, it should
-         * be done outside the beginEnter/endEnter and beginLeave/endLeave
-         * pairs. Preferably between these two pairs.
+         * traced) should not be done inside the beginEnter/endEnter and
+         * beginLeave/endLeave pairs, but between them.
          */
         os::recursive_mutex mutex;
-        int acquired;
+
+        /**
+         * Number of the next call whose enter event is to be written.
+         */
+        unsigned nextWriteNo;
+
+        /**
+         * Serialized calls that can't be written yet, as calls with lower
+         * numbers are still being serialized by other threads.
+         */
+        struct PendingCall {
+            Buffer *enter;
+            Buffer *leave;
+        };
+        typedef std::map<unsigned, PendingCall> PendingMap;
+        PendingMap pending;
+
+        /**
+         * Incremented whenever a new trace file is opened, so that threads
+         * forget which signatures they defined in the old one.
+         */
+        unsigned generation;
 
         /**
          * ID of the processed that opened the trace file.
          */
         os::ProcessId pid;
 
+        /**
+         * Number of whole frames kept when recording, or zero when calls are
+         * written to the file as soon as possible.
+         */
+        unsigned recordFrames;
+
+        typedef std::vector<RecordedCall *> RecordedCalls;
+        typedef std::map<unsigned, RecordedCall *> RecordedCallMap;
+
+        /**
+         * Recorded calls that outlive their frame, namely calls creating
+         * objects or programs or uploading their contents, until the objects
+         * are deleted or overwritten, calls made before the first frame ended,
+         * and the state setting calls these depend on.  By call number.
+         */
+        RecordedCallMap keptCalls;
+
+        /**
+         * The other calls of the last frames, the unfinished frame last.
+         */
+        std::deque<RecordedCalls> frames;
+
+        /**
+         * All recorded calls, to find them as their events are submitted.
+         */
+        RecordedCallMap recordedCalls;
+
+        typedef std::map<std::string, RecordedCall *> StateCallMap;
+
+        /**
+         * Latest state setting call kept from dropped frames for each state
+         * it sets, which a later call setting the same state replaces unless
+         * kept calls were made in between, or calls kept still depend on it.
+         */
+        StateCallMap latestStateCalls;
+
+        typedef StateCallMap SelectedStateMap;
+
+        /**
+         * The calls kept from dropped frames selecting the state which
+         * subsequent calls apply to, such as the bound objects, by the kind
+         * of selection and the state they set.
+         */
+        SelectedStateMap selectedStates;
+
+        /**
+         * Calls made before the first frame ended, which the tables below are
+         * yet to account for.
+         */
+        RecordedCalls initialCalls;
+
+        struct ObjectWrite {
+            Region region;
+            RecordedCall *call;
+        };
+        typedef std::vector<ObjectWrite> ObjectWrites;
+        typedef std::map<std::string, ObjectWrites> ObjectWriteMap;
+
+        /**
+         * Calls kept from dropped frames writing the contents of objects, by
+         * object and image (e.g., texture level), which a later call writing
+         * the same region replaces, and deleting the object releases.
+         */
+        ObjectWriteMap objectWrites;
+
+        /**
+         * Calls kept from dropped frames creating the objects not deleted
+         * yet, by object.
+         */
+        StateCallMap objectCreators;
+
+        struct Binding {
+            unsigned long long name;
+            unsigned contextNo;
+        };
+        typedef std::map<std::string, Binding> BindingMap;
+
+        /**
+         * The object each thread bound to each target as of the dropped
+         * frames, to tell which object the calls writing bound objects write.
+         */
+        BindingMap bindings;
+
+        struct Mapping {
+            RecordedCall *call;
+            std::string object;
+            unsigned long long offset;
+            unsigned long long size;
+            ObjectWrites flushes;
+        };
+        typedef std::map<unsigned long long, Mapping> MappingMap;
+
+        /**
+         * Buffer ranges mapped as of the dropped frames, by address, to tell
+         * which buffer the memcpy calls emitted when unmapping them fill.
+         */
+        MappingMap mappings;
+
+        /**
+         * Number of calls recorded as kept so far.
+         */
+        unsigned keptCount;
+
+        /**
+         * How each function is recorded, by signature ID.
+         */
+        std::vector<unsigned char> callClasses;
+
+        /**
+         * How the state setting calls of each function are told apart, by
+         * signature ID.
+         */
+        std::vector<unsigned char> stateFunctionIds;
+
+        /**
+         * Which objects the calls of each function create, write or bind,
+         * by signature ID.
+         */
+        std::vector<unsigned char> objectFunctionIds;
+
+        /**
+         * Definition of each recorded signature, by kind and ID, for the
+         * calls referring to signatures defined by calls that were dropped.
+         */
+        std::vector< std::vector<char> > recordedDefinitions[SIG_KIND_COUNT];
+
+        /**
+         * Incremented whenever a frame ends, so that threads write blobs anew
+         * in each frame, instead of referring to dropped ones.
+         */
+        unsigned frameEpoch;
+
+        /**
+         * Number of recorded events submitted so far.
+         */
+        unsigned recordedEvents;
+
+        bool recordingWritten;
+
+        /**
+         * Whether to record when each call started and how long it took.
+         */
+        bool callTimes;
+
+        /**
+         * When tracing started, in os::getTime() units.
+         */
+        long long startTime;
+
+        unsigned classifyCall(const FunctionSig *sig, bool fake);
+        void recordCall(unsigned call, const FunctionSig *sig, unsigned callClass, bool keep);
+        void dropFrame(RecordedCalls &frame);
+        void releaseStateCall(RecordedCall *recorded);
+        void supersedeCall(RecordedCall *recorded);
+        bool trackObjects(RecordedCall *recorded);
+        bool lookupBinding(const RecordedCall *recorded, const char *objects,
+                           unsigned long long unit, unsigned long long target,
+                           unsigned long long &name);
+        bool lookupBindingUnit(const RecordedCall *recorded, const char *objects,
+                               unsigned long long target, unsigned long long &unit);
+        void resetBindings(const RecordedCall *recorded, const char *objects,
+                           unsigned long long name, unsigned long long value);
+        bool findObject(const RecordedCall *recorded, const char *objects,
+                        int nameArg, int targetArg,
+                        std::string &object, unsigned long long &target);
+        void writeObject(ObjectWrites &writes, RecordedCall *recorded, const Region &region);
+        void readObject(RecordedCall *recorded, const std::string &object);
+        void closeMapping(MappingMap::iterator it, RecordedCall *closing, bool follow);
+        void unselectObject(const RecordedCall *recorded, const char *objects, unsigned long long name);
+        void deleteObject(const std::string &object, RecordedCall *deleting, bool release);
+        void writeRecording(void);
+        void clearRecording(void);
+
         void checkProcessId();
 
+        ThreadState *getThreadState(void);
+
+        void submitEnter(ThreadState *state);
+        void submitLeave(ThreadState *state);
+        void writeBuffer(Buffer &buffer, size_t begin = 0);
+        void commitBuffer(Buffer &buffer, unsigned call, bool leave);
+        void clearPending(void);
+
+        bool beginDefinition(SigKind kind, unsigned id);
+        void endDefinition(void);
+        bool lookupBlob(const BlobDigest &digest, size_t size);
+        void _write(const void *sBuffer, size_t dwBytesToWrite);
+
     public:
         /**
          * Should never called directly -- use localWriter singleton below
@@ -89,22 +319,31 @@ namespace trace {
         void open(void);
 
         /**
-         * It will acquire the mutex.
+         * It will briefly acquire the mutex to number the call.
          */
         unsigned beginEnter(const FunctionSig *sig, bool fake = false);
 
         /**
-         * It will release the mutex.
+         * Hides Writer::beginArg, to note where arguments begin when
+         * recording.
          */
-        void endEnter(void);
+        void beginArg(unsigned index);
 
         /**
-         * It will acquire the mutex.
+         * Hides Writer::beginReturn, to note where the return value begins
+         * when recording.
          */
+        void beginReturn(void);
+
+        /**
+         * It will acquire the mutex to write the call, if possible.
+         */
+        void endEnter(void);
+
         void beginLeave(unsigned call);
 
         /**
-         * It will release the mutex.
+         * It will acquire the mutex to write the call, if possible.
          */
         void endLeave(void);
 
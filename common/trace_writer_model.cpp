@@ -96,6 +96,10 @@ public:
         writer.endArray();
     }
 
+    void visit(PackedArray *node) {
+        writer.writePackedArray(node->kind, node->elementSize, node->data, node->count);
+    }
+
     void visit(Blob *node) {
         writer.writeBlob(node->buf, node->size);
     }
@@ -129,6 +133,9 @@ public:
         }
         writer.endEnter();
         writer.beginLeave(call_no);
+        if (call->cpuDuration >= 0) {
+            writer.writeTime(call->cpuStart, call->cpuDuration);
+        }
         if (call->ret) {
             writer.beginReturn();
             _visit(call->ret);
@@ -140,6 +147,11 @@ public:
 
 
 void Writer::writeCall(Call *call) {
+    if (call->raw) {
+        _writeRawCall(call);
+        return;
+    }
+
     ModelWriter visitor(*this);
     visitor.visit(call);
 }
@@ -4,12 +4,42 @@
 #include <sstream>
 
 #include <QDebug>
+#include <QFile>
 #include <QSysInfo>
 
 #include "image/image.hpp"
 
 
+ApiSurfaceBlobFile::ApiSurfaceBlobFile(const QString &fileName)
+    : m_fileName(fileName)
+{
+}
+
+ApiSurfaceBlobFile::~ApiSurfaceBlobFile()
+{
+    QFile::remove(m_fileName);
+}
+
+QString ApiSurfaceBlobFile::fileName() const
+{
+    return m_fileName;
+}
+
+QByteArray ApiSurfaceBlobFile::read(qint64 offset, qint64 size) const
+{
+    QFile file(m_fileName);
+    if (!file.open(QIODevice::ReadOnly) ||
+        !file.seek(offset)) {
+        qWarning() << "Could not read" << m_fileName;
+        return QByteArray();
+    }
+    return file.read(size);
+}
+
+
 ApiSurface::ApiSurface()
+    : m_blobOffset(0),
+      m_blobSize(0)
 {
 }
 
@@ -25,9 +55,11 @@ void ApiSurface::setSize(const QSize &size)
 
 struct ByteArrayBuf : public std::streambuf
 {
-    ByteArrayBuf(QByteArray & a)
+    ByteArrayBuf(const QByteArray & a)
     {
-        setg(a.data(), a.data(), a.data() + a.size());
+        // Reading only, so avoid detaching the array
+        char *p = const_cast<char *>(a.constData());
+        setg(p, p, p + a.size());
     }
 };
 
@@ -38,16 +70,38 @@ void ApiSurface::contentsFromBase64(const QByteArray &base64)
     /*
      * We need to do the conversion to create the thumbnail
      */
-    image::Image *image = imageFromBase64(base64);
+    image::Image *image = imageFromData(data());
     Q_ASSERT(image);
     QImage img = qimageFromRawImage(image);
     m_thumb = thumbnail(img);
     delete image;
 }
 
-QByteArray ApiSurface::base64Data() const
+void ApiSurface::contentsFromBlob(const QSharedPointer<ApiSurfaceBlobFile> &file,
+                                  qint64 offset, qint64 size)
 {
-    return m_base64Data;
+    m_blobFile = file;
+    m_blobOffset = offset;
+    m_blobSize = size;
+
+    /*
+     * Only the thumbnail is kept in memory; the image itself is read back
+     * from the file when it is viewed.
+     */
+    image::Image *image = imageFromData(data());
+    if (image) {
+        QImage img = qimageFromRawImage(image);
+        m_thumb = thumbnail(img);
+        delete image;
+    }
+}
+
+QByteArray ApiSurface::data() const
+{
+    if (m_blobFile) {
+        return m_blobFile->read(m_blobOffset, m_blobSize);
+    }
+    return QByteArray::fromBase64(m_base64Data);
 }
 
 QImage ApiSurface::thumb() const
@@ -107,21 +161,20 @@ void ApiFramebuffer::setType(const QString &str)
 }
 
 image::Image *
-ApiSurface::imageFromBase64(const QByteArray &base64)
+ApiSurface::imageFromData(const QByteArray &data)
 {
-    QByteArray dataArray = QByteArray::fromBase64(base64);
     image::Image *image;
 
     /*
      * Detect the PNG vs PFM images.
      */
     const char pngSignature[] = {(char)0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A, 0};
-    if (dataArray.startsWith(pngSignature)) {
-        ByteArrayBuf buf(dataArray);
+    if (data.startsWith(pngSignature)) {
+        ByteArrayBuf buf(data);
         std::istream istr(&buf);
         image = image::readPNG(istr);
     } else {
-        image = image::readPNM(dataArray.data(), dataArray.size());
+        image = image::readPNM(data.constData(), data.size());
     }
 
     return image;
@@ -2,6 +2,8 @@
 #define APISURFACE_H
 
 #include <QImage>
+#include <QMetaType>
+#include <QSharedPointer>
 #include <QSize>
 #include <QString>
 
@@ -9,6 +11,24 @@ namespace image {
     class Image;
 }
 
+/**
+ * File holding the image payloads of a state dump, which surfaces refer to by
+ * offset.  It is removed once the last surface referring to it goes away.
+ */
+class ApiSurfaceBlobFile
+{
+public:
+    explicit ApiSurfaceBlobFile(const QString &fileName);
+    ~ApiSurfaceBlobFile();
+
+    QString fileName() const;
+
+    QByteArray read(qint64 offset, qint64 size) const;
+
+private:
+    QString m_fileName;
+};
+
 class ApiSurface
 {
 public:
@@ -24,11 +44,17 @@ public:
     void setFormatName(const QString &str);
 
     void contentsFromBase64(const QByteArray &base64);
-
-    QByteArray base64Data() const;
+    void contentsFromBlob(const QSharedPointer<ApiSurfaceBlobFile> &file,
+                          qint64 offset, qint64 size);
+
+    /**
+     * The encoded (PNG or PNM) image, loaded on demand when the contents live
+     * in a blob file.
+     */
+    QByteArray data() const;
     QImage thumb() const;
 
-    static image::Image *imageFromBase64(const QByteArray &data);
+    static image::Image *imageFromData(const QByteArray &data);
     static QImage qimageFromRawImage(const image::Image *img,
                                      float lowerValue = 0.0f,
                                      float upperValue = 1.0f,
@@ -38,6 +64,9 @@ public:
 private:
     QSize  m_size;
     QByteArray m_base64Data;
+    QSharedPointer<ApiSurfaceBlobFile> m_blobFile;
+    qint64 m_blobOffset;
+    qint64 m_blobSize;
     QImage m_thumb;
     int m_depth;
     QString m_formatName;
@@ -69,4 +98,6 @@ private:
 
 };
 
+Q_DECLARE_METATYPE(ApiSurface);
+
 #endif
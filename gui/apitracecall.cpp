@@ -436,7 +436,31 @@ ApiTraceState::ApiTraceState()
 {
 }
 
-ApiTraceState::ApiTraceState(const QVariantMap &parsedJson)
+/**
+ * Load the contents of an image dumped by JSONWriter::writeImage, either
+ * inlined as base64 or referring to the blob file by offset.
+ */
+static void
+loadSurfaceContents(ApiSurface &surface, const QVariantMap &image,
+                    const QSharedPointer<ApiSurfaceBlobFile> &blobFile)
+{
+    if (image.contains(QLatin1String("__offset__"))) {
+        if (!blobFile) {
+            qWarning() << "Image refers to a missing blob file";
+            return;
+        }
+        qint64 offset = image[QLatin1String("__offset__")].toLongLong();
+        qint64 size = image[QLatin1String("__size__")].toLongLong();
+        surface.contentsFromBlob(blobFile, offset, size);
+    } else {
+        QByteArray dataArray =
+            image[QLatin1String("__data__")].toByteArray();
+        surface.contentsFromBase64(dataArray);
+    }
+}
+
+ApiTraceState::ApiTraceState(const QVariantMap &parsedJson,
+                             const QSharedPointer<ApiSurfaceBlobFile> &blobFile)
 {
     m_parameters = parsedJson[QLatin1String("parameters")].toMap();
     QVariantMap attachedShaders =
@@ -467,15 +491,12 @@ ApiTraceState::ApiTraceState(const QVariantMap &parsedJson)
         QString formatName =
             image[QLatin1String("__format__")].toString();
 
-        QByteArray dataArray =
-            image[QLatin1String("__data__")].toByteArray();
-
         ApiTexture tex;
         tex.setSize(size);
         tex.setDepth(depth);
         tex.setFormatName(formatName);
         tex.setLabel(itr.key());
-        tex.contentsFromBase64(dataArray);
+        loadSurfaceContents(tex, image, blobFile);
 
         m_textures.append(tex);
     }
@@ -490,15 +511,12 @@ ApiTraceState::ApiTraceState(const QVariantMap &parsedJson)
         int depth = buffer[QLatin1String("__depth__")].toInt();
         QString formatName = buffer[QLatin1String("__format__")].toString();
 
-        QByteArray dataArray =
-            buffer[QLatin1String("__data__")].toByteArray();
-
         ApiFramebuffer fbo;
         fbo.setSize(size);
         fbo.setDepth(depth);
         fbo.setFormatName(formatName);
         fbo.setType(itr.key());
-        fbo.contentsFromBase64(dataArray);
+        loadSurfaceContents(fbo, buffer, blobFile);
         m_framebuffers.append(fbo);
     }
 }
@@ -685,6 +703,7 @@ ApiTraceCall::loadData(TraceLoader *loader,
     }
     m_argValues.squeeze();
     m_flags = call->flags;
+    m_cpuDuration = call->cpuDuration;
     if (call->backtrace != NULL) {
         QString qbacktrace;
         for (int i = 0; i < call->backtrace->size(); i++) {
@@ -990,6 +1009,14 @@ QString ApiTraceCall::toHtml() const
             QString::fromLatin1("Frame %1")
             .arg(m_parentFrame->number);
     }
+    if (m_cpuDuration >= 0) {
+        if (!parentTip.isEmpty()) {
+            parentTip += QLatin1String(", ");
+        }
+        parentTip +=
+            QString::fromLatin1("%1 us while tracing")
+            .arg(m_cpuDuration / 1000.0);
+    }
 
     m_richText += QString::fromLatin1("<span class=\"thread-id\">@%1</span> ")
         .arg(m_thread);
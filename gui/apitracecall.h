@@ -143,7 +143,9 @@ class ApiTraceFrame;
 class ApiTraceState {
 public:
     ApiTraceState();
-    explicit ApiTraceState(const QVariantMap &parseJson);
+    explicit ApiTraceState(const QVariantMap &parseJson,
+                           const QSharedPointer<ApiSurfaceBlobFile> &blobFile =
+                               QSharedPointer<ApiSurfaceBlobFile>());
 
     bool isEmpty() const;
     const QVariantMap & parameters() const;
@@ -301,6 +303,7 @@ private:
     QVector<QVariant> m_argValues;
     QVariant m_returnValue;
     trace::CallFlags m_flags;
+    qint64 m_cpuDuration;
     ApiTraceFrame *m_parentFrame;
     ApiTraceCall *m_parentCall;
     QVector<ApiTraceCall*> m_children;
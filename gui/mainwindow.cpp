@@ -610,7 +610,7 @@ static void addSurfaceItem(const ApiSurface &surface,
     l->setWordWrap(true);
     tree->setItemWidget(item, 1, l);
 
-    item->setData(0, Qt::UserRole, surface.base64Data());
+    item->setData(0, Qt::UserRole, QVariant::fromValue(surface));
 }
 
 void MainWindow::fillStateForFrame()
@@ -765,8 +765,8 @@ void MainWindow::showSelectedSurface()
 
     viewer->setAttribute(Qt::WA_DeleteOnClose, true);
 
-    QByteArray base64Data = var.value<QByteArray>();
-    viewer->setBase64Data(base64Data);
+    ApiSurface surface = var.value<ApiSurface>();
+    viewer->setData(surface.data());
 
     viewer->show();
     viewer->raise();
@@ -1309,7 +1309,8 @@ void MainWindow::saveSelectedSurface()
 
     QImage img = var.value<QImage>();
     if (img.isNull()) {
-        image::Image *traceImage = ApiSurface::imageFromBase64(var.value<QByteArray>());
+        ApiSurface surface = var.value<ApiSurface>();
+        image::Image *traceImage = ApiSurface::imageFromData(surface.data());
         img = ApiSurface::qimageFromRawImage(traceImage);
         delete traceImage;
     }
@@ -8,10 +8,12 @@
 #include "trace_profiler.hpp"
 
 #include <QDebug>
+#include <QDir>
 #include <QVariant>
 #include <QList>
 #include <QImage>
 #include <QJsonDocument>
+#include <QTemporaryFile>
 
 /**
  * Wrapper around a QProcess which enforces IO to block .
@@ -345,9 +347,26 @@ void Retracer::run()
         arguments << QLatin1String("--core");
     }
 
+    QSharedPointer<ApiSurfaceBlobFile> stateBlobFile;
+
     if (m_captureState) {
         arguments << QLatin1String("-D");
         arguments << QString::number(m_captureCall);
+
+        /*
+         * Have the images written to a side file, so that neither the
+         * retracer output nor the parsed state hold them all in memory.
+         * This requires the retracer to share our file system.
+         */
+        if (m_remoteTarget.isEmpty() && prog != QLatin1String("wine")) {
+            QTemporaryFile blobs(QDir::tempPath() + QLatin1String("/qapitrace-state-XXXXXX"));
+            blobs.setAutoRemove(false);
+            if (blobs.open()) {
+                stateBlobFile = QSharedPointer<ApiSurfaceBlobFile>(
+                    new ApiSurfaceBlobFile(blobs.fileName()));
+                arguments << QLatin1String("--dump-state-blobs=") + blobs.fileName();
+            }
+        }
     } else if (m_captureThumbnails) {
         if (!m_thumbnailsToCapture.isEmpty()) {
             arguments << QLatin1String("-S");
@@ -367,6 +386,8 @@ void Retracer::run()
         if (m_profilePixels) {
             arguments << QLatin1String("--ppd");
         }
+
+        arguments << QLatin1String("--profile-format=binary");
     } else {
         if (!m_doubleBuffered) {
             arguments << QLatin1String("--sb");
@@ -489,17 +510,22 @@ void Retracer::run()
             Q_ASSERT(process.state() != QProcess::Running);
         } else if (isProfiling()) {
             profile = new trace::Profile();
+            trace::ProfileBuilder builder(profile);
 
             while (!io.atEnd()) {
-                char line[256];
-                qint64 lineLength;
+                char buffer[64*1024];
+                qint64 length;
 
-                lineLength = io.readLine(line, 256);
+                length = io.read(buffer, sizeof buffer);
 
-                if (lineLength == -1)
+                if (length <= 0)
                     break;
 
-                trace::Profiler::parseLine(line, profile);
+                builder.parse(buffer, length);
+            }
+
+            if (!builder.finish()) {
+                qDebug() << "error: truncated profile";
             }
         } else {
             QByteArray output;
@@ -553,7 +579,7 @@ void Retracer::run()
      */
 
     if (m_captureState) {
-        ApiTraceState *state = new ApiTraceState(parsedJson);
+        ApiTraceState *state = new ApiTraceState(parsedJson, stateBlobFile);
         emit foundState(state);
     }
 
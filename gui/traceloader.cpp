@@ -1,11 +1,45 @@
 #include "traceloader.h"
 
 #include "apitrace.h"
+#include "os_thread.hpp"
+#include "trace_index.hpp"
+#include "trace_search.hpp"
 #include <QDebug>
 #include <QFile>
+#include <QStringMatcher>
 
 #define FRAMES_TO_CACHE 100
 
+/*
+ * Matches calls ignoring case the way Qt does, with Unicode case folding,
+ * rather than just for ASCII letters.
+ */
+class SearchMatcher : public trace::CallMatcher
+{
+public:
+    SearchMatcher(const ApiTrace::SearchRequest &request)
+        : trace::CallMatcher(request.text.toUtf8().constData(),
+                             request.cs == Qt::CaseSensitive),
+          m_matcher(request.text, Qt::CaseInsensitive)
+    {
+    }
+
+    trace::CallMatcher *clone() const
+    {
+        return new SearchMatcher(*this);
+    }
+
+protected:
+    bool containsIgnoringCase(const std::string &text) const
+    {
+        QString str = QString::fromUtf8(text.data(), int(text.size()));
+        return m_matcher.indexIn(str) >= 0;
+    }
+
+private:
+    QStringMatcher m_matcher;
+};
+
 static ApiTraceCall *
 apiCallFromTraceCall(const trace::Call *call,
                      const QHash<QString, QUrl> &helpHash,
@@ -26,7 +60,8 @@ apiCallFromTraceCall(const trace::Call *call,
 }
 
 TraceLoader::TraceLoader(QObject *parent)
-    : QObject(parent)
+    : QObject(parent),
+      m_indexLoaded(false)
 {
 }
 
@@ -49,8 +84,11 @@ void TraceLoader::loadTrace(const QString &filename)
         m_createdFrames.clear();
         m_parser.close();
     }
+    m_index = trace::Index();
+    m_indexLoaded = false;
 
-    if (!m_parser.open(filename.toLatin1())) {
+    m_filename = filename.toLatin1();
+    if (!m_parser.open(m_filename)) {
         qDebug() << "error: failed to open " << filename;
         return;
     }
@@ -58,7 +96,9 @@ void TraceLoader::loadTrace(const QString &filename)
     emit startedParsing();
 
     if (m_parser.supportsOffsets()) {
-        scanTrace();
+        if (!loadIndex(filename)) {
+            scanTrace();
+        }
     } else {
         //Load the entire file into memory
         parseTrace();
@@ -106,6 +146,42 @@ void TraceLoader::loadHelpFile()
     file.close();
 }
 
+bool TraceLoader::loadIndex(const QString &filename)
+{
+    trace::Index &index = m_index;
+    if (!index.load(filename.toLatin1()) ||
+        !m_parser.importSignatures(index.signatures)) {
+        return false;
+    }
+    m_indexLoaded = true;
+
+    QList<ApiTraceFrame*> frames;
+    int numOfFrames = index.frames.size();
+
+    for (int i = 0; i < numOfFrames; ++i) {
+        const trace::Index::Frame &indexFrame = index.frames[i];
+        FrameBookmark frameBookmark(indexFrame.start);
+        frameBookmark.numberOfCalls = indexFrame.numberOfCalls;
+
+        ApiTraceFrame *currentFrame = new ApiTraceFrame();
+        currentFrame->number = i;
+        currentFrame->setNumChildren(indexFrame.numberOfCalls);
+        if (i + 1 < numOfFrames || index.lastFrameComplete) {
+            currentFrame->setLastCallIndex(indexFrame.lastCallNo);
+        }
+        frames.append(currentFrame);
+
+        m_createdFrames.append(currentFrame);
+        m_frameBookmarks[i] = frameBookmark;
+    }
+
+    emit parsed(100);
+
+    emit framesLoaded(frames);
+
+    return true;
+}
+
 void TraceLoader::scanTrace()
 {
     QList<ApiTraceFrame*> frames;
@@ -245,27 +321,25 @@ void TraceLoader::searchNext(const ApiTrace::SearchRequest &request)
     if (m_parser.supportsOffsets()) {
         int startFrame = m_createdFrames.indexOf(request.frame);
         const FrameBookmark &frameBookmark = m_frameBookmarks[startFrame];
-        m_parser.setBookmark(frameBookmark.start);
-        trace::Call *call = 0;
-        while ((call = m_parser.parse_call())) {
 
-            if (callContains(call, request.text, request.cs)) {
-                unsigned frameIdx = callInFrame(call->no);
-                ApiTraceFrame *frame = m_createdFrames[frameIdx];
-                const QVector<ApiTraceCall*> calls =
-                        fetchFrameContents(frame);
-                for (int i = 0; i < calls.count(); ++i) {
-                    if (calls[i]->index() == call->no) {
-                        emit searchResult(request, ApiTrace::SearchResult_Found,
-                                          calls[i]);
-                        break;
-                    }
-                }
-                delete call;
+        if (m_indexLoaded) {
+            if (searchIndex(request, frameBookmark.start.next_call_no, ~0U)) {
                 return;
             }
+        } else {
+            SearchMatcher matcher(request);
+            m_parser.setBookmark(frameBookmark.start);
+            trace::Call *call = 0;
+            while ((call = m_parser.parse_call())) {
+                if (matcher.matches(call)) {
+                    unsigned callNo = call->no;
+                    delete call;
+                    emitSearchResult(request, callNo);
+                    return;
+                }
 
-            delete call;
+                delete call;
+            }
         }
     }
     emit searchResult(request, ApiTrace::SearchResult_NotFound, 0);
@@ -282,6 +356,17 @@ void TraceLoader::searchPrev(const ApiTrace::SearchRequest &request)
 
         const FrameBookmark &frameBookmark = m_frameBookmarks[frameIdx];
         int numCallsToParse = frameBookmark.numberOfCalls;
+
+        if (m_indexLoaded) {
+            unsigned endCallNo = frameBookmark.start.next_call_no + numCallsToParse;
+            if (endCallNo && searchIndex(request, 0, endCallNo - 1)) {
+                return;
+            }
+            emit searchResult(request, ApiTrace::SearchResult_NotFound, 0);
+            return;
+        }
+
+        SearchMatcher matcher(request);
         m_parser.setBookmark(frameBookmark.start);
 
         while ((call = m_parser.parse_call())) {
@@ -291,7 +376,7 @@ void TraceLoader::searchPrev(const ApiTrace::SearchRequest &request)
 
             if (numCallsToParse == 0) {
                 bool foundCall = searchCallsBackwards(frameCalls,
-                                                      frameIdx,
+                                                      matcher,
                                                       request);
 
                 qDeleteAll(frameCalls);
@@ -315,29 +400,54 @@ void TraceLoader::searchPrev(const ApiTrace::SearchRequest &request)
 }
 
 bool TraceLoader::searchCallsBackwards(const QList<trace::Call*> &calls,
-                                       int frameIdx,
+                                       trace::CallMatcher &matcher,
                                        const ApiTrace::SearchRequest &request)
 {
     for (int i = calls.count() - 1; i >= 0; --i) {
         trace::Call *call = calls[i];
-        if (callContains(call, request.text, request.cs)) {
-            ApiTraceFrame *frame = m_createdFrames[frameIdx];
-            const QVector<ApiTraceCall*> apiCalls =
-                    fetchFrameContents(frame);
-            for (int i = 0; i < apiCalls.count(); ++i) {
-                if (apiCalls[i]->index() == call->no) {
-                    emit searchResult(request,
-                                      ApiTrace::SearchResult_Found,
-                                      apiCalls[i]);
-                    break;
-                }
-            }
+        if (matcher.matches(call)) {
+            emitSearchResult(request, call->no);
             return true;
         }
     }
     return false;
 }
 
+/*
+ * Search the calls from firstCallNo to lastCallNo on several threads, using
+ * the trace index.
+ */
+bool TraceLoader::searchIndex(const ApiTrace::SearchRequest &request,
+                              unsigned firstCallNo, unsigned lastCallNo)
+{
+    unsigned callNo;
+    SearchMatcher matcher(request);
+    if (!trace::findCall(m_filename.constData(), m_index,
+                         os::thread::hardware_concurrency(),
+                         matcher,
+                         request.direction == ApiTrace::SearchRequest::Prev,
+                         firstCallNo, lastCallNo, callNo)) {
+        return false;
+    }
+    emitSearchResult(request, callNo);
+    return true;
+}
+
+void TraceLoader::emitSearchResult(const ApiTrace::SearchRequest &request,
+                                   unsigned callNo)
+{
+    unsigned frameIdx = callInFrame(callNo);
+    ApiTraceFrame *frame = m_createdFrames[frameIdx];
+    const QVector<ApiTraceCall*> calls = fetchFrameContents(frame);
+    for (int i = 0; i < calls.count(); ++i) {
+        if (calls[i]->index() == callNo) {
+            emit searchResult(request, ApiTrace::SearchResult_Found,
+                              calls[i]);
+            break;
+        }
+    }
+}
+
 int TraceLoader::callInFrame(int callIdx) const
 {
     unsigned numCalls = 0;
@@ -355,20 +465,6 @@ int TraceLoader::callInFrame(int callIdx) const
     return 0;
 }
 
-bool TraceLoader::callContains(trace::Call *call,
-                               const QString &str,
-                               Qt::CaseSensitivity sensitivity)
-{
-    /*
-     * FIXME: do string comparison directly on trace::Call
-     */
-    ApiTraceCall *apiCall = apiCallFromTraceCall(call, m_helpHash,
-                                                 0, 0, this);
-    bool result = apiCall->contains(str, sensitivity);
-    delete apiCall;
-    return result;
-}
-
 QVector<ApiTraceCall*>
 TraceLoader::fetchFrameContents(ApiTraceFrame *currentFrame)
 {
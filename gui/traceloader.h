@@ -4,7 +4,9 @@
 
 #include "apitrace.h"
 #include "trace_file.hpp"
+#include "trace_index.hpp"
 #include "trace_parser.hpp"
+#include "trace_search.hpp"
 
 #include <QObject>
 #include <QList>
@@ -92,24 +94,34 @@ private:
 
     void loadHelpFile();
     void guessApi(const trace::Call *call);
+    bool loadIndex(const QString &filename);
     void scanTrace();
     void parseTrace();
 
     void searchNext(const ApiTrace::SearchRequest &request);
     void searchPrev(const ApiTrace::SearchRequest &request);
 
+    bool searchIndex(const ApiTrace::SearchRequest &request,
+                     unsigned firstCallNo, unsigned lastCallNo);
+    void emitSearchResult(const ApiTrace::SearchRequest &request,
+                          unsigned callNo);
+
     int callInFrame(int callIdx) const;
-    bool callContains(trace::Call *call,
-                      const QString &str,
-                      Qt::CaseSensitivity sensitivity);
      QVector<ApiTraceCall*> fetchFrameContents(ApiTraceFrame *frame);
      bool searchCallsBackwards(const QList<trace::Call*> &calls,
-                               int frameIdx,
+                               trace::CallMatcher &matcher,
                                const ApiTrace::SearchRequest &request);
 
 private:
     trace::Parser m_parser;
 
+    QByteArray m_filename;
+    /*
+     * The trace index, if loaded, so that searches can span several threads.
+     */
+    trace::Index m_index;
+    bool m_indexLoaded;
+
     typedef QMap<int, FrameBookmark> FrameBookmarks;
     FrameBookmarks m_frameBookmarks;
     QList<ApiTraceFrame*> m_createdFrames;
@@ -40,6 +40,11 @@
 
 #include <algorithm>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define _GL_SIZE_SSE2
+#include <emmintrin.h>
+#endif
+
 #include "os.hpp"
 #include "glimports.hpp"
 
@@ -380,34 +385,143 @@ void
 _shadow_glGetBufferSubData(GLenum target, GLintptr offset, GLsizeiptr size,
                               GLvoid *data);
 
+/* Forward declaration for definition in gltrace_state.cpp */
+GLuint
+_glGetBufferMaxIndex(GLint buffer, GLintptr offset, GLsizei count, GLenum type,
+                     GLboolean restart_enabled, GLuint restart_index);
+
+
+/*
+ * Largest index in an array of indices of type T, skipping the primitive
+ * restart index.
+ */
+template< class T >
 static inline GLuint
-_glDrawElementsBaseVertex_count(GLsizei count, GLenum type, const GLvoid *indices, GLint basevertex)
+_gl_max_index(const T *p, GLsizei count, GLboolean restart_enabled, GLuint restart_index)
 {
-    GLvoid *temp = 0;
+    GLuint maxindex = 0;
+    for (GLsizei i = 0; i < count; ++i) {
+        GLuint index = p[i];
+        if (restart_enabled && index == restart_index) {
+            continue;
+        }
+        if (index > maxindex) {
+            maxindex = index;
+        }
+    }
+    return maxindex;
+}
 
-    if (!count) {
-        return 0;
+#ifdef _GL_SIZE_SSE2
+
+/*
+ * SSE2 versions of the above, processing 16 bytes at a time.  Restart indices
+ * are replaced by zero, which never exceeds the maximum.  SSE2 only has
+ * unsigned byte and signed word maximums, so words and double words are
+ * biased into signed integers.
+ */
+
+static inline GLuint
+_gl_max_index(const GLubyte *p, GLsizei count, GLboolean restart_enabled, GLuint restart_index)
+{
+    bool restart = restart_enabled && restart_index <= 0xff;
+    __m128i vrestart = _mm_set1_epi8((char)restart_index);
+    __m128i vmax = _mm_setzero_si128();
+    GLsizei i;
+    for (i = 0; i + 16 <= count; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        if (restart) {
+            v = _mm_andnot_si128(_mm_cmpeq_epi8(v, vrestart), v);
+        }
+        vmax = _mm_max_epu8(vmax, v);
+    }
+    GLubyte lanes[16];
+    _mm_storeu_si128((__m128i *)lanes, vmax);
+    GLuint maxindex = _gl_max_index<GLubyte>(p + i, count - i, restart_enabled, restart_index);
+    for (unsigned j = 0; j < 16; ++j) {
+        maxindex = std::max<GLuint>(maxindex, lanes[j]);
     }
+    return maxindex;
+}
 
-    GLint element_array_buffer = _element_array_buffer_binding();
-    if (element_array_buffer) {
-        // Read indices from index buffer object
-        GLintptr offset = (GLintptr)indices;
-        GLsizeiptr size = count*_gl_type_size(type);
-        GLvoid *temp = malloc(size);
-        if (!temp) {
-            return 0;
+static inline GLuint
+_gl_max_index(const GLushort *p, GLsizei count, GLboolean restart_enabled, GLuint restart_index)
+{
+    bool restart = restart_enabled && restart_index <= 0xffff;
+    __m128i vrestart = _mm_set1_epi16((short)restart_index);
+    __m128i vbias = _mm_set1_epi16((short)0x8000);
+    __m128i vmax = vbias;
+    GLsizei i;
+    for (i = 0; i + 8 <= count; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        if (restart) {
+            v = _mm_andnot_si128(_mm_cmpeq_epi16(v, vrestart), v);
         }
-        memset(temp, 0, size);
-        _shadow_glGetBufferSubData(GL_ELEMENT_ARRAY_BUFFER, offset, size, temp);
-        indices = temp;
-    } else {
-        if (!indices) {
-            return 0;
+        vmax = _mm_max_epi16(vmax, _mm_xor_si128(v, vbias));
+    }
+    GLushort lanes[8];
+    _mm_storeu_si128((__m128i *)lanes, _mm_xor_si128(vmax, vbias));
+    GLuint maxindex = _gl_max_index<GLushort>(p + i, count - i, restart_enabled, restart_index);
+    for (unsigned j = 0; j < 8; ++j) {
+        maxindex = std::max<GLuint>(maxindex, lanes[j]);
+    }
+    return maxindex;
+}
+
+static inline GLuint
+_gl_max_index(const GLuint *p, GLsizei count, GLboolean restart_enabled, GLuint restart_index)
+{
+    __m128i vrestart = _mm_set1_epi32((int)restart_index);
+    __m128i vbias = _mm_set1_epi32((int)0x80000000);
+    __m128i vmax = vbias;
+    GLsizei i;
+    for (i = 0; i + 4 <= count; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        if (restart_enabled) {
+            v = _mm_andnot_si128(_mm_cmpeq_epi32(v, vrestart), v);
         }
+        v = _mm_xor_si128(v, vbias);
+        __m128i greater = _mm_cmpgt_epi32(v, vmax);
+        vmax = _mm_or_si128(_mm_and_si128(greater, v), _mm_andnot_si128(greater, vmax));
+    }
+    GLuint lanes[4];
+    _mm_storeu_si128((__m128i *)lanes, _mm_xor_si128(vmax, vbias));
+    GLuint maxindex = _gl_max_index<GLuint>(p + i, count - i, restart_enabled, restart_index);
+    for (unsigned j = 0; j < 4; ++j) {
+        maxindex = std::max(maxindex, lanes[j]);
     }
+    return maxindex;
+}
 
-    GLuint maxindex = 0;
+#endif /* _GL_SIZE_SSE2 */
+
+static inline GLuint
+_gl_max_index(GLenum type, const GLvoid *indices, GLsizei count, GLboolean restart_enabled, GLuint restart_index)
+{
+    switch (type) {
+    case GL_UNSIGNED_BYTE:
+        return _gl_max_index((const GLubyte *)indices, count, restart_enabled, restart_index);
+    case GL_UNSIGNED_SHORT:
+        return _gl_max_index((const GLushort *)indices, count, restart_enabled, restart_index);
+    case GL_UNSIGNED_INT:
+        return _gl_max_index((const GLuint *)indices, count, restart_enabled, restart_index);
+    default:
+        os::log("apitrace: warning: %s: unknown GLenum 0x%04X\n", __FUNCTION__, type);
+        return 0;
+    }
+}
+
+static inline GLuint
+_glDrawElementsBaseVertex_count(GLsizei count, GLenum type, const GLvoid *indices, GLint basevertex)
+{
+    if (!count) {
+        return 0;
+    }
+
+    GLint element_array_buffer = _element_array_buffer_binding();
+    if (!element_array_buffer && !indices) {
+        return 0;
+    }
 
     GLboolean restart_enabled = _glIsEnabled(GL_PRIMITIVE_RESTART);
     while ((_glGetError() == GL_INVALID_ENUM))
@@ -418,46 +532,14 @@ _glDrawElementsBaseVertex_count(GLsizei count, GLenum type, const GLvoid *indice
         restart_index = (GLuint)_glGetInteger(GL_PRIMITIVE_RESTART_INDEX);
     }
 
-    GLsizei i;
-    if (type == GL_UNSIGNED_BYTE) {
-        const GLubyte *p = (const GLubyte *)indices;
-        for (i = 0; i < count; ++i) {
-            GLuint index = p[i];
-            if (restart_enabled && index == restart_index) {
-                continue;
-            }
-            if (index > maxindex) {
-                maxindex = index;
-            }
-        }
-    } else if (type == GL_UNSIGNED_SHORT) {
-        const GLushort *p = (const GLushort *)indices;
-        for (i = 0; i < count; ++i) {
-            GLuint index = p[i];
-            if (restart_enabled && index == restart_index) {
-                continue;
-            }
-            if (index > maxindex) {
-                maxindex = index;
-            }
-        }
-    } else if (type == GL_UNSIGNED_INT) {
-        const GLuint *p = (const GLuint *)indices;
-        for (i = 0; i < count; ++i) {
-            GLuint index = p[i];
-            if (restart_enabled && index == restart_index) {
-                continue;
-            }
-            if (index > maxindex) {
-                maxindex = index;
-            }
-        }
-    } else {
-        os::log("apitrace: warning: %s: unknown GLenum 0x%04X\n", __FUNCTION__, type);
-    }
-
+    GLuint maxindex;
     if (element_array_buffer) {
-        free(temp);
+        // Read indices from index buffer object, or rather, from the maximum
+        // index cached for its range
+        maxindex = _glGetBufferMaxIndex(element_array_buffer, (GLintptr)indices, count, type,
+                                        restart_enabled, restart_index);
+    } else {
+        maxindex = _gl_max_index(type, indices, count, restart_enabled, restart_index);
     }
 
     maxindex += basevertex;
@@ -125,6 +125,15 @@ public:
 };
 
 
+/**
+ * Set how Image::writePNG compresses, from a level between 0 (no compression)
+ * and 9 (best compression), or one of "store" (same as 0), "fast" (same as 1,
+ * the default), "rle" (only compress runs of repeated bytes, almost as fast
+ * as storing), "default" and "best".
+ */
+bool
+setPNGCompression(const char *spec);
+
 Image *
 readPNG(std::istream &is);
 
@@ -148,6 +157,49 @@ Image *
 readPNM(const char *buffer, size_t bufferSize);
 
 
+/**
+ * Differences between two images, as measured by compare().
+ */
+struct Difference
+{
+    // Sum of the squared differences of all color samples
+    unsigned long long squareError;
+
+    // Number of color samples compared
+    unsigned long long samples;
+
+    // Number of pixels whose (luminance) difference exceeds the fuzz
+    unsigned long long absoluteError;
+
+    Difference() :
+        squareError(0),
+        samples(0),
+        absoluteError(0)
+    {}
+
+    // Number of bits the color samples match to, on average
+    double
+    precision(void) const;
+};
+
+/**
+ * Compare the color channels of two 8-bit images of the same size, ignoring
+ * alpha.  The fuzz is the ratio of the maximum difference below which pixels
+ * are deemed to match.
+ *
+ * Returns false if the images can't be compared.
+ */
+bool
+compare(const Image &ref, const Image &src, Difference &diff, double fuzz = 0.05);
+
+/**
+ * Create an RGB image of src with the pixels which differ from ref by more
+ * than the fuzz highlighted in red, similar to ImageMagick's compare utility.
+ */
+Image *
+createDiffImage(const Image &ref, const Image &src, double fuzz = 0.05);
+
+
 } /* namespace image */
 
 
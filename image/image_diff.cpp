@@ -0,0 +1,276 @@
+/**************************************************************************
+ *
+ * Copyright 2011 Jose Fonseca
+ * Copyright 2008-2009 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+/*
+ * Image comparison, following scripts/snapdiff.py's metrics.
+ */
+
+
+#include <math.h>
+
+#include <algorithm>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define _IMAGE_SSE2 1
+#endif
+
+#include "image.hpp"
+
+
+namespace image {
+
+
+/**
+ * Luminance of a RGB pixel, rounded as PIL's convert('L') does.
+ */
+static inline unsigned
+luminance(unsigned r, unsigned g, unsigned b) {
+    return (r*19595 + g*38470 + b*7471 + 0x8000) >> 16;
+}
+
+
+/**
+ * Convert a row of pixels with any number of channels to RGB.
+ */
+static void
+toRGB(const unsigned char *src, unsigned width, unsigned channels, unsigned char *dst) {
+    for (unsigned x = 0; x < width; ++x) {
+        if (channels >= 3) {
+            dst[0] = src[0];
+            dst[1] = src[1];
+            dst[2] = src[2];
+        } else {
+            dst[0] = dst[1] = dst[2] = src[0];
+        }
+        src += channels;
+        dst += 3;
+    }
+}
+
+
+/**
+ * Store the absolute differences of a row of n samples into diff, zeroing the
+ * alpha of 4-channel pixels.
+ *
+ * Returns the sum of the squared differences, and the largest difference in
+ * maxDiff.
+ */
+static unsigned long long
+diffRow(const unsigned char *ref, const unsigned char *src, unsigned char *diff,
+        size_t n, unsigned channels, unsigned &maxDiff)
+{
+    unsigned long long squareError = 0;
+    unsigned max = 0;
+    size_t i = 0;
+
+#ifdef _IMAGE_SSE2
+    // 16 bytes always hold whole 4-channel pixels, so alpha can be masked
+    // with a constant.
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i mask = _mm_set1_epi32(channels == 4 ? 0x00ffffff : -1);
+    __m128i vmax = zero;
+    while (n - i >= 16) {
+        // Each iteration adds at most 4*255*255 to each 32-bit sum, so flush
+        // them before they can overflow.
+        size_t end = i + std::min<size_t>((n - i) & ~size_t(15), 16*8192);
+        __m128i vsum = zero;
+        for (; i < end; i += 16) {
+            __m128i a = _mm_loadu_si128((const __m128i *)(ref + i));
+            __m128i b = _mm_loadu_si128((const __m128i *)(src + i));
+            __m128i d = _mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a));
+            d = _mm_and_si128(d, mask);
+            _mm_storeu_si128((__m128i *)(diff + i), d);
+            vmax = _mm_max_epu8(vmax, d);
+            __m128i lo = _mm_unpacklo_epi8(d, zero);
+            __m128i hi = _mm_unpackhi_epi8(d, zero);
+            vsum = _mm_add_epi32(vsum, _mm_add_epi32(_mm_madd_epi16(lo, lo),
+                                                     _mm_madd_epi16(hi, hi)));
+        }
+        unsigned sums[4];
+        _mm_storeu_si128((__m128i *)sums, vsum);
+        squareError += (unsigned long long)sums[0] + sums[1] + sums[2] + sums[3];
+    }
+    unsigned char maxes[16];
+    _mm_storeu_si128((__m128i *)maxes, vmax);
+    max = *std::max_element(maxes, maxes + 16);
+#endif
+
+    for (; i < n; ++i) {
+        unsigned d = ref[i] > src[i] ? ref[i] - src[i] : src[i] - ref[i];
+        if (channels == 4 && i % 4 == 3) {
+            d = 0;
+        }
+        diff[i] = d;
+        squareError += d*d;
+        max = std::max(max, d);
+    }
+
+    maxDiff = max;
+    return squareError;
+}
+
+
+double
+Difference::precision(void) const {
+    if (!samples) {
+        return 0.0;
+    }
+
+    // See also http://effbot.org/zone/pil-comparing-images.htm
+    double rel_error = (squareError*2.0 + 1.0) / (samples*255.0*255.0*2.0);
+    return -log(rel_error)/log(2.0);
+}
+
+
+bool
+compare(const Image &ref, const Image &src, Difference &diff, double fuzz)
+{
+    if (ref.width != src.width ||
+        ref.height != src.height ||
+        ref.channelType != TYPE_UNORM8 ||
+        src.channelType != TYPE_UNORM8) {
+        return false;
+    }
+
+    diff = Difference();
+    diff.samples = (unsigned long long)ref.width * ref.height * 3;
+    if (!diff.samples) {
+        return true;
+    }
+
+    unsigned threshold = fuzz <= 0.0 ? 0 : fuzz >= 1.0 ? 255 : unsigned(255 * fuzz);
+
+    // Compare the rows in place when possible, otherwise convert them to RGB
+    // first.
+    bool direct = ref.channels == src.channels &&
+                  (ref.channels == 3 || ref.channels == 4);
+    unsigned channels = direct ? ref.channels : 3;
+    size_t n = size_t(ref.width) * channels;
+
+    std::vector<unsigned char> buffer(direct ? n : 3*n);
+    unsigned char *diffPixels = &buffer[0];
+    unsigned char *refPixels = direct ? NULL : diffPixels + n;
+    unsigned char *srcPixels = direct ? NULL : diffPixels + 2*n;
+
+    const unsigned char *refRow = ref.start();
+    const unsigned char *srcRow = src.start();
+    for (unsigned y = 0; y < ref.height; ++y) {
+        const unsigned char *a = refRow;
+        const unsigned char *b = srcRow;
+        if (!direct) {
+            toRGB(refRow, ref.width, ref.channels, refPixels);
+            toRGB(srcRow, src.width, src.channels, srcPixels);
+            a = refPixels;
+            b = srcPixels;
+        }
+
+        unsigned maxDiff;
+        diff.squareError += diffRow(a, b, diffPixels, n, channels, maxDiff);
+
+        // The luminance never exceeds the largest channel, so rows within the
+        // threshold can be skipped.
+        if (maxDiff > threshold) {
+            const unsigned char *p = diffPixels;
+            for (unsigned x = 0; x < ref.width; ++x) {
+                if (luminance(p[0], p[1], p[2]) > threshold) {
+                    ++diff.absoluteError;
+                }
+                p += channels;
+            }
+        }
+
+        refRow += ref.stride();
+        srcRow += src.stride();
+    }
+
+    return true;
+}
+
+
+Image *
+createDiffImage(const Image &ref, const Image &src, double fuzz)
+{
+    if (ref.width != src.width ||
+        ref.height != src.height ||
+        ref.channelType != TYPE_UNORM8 ||
+        src.channelType != TYPE_UNORM8) {
+        return NULL;
+    }
+
+    Image *image = new Image(src.width, src.height, 3);
+
+    const unsigned lowlight[3] = {0xff, 0xff, 0xff};
+    const unsigned highlight[3] = {0xf1, 0x00, 0x1e};
+    const unsigned opacity = 0xcc;
+    double scale = fuzz > 0.0 ? 1.0/fuzz : 256.0;
+
+    std::vector<unsigned char> buffer(2 * 3 * size_t(src.width) + 1);
+    unsigned char *refPixels = &buffer[0];
+    unsigned char *srcPixels = refPixels + 3 * size_t(src.width);
+
+    const unsigned char *refRow = ref.start();
+    const unsigned char *srcRow = src.start();
+    unsigned char *dstRow = image->start();
+    for (unsigned y = 0; y < src.height; ++y) {
+        toRGB(refRow, ref.width, ref.channels, refPixels);
+        toRGB(srcRow, src.width, src.channels, srcPixels);
+
+        const unsigned char *a = refPixels;
+        const unsigned char *b = srcPixels;
+        unsigned char *dst = dstRow;
+        for (unsigned x = 0; x < src.width; ++x) {
+            // Scale the difference by the inverse of the fuzz to get a mask
+            unsigned s[3];
+            for (unsigned c = 0; c < 3; ++c) {
+                unsigned d = a[c] > b[c] ? a[c] - b[c] : b[c] - a[c];
+                s[c] = std::min(unsigned(d * scale), 255U);
+            }
+            unsigned m = luminance(s[0], s[1], s[2]);
+
+            // Composite the highlight over the lowlight through the mask, and
+            // blend it over the source image.
+            for (unsigned c = 0; c < 3; ++c) {
+                unsigned mark = (highlight[c]*m + lowlight[c]*(255 - m) + 127) / 255;
+                dst[c] = (b[c]*(255 - opacity) + mark*opacity + 127) / 255;
+            }
+
+            a += 3;
+            b += 3;
+            dst += 3;
+        }
+
+        refRow += ref.stride();
+        srcRow += src.stride();
+        dstRow += image->stride();
+    }
+
+    return image;
+}
+
+
+} /* namespace image */
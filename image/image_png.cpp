@@ -31,34 +31,350 @@
 #include <assert.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include <algorithm>
 #include <fstream>
+#include <vector>
 
+#include "os_thread.hpp"
 #include "image.hpp"
 
 
 namespace image {
 
 
-static const int png_compression_level = Z_BEST_SPEED;
+/*
+ * PNG images are written without libpng, so that the rows can be filtered and
+ * deflated in independent segments, on several threads, and then
+ * concatenated.
+ */
 
+static int png_compression_level = Z_BEST_SPEED;
+static int png_compression_strategy = Z_DEFAULT_STRATEGY;
 
+// Minimum number of bytes of image data worth deflating on a separate thread
+static const size_t png_segment_size = 512*1024;
+
+// Number of threads deflating images, across all the images being written at
+// once, e.g., by several snapshot writers, so that together they don't start
+// more threads than there are processors.
+static os::mutex png_threads_mutex;
+static unsigned png_threads_busy = 0;
+
+
+bool
+setPNGCompression(const char *spec)
+{
+    int level;
+    int strategy = Z_DEFAULT_STRATEGY;
+    if (strcmp(spec, "store") == 0) {
+        level = Z_NO_COMPRESSION;
+    } else if (strcmp(spec, "rle") == 0) {
+        level = Z_BEST_SPEED;
+        strategy = Z_RLE;
+    } else if (strcmp(spec, "fast") == 0) {
+        level = Z_BEST_SPEED;
+    } else if (strcmp(spec, "default") == 0) {
+        level = Z_DEFAULT_COMPRESSION;
+    } else if (strcmp(spec, "best") == 0) {
+        level = Z_BEST_COMPRESSION;
+    } else if (spec[0] >= '0' && spec[0] <= '9' && spec[1] == 0) {
+        level = spec[0] - '0';
+    } else {
+        return false;
+    }
+
+    png_compression_level = level;
+    png_compression_strategy = strategy;
+    return true;
+}
+
+
+enum {
+    PNG_FILTER_VALUE_NONE_ = 0,
+    PNG_FILTER_VALUE_SUB_,
+    PNG_FILTER_VALUE_UP_,
+    PNG_FILTER_VALUE_AVG_,
+    PNG_FILTER_VALUE_PAETH_,
+    PNG_FILTER_VALUE_LAST_
+};
+
+
+static inline unsigned char
+paethPredictor(int a, int b, int c)
+{
+    int p = a + b - c;
+    int pa = abs(p - a);
+    int pb = abs(p - b);
+    int pc = abs(p - c);
+    if (pa <= pb && pa <= pc) {
+        return a;
+    } else if (pb <= pc) {
+        return b;
+    } else {
+        return c;
+    }
+}
+
+
+/**
+ * Filter a row, writing the filter type followed by the filtered bytes.
+ */
 static void
-pngWriteCallback(png_structp png_ptr, png_bytep data, png_size_t length)
+filterRow(int type, const unsigned char *row, const unsigned char *prev,
+          size_t size, unsigned bpp, unsigned char *out)
 {
-    std::ostream *os = (std::ostream *) png_get_io_ptr(png_ptr);
-    os->write((const char *)data, length);
+    *out++ = type;
+
+    size_t i;
+    switch (type) {
+    case PNG_FILTER_VALUE_NONE_:
+        memcpy(out, row, size);
+        break;
+    case PNG_FILTER_VALUE_SUB_:
+        for (i = 0; i < bpp; ++i) {
+            out[i] = row[i];
+        }
+        for (; i < size; ++i) {
+            out[i] = row[i] - row[i - bpp];
+        }
+        break;
+    case PNG_FILTER_VALUE_UP_:
+        for (i = 0; i < size; ++i) {
+            out[i] = row[i] - prev[i];
+        }
+        break;
+    case PNG_FILTER_VALUE_AVG_:
+        for (i = 0; i < bpp; ++i) {
+            out[i] = row[i] - (prev[i] >> 1);
+        }
+        for (; i < size; ++i) {
+            out[i] = row[i] - ((row[i - bpp] + prev[i]) >> 1);
+        }
+        break;
+    case PNG_FILTER_VALUE_PAETH_:
+        for (i = 0; i < bpp; ++i) {
+            out[i] = row[i] - prev[i];
+        }
+        for (; i < size; ++i) {
+            out[i] = row[i] - paethPredictor(row[i - bpp], prev[i], prev[i - bpp]);
+        }
+        break;
+    default:
+        assert(0);
+    }
+}
+
+
+/**
+ * Sum of the absolute values of the filtered bytes, taken as signed, which is
+ * the heuristic libpng uses to pick a filter.
+ */
+static inline unsigned long
+filterCost(const unsigned char *out, size_t size)
+{
+    unsigned long cost = 0;
+    for (size_t i = 1; i <= size; ++i) {
+        unsigned v = out[i];
+        cost += v < 128 ? v : 256 - v;
+    }
+    return cost;
+}
+
+
+/**
+ * Independently deflated range of rows.
+ */
+struct PNGSegment
+{
+    const Image *image;
+    bool strip_alpha;
+    unsigned bpp;
+    size_t rowSize;
+
+    unsigned begin;
+    unsigned end;
+    bool first;
+    bool last;
+
+    std::vector<unsigned char> data;
+    uLong adler;
+    size_t length;
+    bool ok;
+};
+
+
+/**
+ * Get the row as stored in the PNG, counting from the top.
+ */
+static const unsigned char *
+getRow(const PNGSegment &segment, unsigned y, unsigned char *buffer)
+{
+    const Image *image = segment.image;
+    if (image->flipped) {
+        y = image->height - 1 - y;
+    }
+    const unsigned char *row = image->pixels + size_t(y) * image->width * image->channels;
+    if (!segment.strip_alpha) {
+        return row;
+    }
+    for (unsigned x = 0; x < image->width; ++x) {
+        buffer[3*x + 0] = row[4*x + 0];
+        buffer[3*x + 1] = row[4*x + 1];
+        buffer[3*x + 2] = row[4*x + 2];
+    }
+    return buffer;
 }
 
+
+static void
+encodeSegment(PNGSegment &segment)
+{
+    size_t rowSize = segment.rowSize;
+    bool filter = png_compression_level != Z_NO_COMPRESSION;
+
+    std::vector<unsigned char> buffer(2*rowSize + (filter ? PNG_FILTER_VALUE_LAST_ : 1)*(rowSize + 1));
+    unsigned char *rowBuffer = &buffer[0];
+    unsigned char *prevBuffer = rowBuffer + rowSize;
+    unsigned char *outBuffers = prevBuffer + rowSize;
+
+    segment.ok = false;
+    segment.adler = adler32(0L, Z_NULL, 0);
+    segment.length = 0;
+
+    z_stream stream;
+    memset(&stream, 0, sizeof stream);
+    if (deflateInit2(&stream, png_compression_level, Z_DEFLATED, -MAX_WBITS, 8,
+                     png_compression_strategy) != Z_OK) {
+        return;
+    }
+
+    std::vector<unsigned char> &data = segment.data;
+    data.resize(deflateBound(&stream, (rowSize + 1) * (segment.end - segment.begin)) + 64);
+    size_t used = 0;
+
+    if (segment.first) {
+        // zlib header, with the compression level hint
+        int level = png_compression_level == Z_DEFAULT_COMPRESSION ? 6 : png_compression_level;
+        unsigned flevel = level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3;
+        unsigned header = (0x78 << 8) | (flevel << 6);
+        header += 31 - header % 31;
+        data[used++] = header >> 8;
+        data[used++] = header & 0xff;
+    }
+
+    const unsigned char *prev;
+    if (segment.begin) {
+        prev = getRow(segment, segment.begin - 1, prevBuffer);
+    } else {
+        memset(prevBuffer, 0, rowSize);
+        prev = prevBuffer;
+    }
+
+    for (unsigned y = segment.begin; y < segment.end; ++y) {
+        const unsigned char *row = getRow(segment, y, rowBuffer);
+
+        unsigned char *out = outBuffers;
+        if (filter) {
+            unsigned long bestCost = ~0UL;
+            for (int type = 0; type < PNG_FILTER_VALUE_LAST_; ++type) {
+                unsigned char *candidate = outBuffers + type*(rowSize + 1);
+                filterRow(type, row, prev, rowSize, segment.bpp, candidate);
+                unsigned long cost = filterCost(candidate, rowSize);
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    out = candidate;
+                }
+            }
+        } else {
+            filterRow(PNG_FILTER_VALUE_NONE_, row, prev, rowSize, segment.bpp, out);
+        }
+
+        segment.adler = adler32(segment.adler, out, rowSize + 1);
+        segment.length += rowSize + 1;
+
+        // End the segment on a byte boundary, so that the segments can be
+        // concatenated, and only finish the stream on the last one.
+        int flush = Z_NO_FLUSH;
+        if (y + 1 == segment.end) {
+            flush = segment.last ? Z_FINISH : Z_SYNC_FLUSH;
+        }
+
+        stream.next_in = out;
+        stream.avail_in = rowSize + 1;
+        do {
+            if (used == data.size()) {
+                data.resize(2 * data.size());
+            }
+            stream.next_out = &data[used];
+            stream.avail_out = data.size() - used;
+            int ret = deflate(&stream, flush);
+            used = data.size() - stream.avail_out;
+            if (ret == Z_STREAM_ERROR) {
+                deflateEnd(&stream);
+                return;
+            }
+        } while (stream.avail_out == 0);
+
+        if (row == rowBuffer) {
+            std::swap(rowBuffer, prevBuffer);
+        }
+        prev = row;
+    }
+
+    deflateEnd(&stream);
+    data.resize(used);
+    segment.ok = true;
+}
+
+
+static void *
+encodeSegmentThread(PNGSegment *segment)
+{
+    encodeSegment(*segment);
+    return 0;
+}
+
+
+static inline void
+writeUInt32(unsigned char *p, uint32_t value)
+{
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+
+static void
+writeChunk(std::ostream &os, const char *type, const unsigned char *data, size_t length)
+{
+    unsigned char header[8];
+    writeUInt32(header, length);
+    memcpy(header + 4, type, 4);
+
+    uLong crc = crc32(0L, Z_NULL, 0);
+    crc = crc32(crc, header + 4, 4);
+    if (length) {
+        crc = crc32(crc, data, length);
+    }
+
+    unsigned char trailer[4];
+    writeUInt32(trailer, crc);
+
+    os.write((const char *)header, sizeof header);
+    os.write((const char *)data, length);
+    os.write((const char *)trailer, sizeof trailer);
+}
+
+
 bool
 Image::writePNG(std::ostream &os, bool strip_alpha) const
 {
     assert(channelType == TYPE_UNORM8);
 
-    png_structp png_ptr;
-    png_infop info_ptr;
-    int color_type;
-
+    unsigned char color_type;
     switch (channels) {
     case 4:
         color_type = strip_alpha ? PNG_COLOR_TYPE_RGB : PNG_COLOR_TYPE_RGB_ALPHA;
@@ -74,58 +390,99 @@ Image::writePNG(std::ostream &os, bool strip_alpha) const
         break;
     default:
         assert(0);
-        goto no_png;
+        return false;
     }
 
-    png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (!png_ptr)
-        goto no_png;
-
-    info_ptr = png_create_info_struct(png_ptr);
-    if (!info_ptr) {
-        png_destroy_write_struct(&png_ptr,  NULL);
-        goto no_png;
+    if (!width || !height) {
+        return false;
     }
 
-    if (setjmp(png_jmpbuf(png_ptr))) {
-        png_destroy_write_struct(&png_ptr, &info_ptr);
-        goto no_png;
+    strip_alpha = strip_alpha && channels == 4;
+    unsigned bpp = strip_alpha ? 3 : channels;
+    size_t rowSize = size_t(width) * bpp;
+
+    // Split large images in segments to deflate in parallel, on the
+    // processors not already busy deflating other images
+    unsigned numSegments = 1;
+    size_t size = (rowSize + 1) * height;
+    if (png_compression_level != Z_NO_COMPRESSION &&
+        size >= 2*png_segment_size) {
+        numSegments = os::thread::hardware_concurrency();
+        numSegments = std::min<size_t>(numSegments, size / png_segment_size);
+        numSegments = std::max(std::min(numSegments, height), 1U);
+    }
+    {
+        os::unique_lock<os::mutex> lock(png_threads_mutex);
+        unsigned idle = os::thread::hardware_concurrency();
+        idle = idle > png_threads_busy + 1 ? idle - png_threads_busy - 1 : 0;
+        numSegments = std::min(numSegments, idle + 1);
+        png_threads_busy += numSegments;
     }
 
-    png_set_write_fn(png_ptr, &os, pngWriteCallback, NULL);
-
-    png_set_IHDR(png_ptr, info_ptr, width, height, 8,
-                 color_type, PNG_INTERLACE_NONE,
-                 PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
-
-    png_set_compression_level(png_ptr, png_compression_level);
+    std::vector<PNGSegment> segments(numSegments);
+    for (unsigned i = 0; i < numSegments; ++i) {
+        PNGSegment &segment = segments[i];
+        segment.image = this;
+        segment.strip_alpha = strip_alpha;
+        segment.bpp = bpp;
+        segment.rowSize = rowSize;
+        segment.begin = unsigned(uint64_t(height) * i / numSegments);
+        segment.end = unsigned(uint64_t(height) * (i + 1) / numSegments);
+        segment.first = i == 0;
+        segment.last = i + 1 == numSegments;
+    }
 
-    png_write_info(png_ptr, info_ptr);
+    std::vector<os::thread> threads;
+    for (unsigned i = 1; i < numSegments; ++i) {
+        threads.push_back(os::thread(encodeSegmentThread, &segments[i]));
+    }
+    encodeSegment(segments[0]);
+    for (unsigned i = 0; i < threads.size(); ++i) {
+        threads[i].join();
+    }
 
-    if (channels == 4 && strip_alpha) {
-        png_set_filler(png_ptr, 0, PNG_FILLER_AFTER);
+    {
+        os::unique_lock<os::mutex> lock(png_threads_mutex);
+        png_threads_busy -= numSegments;
     }
 
-    if (!flipped) {
-        for (unsigned y = 0; y < height; ++y) {
-            png_bytep row = (png_bytep)(pixels + y*width*channels);
-            png_write_rows(png_ptr, &row, 1);
+    uLong adler = segments[0].adler;
+    for (unsigned i = 0; i < numSegments; ++i) {
+        if (!segments[i].ok) {
+            return false;
         }
-    } else {
-        unsigned y = height;
-        while (y--) {
-            png_bytep row = (png_bytep)(pixels + y*width*channels);
-            png_write_rows(png_ptr, &row, 1);
+        if (i) {
+            adler = adler32_combine(adler, segments[i].adler, segments[i].length);
+        }
+    }
+    unsigned char trailer[4];
+    writeUInt32(trailer, adler);
+    segments.back().data.insert(segments.back().data.end(), trailer, trailer + 4);
+
+    static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    os.write((const char *)signature, sizeof signature);
+
+    unsigned char ihdr[13];
+    writeUInt32(ihdr + 0, width);
+    writeUInt32(ihdr + 4, height);
+    ihdr[8] = 8; // bit depth
+    ihdr[9] = color_type;
+    ihdr[10] = PNG_COMPRESSION_TYPE_BASE;
+    ihdr[11] = PNG_FILTER_TYPE_BASE;
+    ihdr[12] = PNG_INTERLACE_NONE;
+    writeChunk(os, "IHDR", ihdr, sizeof ihdr);
+
+    for (unsigned i = 0; i < numSegments; ++i) {
+        const std::vector<unsigned char> &data = segments[i].data;
+        const size_t maxLength = 1 << 24;
+        for (size_t offset = 0; offset < data.size(); offset += maxLength) {
+            writeChunk(os, "IDAT", &data[offset], std::min(data.size() - offset, maxLength));
         }
     }
 
-    png_write_end(png_ptr, info_ptr);
-    png_destroy_write_struct(&png_ptr, &info_ptr);
-
-    return true;
+    writeChunk(os, "IEND", NULL, 0);
 
-no_png:
-    return false;
+    return !os.fail();
 }
 
 
@@ -229,7 +586,7 @@ readPNG(const char *filename)
     if (!is) {
         return NULL;
     }
-    return readPNG(filename);
+    return readPNG(is);
 }
 
 
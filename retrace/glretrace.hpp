@@ -110,6 +110,7 @@ void initContext();
 void updateDrawable(int width, int height);
 
 void flushQueries();
+void flushSnapshots();
 void beginProfile(trace::Call &call, bool isDraw);
 void endProfile(trace::Call &call, bool isDraw);
 
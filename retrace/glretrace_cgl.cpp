@@ -26,6 +26,8 @@
 
 #include <string.h>
 
+#include <map>
+
 #include "glproc.hpp"
 #include "retrace.hpp"
 #include "retrace_swizzle.hpp"
@@ -28,8 +28,11 @@
 
 #include <string.h>
 
+#include <deque>
 #include <map>
+#include <vector>
 
+#include "image.hpp"
 #include "retrace.hpp"
 #include "glproc.hpp"
 #include "glstate.hpp"
@@ -376,7 +379,7 @@ initContext() {
     /* Check for timer query support */
     if (retrace::profilingGpuTimes) {
         if (!supportsTimestamp && !supportsElapsed) {
-            std::cout << "Error: Cannot run profile, GL_ARB_timer_query or GL_EXT_timer_query extensions are not supported." << std::endl;
+            std::cerr << "Error: Cannot run profile, GL_ARB_timer_query or GL_EXT_timer_query extensions are not supported." << std::endl;
             exit(-1);
         }
 
@@ -384,14 +387,14 @@ initContext() {
         glGetQueryiv(GL_TIME_ELAPSED, GL_QUERY_COUNTER_BITS, &bits);
 
         if (!bits) {
-            std::cout << "Error: Cannot run profile, GL_QUERY_COUNTER_BITS == 0." << std::endl;
+            std::cerr << "Error: Cannot run profile, GL_QUERY_COUNTER_BITS == 0." << std::endl;
             exit(-1);
         }
     }
 
     /* Check for occlusion query support */
     if (retrace::profilingPixelsDrawn && !supportsOcclusion) {
-        std::cout << "Error: Cannot run profile, GL_ARB_occlusion_query extension is not supported." << std::endl;
+        std::cerr << "Error: Cannot run profile, GL_ARB_occlusion_query extension is not supported." << std::endl;
         exit(-1);
     }
 
@@ -601,7 +604,38 @@ debugOutputCallback(GLenum source, GLenum type, GLuint id, GLenum severity,
 
 
 class GLDumper : public retrace::Dumper {
+    /**
+     * Snapshot being read back into a pixel pack buffer.
+     */
+    struct PendingSnapshot {
+        glretrace::Context *context;
+        GLuint buffer;
+        image::Image *image;
+        unsigned call_no;
+        unsigned snapshot_no;
+        unsigned frame_no;
+    };
+
+    /*
+     * Snapshots are mapped this many frames after being requested, by which
+     * time the GPU should be done with them, with at most MAX_PENDING_SNAPSHOTS
+     * in flight.
+     */
+    static const unsigned SNAPSHOT_LATENCY = 2;
+    static const size_t MAX_PENDING_SNAPSHOTS = 3;
+
+    std::deque<PendingSnapshot> pending;
+
+    /* Idle pixel pack buffers, owned by bufferContext */
+    std::vector<GLuint> freeBuffers;
+    glretrace::Context *bufferContext;
+
 public:
+    GLDumper() :
+        bufferContext(NULL)
+    {
+    }
+
     image::Image *
     getSnapshot(void) {
         if (!glretrace::getCurrentContext()) {
@@ -610,6 +644,58 @@ public:
         return glstate::getDrawBufferImage();
     }
 
+    void
+    requestSnapshot(unsigned call_no, unsigned snapshot_no) {
+        glretrace::Context *currentContext = glretrace::getCurrentContext();
+        if (!currentContext) {
+            std::cerr << call_no << ": warning: failed to get snapshot\n";
+            return;
+        }
+
+        if (!supportsPixelBufferObjects()) {
+            retrace::Dumper::requestSnapshot(call_no, snapshot_no);
+            return;
+        }
+
+        while (!pending.empty() &&
+               (pending.size() >= MAX_PENDING_SNAPSHOTS ||
+                retrace::frameNo - pending.front().frame_no >= SNAPSHOT_LATENCY)) {
+            retireSnapshot();
+        }
+
+        if (bufferContext != currentContext) {
+            releaseBuffers();
+            bufferContext = currentContext;
+        }
+
+        PendingSnapshot snapshot;
+        snapshot.context = currentContext;
+        if (freeBuffers.empty()) {
+            glGenBuffers(1, &snapshot.buffer);
+        } else {
+            snapshot.buffer = freeBuffers.back();
+            freeBuffers.pop_back();
+        }
+        snapshot.image = glstate::getDrawBufferImage(snapshot.buffer);
+        if (!snapshot.image) {
+            std::cerr << call_no << ": warning: failed to get snapshot\n";
+            freeBuffers.push_back(snapshot.buffer);
+            return;
+        }
+        snapshot.call_no = call_no;
+        snapshot.snapshot_no = snapshot_no;
+        snapshot.frame_no = retrace::frameNo;
+        pending.push_back(snapshot);
+    }
+
+    void
+    flushSnapshots(void) {
+        while (!pending.empty()) {
+            retireSnapshot();
+        }
+        releaseBuffers();
+    }
+
     bool
     dumpState(std::ostream &os) {
         glretrace::Context *currentContext = glretrace::getCurrentContext();
@@ -622,11 +708,89 @@ public:
 
         return true;
     }
+
+private:
+    static bool
+    supportsPixelBufferObjects(void) {
+        if (glretrace::insideGlBeginEnd) {
+            return false;
+        }
+        glprofile::Profile profile = glprofile::getCurrentContextProfile();
+        if (profile.desktop()) {
+            return profile.versionGreaterOrEqual(2, 1);
+        } else {
+            return profile.versionGreaterOrEqual(3, 0);
+        }
+    }
+
+    /**
+     * Map the oldest pending snapshot and hand it over to the writer.
+     */
+    void
+    retireSnapshot(void) {
+        PendingSnapshot snapshot = pending.front();
+        pending.pop_front();
+
+        if (snapshot.context != glretrace::getCurrentContext()) {
+            // The buffer belongs to a context which is no longer current on
+            // this thread, so it can't be read back anymore.
+            std::cerr << snapshot.call_no << ": warning: failed to get snapshot\n";
+            delete snapshot.image;
+            return;
+        }
+
+        image::Image *image = snapshot.image;
+        size_t size = image->height * image->_stride();
+
+        GLint pixel_pack_buffer_binding = 0;
+        glGetIntegerv(GL_PIXEL_PACK_BUFFER_BINDING, &pixel_pack_buffer_binding);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, snapshot.buffer);
+
+        const void *map;
+        if (glprofile::getCurrentContextProfile().desktop()) {
+            map = glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+        } else {
+            map = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, GL_MAP_READ_BIT);
+        }
+        if (map) {
+            memcpy(image->pixels, map, size);
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        }
+
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, pixel_pack_buffer_binding);
+
+        freeBuffers.push_back(snapshot.buffer);
+
+        if (!map) {
+            std::cerr << snapshot.call_no << ": warning: failed to get snapshot\n";
+            delete image;
+            return;
+        }
+
+        retrace::writeSnapshot(snapshot.call_no, snapshot.snapshot_no, image);
+    }
+
+    void
+    releaseBuffers(void) {
+        if (!freeBuffers.empty() &&
+            bufferContext == glretrace::getCurrentContext()) {
+            glDeleteBuffers(freeBuffers.size(), &freeBuffers[0]);
+        }
+        freeBuffers.clear();
+        bufferContext = NULL;
+    }
+
 };
 
 static GLDumper glDumper;
 
 
+void
+glretrace::flushSnapshots(void) {
+    glDumper.flushSnapshots();
+}
+
+
 void
 retrace::setFeatureLevel(const char *featureLevel)
 {
@@ -657,6 +821,7 @@ retrace::flushRendering(void) {
     glretrace::Context *currentContext = glretrace::getCurrentContext();
     if (currentContext) {
         glretrace::flushQueries();
+        glretrace::flushSnapshots();
     }
 }
 
@@ -158,6 +158,10 @@ makeCurrent(trace::Call &call, glws::Drawable *drawable, Context *context)
 
     flushQueries();
 
+    if (context != currentContext) {
+        flushSnapshots();
+    }
+
     bool success = glws::makeCurrent(drawable, context ? context->wsContext : NULL);
 
     if (!success) {
@@ -62,8 +62,14 @@ void dumpCurrentContext(std::ostream &os);
 bool
 getDrawableBounds(GLint *width, GLint *height);
 
+/**
+ * Read back the current draw buffer.
+ *
+ * If pack_buffer is non-zero the pixels are read into that pixel pack buffer
+ * instead, asynchronously, and the returned image is left uninitialized.
+ */
 image::Image *
-getDrawBufferImage(void);
+getDrawBufferImage(GLuint pack_buffer = 0);
 
 
 } /* namespace glstate */
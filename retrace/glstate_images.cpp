@@ -844,7 +844,7 @@ getFramebufferAttachmentDesc(Context &context, GLenum target, GLenum attachment,
 
 
 image::Image *
-getDrawBufferImage() {
+getDrawBufferImage(GLuint pack_buffer) {
     Context context;
 
     GLenum framebuffer_binding;
@@ -936,7 +936,18 @@ getDrawBufferImage() {
     {
         // TODO: reset imaging state too
         PixelPackState pps(context);
-        glReadPixels(0, 0, desc.width, desc.height, format, type, image->pixels);
+        if (pack_buffer) {
+            GLint pixel_pack_buffer_binding = 0;
+            glGetIntegerv(GL_PIXEL_PACK_BUFFER_BINDING, &pixel_pack_buffer_binding);
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, pack_buffer);
+            glBufferData(GL_PIXEL_PACK_BUFFER,
+                         image->height * image->_stride(), NULL,
+                         GL_STREAM_READ);
+            glReadPixels(0, 0, desc.width, desc.height, format, type, 0);
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, pixel_pack_buffer_binding);
+        } else {
+            glReadPixels(0, 0, desc.width, desc.height, format, type, image->pixels);
+        }
     }
 
 
@@ -195,6 +195,9 @@ encodeBase64String(std::ostream &os, const unsigned char *bytes, size_t size) {
     os << "\"";
 }
 
+std::ostream *
+JSONWriter::blobStream = NULL;
+
 JSONWriter::JSONWriter(std::ostream &_os) :
     os(_os),
     level(0),
@@ -322,18 +325,31 @@ JSONWriter::writeImage(image::Image *image,
 
     writeStringMember("__format__", desc.format.c_str());
 
-    beginMember("__data__");
-    std::stringstream ss;
+    if (blobStream) {
+        long long offset = blobStream->tellp();
 
-    if (image->channelType == image::TYPE_UNORM8) {
-        image->writePNG(ss);
+        if (image->channelType == image::TYPE_UNORM8) {
+            image->writePNG(*blobStream);
+        } else {
+            image->writePNM(*blobStream);
+        }
+
+        writeIntMember("__offset__", offset);
+        writeIntMember("__size__", (long long)blobStream->tellp() - offset);
     } else {
-        image->writePNM(ss);
-    }
+        beginMember("__data__");
+        std::stringstream ss;
 
-    const std::string & s = ss.str();
-    writeBase64(s.data(), s.size());
-    endMember(); // __data__
+        if (image->channelType == image::TYPE_UNORM8) {
+            image->writePNG(ss);
+        } else {
+            image->writePNM(ss);
+        }
+
+        const std::string & s = ss.str();
+        writeBase64(s.data(), s.size());
+        endMember(); // __data__
+    }
 
     endObject();
 }
@@ -193,6 +193,13 @@ public:
         {}
     };
 
+    /**
+     * Where to write image payloads to, instead of inlining them as base64
+     * strings.  Images then refer to their payload by `__offset__` and
+     * `__size__` in this stream, which allows readers to load them lazily.
+     */
+    static std::ostream *blobStream;
+
     void
     writeImage(image::Image *image, const ImageDesc & desc);
 
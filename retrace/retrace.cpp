@@ -121,41 +121,55 @@ void Retracer::addCallbacks(const Entry *entries) {
 }
 
 
-void Retracer::retrace(trace::Call &call) {
-    call_dumped = false;
+static const Callback unsupportedCallback = &unsupported;
+
+
+/**
+ * Find the callback of a function, returning a pointer that stays valid for
+ * as long as the retracer, so that it can be attached to signatures.
+ */
+const Callback *
+Retracer::lookupCallback(const char *name) const {
+    Map::const_iterator it = map.find(name);
+    if (it == map.end()) {
+        return &unsupportedCallback;
+    }
+    return &it->second;
+}
 
-    Callback callback = 0;
 
-    trace::Id id = call.sig->id;
-    if (id >= callbacks.size()) {
-        callbacks.resize(id + 1);
-        callback = 0;
-    } else {
-        callback = callbacks[id];
-    }
+void *
+Retracer::resolveCallback(const trace::FunctionSig *sig, void *param) {
+    Retracer *retracer = static_cast<Retracer *>(param);
+    return const_cast<Callback *>(retracer->lookupCallback(sig->name));
+}
+
 
+void Retracer::bindParser(trace::Parser &parser) {
+    parser.setFunctionSigHook(&resolveCallback, this);
+}
+
+
+void Retracer::retrace(trace::Call &call) {
+    call_dumped = false;
+
+    const Callback *callback =
+        static_cast<const Callback *>(trace::Parser::getFunctionSigData(call.sig));
     if (!callback) {
-        Map::const_iterator it = map.find(call.name());
-        if (it == map.end()) {
-            callback = &unsupported;
-        } else {
-            callback = it->second;
-        }
-        callbacks[id] = callback;
+        callback = lookupCallback(call.name());
     }
 
-    assert(callback);
-    assert(callbacks[id] == callback);
+    assert(*callback);
 
     if (verbosity >= 1) {
         if (verbosity >= 2 ||
             (!(call.flags & trace::CALL_FLAG_VERBOSE) &&
-             callback != &ignore)) {
+             *callback != &ignore)) {
             dumpCall(call);
         }
     }
 
-    callback(call);
+    (*callback)(call);
 }
 
 
@@ -31,6 +31,7 @@
 #include <assert.h>
 #include <string.h>
 
+#include <limits>
 #include <list>
 #include <map>
 #include <ostream>
@@ -67,6 +68,10 @@ public:
      */
     inline void *
     allocArray(const trace::Value *value, size_t size) {
+        const trace::PackedArray *packed = value->toPackedArray();
+        if (packed) {
+            return ::ScopedAllocator::alloc(packed->size() * size);
+        }
         const trace::Array *array = value->toArray();
         if (array) {
             return ::ScopedAllocator::alloc(array->size() * size);
@@ -93,6 +98,50 @@ public:
         return static_cast<T *>(allocArray(value, sizeof_T));
     }
 
+    /**
+     * Get an input array of numbers, pointing straight into the parsed call
+     * when it was packed with the same element type, or converting it into a
+     * newly allocated array otherwise.
+     */
+    template< class T >
+    inline T *
+    readArray(const trace::Value *value) {
+        const trace::PackedArray *packed = value->toPackedArray();
+        if (packed && packed->isArrayOf<T>()) {
+            return static_cast<T *>(const_cast<void *>(packed->data));
+        }
+
+        T *array = allocArray<T>(value);
+        if (!array) {
+            return NULL;
+        }
+
+        typedef std::numeric_limits<T> limits;
+        if (packed) {
+            for (size_t i = 0; i < packed->size(); ++i) {
+                if (!limits::is_integer) {
+                    array[i] = static_cast<T>(packed->getDouble(i));
+                } else if (limits::is_signed) {
+                    array[i] = static_cast<T>(packed->getSInt(i));
+                } else {
+                    array[i] = static_cast<T>(packed->getUInt(i));
+                }
+            }
+        } else {
+            const trace::Array *values = value->toArray();
+            for (size_t i = 0; i < values->size(); ++i) {
+                if (!limits::is_integer) {
+                    array[i] = static_cast<T>(values->values[i]->toDouble());
+                } else if (limits::is_signed) {
+                    array[i] = static_cast<T>(values->values[i]->toSInt());
+                } else {
+                    array[i] = static_cast<T>(values->values[i]->toUInt());
+                }
+            }
+        }
+        return array;
+    }
+
 };
 
 
@@ -182,7 +231,9 @@ class Retracer
     typedef std::map<const char *, Callback, stringComparer> Map;
     Map map;
 
-    std::vector<Callback> callbacks;
+    const Callback *lookupCallback(const char *name) const;
+
+    static void *resolveCallback(const trace::FunctionSig *sig, void *param);
 
 public:
     Retracer() {
@@ -194,6 +245,21 @@ public:
     void addCallback(const Entry *entry);
     void addCallbacks(const Entry *entries);
 
+    /**
+     * Resolve the callback of every function signature the parser defines,
+     * so that retrace() need not look it up.  Must be called after all
+     * callbacks were added.
+     */
+    void bindParser(trace::Parser &parser);
+
+    /**
+     * Retrace a call, dumping it first when verbose.
+     *
+     * There's no separate path for --benchmark: it sets the verbosity below
+     * one, so all that remains of the dumping per call is a single well
+     * predicted comparison, which doesn't warrant duplicating the retrace
+     * loops.
+     */
     void retrace(trace::Call &call);
 };
 
@@ -206,6 +272,21 @@ public:
         return NULL;
     }
 
+    /**
+     * Take a snapshot of the current draw buffer and hand it over to
+     * writeSnapshot(), either straight away or, when the read back can be
+     * done asynchronously, a few frames later.
+     */
+    virtual void
+    requestSnapshot(unsigned call_no, unsigned snapshot_no);
+
+    /**
+     * Hand over all snapshots requested so far.
+     */
+    virtual void
+    flushSnapshots(void) {
+    }
+
     virtual bool
     dumpState(std::ostream &os) {
         return false;
@@ -216,6 +297,14 @@ public:
 extern Dumper *dumper;
 
 
+/**
+ * Encode and write out a snapshot in the background, taking ownership of the
+ * image.
+ */
+void
+writeSnapshot(unsigned call_no, unsigned snapshot_no, image::Image *image);
+
+
 void
 setFeatureLevel(const char *featureLevel);
 
@@ -251,6 +251,9 @@ class SwizzledValueRegistrator(stdapi.Visitor, stdapi.ExpanderMixin):
         pass
 
     def visitArray(self, array, lvalue, rvalue):
+        if array.packable():
+            # Numbers have nothing to swizzle
+            return
         print '    const trace::Array *_a%s = (%s).toArray();' % (array.tag, rvalue)
         print '    if (_a%s) {' % (array.tag)
         length = '_a%s->values.size()' % array.tag
@@ -449,6 +452,13 @@ class Retracer:
         print '    return;'
 
     def extractArg(self, function, arg, arg_type, lvalue, rvalue):
+        # Input arrays of numbers can be read straight from the call, as they
+        # are not written to
+        if arg.input and not arg.output and \
+           isinstance(arg_type, stdapi.Array) and arg_type.packable():
+            print '    %s = _allocator.readArray<%s>(&%s);' % (lvalue, arg_type.type, rvalue)
+            return
+
         ValueAllocator().visit(arg_type, lvalue, rvalue)
         if arg.input:
             ValueDeserializer().visit(arg_type, lvalue, rvalue)
@@ -549,7 +559,7 @@ class Retracer:
                     print 'static retrace::map<%s> _%s_map;' % (handle.type, handle.name)
                 else:
                     key_name, key_type = handle.key
-                    print 'static std::map<%s, retrace::map<%s> > _%s_map;' % (key_type, handle.type, handle.name)
+                    print 'static retrace::flat_map<%s, retrace::map<%s> > _%s_map;' % (key_type, handle.type, handle.name)
                 handle_names.add(handle.name)
         print
 
@@ -29,6 +29,11 @@
 #include <string.h>
 #include <limits.h> // for CHAR_MAX
 #include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <deque>
+#include <vector>
 #include <getopt.h>
 #ifndef _WIN32
 #include <unistd.h> // for isatty()
@@ -38,6 +43,7 @@
 #include "os_time.hpp"
 #include "os_thread.hpp"
 #include "image.hpp"
+#include "json.hpp"
 #include "trace_callset.hpp"
 #include "trace_dump.hpp"
 #include "trace_option.hpp"
@@ -56,9 +62,11 @@ static enum {
 
 static trace::CallSet snapshotFrequency;
 static unsigned snapshotInterval = 0;
-static trace::ParseBookmark lastFrameStart;
+
+static unsigned parseAheadDepth = 0;
 
 static unsigned dumpStateCallNo = ~0;
+static std::ofstream dumpStateBlobs;
 
 retrace::Retracer retracer;
 
@@ -115,48 +123,171 @@ Dumper *dumper = &defaultDumper;
 
 
 /**
- * Take snapshots.
+ * Pool of threads encoding and writing snapshots, so that the replay doesn't
+ * wait on them.
+ *
+ * Whatever goes to stdout -- the images themselves when the snapshot prefix is
+ * "-", or the names of the written files otherwise -- is emitted by the
+ * replaying thread, in the order the snapshots were taken.  The number of
+ * snapshots in flight is bounded, so that memory usage stays bounded too.
  */
-static void
-takeSnapshot(unsigned call_no) {
-    static unsigned snapshot_no = 0;
+class SnapshotWriter
+{
+    struct Job {
+        unsigned call_no;
+        unsigned snapshot_no;
+        image::Image *image;
+        std::string output;
+        bool done;
+    };
 
-    assert(snapshotPrefix);
+    os::mutex mutex;
+    os::condition_variable work_cond;
+    os::condition_variable done_cond;
 
-    image::Image *src = dumper->getSnapshot();
-    if (!src) {
-        std::cerr << call_no << ": warning: failed to get snapshot\n";
-        return;
+    /* Jobs not picked by any worker yet */
+    std::deque<Job *> queue;
+
+    /* All jobs not committed yet, in snapshot order */
+    std::deque<Job *> jobs;
+
+    std::vector<os::thread> workers;
+    size_t maxJobs;
+    bool stopping;
+
+public:
+    SnapshotWriter() :
+        stopping(false)
+    {
+        unsigned numWorkers = os::thread::hardware_concurrency();
+        numWorkers = std::max(std::min(numWorkers, 8U), 1U);
+        maxJobs = 2 * numWorkers;
+        for (unsigned i = 0; i < numWorkers; ++i) {
+            workers.push_back(os::thread(workerThread, this));
+        }
+    }
+
+    ~SnapshotWriter() {
+        finish();
+
+        os::unique_lock<os::mutex> lock(mutex);
+        stopping = true;
+        for (unsigned i = 0; i < workers.size(); ++i) {
+            work_cond.signal();
+        }
+        lock.unlock();
+
+        for (unsigned i = 0; i < workers.size(); ++i) {
+            workers[i].join();
+        }
+    }
+
+    void
+    write(unsigned call_no, unsigned snapshot_no, image::Image *image) {
+        Job *job = new Job;
+        job->call_no = call_no;
+        job->snapshot_no = snapshot_no;
+        job->image = image;
+        job->done = false;
+
+        os::unique_lock<os::mutex> lock(mutex);
+        commit(lock, maxJobs - 1);
+        queue.push_back(job);
+        jobs.push_back(job);
+        lock.unlock();
+
+        work_cond.signal();
+    }
+
+    /**
+     * Wait for all snapshots to be written.
+     */
+    void
+    finish(void) {
+        os::unique_lock<os::mutex> lock(mutex);
+        commit(lock, 0);
+    }
+
+private:
+    /**
+     * Commit finished jobs, waiting until at most maxPending remain.
+     */
+    void
+    commit(os::unique_lock<os::mutex> &lock, size_t maxPending) {
+        while (true) {
+            while (!jobs.empty() && jobs.front()->done) {
+                Job *job = jobs.front();
+                jobs.pop_front();
+                lock.unlock();
+                std::cout.write(job->output.data(), job->output.size());
+                delete job;
+                lock.lock();
+            }
+            if (jobs.size() <= maxPending) {
+                break;
+            }
+            done_cond.wait(lock);
+        }
+        std::cout.flush();
+    }
+
+    static void *
+    workerThread(SnapshotWriter *_this) {
+        _this->work();
+        return 0;
+    }
+
+    void
+    work(void) {
+        os::unique_lock<os::mutex> lock(mutex);
+        while (true) {
+            while (queue.empty() && !stopping) {
+                work_cond.wait(lock);
+            }
+            if (queue.empty()) {
+                break;
+            }
+
+            Job *job = queue.front();
+            queue.pop_front();
+            lock.unlock();
+
+            encode(*job);
+
+            lock.lock();
+            job->done = true;
+            done_cond.signal();
+        }
     }
 
-    if (snapshotPrefix &&
-        (snapshotInterval == 0 ||
-        (snapshot_no % snapshotInterval) == 0)) {
+    static void
+    encode(Job &job) {
+        image::Image *src = job.image;
+        unsigned no = useCallNos ? job.call_no : job.snapshot_no;
 
         if (snapshotPrefix[0] == '-' && snapshotPrefix[1] == 0) {
             char comment[21];
-            snprintf(comment, sizeof comment, "%u",
-                     useCallNos ? call_no : snapshot_no);
+            snprintf(comment, sizeof comment, "%u", no);
+            std::ostringstream os;
             switch (snapshotFormat) {
             case PNM_FMT:
-                src->writePNM(std::cout, comment);
+                src->writePNM(os, comment);
                 break;
             case RAW_RGB:
-                src->writeRAW(std::cout);
+                src->writeRAW(os);
                 break;
             case RAW_MD5:
-                src->writeMD5(std::cout);
+                src->writeMD5(os);
                 break;
             default:
                 assert(0);
                 break;
             }
-        } else if (src->channelType != image::TYPE_UNORM8) {
-            std::cerr << call_no << ": warning: skipping non 8-bit unsigned normalized snapshot\n";
+            job.output = os.str();
         } else {
             os::String filename = os::String::format("%s%010u.png",
                                                      snapshotPrefix,
-                                                     useCallNos ? call_no : snapshot_no);
+                                                     no);
 
             // Alpha channel often has bogus data, so strip it when writing
             // PNG images to disk to simplify visualization.
@@ -164,16 +295,80 @@ takeSnapshot(unsigned call_no) {
 
             if (src->writePNG(filename, strip_alpha) &&
                 retrace::verbosity >= 0) {
-                std::cout << "Wrote " << filename << "\n";
+                job.output = "Wrote ";
+                job.output += filename.str();
+                job.output += "\n";
             }
         }
+
+        delete src;
+        job.image = NULL;
+    }
+};
+
+
+static SnapshotWriter *snapshotWriter = NULL;
+
+
+void
+writeSnapshot(unsigned call_no, unsigned snapshot_no, image::Image *image) {
+    assert(snapshotPrefix);
+
+    bool toStdout = snapshotPrefix[0] == '-' && snapshotPrefix[1] == 0;
+    if (!toStdout && image->channelType != image::TYPE_UNORM8) {
+        std::cerr << call_no << ": warning: skipping non 8-bit unsigned normalized snapshot\n";
+        delete image;
+        return;
+    }
+
+    if (!snapshotWriter) {
+        snapshotWriter = new SnapshotWriter;
     }
+    snapshotWriter->write(call_no, snapshot_no, image);
+}
 
-    delete src;
+
+void
+Dumper::requestSnapshot(unsigned call_no, unsigned snapshot_no) {
+    image::Image *src = getSnapshot();
+    if (!src) {
+        std::cerr << call_no << ": warning: failed to get snapshot\n";
+        return;
+    }
+
+    writeSnapshot(call_no, snapshot_no, src);
+}
+
+
+/**
+ * Take snapshots.
+ */
+static void
+takeSnapshot(unsigned call_no) {
+    static unsigned snapshot_no = 0;
+
+    assert(snapshotPrefix);
+
+    if (snapshotInterval == 0 ||
+        (snapshot_no % snapshotInterval) == 0) {
+        dumper->requestSnapshot(call_no, snapshot_no);
+    }
 
     snapshot_no++;
+}
 
-    return;
+
+/**
+ * Write out all pending snapshots.
+ */
+static void
+finishSnapshots(void) {
+    dumper->flushSnapshots();
+
+    if (snapshotWriter) {
+        delete snapshotWriter;
+        snapshotWriter = NULL;
+    }
 }
 
 
@@ -212,13 +407,246 @@ retraceCall(trace::Call *call) {
             takeSnapshot(call->no);
         }
         if (call->no >= snapshotFrequency.getLast()) {
+            finishSnapshots();
             exit(0);
         }
     }
 
-    if (call->no >= dumpStateCallNo &&
-        dumper->dumpState(std::cout)) {
-        exit(0);
+    if (call->no >= dumpStateCallNo) {
+        // Flush the snapshots taken so far only once, rather than on every
+        // call after a failed attempt to dump the state.
+        static bool snapshotsFinished = false;
+        if (!snapshotsFinished) {
+            finishSnapshots();
+            snapshotsFinished = true;
+        }
+        if (dumper->dumpState(std::cout)) {
+            if (dumpStateBlobs.is_open()) {
+                dumpStateBlobs.close();
+            }
+            exit(0);
+        }
+    }
+}
+
+
+/**
+ * Sequential source of the calls to retrace.
+ *
+ * Takes care of restarting the last frame when looping is requested.
+ */
+class CallSource
+{
+protected:
+    bool started;
+    bool callEndsFrame;
+    trace::ParseBookmark frameStart;
+    trace::ParseBookmark lastFrameStart;
+
+    trace::Call *
+    parseCall(void);
+
+public:
+    CallSource() :
+        started(false),
+        callEndsFrame(false)
+    {
+    }
+
+    virtual ~CallSource() {}
+
+    virtual trace::Call *
+    getCall(void) {
+        return parseCall();
+    }
+
+    virtual void
+    stop(void) {}
+};
+
+
+trace::Call *
+CallSource::parseCall(void) {
+    trace::Call *call = parser.parse_call();
+
+    if (loopCount) {
+        if (!started) {
+            /* If the user wants to loop we need to get a bookmark target. We
+             * usually get this after parsing a call that ends a frame, but
+             * for a trace that has only one frame we need to get it at the
+             * beginning. */
+            parser.getBookmark(lastFrameStart);
+        } else if (!call) {
+            /* Restart last frame. */
+            parser.setBookmark(lastFrameStart);
+            call = parser.parse_call();
+            if (loopCount > 0) {
+                --loopCount;
+            }
+        } else if (callEndsFrame) {
+            lastFrameStart = frameStart;
+        }
+
+        callEndsFrame = call && (call->flags & trace::CALL_FLAG_END_FRAME);
+        if (callEndsFrame) {
+            parser.getBookmark(frameStart);
+        }
+    }
+
+    started = true;
+
+    return call;
+}
+
+
+/**
+ * Call source which decodes calls on a separate thread, so that decompression
+ * and parsing overlap with the retracing of earlier calls.
+ *
+ * Parsed calls are handed over through a bounded queue, so that memory usage
+ * is kept in check when decoding is much faster than retracing.
+ */
+class ParseAheadCallSource : public CallSource
+{
+private:
+    os::mutex mutex;
+    os::condition_variable notEmpty;
+    os::condition_variable notFull;
+
+    /**
+     * These are protected by the mutex.
+     */
+    std::vector<trace::Call *> queue;
+    size_t head;
+    size_t count;
+    bool stopped;
+
+    /**
+     * Only touched by the consumer.
+     */
+    bool finished;
+
+    os::thread thread;
+
+    static void *
+    decoderThread(ParseAheadCallSource *_this);
+
+    void
+    decode(void);
+
+public:
+    ParseAheadCallSource(unsigned depth) :
+        queue(depth),
+        head(0),
+        count(0),
+        stopped(false),
+        finished(false)
+    {
+        assert(depth);
+        thread = os::thread(decoderThread, this);
+    }
+
+    ~ParseAheadCallSource() {
+        stop();
+    }
+
+    trace::Call *
+    getCall(void);
+
+    void
+    stop(void);
+};
+
+
+void *
+ParseAheadCallSource::decoderThread(ParseAheadCallSource *_this) {
+    _this->decode();
+    return 0;
+}
+
+
+void
+ParseAheadCallSource::decode(void) {
+    trace::Call *call;
+    do {
+        call = parseCall();
+
+        os::unique_lock<os::mutex> lock(mutex);
+        while (count == queue.size() && !stopped) {
+            notFull.wait(lock);
+        }
+        if (stopped) {
+            delete call;
+            break;
+        }
+
+        /* A NULL call marks the end of the trace. */
+        queue[(head + count) % queue.size()] = call;
+        ++count;
+        notEmpty.signal();
+    } while (call);
+}
+
+
+trace::Call *
+ParseAheadCallSource::getCall(void) {
+    if (finished) {
+        return NULL;
+    }
+
+    os::unique_lock<os::mutex> lock(mutex);
+    while (count == 0) {
+        notEmpty.wait(lock);
+    }
+
+    trace::Call *call = queue[head];
+    head = (head + 1) % queue.size();
+    --count;
+    notFull.signal();
+
+    if (!call) {
+        finished = true;
+    }
+
+    return call;
+}
+
+
+/**
+ * Stop the decoder thread, discarding any calls decoded so far.
+ *
+ * Must be called before the parser is closed, including when exiting the
+ * process midway through the trace.
+ */
+void
+ParseAheadCallSource::stop(void) {
+    if (!thread.joinable()) {
+        return;
+    }
+
+    mutex.lock();
+    stopped = true;
+    mutex.unlock();
+    notFull.signal();
+
+    thread.join();
+    thread = os::thread();
+
+    while (count) {
+        delete queue[head];
+        head = (head + 1) % queue.size();
+        --count;
+    }
+}
+
+
+static CallSource *callSource = NULL;
+
+
+static void
+stopCallSource(void) {
+    if (callSource) {
+        callSource->stop();
     }
 }
 
@@ -351,33 +779,12 @@ public:
 
         /* Consume successive calls for this thread. */
         do {
-            bool callEndsFrame = false;
-            static trace::ParseBookmark frameStart;
-
             assert(call);
             assert(call->thread_id == leg);
 
-            if (loopCount && call->flags & trace::CALL_FLAG_END_FRAME) {
-                callEndsFrame = true;
-                parser.getBookmark(frameStart);
-            }
-
             retraceCall(call);
             delete call;
-            call = parser.parse_call();
-
-            /* Restart last frame if looping is requested. */
-            if (loopCount) {
-                if (!call) {
-                    parser.setBookmark(lastFrameStart);
-                    call = parser.parse_call();
-                    if (loopCount > 0) {
-                        --loopCount;
-                    }
-                } else if (callEndsFrame) {
-                    lastFrameStart = frameStart;
-                }
-            }
+            call = callSource->getCall();
 
         } while (call && call->thread_id == leg);
 
@@ -390,6 +797,8 @@ public:
             /* Reached the finish line */
             if (0) std::cerr << "finished on leg " << leg << "\n";
             if (leg) {
+                /* Flush while our contexts are still current */
+                flushRendering();
                 /* Notify the fore runner */
                 race->finishLine();
             } else {
@@ -480,20 +889,12 @@ RelayRace::getRunner(unsigned leg) {
 void
 RelayRace::run(void) {
     trace::Call *call;
-    call = parser.parse_call();
+    call = callSource->getCall();
     if (!call) {
         /* Nothing to do */
         return;
     }
 
-    /* If the user wants to loop we need to get a bookmark target. We
-     * usually get this after replaying a call that ends a frame, but
-     * for a trace that has only one frame we need to get it at the
-     * beginning. */
-    if (loopCount) {
-        parser.getBookmark(lastFrameStart);
-    }
-
     RelayRunner *foreRunner = getForeRunner();
     if (call->thread_id == 0) {
         /* We are the forerunner thread, so no need to pass baton */
@@ -549,15 +950,29 @@ RelayRace::stopRunners(void) {
 static void
 mainLoop() {
     addCallbacks(retracer);
+    retracer.bindParser(parser);
 
     long long startTime = 0; 
     frameNo = 0;
 
     startTime = os::getTime();
 
+    if (parseAheadDepth) {
+        static bool registered = false;
+        if (!registered) {
+            // Calls to exit() midway through the trace must not tear down the
+            // parser under the decoder thread's feet.
+            atexit(stopCallSource);
+            registered = true;
+        }
+        callSource = new ParseAheadCallSource(parseAheadDepth);
+    } else {
+        callSource = new CallSource;
+    }
+
     if (singleThread) {
         trace::Call *call;
-        while ((call = parser.parse_call())) {
+        while ((call = callSource->getCall())) {
             retraceCall(call);
             delete call;
         };
@@ -566,10 +981,19 @@ mainLoop() {
         race.run();
     }
     finishRendering();
+    finishSnapshots();
+
+    delete callSource;
+    callSource = NULL;
 
     long long endTime = os::getTime();
     float timeInterval = (endTime - startTime) * (1.0 / os::timeFrequency);
 
+    if (retrace::profiling) {
+        // Calls after the last frame end must precede the summary
+        retrace::profiler.flush();
+    }
+
     if ((retrace::verbosity >= -1) || (retrace::profiling)) {
         std::cout << 
             "Rendered " << frameNo << " frames"
@@ -600,6 +1024,7 @@ usage(const char *argv0) {
         "      --pgpu              gpu profiling (gpu times per draw call)\n"
         "      --ppd               pixels drawn profiling (pixels drawn per draw call)\n"
         "      --pmem              memory usage profiling (vsize rss per call)\n"
+        "      --profile-format=FMT    write profiles as `text` (default) or `binary`\n"
         "      --call-nos[=BOOL]   use call numbers in snapshot filenames\n"
         "      --core              use core profile\n"
         "      --db                use a double buffer visual (default)\n"
@@ -610,11 +1035,14 @@ usage(const char *argv0) {
         "      --snapshot-format=FMT       use (PNM, RGB, or MD5; default is PNM) when writing to stdout output\n"
         "  -S, --snapshot=CALLSET  calls to snapshot (default is every frame)\n"
         "      --snapshot-interval=N    specify a frame interval when generating snaphots (default is 0)\n"
+        "      --snapshot-compression=LEVEL  PNG compression: 0-9, `store`, `rle`, `fast` (default), `default`, or `best`\n"
         "  -v, --verbose           increase output verbosity\n"
         "  -D, --dump-state=CALL   dump state at specific call no\n"
+        "      --dump-state-blobs=FILE  write dumped images to FILE, referring to them by offset\n"
         "  -w, --wait              waitOnFinish on final frame\n"
         "      --loop[=N]          loop N times (N<0 continuously) replaying final frame.\n"
-        "      --singlethread      use a single thread to replay command stream\n";
+        "      --singlethread      use a single thread to replay command stream\n"
+        "      --parse-ahead[=N]   decode up to N calls (default is 256) ahead on a separate thread\n";
 }
 
 enum {
@@ -627,11 +1055,15 @@ enum {
     PGPU_OPT,
     PPD_OPT,
     PMEM_OPT,
+    PROFILE_FORMAT_OPT,
     SB_OPT,
     SNAPSHOT_FORMAT_OPT,
     LOOP_OPT,
     SINGLETHREAD_OPT,
-    SNAPSHOT_INTERVAL_OPT
+    SNAPSHOT_INTERVAL_OPT,
+    SNAPSHOT_COMPRESSION_OPT,
+    DUMP_STATE_BLOBS_OPT,
+    PARSE_AHEAD_OPT
 };
 
 const static char *
@@ -647,20 +1079,24 @@ longOptions[] = {
     {"samples", required_argument, 0, SAMPLES_OPT},
     {"driver", required_argument, 0, DRIVER_OPT},
     {"dump-state", required_argument, 0, 'D'},
+    {"dump-state-blobs", required_argument, 0, DUMP_STATE_BLOBS_OPT},
     {"help", no_argument, 0, 'h'},
     {"pcpu", no_argument, 0, PCPU_OPT},
     {"pgpu", no_argument, 0, PGPU_OPT},
     {"ppd", no_argument, 0, PPD_OPT},
     {"pmem", no_argument, 0, PMEM_OPT},
+    {"profile-format", required_argument, 0, PROFILE_FORMAT_OPT},
     {"sb", no_argument, 0, SB_OPT},
     {"snapshot-prefix", required_argument, 0, 's'},
     {"snapshot-format", required_argument, 0, SNAPSHOT_FORMAT_OPT},
     {"snapshot", required_argument, 0, 'S'},
     {"snapshot-interval", required_argument, 0, SNAPSHOT_INTERVAL_OPT},
+    {"snapshot-compression", required_argument, 0, SNAPSHOT_COMPRESSION_OPT},
     {"verbose", no_argument, 0, 'v'},
     {"wait", no_argument, 0, 'w'},
     {"loop", optional_argument, 0, LOOP_OPT},
     {"singlethread", no_argument, 0, SINGLETHREAD_OPT},
+    {"parse-ahead", optional_argument, 0, PARSE_AHEAD_OPT},
     {0, 0, 0, 0}
 };
 
@@ -676,6 +1112,7 @@ int main(int argc, char **argv)
 {
     using namespace retrace;
     int i;
+    bool binaryProfile = false;
 
     assert(snapshotFrequency.empty());
 
@@ -700,6 +1137,14 @@ int main(int argc, char **argv)
             dumpingState = true;
             retrace::verbosity = -2;
             break;
+        case DUMP_STATE_BLOBS_OPT:
+            dumpStateBlobs.open(optarg, std::ios::out | std::ios::binary | std::ios::trunc);
+            if (!dumpStateBlobs.is_open()) {
+                std::cerr << "error: failed to open " << optarg << "\n";
+                return 1;
+            }
+            JSONWriter::blobStream = &dumpStateBlobs;
+            break;
         case CORE_OPT:
             retrace::setFeatureLevel("3_2_core");
             break;
@@ -773,6 +1218,12 @@ int main(int argc, char **argv)
         case SNAPSHOT_INTERVAL_OPT:
             snapshotInterval = atoi(optarg);
             break;
+        case SNAPSHOT_COMPRESSION_OPT:
+            if (!image::setPNGCompression(optarg)) {
+                std::cerr << "error: unknown snapshot compression `" << optarg << "`\n";
+                return 1;
+            }
+            break;
         case 'v':
             ++retrace::verbosity;
             break;
@@ -782,6 +1233,9 @@ int main(int argc, char **argv)
         case LOOP_OPT:
             loopCount = trace::intOption(optarg, -1);
             break;
+        case PARSE_AHEAD_OPT:
+            parseAheadDepth = std::max(trace::intOption(optarg, 256), 0);
+            break;
         case PGPU_OPT:
             retrace::debug = 0;
             retrace::profiling = true;
@@ -810,6 +1264,16 @@ int main(int argc, char **argv)
 
             retrace::profilingMemoryUsage = true;
             break;
+        case PROFILE_FORMAT_OPT:
+            if (strcmp(optarg, "binary") == 0) {
+                binaryProfile = true;
+            } else if (strcmp(optarg, "text") == 0) {
+                binaryProfile = false;
+            } else {
+                std::cerr << "error: unknown profile format " << optarg << "\n";
+                return 1;
+            }
+            break;
         default:
             std::cerr << "error: unknown option " << opt << "\n";
             usage(argv[0]);
@@ -825,7 +1289,11 @@ int main(int argc, char **argv)
 
     retrace::setUp();
     if (retrace::profiling) {
-        retrace::profiler.setup(retrace::profilingCpuTimes, retrace::profilingGpuTimes, retrace::profilingPixelsDrawn, retrace::profilingMemoryUsage);
+        retrace::profiler.setup(retrace::profilingCpuTimes, retrace::profilingGpuTimes, retrace::profilingPixelsDrawn, retrace::profilingMemoryUsage, binaryProfile);
+        if (binaryProfile) {
+            // Leave stdout to the profile, and send everything else to stderr
+            std::cout.rdbuf(std::cerr.rdbuf());
+        }
     }
 
     os::setExceptionCallback(exceptionCallback);
@@ -28,6 +28,10 @@
 
 #include <string.h>
 
+#include <algorithm>
+#include <map>
+#include <vector>
+
 #include "retrace.hpp"
 #include "retrace_swizzle.hpp"
 
@@ -37,33 +41,58 @@ namespace retrace {
 
 struct Region
 {
-    void *buffer;
+    unsigned long long start;
     unsigned long long size;
+    void *buffer;
 };
 
-typedef std::map<unsigned long long, Region> RegionMap;
+/*
+ * Regions sorted by their (unique) start address.
+ *
+ * Regions are looked up for every pointer argument, but seldom added or
+ * removed, so they are kept in a flat array rather than a tree.
+ */
+typedef std::vector<Region> RegionMap;
 static RegionMap regionMap;
 
+/*
+ * Index of the region last returned by lookupRegion, as consecutive lookups
+ * tend to hit the same region.
+ */
+static size_t lastRegion = 0;
+
 
 static inline bool
 contains(RegionMap::iterator &it, unsigned long long address) {
-    return it->first <= address && (it->first + it->second.size) > address;
+    return it->start <= address && (it->start + it->size) > address;
 }
 
 
 static inline bool
 intersects(RegionMap::iterator &it, unsigned long long start, unsigned long long size) {
-    unsigned long it_start = it->first;
-    unsigned long it_stop  = it->first + it->second.size;
+    unsigned long it_start = it->start;
+    unsigned long it_stop  = it->start + it->size;
     unsigned long stop = start + size;
     return it_start < stop && start < it_stop;
 }
 
 
+static inline bool
+startsBefore(const Region &region, unsigned long long address) {
+    return region.start < address;
+}
+
+
+static inline bool
+startsAfter(unsigned long long address, const Region &region) {
+    return address < region.start;
+}
+
+
 // Iterator to the first region that contains the address, or the first after
 static RegionMap::iterator
 lowerBound(unsigned long long address) {
-    RegionMap::iterator it = regionMap.lower_bound(address);
+    RegionMap::iterator it = std::lower_bound(regionMap.begin(), regionMap.end(), address, startsBefore);
 
     while (it != regionMap.begin()) {
         RegionMap::iterator pred = it;
@@ -77,7 +106,7 @@ lowerBound(unsigned long long address) {
 
 #ifndef NDEBUG
     if (it != regionMap.end()) {
-        assert(contains(it, address) || it->first > address);
+        assert(contains(it, address) || it->start > address);
     }
 #endif
 
@@ -87,11 +116,11 @@ lowerBound(unsigned long long address) {
 // Iterator to the first region that starts after the address
 static RegionMap::iterator
 upperBound(unsigned long long address) {
-    RegionMap::iterator it = regionMap.upper_bound(address);
+    RegionMap::iterator it = std::upper_bound(regionMap.begin(), regionMap.end(), address, startsAfter);
 
 #ifndef NDEBUG
     if (it != regionMap.end()) {
-        assert(it->first >= address);
+        assert(it->start >= address);
     }
 #endif
 
@@ -135,7 +164,7 @@ addRegion(unsigned long long address, void *buffer, unsigned long long size)
             for (RegionMap::iterator it = start; it != stop; ++it) {
                 std::cerr << std::hex << "warning: "
                     "region 0x" << address << "-0x" << (address + size) << " "
-                    "intersects existing region 0x" << it->first << "-0x" << (it->first + it->second.size) << "\n" << std::dec;
+                    "intersects existing region 0x" << it->start << "-0x" << (it->start + it->size) << "\n" << std::dec;
                 assert(intersects(it, address, size));
             }
         }
@@ -144,23 +173,32 @@ addRegion(unsigned long long address, void *buffer, unsigned long long size)
     assert(buffer);
 
     Region region;
-    region.buffer = buffer;
+    region.start = address;
     region.size = size;
+    region.buffer = buffer;
 
-    regionMap[address] = region;
+    RegionMap::iterator it = std::lower_bound(regionMap.begin(), regionMap.end(), address, startsBefore);
+    if (it != regionMap.end() && it->start == address) {
+        *it = region;
+    } else {
+        regionMap.insert(it, region);
+    }
+    lastRegion = 0;
 }
 
+// Iterator to the last region that starts at or before the address
 static RegionMap::iterator
 lookupRegion(unsigned long long address) {
-    RegionMap::iterator it = regionMap.lower_bound(address);
-
+    RegionMap::iterator it = regionMap.begin() + std::min(lastRegion, regionMap.size());
     if (it == regionMap.end() ||
-        it->first > address) {
+        it->start > address ||
+        (it + 1 != regionMap.end() && (it + 1)->start <= address)) {
+        it = std::upper_bound(regionMap.begin(), regionMap.end(), address, startsAfter);
         if (it == regionMap.begin()) {
             return regionMap.end();
-        } else {
-            --it;
         }
+        --it;
+        lastRegion = it - regionMap.begin();
     }
 
     assert(contains(it, address));
@@ -172,6 +210,7 @@ delRegion(unsigned long long address) {
     RegionMap::iterator it = lookupRegion(address);
     if (it != regionMap.end()) {
         regionMap.erase(it);
+        lastRegion = 0;
     } else {
         assert(0);
     }
@@ -181,8 +220,9 @@ delRegion(unsigned long long address) {
 void
 delRegionByPointer(void *ptr) {
     for (RegionMap::iterator it = regionMap.begin(); it != regionMap.end(); ++it) {
-        if (it->second.buffer == ptr) {
+        if (it->buffer == ptr) {
             regionMap.erase(it);
+            lastRegion = 0;
             return;
         }
     }
@@ -193,11 +233,11 @@ static void
 lookupAddress(unsigned long long address, void * & ptr, size_t & len) {
     RegionMap::iterator it = lookupRegion(address);
     if (it != regionMap.end()) {
-        unsigned long long offset = address - it->first;
-        assert(offset < it->second.size);
+        unsigned long long offset = address - it->start;
+        assert(offset < it->size);
 
-        ptr = (char *)it->second.buffer + offset;
-        len = it->second.size - offset;
+        ptr = (char *)it->buffer + offset;
+        len = it->size - offset;
 
         if (retrace::verbosity >= 2) {
             std::cout
@@ -27,7 +27,9 @@
 #define _RETRACE_SWIZZLE_HPP_
 
 
-#include <map>
+#include <algorithm>
+#include <utility>
+#include <vector>
 
 #include "trace_model.hpp"
 
@@ -35,6 +37,232 @@
 namespace retrace {
 
 
+/**
+ * Slot of small non-negative integer keys in a flat_map's dense array.
+ *
+ * Keys of other types (pointers, etc.) are always kept in the sorted array.
+ */
+template <class K>
+inline bool
+denseIndex(const K &, size_t &) {
+    return false;
+}
+
+#define _RETRACE_DENSE_INDEX_UNSIGNED(K) \
+    inline bool \
+    denseIndex(K key, size_t &index) { \
+        index = key > (K)~size_t(0) ? ~size_t(0) : size_t(key); \
+        return true; \
+    }
+
+#define _RETRACE_DENSE_INDEX_SIGNED(K) \
+    inline bool \
+    denseIndex(K key, size_t &index) { \
+        if (key < 0) { \
+            return false; \
+        } \
+        index = (unsigned long long)key > ~size_t(0) ? ~size_t(0) : size_t(key); \
+        return true; \
+    }
+
+_RETRACE_DENSE_INDEX_UNSIGNED(unsigned int)
+_RETRACE_DENSE_INDEX_UNSIGNED(unsigned long)
+_RETRACE_DENSE_INDEX_UNSIGNED(unsigned long long)
+_RETRACE_DENSE_INDEX_SIGNED(int)
+_RETRACE_DENSE_INDEX_SIGNED(long)
+_RETRACE_DENSE_INDEX_SIGNED(long long)
+
+#undef _RETRACE_DENSE_INDEX_UNSIGNED
+#undef _RETRACE_DENSE_INDEX_SIGNED
+
+
+/**
+ * Associative container optimized for object names.
+ *
+ * GL implementations hand out small, mostly consecutive integer names, so
+ * keys below DENSE_LIMIT are stored in a vector indexed by the key itself.
+ * All other keys are kept in vectors sorted by key: names generated in
+ * increasing order are appended to the main one, while out of order names
+ * go to a small one which is merged into the main one once it grows past the
+ * square root of its size.  Lookups are thus an index or binary searches,
+ * rather than a walk down a tree.
+ *
+ * References to the values are invalidated by insertions.
+ */
+template <class K, class V>
+class flat_map
+{
+private:
+    enum {
+        DENSE_LIMIT = 1 << 16,
+        MIN_PENDING = 32
+    };
+
+    struct Slot {
+        V value;
+        bool used;
+
+        Slot() :
+            value(),
+            used(false)
+        {}
+    };
+
+    typedef std::vector<Slot> dense_type;
+    dense_type dense;
+
+    /*
+     * Indices of the used dense slots, in increasing order, so that floor
+     * lookups needn't walk back over unused ones.
+     */
+    std::vector<unsigned> denseUsed;
+
+    typedef std::pair<K, V> entry_type;
+    typedef std::vector<entry_type> sparse_type;
+    sparse_type sparse;
+    sparse_type pending;
+
+    struct KeyLess {
+        bool operator () (const entry_type &entry, const K &key) const {
+            return entry.first < key;
+        }
+        bool operator () (const K &key, const entry_type &entry) const {
+            return key < entry.first;
+        }
+        bool operator () (const entry_type &a, const entry_type &b) const {
+            return a.first < b.first;
+        }
+    };
+
+    static V *
+    findSorted(sparse_type &entries, const K &key) {
+        typename sparse_type::iterator it;
+        it = std::lower_bound(entries.begin(), entries.end(), key, KeyLess());
+        if (it != entries.end() && !(key < it->first)) {
+            return &it->second;
+        }
+        return NULL;
+    }
+
+    static void
+    findSortedFloor(sparse_type &entries, const K &key, K &floorKey, V * &value) {
+        typename sparse_type::iterator it;
+        it = std::upper_bound(entries.begin(), entries.end(), key, KeyLess());
+        if (it != entries.begin()) {
+            --it;
+            if (!value || floorKey < it->first) {
+                floorKey = it->first;
+                value = &it->second;
+            }
+        }
+    }
+
+public:
+
+    V *find(const K &key) {
+        size_t index;
+        if (denseIndex(key, index) && index < DENSE_LIMIT) {
+            if (index < dense.size() && dense[index].used) {
+                return &dense[index].value;
+            }
+            return NULL;
+        }
+
+        V *value = findSorted(sparse, key);
+        if (!value && !pending.empty()) {
+            value = findSorted(pending, key);
+        }
+        return value;
+    }
+
+    V & insert(const K &key, const V &value) {
+        size_t index;
+        if (denseIndex(key, index) && index < DENSE_LIMIT) {
+            if (index >= dense.size()) {
+                size_t size = std::max(dense.size() * 2, size_t(16));
+                size = std::min(std::max(size, index + 1), size_t(DENSE_LIMIT));
+                dense.resize(size);
+            }
+            Slot &slot = dense[index];
+            slot.value = value;
+            if (!slot.used) {
+                slot.used = true;
+                if (denseUsed.empty() || denseUsed.back() < index) {
+                    denseUsed.push_back(unsigned(index));
+                } else {
+                    denseUsed.insert(std::lower_bound(denseUsed.begin(), denseUsed.end(), unsigned(index)),
+                                     unsigned(index));
+                }
+            }
+            return slot.value;
+        }
+
+        V *existing = find(key);
+        if (existing) {
+            *existing = value;
+            return *existing;
+        }
+
+        // Names tend to be generated in increasing order
+        if (sparse.empty() || sparse.back().first < key) {
+            sparse.push_back(entry_type(key, value));
+            return sparse.back().second;
+        }
+
+        typename sparse_type::iterator it;
+        it = std::lower_bound(pending.begin(), pending.end(), key, KeyLess());
+        it = pending.insert(it, entry_type(key, value));
+        if (pending.size() < MIN_PENDING ||
+            pending.size() * pending.size() < sparse.size()) {
+            return it->second;
+        }
+
+        size_t middle = sparse.size();
+        sparse.insert(sparse.end(), pending.begin(), pending.end());
+        pending.clear();
+        std::inplace_merge(sparse.begin(), sparse.begin() + middle, sparse.end(), KeyLess());
+        return *findSorted(sparse, key);
+    }
+
+    V & operator[] (const K &key) {
+        V *value = find(key);
+        if (!value) {
+            value = &insert(key, V());
+        }
+        return *value;
+    }
+
+    /**
+     * Find the entry with the largest key not greater than key.
+     */
+    V *findFloor(const K &key, K &floorKey) {
+        V *value = NULL;
+
+        findSortedFloor(sparse, key, floorKey, value);
+        findSortedFloor(pending, key, floorKey, value);
+
+        size_t index;
+        if (!denseUsed.empty() && denseIndex(key, index)) {
+            if (index >= dense.size() || !dense[index].used) {
+                std::vector<unsigned>::const_iterator it;
+                it = std::upper_bound(denseUsed.begin(), denseUsed.end(),
+                                      std::min(index, dense.size() - 1));
+                index = it == denseUsed.begin() ? dense.size() : *--it;
+            }
+            if (index < dense.size()) {
+                K slotKey = K(index);
+                if (!value || floorKey < slotKey) {
+                    floorKey = slotKey;
+                    value = &dense[index].value;
+                }
+            }
+        }
+
+        return value;
+    }
+};
+
+
 /**
  * Handle map.
  *
@@ -52,27 +280,21 @@ template <class T>
 class map
 {
 private:
-    typedef std::map<T, T> base_type;
+    typedef flat_map<T, T> base_type;
     base_type base;
 
 public:
 
     T & operator[] (const T &key) {
-        typename base_type::iterator it;
-        it = base.find(key);
-        if (it == base.end()) {
-            return (base[key] = key);
+        T *value = base.find(key);
+        if (!value) {
+            return base.insert(key, key);
         }
-        return it->second;
+        return *value;
     }
     
     const T & operator[] (const T &key) const {
-        typename base_type::const_iterator it;
-        it = base.find(key);
-        if (it == base.end()) {
-            return (base[key] = key);
-        }
-        return it->second;
+        return const_cast<map *>(this)->operator[](key);
     }
 
     /*
@@ -85,14 +307,12 @@ public:
      * "myMatrix[0]"), etc.
      */
     T lookupUniformLocation(const T &key) {
-        typename base_type::const_iterator it;
-        it = base.upper_bound(key);
-        if (it != base.begin()) {
-            --it;
-        } else {
-            return (base[key] = key);
+        T floorKey = key;
+        T *value = base.findFloor(key, floorKey);
+        if (!value) {
+            return base.insert(key, key);
         }
-        T t = it->second + (key - it->first);
+        T t = *value + (key - floorKey);
         return t;
     }
 };
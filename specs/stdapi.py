@@ -276,6 +276,14 @@ class Array(Type):
     def visit(self, visitor, *args, **kwargs):
         return visitor.visitArray(self, *args, **kwargs)
 
+    def packable(self):
+        '''Whether the elements are plain numbers, which can be written as
+        raw bytes instead of one by one.'''
+        type = self.type
+        while isinstance(type, (Const, Alias)):
+            type = type.type
+        return isinstance(type, Literal) and type.kind in ('SInt', 'UInt', 'Float', 'Double')
+
 
 class AttribArray(Type):
 
@@ -84,6 +84,28 @@ public:
     }
 };
 
+/**
+ * Range of an element array buffer read by an indexed draw.
+ */
+struct IndexRange {
+    GLintptr offset;
+    GLsizei count;
+    GLenum type;
+    GLboolean restart_enabled;
+    GLuint restart_index;
+
+    bool
+    operator < (const IndexRange &other) const {
+        if (offset != other.offset) return offset < other.offset;
+        if (count != other.count) return count < other.count;
+        if (type != other.type) return type < other.type;
+        if (restart_enabled != other.restart_enabled) return restart_enabled < other.restart_enabled;
+        return restart_index < other.restart_index;
+    }
+};
+
+typedef std::map<IndexRange, GLuint> IndexRangeMap;
+
 class Context {
 public:
     glprofile::Profile profile;
@@ -95,16 +117,34 @@ public:
     // Whether it has been bound before
     bool bound;
 
+    // Identifies the contexts sharing objects with this one, or zero for none
+    unsigned share_group;
+
     // TODO: This will fail for buffers shared by multiple contexts.
     std::map <GLuint, Buffer> buffers;
 
+    // Maximum index of the ranges of element array buffers drawn with user
+    // arrays, so that they needn't be read back and scanned on every draw.
+    // Guarded by the context map mutex, as any context sharing the buffers
+    // may invalidate them.
+    std::map <GLuint, IndexRangeMap> index_ranges;
+    size_t index_range_count;
+
+    // Buffers which pixel and query result reads write into.
+    GLuint pixel_pack_buffer;
+    GLuint query_buffer;
+
     Context(void) :
         profile(glprofile::API_GL, 1, 0),
         user_arrays(false),
         user_arrays_nv(false),
         userArraysOnBegin(false),
         retain_count(0),
-        bound(false)
+        bound(false),
+        share_group(0),
+        index_range_count(0),
+        pixel_pack_buffer(0),
+        query_buffer(0)
     { }
 
     inline bool
@@ -115,7 +155,10 @@ public:
 };
 
 void
-createContext(uintptr_t context_id);
+createContext(uintptr_t context_id, uintptr_t shared_context_id = 0);
+
+void
+shareContext(uintptr_t context_id, uintptr_t shared_context_id);
 
 void
 retainContext(uintptr_t context_id);
@@ -129,6 +172,47 @@ setContext(uintptr_t context_id);
 void
 clearContext(void);
 
+void
+invalidateBuffer(GLuint buffer);
+
+void
+invalidateBufferTarget(GLenum target);
+
+void
+invalidateBuffers(void);
+
+GLenum
+getBufferBinding(GLenum target);
+
+/*
+ * Dirty page tracking of buffer mappings, enabled by the APITRACE_DIRTY_PAGES
+ * environment variable.  See gltrace_mapping.cpp.
+ */
+bool
+isTrackingMappings(void);
+
+/*
+ * Buffers are named within the current context's share group.
+ */
+void
+trackMapping(GLuint buffer, void *map, size_t length, bool autoFlush);
+
+void
+untrackMapping(const void *map);
+
+void
+untrackBuffer(GLuint buffer);
+
+/*
+ * Record the dirty pages of a tracked mapping within the given range.
+ * Returns false if the range isn't tracked, so that it must be recorded whole.
+ */
+bool
+flushMapping(const void *ptr, size_t length);
+
+void
+flushAutoMappings(void);
+
 gltrace::Context *
 getContext(void);
 
@@ -402,6 +402,34 @@ class GlTracer(Tracer):
     # XXX: We currently ignore the gl*Draw*ElementArray* functions
     draw_function_regex = re.compile(r'^gl([A-Z][a-z]+)*Draw(Range)?(Arrays|Elements)([A-Z][a-zA-Z]*)?$' )
 
+    # Functions before which the pages written through persistent mappings
+    # must be recorded, besides the draw calls
+    mapping_flush_function_names = set([
+        'glDispatchCompute',
+        'glDispatchComputeIndirect',
+        'glDispatchComputeGroupSizeARB',
+        'glMemoryBarrier',
+        'glMemoryBarrierEXT',
+        'glFenceSync',
+        'glFlush',
+        'glFinish',
+        'glFrameTerminatorGREMEDY',
+        'glXSwapBuffers',
+        'eglSwapBuffers',
+        'eglSwapBuffersWithDamageEXT',
+        'eglSwapBuffersWithDamageKHR',
+        'wglSwapBuffers',
+        'wglSwapLayerBuffers',
+        'wglSwapMultipleBuffers',
+        'CGLFlushDrawable',
+        'glCopyBufferSubData',
+        'glCopyNamedBufferSubData',
+        'glNamedCopyBufferSubDataEXT',
+    ])
+
+    # Texture uploads, which may read from the GL_PIXEL_UNPACK_BUFFER
+    mapping_flush_upload_regex = re.compile(r'^gl(Compressed)?(Tex|Texture|MultiTex)(Sub)?Image[123]D(?!Multisample)')
+
     interleaved_formats = [
          'GL_V2F',
          'GL_V3F',
@@ -420,6 +448,32 @@ class GlTracer(Tracer):
     ]
 
     def traceFunctionImplBody(self, function):
+        # Record the pages written through persistent mappings before the
+        # calls that may read them
+        if self.draw_function_regex.match(function.name) or \
+           self.mapping_flush_upload_regex.match(function.name) or \
+           function.name in self.mapping_flush_function_names:
+            print '    gltrace::flushAutoMappings();'
+
+        # Deleting or respecifying a buffer unmaps it implicitly
+        if function.name in ('glDeleteBuffers', 'glDeleteBuffersARB'):
+            print '    if (gltrace::isTrackingMappings()) {'
+            print '        for (GLsizei i = 0; i < n; i++) {'
+            print '            gltrace::untrackBuffer(%s[i]);' % function.args[1].name
+            print '        }'
+            print '    }'
+        if function.name in ('glBufferData', 'glBufferDataARB', 'glBufferStorage'):
+            print '    if (gltrace::isTrackingMappings()) {'
+            print '        GLenum _binding = gltrace::getBufferBinding(target);'
+            print '        if (_binding != GL_NONE) {'
+            print '            gltrace::untrackBuffer(_glGetInteger(_binding));'
+            print '        }'
+            print '    }'
+        if function.name in ('glNamedBufferData', 'glNamedBufferDataEXT', 'glNamedBufferStorage', 'glNamedBufferStorageEXT'):
+            print '    if (gltrace::isTrackingMappings()) {'
+            print '        gltrace::untrackBuffer(buffer);'
+            print '    }'
+
         # Defer tracing of user array pointers...
         if function.name in self.array_pointer_function_names:
             print '    GLint _array_buffer = _glGetInteger(GL_ARRAY_BUFFER_BINDING);'
@@ -576,7 +630,7 @@ class GlTracer(Tracer):
             print '                flush = flush && flushing_unmap;'
             print '            }'
             print '            if (flush && length > 0) {'
-            self.emit_memcpy('map', 'length')
+            self.emit_mapping_memcpy('map', 'length')
             print '            }'
             print '        }'
             print '    }'
@@ -605,7 +659,7 @@ class GlTracer(Tracer):
             print '                _glGetBufferParameteriv(target, GL_BUFFER_SIZE, &length);'
             print '            }'
             print '            if (flush && length > 0) {'
-            self.emit_memcpy('map', 'length')
+            self.emit_mapping_memcpy('map', 'length')
             self.shadowBufferMethod('bufferSubData(offset, length, map)')
             print '            }'
             print '        }'
@@ -620,7 +674,7 @@ class GlTracer(Tracer):
             print '        GLint length = 0;'
             print '        _glGetNamedBufferParameteriv(buffer, GL_BUFFER_MAP_LENGTH, &length);'
             print '        if (map && length > 0) {'
-            self.emit_memcpy('map', 'length')
+            self.emit_mapping_memcpy('map', 'length')
             print '        }'
             print '    }'
         if function.name == 'glUnmapNamedBufferEXT':
@@ -633,38 +687,54 @@ class GlTracer(Tracer):
             print '        GLint length = 0;'
             print '        _glGetNamedBufferParameterivEXT(buffer, GL_BUFFER_MAP_LENGTH, &length);'
             print '        if (map && length > 0) {'
-            self.emit_memcpy('map', 'length')
+            self.emit_mapping_memcpy('map', 'length')
             print '        }'
             print '    }'
         if function.name == 'glFlushMappedBufferRange':
             print '    GLvoid *map = NULL;'
             print '    _glGetBufferPointerv(target, GL_BUFFER_MAP_POINTER, &map);'
             print '    if (map && length > 0) {'
-            self.emit_memcpy('(const char *)map + offset', 'length')
+            self.emit_mapping_memcpy('(const char *)map + offset', 'length')
             print '    }'
         if function.name == 'glFlushMappedBufferRangeEXT':
             print '    GLvoid *map = NULL;'
             print '    _glGetBufferPointervOES(target, GL_BUFFER_MAP_POINTER_OES, &map);'
             print '    if (map && length > 0) {'
-            self.emit_memcpy('(const char *)map + offset', 'length')
+            self.emit_mapping_memcpy('(const char *)map + offset', 'length')
             print '    }'
         if function.name == 'glFlushMappedBufferRangeAPPLE':
             print '    GLvoid *map = NULL;'
             print '    _glGetBufferPointerv(target, GL_BUFFER_MAP_POINTER, &map);'
             print '    if (map && size > 0) {'
-            self.emit_memcpy('(const char *)map + offset', 'size')
+            self.emit_mapping_memcpy('(const char *)map + offset', 'size')
             print '    }'
         if function.name == 'glFlushMappedNamedBufferRange':
             print '    GLvoid *map = NULL;'
             print '    _glGetNamedBufferPointerv(buffer, GL_BUFFER_MAP_POINTER, &map);'
             print '    if (map && length > 0) {'
-            self.emit_memcpy('(const char *)map + offset', 'length')
+            self.emit_mapping_memcpy('(const char *)map + offset', 'length')
             print '    }'
         if function.name == 'glFlushMappedNamedBufferRangeEXT':
             print '    GLvoid *map = NULL;'
             print '    _glGetNamedBufferPointervEXT(buffer, GL_BUFFER_MAP_POINTER, &map);'
             print '    if (map && length > 0) {'
-            self.emit_memcpy('(const char *)map + offset', 'length')
+            self.emit_mapping_memcpy('(const char *)map + offset', 'length')
+            print '    }'
+
+        # Stop tracking the dirty pages of mappings, after recording them
+        unmap_pointer_functions = {
+            'glUnmapBuffer': ('_glGetBufferPointerv', 'target'),
+            'glUnmapBufferARB': ('_glGetBufferPointervARB', 'target'),
+            'glUnmapBufferOES': ('_glGetBufferPointervOES', 'target'),
+            'glUnmapNamedBuffer': ('_glGetNamedBufferPointerv', 'buffer'),
+            'glUnmapNamedBufferEXT': ('_glGetNamedBufferPointervEXT', 'buffer'),
+        }
+        if function.name in unmap_pointer_functions:
+            getter, arg_name = unmap_pointer_functions[function.name]
+            print '    if (gltrace::isTrackingMappings()) {'
+            print '        GLvoid *_map = NULL;'
+            print '        %s(%s, GL_BUFFER_MAP_POINTER, &_map);' % (getter, arg_name)
+            print '        gltrace::untrackMapping(_map);'
             print '    }'
 
         # FIXME: We don't support coherent/pinned memory mappings
@@ -682,6 +752,8 @@ class GlTracer(Tracer):
             print r'            os::log("apitrace: warning: %s: MAP_NOTIFY_EXPLICIT_BIT_VMWX set w/ MAP_FLUSH_EXPLICIT_BIT\n", __FUNCTION__);'
             print r'        }'
             print r'        access &= ~GL_MAP_NOTIFY_EXPLICIT_BIT_VMWX;'
+            print r'    } else if (gltrace::isTrackingMappings()) {'
+            print r'        // Recorded through dirty page tracking'
             print r'    } else if (access & GL_MAP_COHERENT_BIT) {'
             print r'        os::log("apitrace: warning: %s: MAP_COHERENT_BIT unsupported (https://github.com/apitrace/apitrace/issues/232)\n", __FUNCTION__);'
             print r'    } else if ((access & GL_MAP_PERSISTENT_BIT) &&'
@@ -745,6 +817,8 @@ class GlTracer(Tracer):
 
         Tracer.traceFunctionImplBody(self, function)
 
+        self.trackMappings(function)
+
     # These entrypoints are only expected to be implemented by tools;
     # drivers will probably not implement them.
     marker_functions = [
@@ -840,6 +914,80 @@ class GlTracer(Tracer):
 
         Tracer.doInvokeFunction(self, function)
 
+        self.invalidateIndexRanges(function)
+
+    # Functions which write into the buffer bound to the target or named by
+    # the given argument
+    buffer_write_targets = {
+        'glBufferData': 'target',
+        'glBufferDataARB': 'target',
+        'glBufferSubData': 'target',
+        'glBufferSubDataARB': 'target',
+        'glBufferStorage': 'target',
+        'glClearBufferData': 'target',
+        'glClearBufferSubData': 'target',
+        'glCopyBufferSubData': 'writeTarget',
+        'glUnmapBuffer': 'target',
+        'glUnmapBufferARB': 'target',
+        'glUnmapBufferOES': 'target',
+    }
+    buffer_write_names = {
+        'glNamedBufferData': 'buffer',
+        'glNamedBufferDataEXT': 'buffer',
+        'glNamedBufferSubData': 'buffer',
+        'glNamedBufferSubDataEXT': 'buffer',
+        'glNamedBufferStorage': 'buffer',
+        'glNamedBufferStorageEXT': 'buffer',
+        'glClearNamedBufferData': 'buffer',
+        'glClearNamedBufferDataEXT': 'buffer',
+        'glClearNamedBufferSubData': 'buffer',
+        'glClearNamedBufferSubDataEXT': 'buffer',
+        'glCopyNamedBufferSubData': 'writeBuffer',
+        'glNamedCopyBufferSubDataEXT': 'writeBuffer',
+        'glUnmapNamedBuffer': 'buffer',
+        'glUnmapNamedBufferEXT': 'buffer',
+        'glInvalidateBufferData': 'buffer',
+        'glInvalidateBufferSubData': 'buffer',
+        'glGetQueryBufferObjectiv': 'buffer',
+        'glGetQueryBufferObjectuiv': 'buffer',
+        'glGetQueryBufferObjecti64v': 'buffer',
+        'glGetQueryBufferObjectui64v': 'buffer',
+    }
+
+    # Functions which may write into the GL_PIXEL_PACK_BUFFER
+    pixel_pack_function_regex = re.compile(r'^gl(Readn?Pixels|Getn?(Compressed)?(Multi)?Tex(ture)?(Sub)?Image|Getn?(PixelMap|PolygonStipple|ColorTable|ConvolutionFilter|SeparableFilter|Histogram|Minmax)(?!Parameter))')
+
+    def invalidateIndexRanges(self, function):
+        # Forget the maximum indices cached by _glGetBufferMaxIndex for
+        # buffers whose contents may have changed
+        if function.name in self.buffer_write_targets:
+            print '    gltrace::invalidateBufferTarget(%s);' % self.buffer_write_targets[function.name]
+        if function.name in self.buffer_write_names:
+            print '    gltrace::invalidateBuffer(%s);' % self.buffer_write_names[function.name]
+        if function.name in ('glDeleteBuffers', 'glDeleteBuffersARB'):
+            buffers = function.args[1].name
+            print '    for (GLsizei i = 0; i < n; i++) {'
+            print '        gltrace::invalidateBuffer(%s[i]);' % buffers
+            print '    }'
+        if function.name in ('glBindBuffer', 'glBindBufferARB'):
+            print '    if (target == GL_PIXEL_PACK_BUFFER) {'
+            print '        gltrace::getContext()->pixel_pack_buffer = buffer;'
+            print '    } else if (target == GL_QUERY_BUFFER) {'
+            print '        gltrace::getContext()->query_buffer = buffer;'
+            print '    }'
+        if self.pixel_pack_function_regex.match(function.name):
+            print '    if (gltrace::getContext()->pixel_pack_buffer) {'
+            print '        gltrace::invalidateBuffer(gltrace::getContext()->pixel_pack_buffer);'
+            print '    }'
+        if function.name.startswith('glGetQueryObject'):
+            print '    if (gltrace::getContext()->query_buffer) {'
+            print '        gltrace::invalidateBuffer(gltrace::getContext()->query_buffer);'
+            print '    }'
+        # Transform feedback, shader storage and image writes
+        if function.name.startswith('glEndTransformFeedback') or \
+           function.name.startswith('glMemoryBarrier'):
+            print '    gltrace::invalidateBuffers();'
+
     buffer_targets = [
         'ARRAY_BUFFER',
         'ELEMENT_ARRAY_BUFFER',
@@ -854,6 +1002,12 @@ class GlTracer(Tracer):
         'ATOMIC_COUNTER_BUFFER',
     ]
 
+    def emit_mapping_memcpy(self, ptr, size):
+        # Only record the dirty pages of tracked mappings
+        print '    if (!gltrace::flushMapping(%s, %s)) {' % (ptr, size)
+        self.emit_memcpy(ptr, size)
+        print '    }'
+
     def wrapRet(self, function, instance):
         Tracer.wrapRet(self, function, instance)
 
@@ -863,6 +1017,37 @@ class GlTracer(Tracer):
             print '        _checkBufferMapRange = true;'
             print '    }'
 
+    def trackMappings(self, function):
+        # Track the pages written through buffer mappings.  This must be done
+        # after the call is recorded, as recording dirty pages also needs the
+        # writer.
+        if function.name in ('glMapBuffer', 'glMapBufferARB', 'glMapBufferOES'):
+            suffix = function.name[len('glMapBuffer'):]
+            if suffix == 'OES':
+                suffix = ''
+            print '    if (gltrace::isTrackingMappings() && _result && access != GL_READ_ONLY) {'
+            print '        GLint _size = 0;'
+            print '        _glGetBufferParameteriv%s(target, GL_BUFFER_SIZE, &_size);' % suffix
+            print '        GLuint _buffer = _glGetInteger(gltrace::getBufferBinding(target));'
+            print '        gltrace::trackMapping(_buffer, _result, _size, false);'
+            print '    }'
+        if function.name in ('glMapNamedBuffer', 'glMapNamedBufferEXT'):
+            suffix = function.name[len('glMapNamedBuffer'):]
+            print '    if (gltrace::isTrackingMappings() && _result && access != GL_READ_ONLY) {'
+            print '        GLint _size = 0;'
+            print '        _glGetNamedBufferParameteriv%s(buffer, GL_BUFFER_SIZE, &_size);' % suffix
+            print '        gltrace::trackMapping(buffer, _result, _size, false);'
+            print '    }'
+        if function.name in ('glMapBufferRange', 'glMapBufferRangeEXT', 'glMapNamedBufferRange', 'glMapNamedBufferRangeEXT'):
+            if function.name.startswith('glMapNamed'):
+                buffer = 'buffer'
+            else:
+                buffer = '_glGetInteger(gltrace::getBufferBinding(target))'
+            print '    if (gltrace::isTrackingMappings() && _result && (access & GL_MAP_WRITE_BIT)) {'
+            print '        bool _autoFlush = (access & GL_MAP_PERSISTENT_BIT) && !(access & GL_MAP_FLUSH_EXPLICIT_BIT);'
+            print '        gltrace::trackMapping(%s, _result, length, _autoFlush);' % buffer
+            print '    }'
+
     boolean_names = [
         'GL_FALSE',
         'GL_TRUE',
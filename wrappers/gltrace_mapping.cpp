@@ -0,0 +1,557 @@
+/**************************************************************************
+ *
+ * Copyright 2016 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+/*
+ * Dirty page tracking of buffer mappings.
+ *
+ * When enabled, the pages of the buffer mappings the application may write
+ * are write-protected, and the first write to each page is caught by a
+ * SIGSEGV handler, which marks the page dirty and lets the write through.
+ * Only the dirty pages are then recorded as fake memcpys when the mapping is
+ * flushed or unmapped, instead of the whole mapped range.
+ *
+ * Persistent mappings without explicit flushes are recorded before the calls
+ * which may read them (draws, compute dispatches, texture uploads, buffer
+ * copies, synchronization and frame boundaries).
+ */
+
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifndef _WIN32
+#include <signal.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#include <algorithm>
+
+#include "os.hpp"
+#include "os_thread.hpp"
+#include "trace_writer_local.hpp"
+#include "gltrace.hpp"
+
+
+namespace gltrace {
+
+
+#ifndef _WIN32
+
+
+/*
+ * Upper bound on the number of mappings tracked at once.  Further mappings
+ * are recorded whole.
+ */
+#define MAX_MAPPINGS 1024
+
+
+struct Mapping {
+    const char *start;
+    const char *end;
+
+    // Buffer name, which is only meaningful within the share group
+    unsigned shareGroup;
+    GLuint buffer;
+
+    bool autoFlush;
+
+    // Page-aligned address of the first page and number of pages covered
+    char *pages;
+    size_t numPages;
+
+    // Size of this structure and the dirty flags, as allocated
+    size_t allocSize;
+
+    // One flag per page, set by the signal handler
+    volatile unsigned char dirty[1];
+};
+
+
+static bool
+checkEnabled(void)
+{
+    const char *value = getenv("APITRACE_DIRTY_PAGES");
+    return value && atoi(value) > 0;
+}
+
+static const bool enabled = checkEnabled();
+
+static size_t pageSize = 0;
+
+/*
+ * The mappings table is modified with the mutex held, so that the mappings
+ * stay valid while they are recorded.  The signal handler can't take it, so
+ * the table and the dirty flags are also guarded by a spin lock, which is only
+ * held for short sections that never write into tracked pages.
+ */
+static os::mutex mutex;
+static volatile int spinLock = 0;
+
+static Mapping *mappings[MAX_MAPPINGS];
+static volatile size_t numMappings = 0;
+static volatile size_t numAutoFlushMappings = 0;
+
+static bool handlersInstalled = false;
+static struct sigaction oldSegvAction;
+#ifdef __APPLE__
+static struct sigaction oldBusAction;
+#endif
+
+
+static inline void
+lockSpin(void)
+{
+    while (__sync_lock_test_and_set(&spinLock, 1)) {
+        sched_yield();
+    }
+}
+
+static inline void
+unlockSpin(void)
+{
+    __sync_lock_release(&spinLock);
+}
+
+
+static inline char *
+pageAddress(const Mapping *mapping, size_t page)
+{
+    return mapping->pages + page * pageSize;
+}
+
+
+/*
+ * Whether the page is covered by any tracked mapping.  Must be called with the
+ * spin lock held.
+ */
+static bool
+isWatched(const char *page)
+{
+    for (size_t i = 0; i < numMappings; ++i) {
+        const Mapping *mapping = mappings[i];
+        if (page >= mapping->pages &&
+            page < mapping->pages + mapping->numPages * pageSize) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+static void
+segvHandler(int sig, siginfo_t *info, void *context)
+{
+    char *page = (char *)((uintptr_t)info->si_addr & ~(uintptr_t)(pageSize - 1));
+    bool handled = false;
+
+    lockSpin();
+    for (size_t i = 0; i < numMappings; ++i) {
+        Mapping *mapping = mappings[i];
+        if (page >= mapping->pages &&
+            page < mapping->pages + mapping->numPages * pageSize) {
+            mapping->dirty[(page - mapping->pages) / pageSize] = 1;
+            handled = true;
+        }
+    }
+    if (handled) {
+        handled = mprotect(page, pageSize, PROT_READ | PROT_WRITE) == 0;
+    }
+    unlockSpin();
+
+    if (handled) {
+        return;
+    }
+
+    // Not ours, so chain to the previous handler
+    struct sigaction *oldAction = &oldSegvAction;
+#ifdef __APPLE__
+    if (sig == SIGBUS) {
+        oldAction = &oldBusAction;
+    }
+#endif
+    if (oldAction->sa_flags & SA_SIGINFO) {
+        oldAction->sa_sigaction(sig, info, context);
+    } else if (oldAction->sa_handler == SIG_DFL ||
+               oldAction->sa_handler == SIG_IGN) {
+        // Restore the default action, and let the fault happen again
+        struct sigaction defaultAction;
+        defaultAction.sa_handler = SIG_DFL;
+        defaultAction.sa_flags = 0;
+        sigemptyset(&defaultAction.sa_mask);
+        sigaction(sig, &defaultAction, NULL);
+    } else {
+        oldAction->sa_handler(sig);
+    }
+}
+
+
+static void
+installHandlers(void)
+{
+    if (handlersInstalled) {
+        return;
+    }
+
+    struct sigaction action;
+    action.sa_sigaction = &segvHandler;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+
+    sigaction(SIGSEGV, &action, &oldSegvAction);
+#ifdef __APPLE__
+    // Writes to protected pages raise SIGBUS on MacOSX
+    sigaction(SIGBUS, &action, &oldBusAction);
+#endif
+
+    handlersInstalled = true;
+}
+
+
+/*
+ * Stop tracking the i-th mapping, letting its pages be written freely again.
+ * Must be called with the mutex held.
+ */
+static void
+removeMapping(size_t i)
+{
+    Mapping *mapping = mappings[i];
+
+    lockSpin();
+
+    mappings[i] = mappings[numMappings - 1];
+    mappings[numMappings - 1] = NULL;
+    --numMappings;
+    if (mapping->autoFlush) {
+        --numAutoFlushMappings;
+    }
+
+    // Only the first and last pages may be shared with other mappings, and
+    // these must stay protected.  The memory may not even be mapped anymore,
+    // so failures are ignored.
+    size_t first = 0;
+    size_t last = mapping->numPages;
+    if (isWatched(pageAddress(mapping, first))) {
+        ++first;
+    }
+    if (last > first && isWatched(pageAddress(mapping, last - 1))) {
+        --last;
+    }
+    if (first < last) {
+        mprotect(pageAddress(mapping, first), (last - first) * pageSize,
+                 PROT_READ | PROT_WRITE);
+    }
+
+    unlockSpin();
+
+    munmap(mapping, mapping->allocSize);
+}
+
+
+/*
+ * Whether all the mapped bytes of the page lie within [begin, end), so that
+ * its dirty flag can be cleared once they are recorded.
+ */
+static inline bool
+isCovered(const Mapping *mapping, size_t page, const char *begin, const char *end)
+{
+    const char *pageBegin = std::max<const char *>(pageAddress(mapping, page), mapping->start);
+    const char *pageEnd = std::min<const char *>(pageAddress(mapping, page + 1), mapping->end);
+    return begin <= pageBegin && pageEnd <= end;
+}
+
+
+/*
+ * Record the dirty pages of the mapping overlapping [begin, end), and
+ * write-protect again those entirely within it.  Must be called with the mutex
+ * held.
+ */
+static void
+flushDirtyPages(Mapping *mapping, const char *begin, const char *end)
+{
+    begin = std::max(begin, mapping->start);
+    end = std::min(end, mapping->end);
+    if (begin >= end) {
+        return;
+    }
+
+    size_t page = (begin - mapping->pages) / pageSize;
+    size_t endPage = (end - mapping->pages + pageSize - 1) / pageSize;
+
+    while (page < endPage) {
+        if (!mapping->dirty[page]) {
+            ++page;
+            continue;
+        }
+
+        lockSpin();
+
+        size_t runEnd = page;
+        while (runEnd < endPage && mapping->dirty[runEnd]) {
+            ++runEnd;
+        }
+
+        // Protect the pages before they are read, so that any later write is
+        // caught again.
+        size_t protectBegin = page;
+        size_t protectEnd = runEnd;
+        if (!isCovered(mapping, protectBegin, begin, end)) {
+            ++protectBegin;
+        }
+        if (protectEnd > protectBegin &&
+            !isCovered(mapping, protectEnd - 1, begin, end)) {
+            --protectEnd;
+        }
+        for (size_t i = protectBegin; i < protectEnd; ++i) {
+            mapping->dirty[i] = 0;
+        }
+        if (protectBegin < protectEnd) {
+            mprotect(pageAddress(mapping, protectBegin),
+                     (protectEnd - protectBegin) * pageSize, PROT_READ);
+        }
+
+        unlockSpin();
+
+        const char *spanBegin = std::max<const char *>(pageAddress(mapping, page), begin);
+        const char *spanEnd = std::min<const char *>(pageAddress(mapping, runEnd), end);
+        trace::fakeMemcpy(spanBegin, spanEnd - spanBegin);
+
+        page = runEnd;
+    }
+}
+
+
+bool
+isTrackingMappings(void)
+{
+    return enabled;
+}
+
+
+void
+trackMapping(GLuint buffer, void *map, size_t length, bool autoFlush)
+{
+    if (!enabled || !map || !length) {
+        return;
+    }
+
+    os::unique_lock<os::mutex> lock(mutex);
+
+    if (!pageSize) {
+        pageSize = sysconf(_SC_PAGESIZE);
+    }
+
+    installHandlers();
+
+    const char *start = (const char *)map;
+    const char *end = start + length;
+    char *pages = (char *)((uintptr_t)start & ~(uintptr_t)(pageSize - 1));
+    size_t numPages = (end - pages + pageSize - 1) / pageSize;
+
+    // Forget stale mappings of the same memory, of buffers which were
+    // released without being unmapped.
+    for (size_t i = 0; i < numMappings; ) {
+        if (mappings[i]->start < end && start < mappings[i]->end) {
+            removeMapping(i);
+        } else {
+            ++i;
+        }
+    }
+
+    if (numMappings >= MAX_MAPPINGS) {
+        static bool warned = false;
+        if (!warned) {
+            os::log("apitrace: warning: too many buffer mappings to track dirty pages\n");
+            warned = true;
+        }
+        return;
+    }
+
+    // Allocate the bookkeeping in pages of its own, so that the signal
+    // handler never writes into tracked memory.
+    size_t allocSize = sizeof(Mapping) + numPages;
+    void *alloc = mmap(NULL, allocSize, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (alloc == MAP_FAILED) {
+        return;
+    }
+
+    // Anonymous pages are zeroed, so no page is dirty yet
+    Mapping *mapping = static_cast<Mapping *>(alloc);
+    mapping->start = start;
+    mapping->end = end;
+    mapping->shareGroup = getContext()->share_group;
+    mapping->buffer = buffer;
+    mapping->autoFlush = autoFlush;
+    mapping->pages = pages;
+    mapping->numPages = numPages;
+    mapping->allocSize = allocSize;
+
+    lockSpin();
+    mappings[numMappings] = mapping;
+    ++numMappings;
+    if (autoFlush) {
+        ++numAutoFlushMappings;
+    }
+    bool protectFailed = mprotect(pages, numPages * pageSize, PROT_READ) != 0;
+    unlockSpin();
+
+    if (protectFailed) {
+        static bool warned = false;
+        if (!warned) {
+            os::log("apitrace: warning: failed to write-protect buffer mapping\n");
+            warned = true;
+        }
+        removeMapping(numMappings - 1);
+    }
+}
+
+
+void
+untrackMapping(const void *map)
+{
+    if (!numMappings || !map) {
+        return;
+    }
+
+    os::unique_lock<os::mutex> lock(mutex);
+
+    for (size_t i = 0; i < numMappings; ++i) {
+        Mapping *mapping = mappings[i];
+        if (mapping->start == map) {
+            if (mapping->autoFlush) {
+                flushDirtyPages(mapping, mapping->start, mapping->end);
+            }
+            removeMapping(i);
+            return;
+        }
+    }
+}
+
+
+void
+untrackBuffer(GLuint buffer)
+{
+    if (!numMappings) {
+        return;
+    }
+
+    unsigned shareGroup = getContext()->share_group;
+
+    os::unique_lock<os::mutex> lock(mutex);
+
+    for (size_t i = 0; i < numMappings; ) {
+        if (mappings[i]->shareGroup == shareGroup &&
+            mappings[i]->buffer == buffer) {
+            removeMapping(i);
+        } else {
+            ++i;
+        }
+    }
+}
+
+
+bool
+flushMapping(const void *ptr, size_t length)
+{
+    if (!numMappings) {
+        return false;
+    }
+
+    os::unique_lock<os::mutex> lock(mutex);
+
+    const char *begin = (const char *)ptr;
+    const char *end = begin + length;
+    for (size_t i = 0; i < numMappings; ++i) {
+        Mapping *mapping = mappings[i];
+        if (mapping->start <= begin && end <= mapping->end) {
+            flushDirtyPages(mapping, begin, end);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+void
+flushAutoMappings(void)
+{
+    if (!numAutoFlushMappings) {
+        return;
+    }
+
+    os::unique_lock<os::mutex> lock(mutex);
+
+    for (size_t i = 0; i < numMappings; ++i) {
+        Mapping *mapping = mappings[i];
+        if (mapping->autoFlush) {
+            flushDirtyPages(mapping, mapping->start, mapping->end);
+        }
+    }
+}
+
+
+#else /* _WIN32 */
+
+
+bool
+isTrackingMappings(void)
+{
+    return false;
+}
+
+void
+trackMapping(GLuint buffer, void *map, size_t length, bool autoFlush)
+{
+}
+
+void
+untrackMapping(const void *map)
+{
+}
+
+void
+untrackBuffer(GLuint buffer)
+{
+}
+
+bool
+flushMapping(const void *ptr, size_t length)
+{
+    return false;
+}
+
+void
+flushAutoMappings(void)
+{
+}
+
+
+#endif /* _WIN32 */
+
+
+} /* namespace gltrace */
@@ -36,6 +36,7 @@
 #include <os_thread.hpp>
 #include <glproc.hpp>
 #include <gltrace.hpp>
+#include <glsize.hpp>
 
 namespace gltrace {
 
@@ -47,6 +48,20 @@ typedef std::tr1::shared_ptr<Context> context_ptr_t;
 static std::map<uintptr_t, context_ptr_t> context_map;
 static os::recursive_mutex context_map_mutex;
 
+/*
+ * Number of index ranges cached by the contexts in the map, plus the scans in
+ * progress that may cache one.  It is only changed with the context map mutex
+ * held, but read without it, so that buffer writes needn't take the mutex
+ * when nothing is cached.
+ */
+static volatile size_t index_range_users = 0;
+
+/*
+ * Incremented whenever cached ranges are invalidated, so that scans done
+ * without the mutex held can tell whether buffers were written meanwhile.
+ */
+static unsigned index_range_epoch = 0;
+
 class ThreadState {
 public:
     context_ptr_t current_context;
@@ -106,16 +121,37 @@ bool releaseContext(uintptr_t context_id)
      * so don't assert on it being valid.
      */
     if (context_map.find(context_id) != context_map.end()) {
-        res = _releaseContext(context_map[context_id]);
-        if (res)
+        context_ptr_t ctx = context_map[context_id];
+        res = _releaseContext(ctx);
+        if (res) {
+            // Its ranges won't be invalidated any more
+            index_range_users -= ctx->index_range_count;
+            ctx->index_ranges.clear();
+            ctx->index_range_count = 0;
             context_map.erase(context_id);
+        }
     }
     context_map_mutex.unlock();
 
     return res;
 }
 
-void createContext(uintptr_t context_id)
+static unsigned next_share_group = 0;
+
+/*
+ * Share group of the given context, or a new one if it isn't known.  Must be
+ * called with the context map mutex held.
+ */
+static unsigned getShareGroup(uintptr_t context_id)
+{
+    std::map<uintptr_t, context_ptr_t>::iterator it = context_map.find(context_id);
+    if (context_id && it != context_map.end()) {
+        return it->second->share_group;
+    }
+    return ++next_share_group;
+}
+
+void createContext(uintptr_t context_id, uintptr_t shared_context_id)
 {
     // wglCreateContextAttribsARB causes internal calls to wglCreateContext to be
     // traced, causing context to be defined twice.
@@ -127,12 +163,27 @@ void createContext(uintptr_t context_id)
 
     context_map_mutex.lock();
 
+    ctx->share_group = getShareGroup(shared_context_id);
     _retainContext(ctx);
     context_map[context_id] = ctx;
 
     context_map_mutex.unlock();
 }
 
+/*
+ * Note that a context shares the objects of another one from now on, as with
+ * wglShareLists.
+ */
+void shareContext(uintptr_t context_id, uintptr_t shared_context_id)
+{
+    os::unique_lock<os::recursive_mutex> lock(context_map_mutex);
+
+    std::map<uintptr_t, context_ptr_t>::iterator it = context_map.find(context_id);
+    if (it != context_map.end()) {
+        it->second->share_group = getShareGroup(shared_context_id);
+    }
+}
+
 void setContext(uintptr_t context_id)
 {
     ThreadState *ts = get_ts();
@@ -191,4 +242,188 @@ Context *getContext(void)
     return get_ts()->current_context.get();
 }
 
+
+/*
+ * Upper bound on the number of index ranges cached by each context.
+ */
+#define MAX_INDEX_RANGES 16384
+
+GLenum
+getBufferBinding(GLenum target) {
+    switch (target) {
+    case GL_ARRAY_BUFFER:
+        return GL_ARRAY_BUFFER_BINDING;
+    case GL_ATOMIC_COUNTER_BUFFER:
+        return GL_ATOMIC_COUNTER_BUFFER_BINDING;
+    case GL_COPY_READ_BUFFER:
+        return GL_COPY_READ_BUFFER_BINDING;
+    case GL_COPY_WRITE_BUFFER:
+        return GL_COPY_WRITE_BUFFER_BINDING;
+    case GL_DRAW_INDIRECT_BUFFER:
+        return GL_DRAW_INDIRECT_BUFFER_BINDING;
+    case GL_DISPATCH_INDIRECT_BUFFER:
+        return GL_DISPATCH_INDIRECT_BUFFER_BINDING;
+    case GL_ELEMENT_ARRAY_BUFFER:
+        return GL_ELEMENT_ARRAY_BUFFER_BINDING;
+    case GL_PIXEL_PACK_BUFFER:
+        return GL_PIXEL_PACK_BUFFER_BINDING;
+    case GL_PIXEL_UNPACK_BUFFER:
+        return GL_PIXEL_UNPACK_BUFFER_BINDING;
+    case GL_QUERY_BUFFER:
+        return GL_QUERY_BUFFER_BINDING;
+    case GL_SHADER_STORAGE_BUFFER:
+        return GL_SHADER_STORAGE_BUFFER_BINDING;
+    case GL_TEXTURE_BUFFER:
+        return GL_TEXTURE_BUFFER;
+    case GL_TRANSFORM_FEEDBACK_BUFFER:
+        return GL_TRANSFORM_FEEDBACK_BUFFER_BINDING;
+    case GL_UNIFORM_BUFFER:
+        return GL_UNIFORM_BUFFER_BINDING;
+    default:
+        return GL_NONE;
+    }
+}
+
+static inline bool
+hasIndexRanges(void)
+{
+    return index_range_users != 0;
+}
+
+/*
+ * Forget the maximum indices cached for a buffer, in every context, as it may
+ * be shared.
+ */
+void invalidateBuffer(GLuint buffer)
+{
+    if (!hasIndexRanges()) {
+        return;
+    }
+
+    os::unique_lock<os::recursive_mutex> lock(context_map_mutex);
+    ++index_range_epoch;
+    std::map<uintptr_t, context_ptr_t>::iterator it;
+    for (it = context_map.begin(); it != context_map.end(); ++it) {
+        Context *ctx = it->second.get();
+        std::map<GLuint, IndexRangeMap>::iterator found = ctx->index_ranges.find(buffer);
+        if (found != ctx->index_ranges.end()) {
+            ctx->index_range_count -= found->second.size();
+            index_range_users -= found->second.size();
+            ctx->index_ranges.erase(found);
+        }
+    }
+}
+
+void invalidateBufferTarget(GLenum target)
+{
+    // Don't bother querying the binding if nothing is cached
+    if (!hasIndexRanges()) {
+        return;
+    }
+
+    GLenum binding = getBufferBinding(target);
+    if (binding == GL_NONE) {
+        invalidateBuffers();
+        return;
+    }
+
+    GLint buffer = _glGetInteger(binding);
+    if (buffer > 0) {
+        invalidateBuffer(buffer);
+    }
+}
+
+void invalidateBuffers(void)
+{
+    if (!hasIndexRanges()) {
+        return;
+    }
+
+    os::unique_lock<os::recursive_mutex> lock(context_map_mutex);
+    ++index_range_epoch;
+    std::map<uintptr_t, context_ptr_t>::iterator it;
+    for (it = context_map.begin(); it != context_map.end(); ++it) {
+        Context *ctx = it->second.get();
+        index_range_users -= ctx->index_range_count;
+        ctx->index_ranges.clear();
+        ctx->index_range_count = 0;
+    }
+}
+
+}
+
+
+GLuint
+_glGetBufferMaxIndex(GLint buffer, GLintptr offset, GLsizei count, GLenum type,
+                     GLboolean restart_enabled, GLuint restart_index)
+{
+    gltrace::ThreadState *ts = gltrace::get_ts();
+    gltrace::Context *ctx = ts->current_context.get();
+
+    // Only contexts in the map get their ranges invalidated, and persistently
+    // mapped buffers may be written at any time.
+    bool cacheable = ctx != ts->dummy_context.get();
+    if (cacheable && !ctx->needsShadowBuffers()) {
+        GLint mapped = GL_FALSE;
+        _glGetBufferParameteriv(GL_ELEMENT_ARRAY_BUFFER, GL_BUFFER_MAPPED, &mapped);
+        cacheable = !mapped;
+    }
+
+    gltrace::IndexRange range;
+    range.offset = offset;
+    range.count = count;
+    range.type = type;
+    range.restart_enabled = restart_enabled;
+    range.restart_index = restart_index;
+
+    // The buffer is read and scanned without the mutex held, so note the
+    // epoch to tell whether it was written meanwhile.
+    unsigned epoch = 0;
+    if (cacheable) {
+        gltrace::context_map_mutex.lock();
+        std::map<GLuint, gltrace::IndexRangeMap>::const_iterator ranges = ctx->index_ranges.find(buffer);
+        if (ranges != ctx->index_ranges.end()) {
+            gltrace::IndexRangeMap::const_iterator found = ranges->second.find(range);
+            if (found != ranges->second.end()) {
+                GLuint maxindex = found->second;
+                gltrace::context_map_mutex.unlock();
+                return maxindex;
+            }
+        }
+        epoch = gltrace::index_range_epoch;
+        ++gltrace::index_range_users;
+        gltrace::context_map_mutex.unlock();
+    }
+
+    GLuint maxindex = 0;
+    GLsizeiptr size = count*_gl_type_size(type);
+    GLvoid *temp = malloc(size);
+    if (temp) {
+        memset(temp, 0, size);
+        _shadow_glGetBufferSubData(GL_ELEMENT_ARRAY_BUFFER, offset, size, temp);
+
+        maxindex = _gl_max_index(type, temp, count, restart_enabled, restart_index);
+
+        free(temp);
+    }
+
+    if (cacheable) {
+        gltrace::context_map_mutex.lock();
+        --gltrace::index_range_users;
+        // Released contexts are out of the map
+        if (temp && epoch == gltrace::index_range_epoch && ctx->retain_count) {
+            if (ctx->index_range_count >= MAX_INDEX_RANGES) {
+                gltrace::index_range_users -= ctx->index_range_count;
+                ctx->index_ranges.clear();
+                ctx->index_range_count = 0;
+            }
+            if (ctx->index_ranges[buffer].insert(std::make_pair(range, maxindex)).second) {
+                ++ctx->index_range_count;
+                ++gltrace::index_range_users;
+            }
+        }
+        gltrace::context_map_mutex.unlock();
+    }
+
+    return maxindex;
 }
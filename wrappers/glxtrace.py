@@ -45,12 +45,14 @@ class GlxTracer(GlTracer):
         "glXGetProcAddressARB",
     ]
 
-    createContextFunctionNames = [
-        'glXCreateContext',
-        'glXCreateContextAttribsARB',
-        'glXCreateContextWithConfigSGIX',
-        'glXCreateNewContext',
-    ]
+    # Context creation functions, and their argument naming the context to
+    # share objects with
+    createContextFunctionNames = {
+        'glXCreateContext': 'shareList',
+        'glXCreateContextAttribsARB': 'share_context',
+        'glXCreateContextWithConfigSGIX': 'share_list',
+        'glXCreateNewContext': 'shareList',
+    }
 
     destroyContextFunctionNames = [
         'glXDestroyContext',
@@ -70,7 +72,7 @@ class GlxTracer(GlTracer):
 
         if function.name in self.createContextFunctionNames:
             print '    if (_result != NULL)'
-            print '        gltrace::createContext((uintptr_t)_result);'
+            print '        gltrace::createContext((uintptr_t)_result, (uintptr_t)%s);' % self.createContextFunctionNames[function.name]
 
         if function.name in self.makeCurrentFunctionNames:
             print '    if (_result) {'
@@ -198,6 +198,12 @@ class ValueSerializer(stdapi.Visitor, stdapi.ExpanderMixin):
         array_length = self.expand(array.length)
         print '    if (%s) {' % instance
         print '        size_t %s = %s > 0 ? %s : 0;' % (length, array_length, array_length)
+        if array.packable():
+            print '        trace::localWriter.writeArray(%s, %s);' % (instance, length)
+            print '    } else {'
+            print '        trace::localWriter.writeNull();'
+            print '    }'
+            return
         print '        trace::localWriter.beginArray(%s);' % length
         print '        for (size_t %s = 0; %s < %s; ++%s) {' % (index, index, length, index)
         print '            trace::localWriter.beginElement();'
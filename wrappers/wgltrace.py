@@ -86,8 +86,16 @@ class WglTracer(GlTracer):
         GlTracer.traceFunctionImplBody(self, function)
 
         if function.name in self.createContextFunctionNames:
+            if function.name == 'wglCreateContextAttribsARB':
+                share = '(uintptr_t)hShareContext'
+            else:
+                share = '0'
             print '    if (_result)'
-            print '        gltrace::createContext((uintptr_t)_result);'
+            print '        gltrace::createContext((uintptr_t)_result, %s);' % share
+
+        if function.name == 'wglShareLists':
+            print '    if (_result)'
+            print '        gltrace::shareContext((uintptr_t)hglrc2, (uintptr_t)hglrc1);'
 
         if function.name in self.makeCurrentFunctionNames:
             print '    if (_result) {'